@@ -12,6 +12,7 @@ LOCAL_SRC_FILES = \
 		  control/lisp_ctrl_device.c     \
 		  control/lisp_local_db.c        \
 		  control/lisp_map_cache.c       \
+		  control/lisp_mreq_sched.c      \
 		  control/lisp_xtr.c             \
 		  control/lisp_ms.c              \
 		  control/control-data-plane/control-data-plane.c    \
@@ -42,12 +43,14 @@ LOCAL_SRC_FILES = \
 		  liblisp/lisp_message_fields.c  \
 		  liblisp/lisp_nonce.c           \
 		  lib/cksum.c                    \
+		  lib/gen_counter.c              \
 		  lib/generic_list.c             \
 		  lib/hmac.c                     \
 		  lib/iface_locators.c           \
 		  lib/lbuf.c                     \
 		  lib/lisp_site.c                \
 		  lib/lmlog.c                    \
+		  lib/lpm.c                      \
 		  lib/mapping_db.c               \
 		  lib/map_cache_entry.c          \
 		  lib/map_local_entry.c			 \
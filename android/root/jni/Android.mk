@@ -12,13 +12,16 @@ LOCAL_SRC_FILES = \
 		  control/lisp_ctrl_device.c     \
 		  control/lisp_local_db.c        \
 		  control/lisp_map_cache.c       \
+		  control/lisp_mreq_sched.c      \
 		  control/lisp_xtr.c             \
 		  control/lisp_ms.c              \
 		  control/control-data-plane/control-data-plane.c    \
 		  control/control-data-plane/tun/cdp_tun.c     \
 		  data-plane/data-plane.c        \
 		  data-plane/tun/tun.c     \
+		  data-plane/tun/tun_encap.c                   \
 		  data-plane/tun/tun_input.c                   \
+		  data-plane/tun/tun_mq.c                      \
 		  data-plane/tun/tun_output.c                  \
 		  elibs/libcfu/cfu.c             \
 		  elibs/libcfu/cfuhash.c         \
@@ -42,12 +45,14 @@ LOCAL_SRC_FILES = \
 		  liblisp/lisp_message_fields.c  \
 		  liblisp/lisp_nonce.c           \
 		  lib/cksum.c                    \
+		  lib/gen_counter.c              \
 		  lib/generic_list.c             \
 		  lib/hmac.c                     \
 		  lib/iface_locators.c           \
 		  lib/lbuf.c                     \
 		  lib/lisp_site.c                \
 		  lib/lmlog.c                    \
+		  lib/lpm.c                      \
 		  lib/mapping_db.c               \
 		  lib/map_cache_entry.c          \
 		  lib/map_local_entry.c			 \
@@ -81,12 +81,18 @@ tun_control_dp_init(lisp_ctrl_t *ctrl, ...)
     /* Generate receive sockets for control port (4342)*/
     if (default_rloc_afi != AF_INET6) {
         socket = open_control_input_socket(AF_INET);
-        sockmstr_register_read_listener(smaster, tun_control_dp_recv_msg, ctrl,socket);
+        if (sockmstr_register_read_listener(smaster, tun_control_dp_recv_msg,
+                ctrl, socket) == NULL) {
+            return (BAD);
+        }
     }
 
     if (default_rloc_afi != AF_INET) {
         socket = open_control_input_socket(AF_INET6);
-        sockmstr_register_read_listener(smaster, tun_control_dp_recv_msg, ctrl,socket);
+        if (sockmstr_register_read_listener(smaster, tun_control_dp_recv_msg,
+                ctrl, socket) == NULL) {
+            return (BAD);
+        }
     }
 
     data = (tun_ctr_dplane_data_t *)xmalloc(sizeof(tun_ctr_dplane_data_t));
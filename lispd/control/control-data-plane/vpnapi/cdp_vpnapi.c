@@ -80,7 +80,10 @@ vpnapi_control_dp_init(lisp_ctrl_t *ctrl, ...)
     /* Generate receive sockets for control port (4342)*/
     if (default_rloc_afi != AF_INET6) {
         data->ipv4_ctrl_socket = open_control_input_socket(AF_INET);
-        sockmstr_register_read_listener(smaster, vpnapi_control_dp_recv_msg, ctrl,data->ipv4_ctrl_socket);
+        if (sockmstr_register_read_listener(smaster, vpnapi_control_dp_recv_msg,
+                ctrl, data->ipv4_ctrl_socket) == NULL) {
+            return (BAD);
+        }
         lispd_jni_protect_socket(data->ipv4_ctrl_socket);
     }else {
         data->ipv4_ctrl_socket = ERR_SOCKET;
@@ -88,7 +91,10 @@ vpnapi_control_dp_init(lisp_ctrl_t *ctrl, ...)
 
     if (default_rloc_afi != AF_INET) {
         data->ipv6_ctrl_socket = open_control_input_socket(AF_INET6);
-        sockmstr_register_read_listener(smaster, vpnapi_control_dp_recv_msg, ctrl,data->ipv6_ctrl_socket);
+        if (sockmstr_register_read_listener(smaster, vpnapi_control_dp_recv_msg,
+                ctrl, data->ipv6_ctrl_socket) == NULL) {
+            return (BAD);
+        }
         lispd_jni_protect_socket(data->ipv6_ctrl_socket);
     }else {
         data->ipv6_ctrl_socket = ERR_SOCKET;
@@ -343,7 +349,12 @@ vpnapi_control_dp_reset_socket(vpnapi_ctr_dplane_data_t * data, int fd, int afi)
         return (BAD);
     }
 
-    sockmstr_register_read_listener(smaster,old_sock->recv_cb,old_sock->arg,new_fd);
+    if (sockmstr_register_read_listener(smaster, old_sock->recv_cb,
+            old_sock->arg, new_fd) == NULL) {
+        /* Keep the old socket */
+        close(new_fd);
+        return (BAD);
+    }
     sockmstr_unregister_read_listenedr(smaster,old_sock);
     /* Protect the socket from loops in the system*/
     lispd_jni_protect_socket(new_fd);
@@ -98,13 +98,17 @@ ctrl_destroy(lisp_ctrl_t *ctrl)
     LMLOG(LDBG_1,"Lisp controler destroyed");
 }
 
-void
+int
 ctrl_init(lisp_ctrl_t *ctrl)
 {
-    ctrl->control_data_plane->control_dp_init(ctrl,smaster);
+    if (ctrl->control_data_plane->control_dp_init(ctrl,smaster) != GOOD) {
+        LMLOG(LCRIT, "Couldn't initialize the control data plane");
+        return(BAD);
+    }
     set_rlocs(ctrl);
 
     LMLOG(LDBG_1, "Control initialized");
+    return(GOOD);
 }
 
 void
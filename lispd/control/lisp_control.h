@@ -45,7 +45,7 @@ struct lisp_ctrl {
 
 lisp_ctrl_t *ctrl_create();
 void ctrl_destroy(lisp_ctrl_t *ctrl);
-void ctrl_init(lisp_ctrl_t *ctrl);
+int ctrl_init(lisp_ctrl_t *ctrl);
 
 void ctrl_update_iface_info(lisp_ctrl_t *ctrl);
 
@@ -38,6 +38,7 @@ local_map_db_new()
         LMLOG(LCRIT, "Could allocate local map database ");
         return(NULL);
     }
+    db->gen = gen_counter_new();
 
     return(db);
 }
@@ -46,17 +47,24 @@ void
 local_map_db_del(local_map_db_t *lmdb)
 {
     mdb_del(lmdb->db, (mdb_del_fct)map_local_entry_del);
+    gen_counter_del(lmdb->gen);
     free(lmdb);
 }
 
 int
 local_map_db_add_entry(local_map_db_t *lmdb, map_local_entry_t *map_loc_e)
 {
+    map_local_entry_t *cover;
+
+    cover = mdb_lookup_less_specific(lmdb->db, map_local_entry_eid(map_loc_e));
     if (mdb_add_entry(lmdb->db, map_local_entry_eid(map_loc_e), map_loc_e) != GOOD) {
         LMLOG(LDBG_3, "Couldn't add mapping for EID %s to local mappings database",
                 lisp_addr_to_char(map_local_entry_eid(map_loc_e)));
         return(BAD);
     }
+    /* Packets from the new EID were forwarded using the covering mapping or
+     * natively */
+    gen_counter_bump(cover ? cover->gen : lmdb->gen);
     return(GOOD);
 }
 
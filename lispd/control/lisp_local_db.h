@@ -29,6 +29,8 @@
 
 typedef struct local_map_db_t_ {
     mdb_t *db;
+    /* Generation of the EIDs not covered by any local mapping */
+    gen_counter_t *gen;
 } local_map_db_t;
 
 
@@ -17,11 +17,107 @@
  *
  */
 
+#include <inttypes.h>
+#include <math.h>
+
 #include "lisp_map_cache.h"
 #include "../lib/lmlog.h"
-#include <math.h>
 
 
+/* Negative and not active entries are evicted first */
+static inline int
+mcache_entry_evict_first(mcache_entry_t *mce)
+{
+    return (mce->active == NOT_ACTIVE || !mcache_has_locators(mce));
+}
+
+static void
+mcache_lru_push(map_cache_db_t *mcdb, mcache_entry_t *mce)
+{
+    mce->lru_low = mcache_entry_evict_first(mce);
+    list_push_front(mce->lru_low ? &mcdb->lru_low : &mcdb->lru,
+            &mce->lru_elt);
+}
+
+static void
+mcache_lru_unlink(map_cache_db_t *mcdb, mcache_entry_t *mce)
+{
+    if (!mce->in_lru) {
+        return;
+    }
+    list_remove(&mce->lru_elt);
+    mce->in_lru = FALSE;
+    mcdb->n_entries--;
+    mcdb->mem -= mce->mem_size;
+}
+
+static int
+mcache_over_limits(map_cache_db_t *mcdb)
+{
+    return ((mcdb->max_entries > 0 && mcdb->n_entries > mcdb->max_entries)
+            || (mcdb->max_mem > 0 && mcdb->mem > mcdb->max_mem));
+}
+
+/* Least recently used entry other than keep, from the entries evicted
+ * first if there is any */
+static mcache_entry_t *
+mcache_lru_victim(map_cache_db_t *mcdb, mcache_entry_t *keep)
+{
+    struct ovs_list *it;
+    mcache_entry_t *mce;
+
+    it = mcdb->lru_low.prev;
+    while (it != &mcdb->lru_low) {
+        mce = CONTAINER_OF(it, mcache_entry_t, lru_elt);
+        it = it->prev;
+        /* Activated since it was last used */
+        if (!mcache_entry_evict_first(mce)) {
+            list_remove(&mce->lru_elt);
+            mcache_lru_push(mcdb, mce);
+            continue;
+        }
+        if (mce != keep) {
+            return (mce);
+        }
+    }
+
+    LIST_FOR_EACH_REVERSE(mce, lru_elt, &mcdb->lru) {
+        if (mce != keep) {
+            return (mce);
+        }
+    }
+    return (NULL);
+}
+
+static void
+mcache_evict(map_cache_db_t *mcdb, mcache_entry_t *keep)
+{
+    mcache_entry_t *mce;
+
+    while (mcache_over_limits(mcdb)) {
+        mce = mcache_lru_victim(mcdb, keep);
+        if (!mce) {
+            return;
+        }
+        if (mcdb->evicted_low + mcdb->evicted == 0) {
+            LMLOG(LWRN, "Map-cache full (%d entries, %zu KB). Evicting the "
+                    "least recently used entries", mcdb->n_entries,
+                    mcdb->mem / 1024);
+        }
+        LMLOG(LDBG_1, "mcache_evict: Evicting %s map cache entry of %s",
+                mce->lru_low ? "negative or not active" : "active",
+                lisp_addr_to_char(mapping_eid(mcache_entry_mapping(mce))));
+        if (mce->lru_low) {
+            mcdb->evicted_low++;
+        } else {
+            mcdb->evicted++;
+        }
+        mcache_remove_entry(mcdb, mapping_eid(mcache_entry_mapping(mce)));
+        /* Stops its timers and invalidates the forwarding info using it */
+        mcache_entry_del(mce);
+    }
+}
+
 map_cache_db_t*
 mcache_new()
 {
@@ -36,6 +132,8 @@ mcache_new()
         LMLOG(LCRIT, "Could create map cache db ");
         return(NULL);
     }
+    list_init(&mcdb->lru_low);
+    list_init(&mcdb->lru);
 
     return(mcdb);
 }
@@ -47,28 +145,87 @@ mcache_del(map_cache_db_t *mcdb)
     free(mcdb);
 }
 
+void
+mcache_set_limits(map_cache_db_t *mcdb, int max_entries, size_t max_mem)
+{
+    mcdb->max_entries = max_entries;
+    mcdb->max_mem = max_mem;
+    mcache_evict(mcdb, NULL);
+}
+
 
+/* Add 'mce' to the map cache. Entries other than 'mce' may be evicted and
+ * freed: callers must not use pointers to other entries obtained before */
 int
 mcache_add_entry(map_cache_db_t *mcdb, lisp_addr_t *key, mcache_entry_t *mce)
 {
-    return(mdb_add_entry(mcdb->db, key, mce));
+    if (mdb_add_entry(mcdb->db, key, mce) != GOOD) {
+        return(BAD);
+    }
+    /* The data of an existing prefix is not replaced */
+    if (mdb_lookup_entry_exact(mcdb->db, key) != mce) {
+        LMLOG(LDBG_1, "mcache_add_entry: %s already in the map cache",
+                lisp_addr_to_char(key));
+        return(BAD);
+    }
+
+    if (mce->how_learned != MCE_STATIC) {
+        mce->mem_size = mcache_entry_mem_size(mce);
+        mce->in_lru = TRUE;
+        mcdb->n_entries++;
+        mcdb->mem += mce->mem_size;
+        mcache_lru_push(mcdb, mce);
+        mcache_evict(mcdb, mce);
+    }
+    return(GOOD);
 }
 
 void *
 mcache_remove_entry(map_cache_db_t *mcdb, lisp_addr_t *key)
 {
-    return(mdb_remove_entry(mcdb->db, key));
+    mcache_entry_t *mce;
+
+    mce = mdb_remove_entry(mcdb->db, key);
+    if (mce) {
+        mcache_lru_unlink(mcdb, mce);
+    }
+    return(mce);
+}
+
+/* To be called when the mapping or the state of an entry change. Its memory
+ * and the list where it is are updated, and entries are evicted if
+ * needed. As with mcache_add_entry, entries other than 'mce' may be freed */
+void
+mcache_entry_updated(map_cache_db_t *mcdb, mcache_entry_t *mce)
+{
+    if (!mce->in_lru) {
+        return;
+    }
+    mcdb->mem -= mce->mem_size;
+    mce->mem_size = mcache_entry_mem_size(mce);
+    mcdb->mem += mce->mem_size;
+    list_remove(&mce->lru_elt);
+    mcache_lru_push(mcdb, mce);
+    mcache_evict(mcdb, mce);
 }
 
 
 /*
  * Look up a given lisp_addr_t in the database, returning the
  * lispd_map_cache_entry of this lisp_addr_t if it exists or NULL.
+ * The entry becomes the most recently used
  */
 mcache_entry_t *
 mcache_lookup(map_cache_db_t *mcdb, lisp_addr_t *laddr)
 {
-    return(mdb_lookup_entry(mcdb->db, laddr));
+    mcache_entry_t *mce;
+
+    mce = mdb_lookup_entry(mcdb->db, laddr);
+    if (mce && mce->in_lru) {
+        list_remove(&mce->lru_elt);
+        mcache_lru_push(mcdb, mce);
+    }
+    return(mce);
 }
 
 /*
@@ -81,6 +238,24 @@ mcache_lookup_exact(map_cache_db_t *mcdb, lisp_addr_t *laddr)
 }
 
 
+/*
+ * Entry of the longest prefix that contains 'laddr', other than 'laddr'
+ */
+mcache_entry_t *
+mcache_lookup_less_specific(map_cache_db_t *mcdb, lisp_addr_t *laddr)
+{
+    return(mdb_lookup_less_specific(mcdb->db, laddr));
+}
+
+/*
+ * Entries of the prefixes contained in 'pref', other than 'pref'
+ */
+glist_t *
+mcache_lookup_more_specifics(map_cache_db_t *mcdb, lisp_addr_t *pref)
+{
+    return(mdb_lookup_more_specifics(mcdb->db, pref));
+}
+
 void mcache_dump_db(map_cache_db_t *mcdb, int log_level)
 {
     if (is_loggable(log_level) == FALSE) {
@@ -95,6 +270,33 @@ void mcache_dump_db(map_cache_db_t *mcdb, int log_level)
         mce = (mcache_entry_t *)it;
         map_cache_entry_dump(mce, log_level);
     } mdb_foreach_entry_end;
+    mcache_dump_stats(mcdb, log_level);
     LMLOG(log_level,"*******************************************************\n");
 
 }
+
+void
+mcache_dump_stats(map_cache_db_t *mcdb, int log_level)
+{
+    char max_entries[24], max_mem[24];
+
+    if (is_loggable(log_level) == FALSE) {
+        return;
+    }
+
+    if (mcdb->max_entries > 0) {
+        snprintf(max_entries, sizeof(max_entries), "%d", mcdb->max_entries);
+    } else {
+        snprintf(max_entries, sizeof(max_entries), "no limit");
+    }
+    if (mcdb->max_mem > 0) {
+        snprintf(max_mem, sizeof(max_mem), "%zu KB", mcdb->max_mem / 1024);
+    } else {
+        snprintf(max_mem, sizeof(max_mem), "no limit");
+    }
+
+    LMLOG(log_level, "Dynamic entries: %d (%s), memory: %zu KB (%s), evicted: "
+            "%"PRIu64" negative or not active, %"PRIu64" active",
+            mcdb->n_entries, max_entries, mcdb->mem / 1024, max_mem,
+            mcdb->evicted_low, mcdb->evicted);
+}
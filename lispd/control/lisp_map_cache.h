@@ -25,12 +25,29 @@
 #include "../lib/mapping_db.h"
 #include "../liblisp/liblisp.h"
 
+/*
+ * The dynamic entries are kept in two lists by recency of use: negative and
+ * not active entries, and the rest. When the number of dynamic entries or
+ * their memory exceed the limits, the least recently used entries are
+ * evicted, those of the first list before any other. Static entries are
+ * never evicted nor counted.
+ */
 typedef struct map_cache_db {
     mdb_t *db;
+
+    int max_entries;            /* 0 is no limit */
+    size_t max_mem;             /* bytes. 0 is no limit */
+    int n_entries;
+    size_t mem;
+    struct ovs_list lru_low;    /* most recently used first */
+    struct ovs_list lru;
+    uint64_t evicted_low;
+    uint64_t evicted;
 } map_cache_db_t;
 
 map_cache_db_t *mcache_new();
 void mcache_del(map_cache_db_t *mcdb);
+void mcache_set_limits(map_cache_db_t *, int max_entries, size_t max_mem);
 
 
 int mcache_add_entry(map_cache_db_t *, lisp_addr_t *key, mcache_entry_t *entry);
@@ -38,8 +55,12 @@ void *mcache_remove_entry(map_cache_db_t *, lisp_addr_t *key);
 void map_cache_del_entry(map_cache_db_t *, lisp_addr_t *laddr);
 mcache_entry_t *mcache_lookup_exact(map_cache_db_t *, lisp_addr_t *addr);
 mcache_entry_t *mcache_lookup(map_cache_db_t *, lisp_addr_t *addr);
+mcache_entry_t *mcache_lookup_less_specific(map_cache_db_t *, lisp_addr_t *addr);
+glist_t *mcache_lookup_more_specifics(map_cache_db_t *, lisp_addr_t *pref);
+void mcache_entry_updated(map_cache_db_t *, mcache_entry_t *);
 
 void mcache_dump_db(map_cache_db_t *, int log_level);
+void mcache_dump_stats(map_cache_db_t *, int log_level);
 
 #define mcache_foreach_entry(MC, EIT)               \
     mdb_foreach_entry((MC)->db, (EIT)) {
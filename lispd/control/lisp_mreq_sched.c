@@ -0,0 +1,468 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lisp_mreq_sched.h"
+#include "lisp_xtr.h"
+#include "../lib/lmlog.h"
+#include "../lib/sockets.h"
+#include "../lib/timers_utils.h"
+#include "../lib/util.h"
+
+
+static int mreq_sched_flush_cb(sock_t *sl);
+static void mreq_sched_flush(mreq_sched_t *sched);
+
+static uint64_t
+mreq_sched_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+mreq_sched_arm(mreq_sched_t *sched, uint64_t deadline)
+{
+    struct itimerspec its;
+    uint64_t now, delay;
+
+    if (sched->timer_fd < 0 || deadline == sched->timer_deadline) {
+        return;
+    }
+    sched->timer_deadline = deadline;
+
+    memset(&its, 0, sizeof(its));
+    if (deadline != 0) {
+        now = mreq_sched_now();
+        /* an expired deadline fires as soon as possible */
+        delay = (deadline > now) ? deadline - now : 1;
+        its.it_value.tv_sec = delay / 1000000;
+        its.it_value.tv_nsec = (delay % 1000000) * 1000;
+    }
+    if (timerfd_settime(sched->timer_fd, 0, &its, NULL) == -1) {
+        LMLOG(LERR, "mreq_sched_arm: timerfd_settime error: %s",
+                strerror(errno));
+    }
+}
+
+static void
+mreq_queue_refill(mreq_sched_t *sched, mreq_queue_t *q, uint64_t now)
+{
+    if (sched->rate == 0) {
+        return;
+    }
+    q->tokens += (double)(now - q->tb_last) * sched->rate / 1000000;
+    if (q->tokens > sched->burst) {
+        q->tokens = sched->burst;
+    }
+    q->tb_last = now;
+}
+
+static mreq_queue_t *
+mreq_queue_new(mreq_sched_t *sched, lisp_addr_t *mr)
+{
+    mreq_queue_t *q = xzalloc(sizeof(mreq_queue_t));
+
+    q->mr = lisp_addr_clone(mr);
+    list_init(&q->reqs);
+    q->tokens = sched->burst;
+    q->tb_last = mreq_sched_now();
+
+    return (q);
+}
+
+static void
+mreq_queue_del(mreq_queue_t *q)
+{
+    timer_map_req_argument *req, *next;
+
+    LIST_FOR_EACH_SAFE(req, next, q_elt, &q->reqs) {
+        list_remove(&req->q_elt);
+        req->queue = NULL;
+    }
+    lisp_addr_del(q->mr);
+    free(q);
+}
+
+static mreq_queue_t *
+mreq_sched_queue(mreq_sched_t *sched, lisp_addr_t *mr)
+{
+    glist_entry_t *it;
+    mreq_queue_t *q;
+
+    glist_for_each_entry(it, sched->queues) {
+        q = (mreq_queue_t *)glist_entry_data(it);
+        if (lisp_addr_cmp(q->mr, mr) == 0) {
+            return (q);
+        }
+    }
+
+    q = mreq_queue_new(sched, mr);
+    glist_add_tail(q, sched->queues);
+    return (q);
+}
+
+static void
+mreq_queue_pop(mreq_queue_t *q, timer_map_req_argument *req)
+{
+    list_remove(&req->q_elt);
+    req->queue = NULL;
+    q->depth--;
+}
+
+mreq_sched_t *
+mreq_sched_new(lisp_xtr_t *xtr, int rate, int burst)
+{
+    mreq_sched_t *sched = xzalloc(sizeof(mreq_sched_t));
+
+    sched->xtr = xtr;
+    sched->queues = glist_new_managed((glist_del_fct)mreq_queue_del);
+    sched->rate = rate;
+    sched->burst = (burst > 0) ? burst : ((rate > 0) ? rate : 1);
+
+    sched->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (sched->timer_fd < 0) {
+        LMLOG(LERR, "mreq_sched_new: timerfd_create error: %s. Map-Requests "
+                "are sent without waiting for other misses", strerror(errno));
+    } else if (sockmstr_register_read_listener(smaster, mreq_sched_flush_cb,
+            sched, sched->timer_fd) == NULL) {
+        LMLOG(LERR, "mreq_sched_new: Couldn't listen to the timer. "
+                "Map-Requests are sent without waiting for other misses");
+        close(sched->timer_fd);
+        sched->timer_fd = -1;
+    }
+
+    return (sched);
+}
+
+void
+mreq_sched_del(mreq_sched_t *sched)
+{
+    sock_t *sock;
+
+    if (!sched) {
+        return;
+    }
+
+    /* Nonces of the Map-Requests sent */
+    stop_timers_from_obj(sched, ptrs_to_timers_ht, nonces_ht);
+
+    if (sched->timer_fd >= 0) {
+        sock = sockmstr_register_get_by_fd(smaster, sched->timer_fd);
+        if (sock) {
+            sockmstr_unregister_read_listenedr(smaster, sock);
+        }
+        close(sched->timer_fd);
+    }
+    glist_destroy(sched->queues);
+    free(sched);
+}
+
+/* Queues the EID of the not active entry of 'req' to be requested to 'mr'.
+ * Nothing is done if it is already queued */
+int
+mreq_sched_add(mreq_sched_t *sched, lisp_addr_t *mr,
+        timer_map_req_argument *req)
+{
+    mreq_queue_t *q;
+
+    if (req->queue) {
+        return (GOOD);
+    }
+
+    q = mreq_sched_queue(sched, mr);
+    list_push_back(&q->reqs, &req->q_elt);
+    req->queue = q;
+    q->depth++;
+    q->queued++;
+    if (q->depth > q->max_depth) {
+        q->max_depth = q->depth;
+    }
+
+    if (sched->timer_fd < 0) {
+        mreq_sched_flush(sched);
+    } else if (sched->timer_deadline == 0) {
+        mreq_sched_arm(sched, mreq_sched_now() + MREQ_BATCH_WINDOW * 1000);
+    }
+
+    return (GOOD);
+}
+
+/* Removes 'req' from the queue it is in, if any. Called when its entry is
+ * removed: resolved by the Map-Reply of a covering prefix or evicted */
+void
+mreq_sched_cancel(timer_map_req_argument *req)
+{
+    if (req->queue) {
+        req->queue->cancelled++;
+        mreq_queue_pop(req->queue, req);
+    }
+}
+
+int
+mreq_sched_depth(mreq_sched_t *sched)
+{
+    glist_entry_t *it;
+    int depth = 0;
+
+    glist_for_each_entry(it, sched->queues) {
+        depth += ((mreq_queue_t *)glist_entry_data(it))->depth;
+    }
+    return (depth);
+}
+
+static mreq_batch_t *
+mreq_batch_new(mreq_sched_t *sched)
+{
+    mreq_batch_t *batch = xzalloc(sizeof(mreq_batch_t));
+
+    batch->sched = sched;
+    batch->eids = glist_new_managed((glist_del_fct)lisp_addr_del);
+    sched->inflight++;
+
+    return (batch);
+}
+
+static void
+mreq_batch_free(mreq_batch_t *batch)
+{
+    batch->sched->inflight--;
+    glist_destroy(batch->eids);
+    free(batch);
+}
+
+static int
+mreq_batch_expire_cb(lmtimer_t *timer)
+{
+    mreq_batch_t *batch = lmtimer_cb_argument(timer);
+
+    stop_timer_from_obj(batch->sched, timer, ptrs_to_timers_ht, nonces_ht);
+    return (GOOD);
+}
+
+/* Removes from the batch the EIDs contained in the prefix 'pref' of a record
+ * of a Map-Reply. Returns the number of EIDs removed. A record not covering
+ * any of them was not requested */
+int
+mreq_batch_retire_eids(mreq_batch_t *batch, lisp_addr_t *pref)
+{
+    glist_entry_t *it, *next;
+    lisp_addr_t *eid;
+    int retired = 0;
+
+    if (lisp_addr_lafi(pref) != LM_AFI_IPPREF) {
+        return (0);
+    }
+
+    glist_for_each_entry_safe(it, next, batch->eids) {
+        eid = (lisp_addr_t *)glist_entry_data(it);
+        if (ip_prefix_contains(lisp_addr_get_ippref(pref),
+                lisp_addr_ip_get_addr(eid), lisp_addr_ip_get_plen(eid))) {
+            glist_remove(it, batch->eids);
+            retired++;
+        }
+    }
+
+    return (retired);
+}
+
+/* EIDs of the batch not answered yet */
+int
+mreq_batch_pending(mreq_batch_t *batch)
+{
+    return (glist_size(batch->eids));
+}
+
+/* Sends one Map-Request with the EIDs at the head of the queue that have the
+ * same AFI as the first one and fit in a message. The source EID is that of
+ * the first one */
+static int
+mreq_queue_send(mreq_sched_t *sched, mreq_queue_t *q)
+{
+    lisp_xtr_t *xtr = sched->xtr;
+    timer_map_req_argument *first, *req, *next;
+    mreq_batch_t *batch;
+    lisp_addr_t *seid, *deid, *eid;
+    glist_t *rlocs;
+    lbuf_t *b;
+    void *hdr;
+    lmtimer_t *timer;
+    uint64_t nonce;
+    uconn_t uc;
+    int afi;
+
+    first = CONTAINER_OF(list_front(&q->reqs), timer_map_req_argument, q_elt);
+    mreq_queue_pop(q, first);
+    seid = first->src_eid;
+    deid = mapping_eid(mcache_entry_mapping(first->mce));
+    afi = lisp_addr_ip_afi(deid);
+
+    /* Rlocs to be used as ITR of the map req. */
+    rlocs = ctrl_default_rlocs(xtr->super.ctrl);
+    b = lisp_msg_mreq_create(seid, rlocs, deid);
+    if (b == NULL) {
+        LMLOG(LDBG_1, "Couldn't create Map-Request for EID %s. Removing its "
+                "entry", lisp_addr_to_char(deid));
+        glist_destroy(rlocs);
+        /* Out of the queue, its retry timer would never send it again. A
+         * new miss creates the entry again */
+        tr_mcache_remove_entry(xtr, first->mce);
+        return (BAD);
+    }
+    hdr = lisp_msg_hdr(b);
+    batch = mreq_batch_new(sched);
+    glist_add_tail(lisp_addr_clone(deid), batch->eids);
+
+    LIST_FOR_EACH_SAFE(req, next, q_elt, &q->reqs) {
+        if (MREQ_REC_COUNT(hdr) == UINT8_MAX) {
+            break;
+        }
+        eid = mapping_eid(mcache_entry_mapping(req->mce));
+        if (lisp_addr_ip_afi(eid) != afi) {
+            continue;
+        }
+        if (lbuf_size(b) + sizeof(eid_record_hdr_t)
+                + lisp_addr_size_to_write(eid) > MAX_LISP_MSG_LEN) {
+            break;
+        }
+        lisp_msg_put_eid_rec(b, eid);
+        glist_add_tail(lisp_addr_clone(eid), batch->eids);
+        mreq_queue_pop(q, req);
+    }
+
+    nonce = nonce_new();
+    MREQ_NONCE(hdr) = nonce;
+    LMLOG(LDBG_1, "%s, itr-rlocs:%s, src-eid: %s, req-eid: %s (%d records)",
+            lisp_msg_hdr_to_char(b), laddr_list_to_char(rlocs),
+            lisp_addr_to_char(seid), lisp_addr_to_char(deid),
+            MREQ_REC_COUNT(hdr));
+    glist_destroy(rlocs);
+
+    q->sent_msgs++;
+    q->sent_recs += MREQ_REC_COUNT(hdr);
+
+    /* Encapsulate message and send it to the map resolver */
+    lisp_msg_encap(b, LISP_CONTROL_PORT, LISP_CONTROL_PORT, seid, deid);
+    uconn_init(&uc, LISP_CONTROL_PORT, LISP_CONTROL_PORT, NULL, q->mr);
+    send_msg(&xtr->super, b, &uc);
+    lisp_msg_destroy(b);
+
+    /* Map-Replies are accepted until the EIDs are answered or would have
+     * been aborted */
+    timer = lmtimer_with_nonce_new(MAP_REQUEST_BATCH_TIMER, xtr,
+            mreq_batch_expire_cb, batch, (lmtimer_del_cb_arg_fn)mreq_batch_free);
+    htable_ptrs_timers_add(ptrs_to_timers_ht, sched, timer);
+    htable_nonces_insert(nonces_ht, nonce, lmtimer_nonces(timer));
+    lmtimer_start(timer, LISPD_INITIAL_MRQ_TIMEOUT * (xtr->map_request_retries + 1));
+
+    return (GOOD);
+}
+
+/* Sends the queued EIDs the buckets allow and arms the timer for the
+ * earliest queue that has to wait for tokens */
+static void
+mreq_sched_flush(mreq_sched_t *sched)
+{
+    glist_entry_t *it;
+    mreq_queue_t *q;
+    uint64_t now, wait, deadline = 0;
+    int sent = FALSE;
+
+    now = mreq_sched_now();
+    glist_for_each_entry(it, sched->queues) {
+        q = (mreq_queue_t *)glist_entry_data(it);
+        mreq_queue_refill(sched, q, now);
+        while (q->depth > 0 && (sched->rate == 0 || q->tokens >= 1)) {
+            if (mreq_queue_send(sched, q) != GOOD) {
+                continue;
+            }
+            if (sched->rate > 0) {
+                q->tokens -= 1;
+            }
+            sent = TRUE;
+        }
+        if (q->depth == 0) {
+            continue;
+        }
+
+        if (q->throttled == 0) {
+            LMLOG(LWRN, "Map-Requests to %s limited to %d per second. "
+                    "Queueing the map-cache misses", lisp_addr_to_char(q->mr),
+                    sched->rate);
+        }
+        q->throttled++;
+        wait = (uint64_t)((1 - q->tokens) * 1000000 / sched->rate) + 1;
+        if (deadline == 0 || now + wait < deadline) {
+            deadline = now + wait;
+        }
+    }
+
+    mreq_sched_arm(sched, deadline);
+    if (sent && deadline == 0) {
+        mreq_sched_dump_stats(sched, LDBG_2);
+    }
+}
+
+static int
+mreq_sched_flush_cb(sock_t *sl)
+{
+    mreq_sched_t *sched = sl->arg;
+    uint64_t expirations;
+
+    if (read(sl->fd, &expirations, sizeof(expirations)) < 0
+            && errno != EAGAIN) {
+        LMLOG(LDBG_2, "mreq_sched_flush_cb: read error: %s", strerror(errno));
+    }
+    sched->timer_deadline = 0;
+    mreq_sched_flush(sched);
+
+    return (GOOD);
+}
+
+void
+mreq_sched_dump_stats(mreq_sched_t *sched, int log_level)
+{
+    glist_entry_t *it;
+    mreq_queue_t *q;
+
+    if (is_loggable(log_level) == FALSE) {
+        return;
+    }
+
+    LMLOG(log_level, "Map-Request scheduler: rate %d/s (burst %d), %d "
+            "Map-Requests waiting for replies, %"PRIu64" not active entries "
+            "resolved by a covering prefix", sched->rate, sched->burst,
+            sched->inflight, sched->resolved_by_cover);
+    glist_for_each_entry(it, sched->queues) {
+        q = (mreq_queue_t *)glist_entry_data(it);
+        LMLOG(log_level, "  %s: depth %d (max %d), queued %"PRIu64", "
+                "cancelled %"PRIu64", sent %"PRIu64" Map-Requests with %"PRIu64
+                " records, throttled %"PRIu64, lisp_addr_to_char(q->mr),
+                q->depth, q->max_depth, q->queued, q->cancelled, q->sent_msgs,
+                q->sent_recs, q->throttled);
+    }
+}
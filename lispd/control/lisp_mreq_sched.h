@@ -0,0 +1,94 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LISP_MREQ_SCHED_H_
+#define LISP_MREQ_SCHED_H_
+
+#include "../defs.h"
+#include "../elibs/ovs/list.h"
+#include "../liblisp/lisp_address.h"
+#include "../lib/generic_list.h"
+
+/*
+ * Scheduler of the Map-Requests of map-cache misses. The EIDs to resolve wait
+ * in a queue per Map-Resolver and are sent packed in multi-record
+ * Map-Requests, at most 'rate' Map-Requests per second to each Map-Resolver
+ * with bursts of up to 'burst'. A miss waits at most MREQ_BATCH_WINDOW ms
+ * for others to be packed with it when the Map-Resolver has tokens left.
+ *
+ * The queued element is the argument of the retry timer of the not active
+ * entry of the EID, so the EID leaves the queue when the entry is removed.
+ * A Map-Reply replaces the not active entries its prefixes cover, which
+ * takes the misses it also answers out of the queues unsent. One nonce is
+ * used for all the records of a Map-Request. It is kept until all the EIDs it
+ * carries are answered or would have been aborted, and only accepts records
+ * covering the EIDs not answered yet.
+ */
+
+struct lisp_xtr;
+struct _timer_map_req_argument;
+
+typedef struct mreq_queue {
+    lisp_addr_t *mr;            /* Map-Resolver */
+    struct ovs_list reqs;       /* <timer_map_req_argument> oldest first */
+    int depth;
+    double tokens;
+    uint64_t tb_last;           /* usec. Last refill of the bucket */
+
+    /* Metrics */
+    int max_depth;
+    uint64_t queued;            /* EIDs added to the queue */
+    uint64_t cancelled;         /* EIDs removed before being sent */
+    uint64_t sent_msgs;
+    uint64_t sent_recs;
+    uint64_t throttled;         /* times the queue waited for tokens */
+} mreq_queue_t;
+
+typedef struct mreq_sched {
+    struct lisp_xtr *xtr;
+    glist_t *queues;            /* <mreq_queue_t *> one per Map-Resolver */
+    int rate;                   /* Map-Requests per second. 0 is no limit */
+    int burst;
+    int timer_fd;
+    uint64_t timer_deadline;    /* usec. 0 if disarmed */
+    int inflight;               /* Map-Requests whose nonce is kept */
+    uint64_t resolved_by_cover; /* not active entries resolved by the
+                                 * Map-Reply of a covering prefix */
+} mreq_sched_t;
+
+/* Map-Request sent by the scheduler. Argument of the timer of its nonce */
+typedef struct mreq_batch {
+    mreq_sched_t *sched;
+    glist_t *eids;              /* <lisp_addr_t *> not answered yet */
+} mreq_batch_t;
+
+mreq_sched_t *mreq_sched_new(struct lisp_xtr *xtr, int rate, int burst);
+void mreq_sched_del(mreq_sched_t *sched);
+
+int mreq_sched_add(mreq_sched_t *sched, lisp_addr_t *mr,
+        struct _timer_map_req_argument *req);
+void mreq_sched_cancel(struct _timer_map_req_argument *req);
+int mreq_sched_depth(mreq_sched_t *sched);
+
+int mreq_batch_retire_eids(mreq_batch_t *batch, lisp_addr_t *pref);
+int mreq_batch_pending(mreq_batch_t *batch);
+
+void mreq_sched_dump_stats(mreq_sched_t *sched, int log_level);
+
+#endif /* LISP_MREQ_SCHED_H_ */
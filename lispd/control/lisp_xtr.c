@@ -31,6 +31,8 @@ static void mc_entry_start_expiration_timer(lisp_xtr_t *, mcache_entry_t *);
 static int handle_locator_probe_reply(lisp_xtr_t *, mcache_entry_t *, lisp_addr_t *);
 static int update_mcache_entry(lisp_xtr_t *, mapping_t *);
 static int tr_recv_map_reply(lisp_xtr_t *, lbuf_t *, uconn_t *);
+static int tr_recv_mreq_batch_reply(lisp_xtr_t *, lbuf_t *, void *,
+        lmtimer_t *);
 static int tr_reply_to_smr(lisp_xtr_t *xtr, lisp_addr_t *src_eid, lisp_addr_t *req_eid);
 static int tr_recv_map_request(lisp_xtr_t *, lbuf_t *, uconn_t *);
 static int tr_recv_map_notify(lisp_xtr_t *, lbuf_t *);
@@ -47,14 +49,12 @@ static int send_smr_invoked_map_request(lisp_xtr_t *xtr, lisp_addr_t *src_eid,
         mcache_entry_t *mce, uint64_t nonce);
 static int program_smr(lisp_xtr_t *, int time);
 static int send_map_request_retry_cb(lmtimer_t *timer);
-static int build_and_send_map_request(lisp_xtr_t *xtr, lisp_addr_t *src_eid,
-        mcache_entry_t *mce, uint64_t nonce);
 //static int send_map_reg(lisp_xtr_t *, lbuf_t *, lisp_addr_t *);
-static int build_and_send_map_reg(lisp_xtr_t *, mapping_t *, map_server_elt *,
-        uint64_t);
+static int build_map_regs(lisp_xtr_t *, lmtimer_t *);
+static void send_map_regs(lisp_xtr_t *, timer_map_reg_argument *);
+static void map_register_round_end(lmtimer_t *);
 //static int build_and_send_ecm_map_reg(lisp_xtr_t *, mapping_t *, lisp_addr_t *,
 //        uint64_t);
-int program_map_register_for_mapping(lisp_xtr_t *xtr, map_local_entry_t *mle);
 static int rloc_probing(lisp_xtr_t *, mapping_t *, locator_t *loc, uint64_t nonce);
 static void program_rloc_probing(lisp_xtr_t *, mcache_entry_t *, locator_t *, int);
 static void program_mce_rloc_probing(lisp_xtr_t *, mcache_entry_t *);
@@ -82,8 +82,7 @@ timer_map_req_argument *timer_map_req_arg_new_init(mcache_entry_t *mce,
         lisp_addr_t *src_eid);
 void timer_map_req_arg_free(timer_map_req_argument * timer_arg);
 /* Funtions related to timer_map_reg_argument */
-timer_map_reg_argument * timer_map_reg_argument_new_init(map_local_entry_t *mle,
-        map_server_elt *ms);
+timer_map_reg_argument * timer_map_reg_argument_new_init(map_server_elt *ms);
 void timer_map_reg_arg_free(timer_map_reg_argument * timer_arg);
 
 
@@ -148,6 +147,7 @@ handle_locator_probe_reply(lisp_xtr_t *xtr, mcache_entry_t *mce,
 
         LMLOG(LDBG_1," Locator %s state changed to UP",
                 lisp_addr_to_char(locator_addr(loct)));
+        gen_counter_bump(mce->gen);
 
         /* [re]Calculate forwarding info if status changed*/
         xtr->fwd_policy->updated_map_cache_inf(
@@ -187,6 +187,8 @@ update_mcache_entry(lisp_xtr_t *xtr, mapping_t *recv_map)
 
     /* DISCARD all locator state */
     mapping_update_locators(map, mapping_locators_lists(recv_map));
+    gen_counter_bump(mce->gen);
+    mcache_entry_updated(xtr->map_cache, mce);
 
     /* Update forwarding info */
     xtr->fwd_policy->updated_map_cache_inf(
@@ -230,6 +232,9 @@ tr_recv_map_reply(lisp_xtr_t *xtr, lbuf_t *buf, uconn_t *udp_con)
         return(BAD);
     }
     timer = nonces_list_timer(nonces_lst);
+    if (lmtimer_type(timer) == MAP_REQUEST_BATCH_TIMER){
+        return (tr_recv_mreq_batch_reply(xtr, &b, mrep_hdr, timer));
+    }
     /* If it is not a Map Reply Probe */
     if (!MREP_RLOC_PROBE(mrep_hdr)){
         t_mr_arg = (timer_map_req_argument *)lmtimer_cb_argument(timer);
@@ -267,6 +272,10 @@ tr_recv_map_reply(lisp_xtr_t *xtr, lbuf_t *buf, uconn_t *udp_con)
                 tr_mcache_add_mapping(xtr, m);
                 /* Mapping is ACTIVE */
             } else {
+                /* The update may evict the entry of the nonce, which stops
+                 * its timer. Remove nonces_lst and the timer before */
+                stop_timer_from_obj(mce,timer,ptrs_to_timers_ht,nonces_ht);
+                timer = NULL;
                 /* the reply might be for an active mapping (SMR)*/
                 update_mcache_entry(xtr, m);
                 mapping_del(m);
@@ -326,6 +335,98 @@ err:
     return(BAD);
 }
 
+/* Not active entries of EIDs contained in the mapping would shadow it */
+static void
+tr_remove_covered_not_active(lisp_xtr_t *xtr, mapping_t *m)
+{
+    glist_t *covered;
+    glist_entry_t *it;
+    mcache_entry_t *mce;
+
+    covered = mcache_lookup_more_specifics(xtr->map_cache, mapping_eid(m));
+    glist_for_each_entry(it, covered) {
+        mce = (mcache_entry_t *)glist_entry_data(it);
+        if (mcache_entry_active(mce)) {
+            continue;
+        }
+        LMLOG(LDBG_2, "Map-Reply for %s resolves the pending EID %s",
+                lisp_addr_to_char(mapping_eid(m)),
+                lisp_addr_to_char(mapping_eid(mcache_entry_mapping(mce))));
+        /* Stops its retry timer, which takes it out of the queue */
+        tr_mcache_remove_entry(xtr, mce);
+        xtr->mreq_sched->resolved_by_cover++;
+    }
+    glist_destroy(covered);
+}
+
+/* Map-Reply to a Map-Request of the scheduler. The records covering EIDs of
+ * the Map-Request not answered yet are installed and replace the not active
+ * entries they cover. The nonce is kept until all the EIDs are answered since
+ * they may be answered in other Map-Replies */
+static int
+tr_recv_mreq_batch_reply(lisp_xtr_t *xtr, lbuf_t *b, void *mrep_hdr,
+        lmtimer_t *timer)
+{
+    mreq_batch_t *batch = lmtimer_cb_argument(timer);
+    mapping_t *m;
+    locator_t *probed;
+    mcache_entry_t *mce;
+    int i, ret = GOOD;
+
+    for (i = 0; i < MREP_REC_COUNT(mrep_hdr); i++) {
+        m = mapping_new();
+        if (lisp_msg_parse_mapping_record(b, m, &probed) != GOOD) {
+            mapping_del(m);
+            ret = BAD;
+            break;
+        }
+        if (mreq_batch_retire_eids(batch, mapping_eid(m)) == 0) {
+            LMLOG(LDBG_1, "Map-Reply record for %s doesn't answer any pending "
+                    "EID of its Map-Request. Discarding record",
+                    lisp_addr_to_char(mapping_eid(m)));
+            mapping_del(m);
+            continue;
+        }
+        if (mapping_has_elp_with_l_bit(m)){
+            LMLOG(LDBG_1,"Received a Map Reply with an ELP with the L bit set. "
+                    "Not supported -> Discrding record");
+            mapping_del(m);
+            continue;
+        }
+
+        mce = mcache_lookup_exact(xtr->map_cache, mapping_eid(m));
+        if (mce && mcache_entry_active(mce)) {
+            /* Already answered by the reply to another Map-Request */
+            update_mcache_entry(xtr, m);
+            mapping_del(m);
+        } else {
+            if (mce) {
+                /* delete placeholder/dummy mapping inorder to install the new one */
+                tr_mcache_remove_entry(xtr, mce);
+            }
+            /* DO NOT free mapping in this case */
+            if (tr_mcache_add_mapping(xtr, m) != GOOD) {
+                continue;
+            }
+            mce = mcache_lookup_exact(xtr->map_cache, mapping_eid(m));
+            if (!mce) {
+                continue;
+            }
+        }
+        tr_remove_covered_not_active(xtr, mcache_entry_mapping(mce));
+    }
+
+    if (mreq_batch_pending(batch) == 0) {
+        /* Remove the nonce and the timer */
+        stop_timer_from_obj(xtr->mreq_sched, timer, ptrs_to_timers_ht,
+                nonces_ht);
+    }
+
+    mcache_dump_db(xtr->map_cache, LDBG_3);
+    mreq_sched_dump_stats(xtr->mreq_sched, LDBG_3);
+
+    return (ret);
+}
 
 static int
 tr_reply_to_smr(lisp_xtr_t *xtr, lisp_addr_t *src_eid, lisp_addr_t *req_eid)
@@ -530,6 +631,8 @@ handle_merge_semantics(lisp_xtr_t *xtr, mapping_t *rec_map)
         LMLOG(LDBG_3, "Prefix %s already registered, updating locators",
                 lisp_addr_to_char(eid));
         mapping_update_locators(map,mapping_locators_lists(rec_map));
+        gen_counter_bump(mce->gen);
+        mcache_entry_updated(xtr->map_cache, mce);
 
         /* Update forward info*/
         xtr->fwd_policy->updated_map_cache_inf(
@@ -555,6 +658,7 @@ tr_recv_map_notify(lisp_xtr_t *xtr, lbuf_t *buf)
     nonces_list_t *nonces_lst;
     lmtimer_t *timer;
     timer_map_reg_argument *timer_arg;
+    glist_entry_t *it, *mreg_it = NULL;
     int i, res = BAD;
     lbuf_t b;
 
@@ -580,6 +684,21 @@ tr_recv_map_notify(lisp_xtr_t *xtr, lbuf_t *buf)
         return(BAD);
     }
 
+    /* The Map-Notify acknowledges the Map-Register of the round with its
+     * nonce, and with it all the records the message carried */
+    glist_for_each_entry(it, timer_arg->pending) {
+        if (MREG_NONCE(lisp_msg_hdr((lbuf_t *)glist_entry_data(it)))
+                == MNTF_NONCE(hdr)) {
+            mreg_it = it;
+            break;
+        }
+    }
+    if (!mreg_it) {
+        LMLOG(LDBG_1, "Map-Register with nonce %"PRIx64" already acknowledged."
+                " Discarding Map-Notify!", MNTF_NONCE(hdr));
+        return(GOOD);
+    }
+
     lisp_msg_pull_auth_field(&b);
 
     for (i = 0; i < MNTF_REC_COUNT(hdr); i++) {
@@ -596,12 +715,12 @@ tr_recv_map_notify(lisp_xtr_t *xtr, lbuf_t *buf)
         if (!local_map) {
             LMLOG(LDBG_1, "Map-Notify confirms registration of UNKNOWN EID %s."
                     " Dropping!", lisp_addr_to_char(eid));
+            mapping_del(m);
             continue;
         }
 
-        LMLOG(LDBG_1, "Map-Notify message confirms correct registration of %s."
-                "Programing next Map-Register in %d seconds",lisp_addr_to_char(eid),
-                MAP_REGISTER_INTERVAL);
+        LMLOG(LDBG_2, "Map-Notify message confirms correct registration of %s",
+                lisp_addr_to_char(eid));
 
         /* MULTICAST MERGE SEMANTICS */
         if (lisp_addr_is_mc(eid) && mapping_cmp(local_map, m) != 0) {
@@ -610,11 +729,18 @@ tr_recv_map_notify(lisp_xtr_t *xtr, lbuf_t *buf)
 
 
         mapping_del(m);
-        htable_nonces_reset_nonces_lst(nonces_ht,nonces_lst);
-        lmtimer_start(timer,MAP_REGISTER_INTERVAL);
-
+    }
 
+    glist_remove(mreg_it, timer_arg->pending);
+    LMLOG(LDBG_1, "Map-Notify from %s confirms %d records. %d Map-Registers "
+            "pending", lisp_addr_to_char(ms->address), MNTF_REC_COUNT(hdr),
+            glist_size(timer_arg->pending));
 
+    if (glist_size(timer_arg->pending) == 0) {
+        LMLOG(LDBG_1, "Local mappings registered in %s. Programing next "
+                "Map-Register in %d seconds", lisp_addr_to_char(ms->address),
+                MAP_REGISTER_INTERVAL);
+        map_register_round_end(timer);
     }
 
     return(GOOD);
@@ -648,9 +774,11 @@ handle_map_cache_miss(lisp_xtr_t *xtr, lisp_addr_t *requested_eid,
         return(BAD);
     }
 
+    /* The nonces are those of the Map-Requests of the scheduler */
     timer_arg = timer_map_req_arg_new_init(mce,src_eid);
-    timer = lmtimer_with_nonce_new(MAP_REQUEST_RETRY_TIMER,xtr,send_map_request_retry_cb,
-            timer_arg,(lmtimer_del_cb_arg_fn)timer_map_req_arg_free);
+    timer = lmtimer_create(MAP_REQUEST_RETRY_TIMER);
+    lmtimer_init(timer, xtr, send_map_request_retry_cb, timer_arg,
+            (lmtimer_del_cb_arg_fn)timer_map_req_arg_free, NULL);
     htable_ptrs_timers_add(ptrs_to_timers_ht,mce,timer);
 
     return(send_map_request_retry_cb(timer));
@@ -788,7 +916,13 @@ send_all_smr_and_reg(lisp_xtr_t *xtr)
     /* Get a list of mappings that require smrs */
     map_loc_e_list = get_map_local_entry_to_smr(xtr);
 
-    /* Send map register and SMR request for each mapping */
+    /* Re-register the updated mappings together with the rest in the
+     * batched Map-Registers to each map server */
+    if (glist_size(map_loc_e_list) > 0) {
+        program_map_register(xtr);
+    }
+
+    /* Send SMR request for each mapping */
     //glist_dump(map_loc_e_list,(glist_to_char_fct)map_local_entry_to_char,LDBG_1);
 
     glist_for_each_entry(it, map_loc_e_list) {
@@ -796,8 +930,6 @@ send_all_smr_and_reg(lisp_xtr_t *xtr)
         map = map_local_entry_mapping(map_loc_e);
         eid = mapping_eid(map);
 
-        program_map_register_for_mapping(xtr, map_loc_e);
-
         LMLOG(LDBG_1, "Start SMR for local EID %s", lisp_addr_to_char(eid));
 
         /* For each map cache entry with same afi as local EID mapping */
@@ -959,29 +1091,42 @@ static int
 send_map_request_retry_cb(lmtimer_t *timer)
 {
     timer_map_req_argument *timer_arg = (timer_map_req_argument *)lmtimer_cb_argument(timer);
-    nonces_list_t *nonces_list = lmtimer_nonces(timer);
     lisp_xtr_t *xtr = lmtimer_owner(timer);
-    uint64_t nonce;
-    lisp_addr_t *deid;
-    int retries = nonces_list_size(nonces_list);
+    lisp_addr_t *deid, *drloc;
 
     deid = mapping_eid (mcache_entry_mapping(timer_arg->mce));
-    if (retries - 1 < xtr->map_request_retries) {
 
-        if (retries > 0) {
+    if (timer_arg->retries <= xtr->map_request_retries) {
+        /* Not sent yet. Still waiting for tokens of its Map-Resolver. The
+         * wait counts as a retry so that the entry is eventually aborted */
+        if (timer_arg->queue != NULL) {
+            timer_arg->retries++;
+            lmtimer_start(timer, LISPD_INITIAL_MRQ_TIMEOUT);
+            return (GOOD);
+        }
+
+        if (timer_arg->retries > 0) {
             LMLOG(LDBG_1, "Retransmitting Map Request for EID: %s (%d retries)",
-                    lisp_addr_to_char(deid), retries);
+                    lisp_addr_to_char(deid), timer_arg->retries);
         }
-        nonce = nonce_new();
-        if (build_and_send_map_request(xtr, timer_arg->src_eid, timer_arg->mce, nonce) != GOOD){
+        if (glist_size(xtr->map_resolvers) == 0){
+            LMLOG(LDBG_1, "Couldn't send map request: No map resolver configured");
             return (BAD);
         }
-        htable_nonces_insert(nonces_ht, nonce, nonces_list);
+        drloc = get_map_resolver(xtr);
+        if (!drloc){
+            return (BAD);
+        }
+        /* Sent with the other misses to the Map-Resolver */
+        if (mreq_sched_add(xtr->mreq_sched, drloc, timer_arg) != GOOD){
+            return (BAD);
+        }
+        timer_arg->retries++;
         lmtimer_start(timer, LISPD_INITIAL_MRQ_TIMEOUT);
         return (GOOD);
     } else {
         LMLOG(LDBG_1, "No Map-Reply for EID %s after %d retries. Aborting!",
-                lisp_addr_to_char(deid), retries -1 );
+                lisp_addr_to_char(deid), timer_arg->retries -1 );
         /* When removing mce, all timers associated to it are canceled */
         tr_mcache_remove_entry(xtr,timer_arg->mce);
 
@@ -989,102 +1134,152 @@ send_map_request_retry_cb(lmtimer_t *timer)
     }
 }
 
-
-/* Sends a Map-Request for EID in 'mce' and sets-up a retry timer */
-static int
-build_and_send_map_request(lisp_xtr_t *xtr, lisp_addr_t *seid,
-        mcache_entry_t *mce, uint64_t nonce)
+/* Map-Register to the map server without records, nonce and auth data */
+static lbuf_t *
+map_reg_batch_create(map_server_elt *ms)
 {
-    uconn_t uc;
-    mapping_t *m = NULL;
-    lisp_addr_t *deid = NULL;
-    lisp_addr_t *drloc, *srloc;
-    glist_t *rlocs = NULL;
-    lbuf_t *b = NULL;
-    void *mr_hdr = NULL;
+    lbuf_t *b = lisp_msg_create(LISP_MAP_REGISTER);
 
-    if (glist_size(xtr->map_resolvers) == 0){
-        LMLOG(LDBG_1, "Couldn't send map request: No map resolver configured");
-        return (BAD);
+    if (!lisp_msg_put_empty_auth_record(b, ms->key_type)) {
+        lisp_msg_destroy(b);
+        return(NULL);
     }
+    MREG_PROXY_REPLY(lisp_msg_hdr(b)) = ms->proxy_reply;
 
-    m = mcache_entry_mapping(mce);
-    deid = mapping_eid(m);
+    return(b);
+}
 
-    /* BUILD Map-Request */
+/* Add the record of the mapping to the Map-Register. Fails, leaving the
+ * message untouched, if the record doesn't fit in MAX_LISP_MSG_LEN. A record
+ * alone in its message is always added */
+static int
+map_reg_batch_put_mapping(lbuf_t *b, mapping_t *m)
+{
+    uint32_t size = lbuf_size(b);
 
-    // Rlocs to be used as ITR of the map req.
-    rlocs = ctrl_default_rlocs(xtr->super.ctrl);
-    LMLOG(LDBG_1, "locators for req: %s", laddr_list_to_char(rlocs));
-    b = lisp_msg_mreq_create(seid, rlocs, deid);
-    if (b == NULL) {
-        glist_destroy(rlocs);
+    if (!lisp_msg_put_mapping(b, m, NULL)) {
+        lbuf_set_size(b, size);
         return(BAD);
     }
 
-    mr_hdr = lisp_msg_hdr(b);
-    MREQ_NONCE(mr_hdr) = nonce;
-    LMLOG(LDBG_1, "%s, itr-rlocs:%s, src-eid: %s, req-eid: %s",
-            lisp_msg_hdr_to_char(b), laddr_list_to_char(rlocs),
-            lisp_addr_to_char(seid), lisp_addr_to_char(deid));
-    glist_destroy(rlocs);
-
+    if (lbuf_size(b) > MAX_LISP_MSG_LEN && MREG_REC_COUNT(lisp_msg_hdr(b)) > 1) {
+        lbuf_set_size(b, size);
+        MREG_REC_COUNT(lisp_msg_hdr(b))--;
+        return(BAD);
+    }
 
-    /* Encapsulate message and send it to the map resolver */
+    return(GOOD);
+}
 
-    lisp_msg_encap(b, LISP_CONTROL_PORT, LISP_CONTROL_PORT, seid, deid);
+/* Authenticate the Map-Register with a new nonce and keep it in the round of
+ * the map server until it is acknowledged */
+static int
+map_reg_batch_close(lmtimer_t *timer, lbuf_t *b)
+{
+    timer_map_reg_argument *timer_arg = lmtimer_cb_argument(timer);
+    map_server_elt *ms = timer_arg->ms;
+    uint64_t nonce = nonce_new();
 
-    srloc = NULL;
-    drloc = get_map_resolver(xtr);
-    if (!drloc){
+    MREG_NONCE(lisp_msg_hdr(b)) = nonce;
+    if (lisp_msg_fill_auth_data(b, ms->key_type, ms->key) != GOOD) {
         lisp_msg_destroy(b);
-        return (BAD);
+        return(BAD);
     }
 
-    uconn_init(&uc, LISP_CONTROL_PORT, LISP_CONTROL_PORT, srloc, drloc);
-    send_msg(&xtr->super, b, &uc);
-
-    lisp_msg_destroy(b);
+    htable_nonces_insert(nonces_ht, nonce, lmtimer_nonces(timer));
+    glist_add_tail(b, timer_arg->pending);
 
     return(GOOD);
 }
 
-/* build and send generic map-register with one record
- * for each map server */
 static int
-build_and_send_map_reg(lisp_xtr_t * xtr, mapping_t * m, map_server_elt *ms,
-        uint64_t nonce)
+map_reg_batch_add_mapping(lmtimer_t *timer, lbuf_t **b, mapping_t *m)
 {
-    lbuf_t * b = NULL;
-    void * hdr = NULL;
-    lisp_addr_t * drloc = NULL;
-    uconn_t uc;
+    timer_map_reg_argument *timer_arg = lmtimer_cb_argument(timer);
+
+    if (map_reg_batch_put_mapping(*b, m) == GOOD) {
+        return(GOOD);
+    }
 
+    if (MREG_REC_COUNT(lisp_msg_hdr(*b)) == 0) {
+        LMLOG(LWRN, "Couldn't build the record of %s for the Map-Register",
+                lisp_addr_to_char(mapping_eid(m)));
+        return(GOOD);
+    }
 
-    b = lisp_msg_mreg_create(m, ms->key_type);
+    /* Message full. Close it and start the next one with the record */
+    if (map_reg_batch_close(timer, *b) != GOOD) {
+        *b = NULL;
+        return(BAD);
+    }
+    *b = map_reg_batch_create(timer_arg->ms);
+    if (!*b) {
+        return(BAD);
+    }
+    if (map_reg_batch_put_mapping(*b, m) != GOOD) {
+        LMLOG(LWRN, "Couldn't build the record of %s for the Map-Register",
+                lisp_addr_to_char(mapping_eid(m)));
+    }
 
+    return(GOOD);
+}
+
+/* Pack the records of all the local mappings in as few Map-Registers to the
+ * map server of the timer as fit in MAX_LISP_MSG_LEN, with one nonce and one
+ * HMAC per message */
+static int
+build_map_regs(lisp_xtr_t *xtr, lmtimer_t *timer)
+{
+    timer_map_reg_argument *timer_arg = lmtimer_cb_argument(timer);
+    void *it = NULL;
+    lbuf_t *b = NULL;
+    int res = GOOD;
+
+    b = map_reg_batch_create(timer_arg->ms);
     if (!b) {
         return(BAD);
     }
 
-    hdr = lisp_msg_hdr(b);
-    MREG_PROXY_REPLY(hdr) = ms->proxy_reply;
-    MREG_NONCE(hdr) = nonce;
+    /* No continue or break inside the walk of the database */
+    local_map_db_foreach_entry(xtr->local_mdb, it) {
+        if (res == GOOD) {
+            res = map_reg_batch_add_mapping(timer, &b,
+                    map_local_entry_mapping((map_local_entry_t *)it));
+        }
+    } local_map_db_foreach_end;
 
-    if (lisp_msg_fill_auth_data(b, ms->key_type,
-            ms->key) != GOOD) {
+    if (res != GOOD) {
+        lisp_msg_destroy(b);
         return(BAD);
     }
-    drloc =  ms->address;
-    LMLOG(LDBG_1, "%s, EID: %s, MS: %s", lisp_msg_hdr_to_char(b),
-            lisp_addr_to_char(mapping_eid(m)), lisp_addr_to_char(drloc));
 
-    uconn_init(&uc, LISP_CONTROL_PORT, LISP_CONTROL_PORT, NULL, drloc);
-    send_msg(&xtr->super, b, &uc);
+    if (MREG_REC_COUNT(lisp_msg_hdr(b)) == 0) {
+        lisp_msg_destroy(b);
+        return(GOOD);
+    }
 
-    lisp_msg_destroy(b);
+    return(map_reg_batch_close(timer, b));
+}
 
-    return(GOOD);
+static void
+send_map_regs(lisp_xtr_t *xtr, timer_map_reg_argument *timer_arg)
+{
+    glist_entry_t *it;
+    lbuf_t *b;
+    uconn_t uc;
+
+    glist_for_each_entry(it, timer_arg->pending) {
+        b = (lbuf_t *)glist_entry_data(it);
+        LMLOG(LDBG_1, "%s, MS: %s", lisp_msg_hdr_to_char(b),
+                lisp_addr_to_char(timer_arg->ms->address));
+
+        uconn_init(&uc, LISP_CONTROL_PORT, LISP_CONTROL_PORT, NULL,
+                timer_arg->ms->address);
+        send_msg(&xtr->super, b, &uc);
+        /* The message is kept for the retries. Drop the outer headers the
+         * data plane may have pushed */
+        lbuf_point_to_lisp(b);
+    }
 }
 
 //static int
@@ -1137,82 +1332,63 @@ build_and_send_map_reg(lisp_xtr_t * xtr, mapping_t * m, map_server_elt *ms,
 //    return(GOOD);
 //}
 
+static void
+map_register_round_end(lmtimer_t *timer)
+{
+    timer_map_reg_argument *timer_arg = lmtimer_cb_argument(timer);
+
+    timer_arg->retries = 0;
+    glist_remove_all(timer_arg->pending);
+    htable_nonces_reset_nonces_lst(nonces_ht, lmtimer_nonces(timer));
+    lmtimer_start(timer, MAP_REGISTER_INTERVAL);
+}
+
 static int
 map_register_cb(lmtimer_t *timer)
 {
     timer_map_reg_argument *timer_arg = lmtimer_cb_argument(timer);
-    nonces_list_t *nonces_lst = lmtimer_nonces(timer);
     lisp_xtr_t *xtr = lmtimer_owner(timer);
-    mapping_t *map = map_local_entry_mapping(timer_arg->mle);
     map_server_elt *ms = timer_arg->ms;
-    uint64_t nonce;
 
-    if ((nonces_list_size(nonces_lst) -1) < xtr->probe_retries){
-        nonce = nonce_new();
-        if (build_and_send_map_reg(xtr, map, ms, nonce) != GOOD){
+    if (glist_size(timer_arg->pending) == 0) {
+        /* New registration round */
+        if (build_map_regs(xtr, timer) != GOOD) {
+            LMLOG(LWRN, "Couldn't build the Map-Registers to %s. Retry in %d "
+                    "seconds", lisp_addr_to_char(ms->address),
+                    MAP_REGISTER_INTERVAL);
+            map_register_round_end(timer);
             return (BAD);
         }
-        if (nonces_list_size(nonces_lst) > 0) {
-            LMLOG(LDBG_1,"Sent Retry Map-Register for mapping %s to %s "
-                    "(%d retries)", lisp_addr_to_char(mapping_eid(map)),
-                    lisp_addr_to_char(ms->address), nonces_list_size(nonces_lst));
-        } else {
-            LMLOG(LDBG_1,"Sent Map-Register for mapping %s to %s "
-                    , lisp_addr_to_char(mapping_eid(map)),
-                    lisp_addr_to_char(ms->address));
+        if (glist_size(timer_arg->pending) == 0) {
+            map_register_round_end(timer);
+            return (GOOD);
         }
-        htable_nonces_insert(nonces_ht, nonce,nonces_lst);
-        lmtimer_start(timer, LISPD_INITIAL_MREG_TIMEOUT);
-        return (GOOD);
-    }else{
-        /* If we have reached maximum number of retransmissions, change remote
-         *  locator status */
-
+        send_map_regs(xtr, timer_arg);
+        LMLOG(LDBG_1,"Sent %d Map-Registers with the local mappings to %s",
+                glist_size(timer_arg->pending), lisp_addr_to_char(ms->address));
+    } else if (timer_arg->retries < xtr->probe_retries) {
+        timer_arg->retries++;
+        send_map_regs(xtr, timer_arg);
+        LMLOG(LDBG_1,"Sent %d Retry Map-Registers to %s (%d retries)",
+                glist_size(timer_arg->pending), lisp_addr_to_char(ms->address),
+                timer_arg->retries);
+    } else {
         /* Reprogram time for next Map Register interval */
-        htable_nonces_reset_nonces_lst(nonces_ht,nonces_lst);
-        lmtimer_start(timer, MAP_REGISTER_INTERVAL);
-        LMLOG(LWRN,"Map Register of %s to %s not received reply. Retry in %d seconds",
-                lisp_addr_to_char(mapping_eid(map)), lisp_addr_to_char(ms->address),
-                MAP_REGISTER_INTERVAL);
-
-        return (BAD);
-    }
-}
-
-int
-program_map_register(lisp_xtr_t *xtr)
-{
-    void *map_local_entry_it;
-    map_local_entry_t *mle;
-    lmtimer_t *timer;
-    timer_map_reg_argument *timer_arg;
-    map_server_elt *ms;
-    glist_entry_t *ms_it;
-
-    if (glist_size(xtr->map_servers) == 0){
+        LMLOG(LWRN,"%d Map-Registers to %s not received reply. Retry in %d "
+                "seconds", glist_size(timer_arg->pending),
+                lisp_addr_to_char(ms->address), MAP_REGISTER_INTERVAL);
+        map_register_round_end(timer);
         return (BAD);
     }
 
-    local_map_db_foreach_entry(xtr->local_mdb, map_local_entry_it) {
-        mle = (map_local_entry_t *)map_local_entry_it;
-        /* Cancel timers associated to the map register of the local map entry */
-        stop_timers_of_type_from_obj(mle,MAP_REGISTER_TIMER,ptrs_to_timers_ht, nonces_ht);
-        /* Configure map register for each map server */
-        glist_for_each_entry(ms_it,xtr->map_servers){
-            ms = (map_server_elt *)glist_entry_data(ms_it);
-            timer_arg = timer_map_reg_argument_new_init(mle,ms);
-            timer = lmtimer_with_nonce_new(MAP_REGISTER_TIMER, xtr, map_register_cb,
-                    timer_arg,(lmtimer_del_cb_arg_fn)timer_map_reg_arg_free);
-            htable_ptrs_timers_add(ptrs_to_timers_ht, mle, timer);
-            map_register_cb(timer);
-        }
-    } local_map_db_foreach_end;
-
-    return(GOOD);
+    lmtimer_start(timer, LISPD_INITIAL_MREG_TIMEOUT);
+    return (GOOD);
 }
 
+/* Start a registration round of the local mappings in each map server. Any
+ * round in progress is replaced */
 int
-program_map_register_for_mapping(lisp_xtr_t *xtr, map_local_entry_t *mle)
+program_map_register(lisp_xtr_t *xtr)
 {
     lmtimer_t *timer;
     timer_map_reg_argument *timer_arg;
@@ -1223,15 +1399,14 @@ program_map_register_for_mapping(lisp_xtr_t *xtr, map_local_entry_t *mle)
         return (BAD);
     }
 
-    /* Cancel timers associated to the map register of the local map entry */
-    stop_timers_of_type_from_obj(mle,MAP_REGISTER_TIMER,ptrs_to_timers_ht, nonces_ht);
-    /* Configure map register for each map server */
     glist_for_each_entry(ms_it,xtr->map_servers){
         ms = (map_server_elt *)glist_entry_data(ms_it);
-        timer_arg = timer_map_reg_argument_new_init(mle,ms);
+        /* Cancel the round in progress with the map server */
+        stop_timers_of_type_from_obj(ms,MAP_REGISTER_TIMER,ptrs_to_timers_ht, nonces_ht);
+        timer_arg = timer_map_reg_argument_new_init(ms);
         timer = lmtimer_with_nonce_new(MAP_REGISTER_TIMER, xtr, map_register_cb,
                 timer_arg,(lmtimer_del_cb_arg_fn)timer_map_reg_arg_free);
-        htable_ptrs_timers_add(ptrs_to_timers_ht, mle, timer);
+        htable_ptrs_timers_add(ptrs_to_timers_ht, ms, timer);
         map_register_cb(timer);
     }
 
@@ -1292,6 +1467,7 @@ rloc_probing_cb(lmtimer_t *timer)
                 }
                 mce = xtr->petrs;
             }
+            gen_counter_bump(mce->gen);
 
             xtr->fwd_policy->updated_map_cache_inf(
                     xtr->fwd_policy_dev_parm,
@@ -1402,6 +1578,7 @@ int
 tr_mcache_add_mapping(lisp_xtr_t *xtr, mapping_t *m)
 {
     mcache_entry_t *mce = NULL;
+    mcache_entry_t *cover = NULL;
     void *routing_inf = NULL;
 
     mce = mcache_entry_new();
@@ -1420,6 +1597,12 @@ tr_mcache_add_mapping(lisp_xtr_t *xtr, mapping_t *m)
     }
     mcache_entry_set_routing_info(mce,routing_inf,xtr->fwd_policy->del_map_cache_policy_inf);
 
+    /* Flows using the less specific entry have to be resolved again. Done
+     * before the insertion, which may evict it */
+    cover = mcache_lookup_less_specific(xtr->map_cache, mapping_eid(m));
+    if (cover) {
+        gen_counter_bump(cover->gen);
+    }
     if (mcache_add_entry(xtr->map_cache, mapping_eid(m), mce) != GOOD) {
         LMLOG(LDBG_1, "tr_mcache_add_mapping: Couldn't add map cache entry %s to data base!. Discarding it.",
                 lisp_addr_to_char(mapping_eid(m)));
@@ -1428,6 +1611,7 @@ tr_mcache_add_mapping(lisp_xtr_t *xtr, mapping_t *m)
     }
 
     mcache_entry_set_active(mce, ACTIVE);
+    mcache_entry_updated(xtr->map_cache, mce);
 
     /* Reprogramming timers */
     mc_entry_start_expiration_timer(xtr, mce);
@@ -1442,6 +1626,7 @@ int
 tr_mcache_add_static_mapping(lisp_xtr_t *xtr, mapping_t *m)
 {
     mcache_entry_t *mce = NULL;
+    mcache_entry_t *cover = NULL;
     void * routing_inf = NULL;
 
     mce = mcache_entry_new();
@@ -1459,6 +1644,11 @@ tr_mcache_add_static_mapping(lisp_xtr_t *xtr, mapping_t *m)
     }
     mcache_entry_set_routing_info(mce,routing_inf,xtr->fwd_policy->del_map_cache_policy_inf);
 
+    /* Done before the insertion, which may evict the less specific entry */
+    cover = mcache_lookup_less_specific(xtr->map_cache, mapping_eid(m));
+    if (cover) {
+        gen_counter_bump(cover->gen);
+    }
     if (mcache_add_entry(xtr->map_cache, mapping_eid(m), mce) != GOOD) {
         LMLOG(LDBG_1, "tr_mcache_add_static_mapping: Couldn't add static map cache entry %s to data base!. Discarding it.",
                         lisp_addr_to_char(mapping_eid(m)));
@@ -1477,6 +1667,7 @@ tr_mcache_remove_entry(lisp_xtr_t *xtr, mcache_entry_t *mce)
     lisp_addr_t *eid = mapping_eid(mcache_entry_mapping(mce));
 
     data = mcache_remove_entry(xtr->map_cache, eid);
+    /* Deleting the entry invalidates the forwarding info using it */
     mcache_entry_del(data);
     mcache_dump_db(xtr->map_cache, LDBG_3);
 
@@ -1594,6 +1785,7 @@ xtr_if_event(lisp_ctrl_dev_t *dev, char *iface_name, lisp_addr_t *old_addr,
                 }
                 /* Activate locator */
                 mapping_activate_locator(mapping,locator,new_addr);
+                gen_counter_bump(map_loc_e->gen);
                 /* Recalculate forwarding info of the mappings with activated locators */
                 xtr->fwd_policy->updated_map_loc_inf(
                                            xtr->fwd_policy_dev_parm,
@@ -1624,6 +1816,7 @@ xtr_if_event(lisp_ctrl_dev_t *dev, char *iface_name, lisp_addr_t *old_addr,
             map_loc_e = (map_local_entry_t *)glist_entry_data(it_m);
             mapping = map_local_entry_mapping(map_loc_e);
             mapping_sort_locators(mapping, new_addr);
+            gen_counter_bump(map_loc_e->gen);
         }
     /* New status */
     }else{
@@ -1644,6 +1837,7 @@ xtr_if_event(lisp_ctrl_dev_t *dev, char *iface_name, lisp_addr_t *old_addr,
         /* Recalculate forwarding info of the affected mappings */
         glist_for_each_entry(it_m, if_loct->map_loc_entries){
             map_loc_e = (map_local_entry_t *)glist_entry_data(it_m);
+            gen_counter_bump(map_loc_e->gen);
             xtr->fwd_policy->updated_map_loc_inf(
                     xtr->fwd_policy_dev_parm,
                     map_local_entry_fwd_info(map_loc_e),
@@ -1651,6 +1845,7 @@ xtr_if_event(lisp_ctrl_dev_t *dev, char *iface_name, lisp_addr_t *old_addr,
         }
     }
     if (xtr->super.mode == RTR_MODE && xtr->all_locs_map) {
+        gen_counter_bump(xtr->all_locs_map->gen);
         xtr->fwd_policy->updated_map_loc_inf(
                             xtr->fwd_policy_dev_parm,
                             map_local_entry_fwd_info(xtr->all_locs_map),
@@ -1742,6 +1937,7 @@ map_server_elt_del (map_server_elt *map_server)
     if (map_server == NULL){
         return;
     }
+    stop_timers_from_obj(map_server, ptrs_to_timers_ht, nonces_ht);
     lisp_addr_del (map_server->address);
     free(map_server->key);
     free(map_server);
@@ -1776,6 +1972,11 @@ xtr_ctrl_construct(lisp_ctrl_dev_t *dev)
     /* set up databases */
     xtr->local_mdb = local_map_db_new();
     xtr->map_cache = mcache_new();
+    if (xtr->map_cache) {
+        mcache_set_limits(xtr->map_cache, map_cache_max_entries,
+                (size_t)map_cache_max_size * 1024);
+    }
+    xtr->mreq_sched = mreq_sched_new(xtr, map_request_rate, map_request_burst);
     xtr->map_servers = glist_new_managed((glist_del_fct)map_server_elt_del);
     xtr->map_resolvers = glist_new_managed((glist_del_fct)lisp_addr_del);
     xtr->pitrs = glist_new_managed((glist_del_fct)lisp_addr_del);
@@ -1783,7 +1984,7 @@ xtr_ctrl_construct(lisp_ctrl_dev_t *dev)
     xtr->iface_locators_table = shash_new_managed((free_key_fn_t)iface_locators_del);
 
     if (!xtr->local_mdb || !xtr->map_cache || !xtr->map_servers ||
-            !xtr->map_resolvers || !xtr->pitrs || !xtr->petrs ||
+            !xtr->map_resolvers || !xtr->mreq_sched || !xtr->pitrs || !xtr->petrs ||
             !xtr->iface_locators_table) {
         return(BAD);
     }
@@ -1815,6 +2016,8 @@ xtr_ctrl_destruct(lisp_ctrl_dev_t *dev)
 
     shash_destroy(xtr->iface_locators_table);
     mcache_del(xtr->map_cache);
+    /* After the map-cache, whose not active entries are in its queues */
+    mreq_sched_del(xtr->mreq_sched);
     mcache_entry_del(xtr->petrs);
     local_map_db_del(xtr->local_mdb);
     glist_destroy(xtr->map_resolvers);
@@ -2107,6 +2310,8 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
         map_loc_e = local_map_db_lookup_eid(xtr->local_mdb, &tuple->src_addr);
         if (map_loc_e == NULL){
             LMLOG(LDBG_3, "The source address %s is not a local EID", lisp_addr_to_char(&tuple->src_addr));
+            /* Until a local mapping covering the source is added */
+            fwd_info_set_gens(fwd_info, xtr->local_mdb->gen, NULL);
             return (fwd_info);
         }
     }else {
@@ -2114,12 +2319,17 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
     }
 
     mce = mcache_lookup(xtr->map_cache, &tuple->dst_addr);
+    /* The data plane keeps the info until any of the mappings consulted
+     * changes: the local one, the map cache entry of the destination, if
+     * any, and the PETRs entry when the PETRs are considered */
+    fwd_info_set_gens(fwd_info, map_loc_e->gen, mce ? mce->gen : NULL);
 
     if (!mce) {
         fwd_info->temporal = TRUE;
         LMLOG(LDBG_1, "No map cache for EID %s. Sending Map-Request!",
                 lisp_addr_to_char(&tuple->dst_addr));
         handle_map_cache_miss(xtr, &tuple->dst_addr, &tuple->src_addr);
+        fwd_info_set_petr_gen(fwd_info, xtr->petrs->gen);
         if (mcache_has_locators(xtr->petrs) == FALSE){
             LMLOG(LDBG_3, "Trying to forward to PETR but none found ...");
             return (fwd_info);
@@ -2129,6 +2339,7 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
         fwd_info->temporal = TRUE;
         LMLOG(LDBG_2, "Already sent Map-Request for %s. Waiting for reply!",
                 lisp_addr_to_char(&tuple->dst_addr));
+        fwd_info_set_petr_gen(fwd_info, xtr->petrs->gen);
         if (mcache_has_locators(xtr->petrs) == FALSE){
             LMLOG(LDBG_3, "Trying to forward to PETR but none found ...");
             return (fwd_info);
@@ -2141,6 +2352,7 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
     if (mapping_locator_count(dmap) == 0) {
         LMLOG(LDBG_3, "Destination %s has a NEGATIVE mapping!",
                 lisp_addr_to_char(&tuple->dst_addr));
+        fwd_info_set_petr_gen(fwd_info, xtr->petrs->gen);
         if (mcache_has_locators(xtr->petrs) == FALSE){
             LMLOG(LDBG_3, "Trying to forward to PETR but none found ...");
             return (fwd_info);
@@ -2159,6 +2371,7 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
 
     if (!fwd_info->fwd_info){
         if (mce != xtr->petrs){
+            fwd_info_set_petr_gen(fwd_info, xtr->petrs->gen);
             if (mcache_has_locators(xtr->petrs) == FALSE){
                 LMLOG(LDBG_3, "Forwarding packet to PeTR");
                 mce = xtr->petrs;
@@ -2177,6 +2390,7 @@ tr_get_fwd_entry(lisp_xtr_t *xtr, packet_tuple_t *tuple)
             LMLOG(LDBG_3, "tr_get_fwd_entry: No PETR compatible with local locators afi");
         }
     }
+
     return (fwd_info);
 }
 
@@ -2384,6 +2598,8 @@ timer_map_req_arg_new_init(mcache_entry_t *mce,lisp_addr_t *src_eid)
     timer_map_req_argument *timer_arg = xmalloc(sizeof(timer_map_req_argument));
     timer_arg->mce = mce;
     timer_arg->src_eid = lisp_addr_clone(src_eid);
+    timer_arg->retries = 0;
+    timer_arg->queue = NULL;
 
     return(timer_arg);
 }
@@ -2391,17 +2607,18 @@ timer_map_req_arg_new_init(mcache_entry_t *mce,lisp_addr_t *src_eid)
 void
 timer_map_req_arg_free(timer_map_req_argument * timer_arg)
 {
+    mreq_sched_cancel(timer_arg);
     lisp_addr_del(timer_arg->src_eid);
     free(timer_arg);
 }
 
 timer_map_reg_argument *
-timer_map_reg_argument_new_init(map_local_entry_t *mle,
-        map_server_elt *ms)
+timer_map_reg_argument_new_init(map_server_elt *ms)
 {
     timer_map_reg_argument *timer_arg = xmalloc(sizeof(timer_map_reg_argument));
-    timer_arg->mle = mle;
     timer_arg->ms = ms;
+    timer_arg->retries = 0;
+    timer_arg->pending = glist_new_managed((glist_del_fct)lisp_msg_destroy);
 
     return(timer_arg);
 }
@@ -2409,5 +2626,6 @@ timer_map_reg_argument_new_init(map_local_entry_t *mle,
 void
 timer_map_reg_arg_free(timer_map_reg_argument * timer_arg)
 {
+    glist_destroy(timer_arg->pending);
     free(timer_arg);
 }
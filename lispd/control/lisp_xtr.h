@@ -22,6 +22,7 @@
 #define LISP_XTR_H_
 
 #include "lisp_ctrl_device.h"
+#include "lisp_mreq_sched.h"
 #include "../defs.h"
 #include "../fwd_policies/fwd_policy.h"
 #include "../lib/shash.h"
@@ -63,6 +64,7 @@ typedef struct lisp_xtr {
 
     /* MAP RESOLVERS */
     glist_t *map_resolvers; // <lisp_addr_t *>
+    mreq_sched_t *mreq_sched;
 
     /* MAP SERVERs */
     glist_t *map_servers; // <map_server_elt *>
@@ -99,11 +101,19 @@ typedef struct _timer_rloc_prob_argument {
 typedef struct _timer_map_req_argument {
     mcache_entry_t  *mce;
     lisp_addr_t     *src_eid;
+    int             retries;
+    /* Map-Resolver queue of the scheduler it waits in. NULL if none */
+    mreq_queue_t    *queue;
+    struct ovs_list q_elt;
 } timer_map_req_argument;
 
+/* One per map server. A registration round packs the records of all the local
+ * mappings in as few Map-Registers as fit the MTU, and lasts until each one
+ * is acknowledged by a Map-Notify or the retries are exhausted */
 typedef struct _timer_map_reg_argument {
-    map_local_entry_t  *mle;
     map_server_elt     *ms;
+    int                retries;
+    glist_t            *pending;   /* <lbuf_t *> Map-Registers not acked */
 } timer_map_reg_argument;
 
 map_server_elt * map_server_elt_new_init(lisp_addr_t *address,uint8_t key_type,
@@ -18,6 +18,7 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <stdarg.h>
@@ -25,10 +26,13 @@
 #include "tun.h"
 #include "tun_input.h"
 #include "tun_output.h"
+#include "tun_encap.h"
+#include "tun_mq.h"
 #include "../data-plane.h"
 #include "../../lispd_external.h"
 #include "../../lib/lmlog.h"
 #include "../../lib/routing_tables_lib.h"
+#include "../../lib/timers.h"
 
 
 int tun_configure_data_plane(lisp_dev_type_e dev_type, ...);
@@ -56,7 +60,12 @@ int tun_updated_link(iface_t *iface, int old_iface_index, int new_iface_index, i
 void tun_process_new_gateway(iface_t *iface,lisp_addr_t *gateway);
 
 void tun_set_default_output_ifaces();
+static int tun_batch_stats_timer_cb(lmtimer_t *timer);
+static int tun_encap_sweep_timer_cb(lmtimer_t *timer);
 
+tun_batch_stats_t tun_bstats;
+static lmtimer_t *tun_stats_timer = NULL;
+static lmtimer_t *tun_encap_timer = NULL;
 
 data_plane_struct_t dplane_tun = {
         .datap_init = tun_configure_data_plane,
@@ -91,7 +100,10 @@ tun_configure_data_plane(lisp_dev_type_e dev_type, ...)
 
     switch (dev_type){
     case MN_MODE:
-        sockmstr_register_read_listener(smaster, tun_output_recv, NULL,tun_receive_fd);
+        if (data_queues == 1 && sockmstr_register_read_listener(smaster,
+                tun_output_recv, NULL, tun_receive_fd) == NULL){
+            return (BAD);
+        }
         cb_func = tun_process_input_packet;
         break;
     case xTR_MODE:
@@ -99,7 +111,10 @@ tun_configure_data_plane(lisp_dev_type_e dev_type, ...)
         /* Rules created for EID will redirect traffic to this table*/
         configure_routing_to_tun_router(AF_INET);
         configure_routing_to_tun_router(AF_INET6);
-        sockmstr_register_read_listener(smaster, tun_output_recv, NULL,tun_receive_fd);
+        if (data_queues == 1 && sockmstr_register_read_listener(smaster,
+                tun_output_recv, NULL, tun_receive_fd) == NULL){
+            return (BAD);
+        }
         cb_func = tun_process_input_packet;
         break;
     case RTR_MODE:
@@ -112,22 +127,47 @@ tun_configure_data_plane(lisp_dev_type_e dev_type, ...)
     /* Generate receive sockets for data port (4341) */
     if (default_rloc_afi != AF_INET6) {
         ipv4_data_input_fd = open_data_raw_input_socket(AF_INET);
-        sockmstr_register_read_listener(smaster, cb_func, NULL,
-                ipv4_data_input_fd);
+        if (sockmstr_register_read_listener(smaster, cb_func, NULL,
+                ipv4_data_input_fd) == NULL){
+            return (BAD);
+        }
     }
 
     if (default_rloc_afi != AF_INET) {
         ipv6_data_input_fd = open_data_raw_input_socket(AF_INET6);
-        sockmstr_register_read_listener(smaster, cb_func, NULL,
-                ipv6_data_input_fd);
+        if (sockmstr_register_read_listener(smaster, cb_func, NULL,
+                ipv6_data_input_fd) == NULL){
+            return (BAD);
+        }
     }
     dplane_tun.datap_data = (void *)xmalloc(sizeof(tun_dplane_data_t));
     tun_output_init();
+    tun_input_init();
+
+    memset(&tun_bstats, 0, sizeof(tun_batch_stats_t));
+    tun_stats_timer = lmtimer_create(DATA_PLANE_STATS_TIMER);
+    lmtimer_init(tun_stats_timer, NULL, tun_batch_stats_timer_cb, NULL,
+            NULL, NULL);
+    lmtimer_start(tun_stats_timer, TUN_STATS_INTERVAL);
+
+    /* Close the connected sockets that are not used anymore */
+    tun_encap_timer = lmtimer_create(DATA_PLANE_ENCAP_TIMER);
+    lmtimer_init(tun_encap_timer, NULL, tun_encap_sweep_timer_cb, NULL,
+            NULL, NULL);
+    lmtimer_start(tun_encap_timer, TUN_ENCAP_SWEEP_INTERVAL);
 
     /* Select the default rlocs for output data packets and output control
      * packets */
     tun_set_default_output_ifaces();
 
+    /* With a multi queue tun, packets read from the tun are processed by
+     * a worker thread per queue */
+    if (data_queues > 1 && dev_type != RTR_MODE){
+        if (tun_mq_init(data_queues) != GOOD){
+            return (BAD);
+        }
+    }
+
     return (GOOD);
 
 }
@@ -136,10 +176,56 @@ void
 tun_uninit_data_plane()
 {
     tun_dplane_data_t *data = (tun_dplane_data_t *)dplane_tun.datap_data;
+    tun_mq_uninit();
+    tun_batch_stats_dump(LDBG_1);
+    lmtimer_stop(tun_stats_timer);
+    tun_stats_timer = NULL;
+    lmtimer_stop(tun_encap_timer);
+    tun_encap_timer = NULL;
+    tun_input_uninit();
     tun_output_uninit();
+    tun_encap_uninit();
     free(data);
 }
 
+void
+tun_batch_stats_dump(int log_level)
+{
+    if (!is_loggable(log_level)) {
+        return;
+    }
+
+    LMLOG(log_level, "Data plane batches (max size %d):", data_batch_size);
+    LMLOG(log_level, "  RX: %"PRIu64" packets in %"PRIu64" batches "
+            "(avg %.2f, max %u)", tun_bstats.rx_pkts, tun_bstats.rx_batches,
+            tun_bstats.rx_batches ?
+                    (double)tun_bstats.rx_pkts / tun_bstats.rx_batches : 0.0,
+            tun_bstats.rx_max_batch);
+    LMLOG(log_level, "  TX: %"PRIu64" packets in %"PRIu64" batches "
+            "(avg %.2f, max %u), %"PRIu64" errors", tun_bstats.tx_pkts,
+            tun_bstats.tx_batches, tun_bstats.tx_batches ?
+                    (double)tun_bstats.tx_pkts / tun_bstats.tx_batches : 0.0,
+            tun_bstats.tx_max_batch, tun_bstats.tx_errors);
+    ttable_stats_dump(&ttable, log_level);
+    tun_mq_stats_dump(log_level);
+}
+
+static int
+tun_batch_stats_timer_cb(lmtimer_t *timer)
+{
+    tun_batch_stats_dump(LDBG_1);
+    lmtimer_start(timer, TUN_STATS_INTERVAL);
+    return (GOOD);
+}
+
+static int
+tun_encap_sweep_timer_cb(lmtimer_t *timer)
+{
+    tun_encap_sweep();
+    lmtimer_start(timer, TUN_ENCAP_SWEEP_INTERVAL);
+    return (GOOD);
+}
+
 int
 tun_add_datap_iface_addr(iface_t *iface, int afi)
 {
@@ -253,6 +339,15 @@ create_tun()
     int flags = IFF_TUN | IFF_NO_PI; // Create a tunnel without persistence
     char *clonedev = CLONEDEV;
 
+    if (data_queues > 1){
+#ifdef IFF_MULTI_QUEUE
+        flags |= IFF_MULTI_QUEUE;
+#else
+        LMLOG(LWRN, "create_tun: Multi queue tun not supported. Using one queue");
+        data_queues = 1;
+#endif
+    }
+
 
     /* Arguments taken by the function:
      *
@@ -314,6 +409,14 @@ create_tun()
         return(BAD);
     }
 
+    /* Non blocking reads let tun_output_recv drain all the pending packets
+     * of the queue in a single wakeup */
+    if (fcntl(tun_receive_fd, F_SETFL,
+            fcntl(tun_receive_fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        LMLOG(LWRN, "create_tun: Unable to set tun in non blocking mode: %s",
+                strerror(errno));
+    }
+
     /* this is the special file descriptor that the caller will use to talk
      * with the virtual interface */
     LMLOG(LDBG_2, "Tunnel fd at creation is %d", tun_receive_fd);
@@ -325,6 +428,44 @@ create_tun()
     return (tun_receive_fd);
 }
 
+/*
+ * Open an additional queue of the multi queue tun interface created with
+ * create_tun. Returns the file descriptor of the queue
+ */
+int
+tun_open_queue()
+{
+    struct ifreq ifr;
+    int fd;
+
+#ifdef IFF_MULTI_QUEUE
+    if ((fd = open(CLONEDEV, O_RDWR)) < 0) {
+        LMLOG(LCRIT, "TUN/TAP: Failed to open clone device");
+        return(ERR_SOCKET);
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+    strncpy(ifr.ifr_name, TUN_IFACE_NAME, IFNAMSIZ - 1);
+
+    if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
+        LMLOG(LCRIT, "TUN/TAP: Failed to attach queue to tunnel interface, "
+                "errno: %d.", errno);
+        close(fd);
+        return(ERR_SOCKET);
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        LMLOG(LWRN, "tun_open_queue: Unable to set queue in non blocking "
+                "mode: %s", strerror(errno));
+    }
+
+    return (fd);
+#else
+    return (ERR_SOCKET);
+#endif
+}
+
 /*
 * For mobile node mode, we create two /1 routes covering the full IP addresses space to route all traffic
 * generated by the node to the lispTun0 interface
@@ -876,6 +1017,7 @@ tun_updated_addr(iface_t *iface, lisp_addr_t *old_addr, lisp_addr_t *new_addr)
 
         del_rule(new_addr_ip_afi, 0, iface->iface_index, iface->iface_index, RTN_UNICAST,
                 old_addr, NULL, 0);
+        tun_encap_close_src(old_addr);
     }
     /* Rebind socket and add new routing */
     add_rule(new_addr_ip_afi, 0, iface->iface_index, iface->iface_index, RTN_UNICAST,
@@ -66,6 +66,8 @@
 
 #define TUN_MTU                 1440 /* 1500 - 60 = 1440 */
 
+#define TUN_STATS_INTERVAL      60   /* Seconds between dumps of data plane stats */
+
 
 /* Tun MN variables */
 
@@ -75,9 +77,38 @@ uint8_t *tun_receive_buf;
 
 lisp_addr_t * tun_get_default_output_address(int afi);
 int tun_get_default_output_socket(int);
+int tun_open_queue();
 
 typedef struct iface iface_t;
 
+/* Counters of the batched I/O of the data plane. A batch is the set of
+ * packets read in a wakeup of a socket or sent with a sendmmsg call. The
+ * counters of the workers are read by the control thread, so the 64 bit
+ * ones are updated atomically */
+typedef struct tun_batch_stats_ {
+    uint64_t rx_batches;
+    uint64_t rx_pkts;
+    uint32_t rx_max_batch;
+    uint64_t tx_batches;
+    uint64_t tx_pkts;
+    uint64_t tx_errors;
+    uint32_t tx_max_batch;
+} tun_batch_stats_t;
+
+extern tun_batch_stats_t tun_bstats;
+
+static inline void
+tun_bstats_rx(int npkts)
+{
+    tun_bstats.rx_batches++;
+    tun_bstats.rx_pkts += npkts;
+    if (npkts > tun_bstats.rx_max_batch) {
+        tun_bstats.rx_max_batch = npkts;
+    }
+}
+
+void tun_batch_stats_dump(int log_level);
+
 typedef struct tun_dplane_data_{
     iface_t *default_out_iface_v4;
     iface_t *default_out_iface_v6;
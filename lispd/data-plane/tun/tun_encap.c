@@ -0,0 +1,243 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <string.h>
+#include <unistd.h>
+
+#include "tun_encap.h"
+#include "tun_mq.h"
+#include "../../elibs/khash/khash.h"
+#include "../../lib/lmlog.h"
+#include "../../lib/packets.h"
+#include "../../lib/sockets-util.h"
+#include "../../lib/util.h"
+#include "../../liblisp/liblisp.h"
+
+/* Pairs of RLOCs are keyed with the fixed size key of the flow table */
+static inline khint_t
+encap_key_hash(flow_key_t key)
+{
+    return (flow_key_hash(&key));
+}
+#define encap_key_equal(a, b) (memcmp(&(a), &(b), sizeof(flow_key_t)) == 0)
+
+KHASH_INIT(encap_sock, flow_key_t, tun_encap_sock_t *, 1, encap_key_hash,
+        encap_key_equal)
+
+/* Only accessed by the control thread. The workers just read the
+ * descriptors and generations */
+static khash_t(encap_sock) *encap_socks = NULL;
+static tun_encap_sock_t *free_encap_socks = NULL;
+
+
+static int
+encap_key_init(flow_key_t *key, ip_addr_t *src, ip_addr_t *dst)
+{
+    memset(key, 0, sizeof(flow_key_t));
+    key->afi = ip_addr_afi(src);
+    if ((key->afi != AF_INET && key->afi != AF_INET6)
+            || ip_addr_afi(dst) != key->afi) {
+        return (BAD);
+    }
+    ip_addr_copy_to(key->src, src);
+    ip_addr_copy_to(key->dst, dst);
+    return (GOOD);
+}
+
+/* Close the sockets of the list once the workers can't be using them and
+ * move them to the free list */
+static void
+encap_socks_release(tun_encap_sock_t *closed)
+{
+    tun_encap_sock_t *es;
+
+    if (!closed) {
+        return;
+    }
+
+    /* Workers may still have packets queued to the descriptors. Close them
+     * once they can't be used anymore, so the numbers are not reused */
+    tun_mq_synchronize();
+    while (closed) {
+        es = closed;
+        closed = es->next;
+        if (es->fd != ERR_SOCKET) {
+            close(es->fd);
+            es->fd = ERR_SOCKET;
+        }
+        es->next = free_encap_socks;
+        free_encap_socks = es;
+    }
+}
+
+/* Return the socket connected from 'srloc' to 'drloc', opening it if needed.
+ * NULL when MAX_ENCAP_SOCKETS are open: the packets of the pair are then
+ * encapsulated by lispd until a sweep frees some of them */
+tun_encap_sock_t *
+tun_encap_sock_get(lisp_addr_t *srloc, lisp_addr_t *drloc)
+{
+    tun_encap_sock_t *es;
+    flow_key_t key;
+    khiter_t k;
+    int ret;
+
+    if (encap_key_init(&key, lisp_addr_ip(srloc), lisp_addr_ip(drloc)) != GOOD) {
+        return (NULL);
+    }
+    if (!encap_socks) {
+        encap_socks = kh_init(encap_sock);
+    }
+
+    k = kh_get(encap_sock, encap_socks, key);
+    if (k != kh_end(encap_socks)) {
+        es = kh_value(encap_socks, k);
+    } else {
+        if (kh_size(encap_socks) >= MAX_ENCAP_SOCKETS) {
+            LMLOG(LDBG_2, "tun_encap_sock_get: No free sockets for %s -> %s",
+                    lisp_addr_to_char(srloc), lisp_addr_to_char(drloc));
+            return (NULL);
+        }
+        if (free_encap_socks) {
+            es = free_encap_socks;
+            free_encap_socks = es->next;
+        } else {
+            es = xzalloc(sizeof(tun_encap_sock_t));
+        }
+        ip_addr_copy(&es->src, lisp_addr_ip(srloc));
+        ip_addr_copy(&es->dst, lisp_addr_ip(drloc));
+        es->fd = ERR_SOCKET;
+        es->used = 0;
+        es->retry = 0;
+        es->next = NULL;
+        k = kh_put(encap_sock, encap_socks, key, &ret);
+        kh_value(encap_socks, k) = es;
+    }
+
+    if (es->fd == ERR_SOCKET && time(NULL) >= es->retry) {
+        es->fd = open_udp_connected_socket(srloc, drloc, LISP_DATA_PORT);
+        if (es->fd == ERR_SOCKET) {
+            es->retry = time(NULL) + TUN_ENCAP_RETRY_INTERVAL;
+        }
+    }
+    /* A new flow uses it, even if it has not sent anything yet */
+    es->used = 1;
+
+    return (es);
+}
+
+/* Close the sockets bound to an address that is no longer ours and free
+ * them. They are opened again for the next flows of the pairs */
+void
+tun_encap_close_src(lisp_addr_t *srloc)
+{
+    tun_encap_sock_t *closed = NULL, *es;
+    khiter_t k;
+
+    if (!encap_socks) {
+        return;
+    }
+
+    for (k = kh_begin(encap_socks); k != kh_end(encap_socks); k++) {
+        if (!kh_exist(encap_socks, k)) {
+            continue;
+        }
+        es = kh_value(encap_socks, k);
+        if (ip_addr_cmp(&es->src, lisp_addr_ip(srloc)) != 0) {
+            continue;
+        }
+        kh_del(encap_sock, encap_socks, k);
+        /* Invalidates the forwarding entries using it */
+        es->gen++;
+        es->next = closed;
+        closed = es;
+    }
+
+    encap_socks_release(closed);
+}
+
+/* Close the sockets not used by the workers since the previous sweep and
+ * those that failed to open whose retry time has passed. Returns the
+ * number of sockets freed */
+int
+tun_encap_sweep()
+{
+    tun_encap_sock_t *closed = NULL, *es;
+    time_t now = time(NULL);
+    khiter_t k;
+    int freed = 0;
+
+    if (!encap_socks) {
+        return (0);
+    }
+
+    for (k = kh_begin(encap_socks); k != kh_end(encap_socks); k++) {
+        if (!kh_exist(encap_socks, k)) {
+            continue;
+        }
+        es = kh_value(encap_socks, k);
+        if (es->fd != ERR_SOCKET ? es->used : now < es->retry) {
+            es->used = 0;
+            continue;
+        }
+        kh_del(encap_sock, encap_socks, k);
+        /* Invalidates the forwarding entries using it */
+        es->gen++;
+        es->next = closed;
+        closed = es;
+        freed++;
+    }
+
+    encap_socks_release(closed);
+    LMLOG(LDBG_2, "tun_encap_sweep: %d sockets freed, %u in use", freed,
+            kh_size(encap_socks));
+    return (freed);
+}
+
+void
+tun_encap_uninit()
+{
+    tun_encap_sock_t *es;
+    khiter_t k;
+
+    if (encap_socks) {
+        for (k = kh_begin(encap_socks); k != kh_end(encap_socks); k++) {
+            if (!kh_exist(encap_socks, k)) {
+                continue;
+            }
+            es = kh_value(encap_socks, k);
+            if (es->fd != ERR_SOCKET) {
+                close(es->fd);
+            }
+            free(es);
+        }
+        kh_destroy(encap_sock, encap_socks);
+        encap_socks = NULL;
+    }
+    while (free_encap_socks) {
+        es = free_encap_socks;
+        free_encap_socks = es->next;
+        free(es);
+    }
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
@@ -0,0 +1,93 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef TUN_ENCAP_H_
+#define TUN_ENCAP_H_
+
+#include <time.h>
+
+#include "../../defs.h"
+#include "../../liblisp/lisp_address.h"
+
+/*
+ * UDP sockets connected to the remote RLOCs, used when data-encap is udp.
+ * Only the LISP header is built by lispd: the kernel adds the outer UDP and
+ * IP headers using the route cached in the socket and computes the checksum.
+ * There is a socket per pair of local and remote RLOCs, indexed by the pair.
+ * At most MAX_ENCAP_SOCKETS are open at the same time.
+ *
+ * Forwarding entries keep a pointer to the socket and the generation it had.
+ * Closing a socket bumps its generation and the structure is reused for
+ * other pairs but never freed, so the entries of the closed socket read
+ * ERR_SOCKET and encapsulate their packets in lispd.
+ *
+ * The sockets are marked when a flow is resolved to them and when a packet
+ * is sent through them. tun_encap_sweep closes the ones not used since the
+ * previous sweep. A socket that could not be opened is not tried again
+ * before TUN_ENCAP_RETRY_INTERVAL.
+ */
+
+#define TUN_ENCAP_SWEEP_INTERVAL    60  /* Seconds between sweeps of idle sockets */
+#define TUN_ENCAP_RETRY_INTERVAL    10  /* Seconds before opening a socket that failed */
+
+typedef struct tun_encap_sock_ {
+    ip_addr_t src;
+    ip_addr_t dst;
+    volatile int fd;
+    volatile uint32_t gen;
+    volatile uint8_t used;          /* Set when used, cleared by sweeps */
+    time_t retry;                   /* Next open attempt after a failure */
+    struct tun_encap_sock_ *next;   /* Free list */
+} tun_encap_sock_t;
+
+tun_encap_sock_t *tun_encap_sock_get(lisp_addr_t *srloc, lisp_addr_t *drloc);
+void tun_encap_close_src(lisp_addr_t *srloc);
+int tun_encap_sweep();
+void tun_encap_uninit();
+
+/* Descriptor of the socket if it is still the one of generation 'gen' */
+static inline int
+tun_encap_sock_fd(tun_encap_sock_t *es, uint32_t gen)
+{
+    int fd;
+
+    if (!es) {
+        return (ERR_SOCKET);
+    }
+    fd = es->fd;
+    return (es->gen == gen ? fd : ERR_SOCKET);
+}
+
+/* Keep the socket open in the next sweep. Only written when it changes, not
+ * to dirty the cache line with every packet */
+static inline void
+tun_encap_sock_touch(tun_encap_sock_t *es)
+{
+    if (!es->used) {
+        es->used = 1;
+    }
+}
+
+#endif /* TUN_ENCAP_H_ */
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
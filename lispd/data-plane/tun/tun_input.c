@@ -29,26 +29,74 @@
 #include "../../lib/lmlog.h"
 #include "../../lib/simplemux.h"
 
-/* static buffer to receive packets */
-static uint8_t pkt_recv_buf[MAX_IP_PKT_LEN+1];
-static lbuf_t pkt_buf;
+#define TUN_INPUT_BUF_SIZE  (MAX_IP_PKT_LEN+1)
+
+/* static buffers to receive a batch of packets */
+static uint8_t *pkt_recv_bufs = NULL;
+static lbuf_t *pkt_bufs = NULL;
+static int *pkt_afi = NULL;
+static uint8_t *pkt_ttl = NULL;
+static uint8_t *pkt_tos = NULL;
+static sock_batch_t *pkt_batch = NULL;
+
+void
+tun_input_init()
+{
+    pkt_recv_bufs = xmalloc(data_batch_size * TUN_INPUT_BUF_SIZE);
+    pkt_bufs = xzalloc(data_batch_size * sizeof(lbuf_t));
+    pkt_afi = xzalloc(data_batch_size * sizeof(int));
+    pkt_ttl = xzalloc(data_batch_size * sizeof(uint8_t));
+    pkt_tos = xzalloc(data_batch_size * sizeof(uint8_t));
+    pkt_batch = sock_batch_new(data_batch_size);
+}
 
-/*  SIMPLEMUX  ****************************/
-static uint16_t destination_port;
-/*****************************************/
+void
+tun_input_uninit()
+{
+    free(pkt_recv_bufs);
+    free(pkt_bufs);
+    free(pkt_afi);
+    free(pkt_ttl);
+    free(pkt_tos);
+    sock_batch_del(pkt_batch);
+    pkt_recv_bufs = NULL;
+    pkt_bufs = NULL;
+    pkt_batch = NULL;
+}
 
-int
-tun_read_and_decap_pkt(int sock, lbuf_t *b)
+/* Read all the packets pending in the socket, up to data_batch_size, with a
+ * single system call. Returns the number of packets read */
+static int
+tun_recv_batch(int sock, uint32_t headroom)
 {
-    uint8_t ttl = 0, tos = 0;
-    int afi;
-    lisphdr_t *lisp_hdr;
-    struct udphdr *udph;
+    int i, npkts;
+
+    for (i = 0; i < data_batch_size; i++) {
+        lbuf_use_stack(&pkt_bufs[i], pkt_recv_bufs + i * TUN_INPUT_BUF_SIZE,
+                MAX_IP_PKT_LEN);
+        if (headroom) {
+            lbuf_reserve(&pkt_bufs[i], headroom);
+        }
+    }
 
-    if (sock_data_recv(sock, b, &afi, &ttl, &tos) != GOOD) {
-        return(BAD);
+    npkts = sock_data_recv_batch(sock, pkt_batch, pkt_bufs, data_batch_size,
+            pkt_afi, pkt_ttl, pkt_tos);
+    if (npkts > 0) {
+        tun_bstats_rx(npkts);
     }
 
+    return (npkts);
+}
+
+/* Remove the outer headers of a packet received from a raw data socket.
+ * The UDP destination port is returned in 'dport' to identify LISP and
+ * SIMPLEMUX packets */
+static int
+tun_decap_pkt(lbuf_t *b, int afi, uint8_t ttl, uint8_t tos, uint16_t *dport)
+{
+    lisphdr_t *lisp_hdr;
+    struct udphdr *udph;
+
     if (afi == AF_INET){
         /* With input RAW UDP sockets in IPv4, we get the whole external
          * IPv4 packet */
@@ -68,8 +116,8 @@ tun_read_and_decap_pkt(int sock, lbuf_t *b)
      * we only want LISP data ones */
     
 	/* SIMPLEMUX ****************************************/
-    destination_port = ntohs(udph->dest);
-	if (ntohs(udph->dest) != LISP_DATA_PORT && ntohs(udph->dest) != MUX_DATA_PORT) {
+    *dport = ntohs(udph->dest);
+	if (*dport != LISP_DATA_PORT && *dport != MUX_DATA_PORT) {
         return (ERR_NOT_LISP);
     }
      
@@ -104,56 +152,97 @@ tun_read_and_decap_pkt(int sock, lbuf_t *b)
     return(GOOD);
 }
 
+/* RLOCs of the tunnel of a received packet. The remote one is the source
+ * address returned by recvmmsg. The local one is read from the outer header,
+ * which is only available with IPv4. With IPv6 it is left unspecified, so the
+ * packets of a peer to any local IPv6 RLOC share the same ROHC contexts */
+static void
+tun_pkt_rlocs(lbuf_t *b, int i, ip_addr_t *local, ip_addr_t *remote)
+{
+    union sockunion *su = &pkt_batch->su[i];
+    struct iphdr *iph;
+
+    memset(local, 0, sizeof(ip_addr_t));
+    if (pkt_afi[i] == AF_INET) {
+        iph = lbuf_ip(b);
+        ip_addr_init(local, &iph->daddr, AF_INET);
+        ip_addr_init(remote, &su->s4.sin_addr, AF_INET);
+    } else {
+        ip_addr_set_afi(local, AF_INET6);
+        ip_addr_init(remote, &su->s6.sin6_addr, AF_INET6);
+    }
+}
+
 int
 tun_process_input_packet(sock_t *sl)
 {
-    lbuf_use_stack(&pkt_buf, &pkt_recv_buf, MAX_IP_PKT_LEN);
-
-    if (tun_read_and_decap_pkt(sl->fd, &pkt_buf) != GOOD) {
-        return (BAD);
+    uint16_t dport;
+    lbuf_t *b;
+    ip_addr_t local, remote;
+    int i, npkts;
+
+    npkts = tun_recv_batch(sl->fd, 0);
+
+    for (i = 0; i < npkts; i++) {
+        b = &pkt_bufs[i];
+        if (tun_decap_pkt(b, pkt_afi[i], pkt_ttl[i], pkt_tos[i], &dport)
+                != GOOD) {
+            continue;
+        }
+
+        /* original without modification: SIMPLEMUX
+        if ((write(tun_receive_fd, lbuf_l3(b), lbuf_size(b))) < 0) {
+            LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
+        }*/
+
+        /*   SIMPLEMUX *************************************************/
+        switch (dport)
+        {
+            case LISP_DATA_PORT:
+                if ((write(tun_receive_fd, lbuf_l3(b), lbuf_size(b))) < 0) {
+                    LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
+                }
+                break;
+            case MUX_DATA_PORT:
+                tun_pkt_rlocs(b, i, &local, &remote);
+                demux_packets (lbuf_data(b), lbuf_size(b),tun_receive_fd, &local, &remote);
+                break;
+            default:
+                break;
+        }
+        /*   SIMPLEMUX *************************************************/
     }
 
-	/* original without modification: SIMPLEMUX
-	if ((write(tun_receive_fd, lbuf_l3(&pkt_buf), lbuf_size(&pkt_buf))) < 0) {
-        LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
-    }*/
-
-	/*   SIMPLEMUX *************************************************/
-	switch (destination_port)
-	{
-		case LISP_DATA_PORT:
-			if ((write(tun_receive_fd, lbuf_l3(&pkt_buf), lbuf_size(&pkt_buf))) < 0) {
-				LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
-			}
-			break;
-		case MUX_DATA_PORT:
-			demux_packets (lbuf_data(&pkt_buf), lbuf_size(&pkt_buf),tun_receive_fd);
-			break;
-		default:
-			break;
-	}
-	/*   SIMPLEMUX *************************************************/
-
 	return (GOOD);
 }
 
 int
 tun_rtr_process_input_packet(struct sock *sl)
 {
-    lbuf_use_stack(&pkt_buf, &pkt_recv_buf, MAX_IP_PKT_LEN);
+    uint16_t dport;
+    lbuf_t *b;
+    int i, npkts;
+
     /* Reserve space in case the received packet was IPv6. In this case the IPv6 header is
      * not provided */
-    lbuf_reserve(&pkt_buf,LBUF_STACK_OFFSET);
+    npkts = tun_recv_batch(sl->fd, LBUF_STACK_OFFSET);
 
-    if (tun_read_and_decap_pkt(sl->fd, &pkt_buf) != GOOD) {
-        return (BAD);
-    }
+    for (i = 0; i < npkts; i++) {
+        b = &pkt_bufs[i];
+        if (tun_decap_pkt(b, pkt_afi[i], pkt_ttl[i], pkt_tos[i], &dport)
+                != GOOD) {
+            continue;
+        }
 
-    LMLOG(LDBG_3, "INPUT (4341): Forwarding to OUPUT for re-encapsulation");
+        LMLOG(LDBG_3, "INPUT (4341): Forwarding to OUPUT for re-encapsulation");
+
+        lbuf_point_to_l3(b);
+        lbuf_reset_ip(b);
+        tun_output(b);
+    }
 
-    lbuf_point_to_l3(&pkt_buf);
-    lbuf_reset_ip(&pkt_buf);
-    tun_output(&pkt_buf);
+    /* Re-encapsulated packets are still in the receive buffers */
+    tun_output_flush();
 
     return(GOOD);
 }
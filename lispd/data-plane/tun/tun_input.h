@@ -31,6 +31,8 @@
 #include "../../lib/sockets.h"
 #include "../../lib/cksum.h"
 
+void tun_input_init();
+void tun_input_uninit();
 int tun_process_input_packet(struct sock *sl);
 int tun_rtr_process_input_packet(struct sock *sl);
 
@@ -0,0 +1,454 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "tun_mq.h"
+#include "../../fwd_policies/fwd_policy.h"
+#include "../../lib/cksum.h"
+#include "../../lib/lmlog.h"
+#include "../../lib/packets.h"
+#include "../../lispd_external.h"
+
+extern int numdsm;
+
+/* Packet handed by a worker to the control thread */
+typedef struct tun_mq_pkt_ {
+    struct ovs_list list_elt;
+    tun_worker_t *worker;
+    uint8_t miss;           /* The worker has no forwarding info of the flow */
+    lbuf_t *b;
+} tun_mq_pkt_t;
+
+/* Forwarding info of a flow sent by the control thread to a worker */
+typedef struct tun_mq_reply_ {
+    struct ovs_list list_elt;
+    packet_tuple_t tpl;
+    fwd_info_t *fi;
+} tun_mq_reply_t;
+
+static tun_worker_t *workers = NULL;
+static int nworkers = 0;
+
+/* Packets pending to be processed by the control thread */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ovs_list pending;
+static int npending = 0;
+static uint64_t pending_drops = 0;
+
+/* The write end is used by the workers to wake up the control thread */
+static int notify_pipe[2] = {-1, -1};
+
+static int tun_mq_process_pending(sock_t *sl);
+
+
+static int
+tun_mq_handoff(tun_worker_t *w, lbuf_t *b, int miss)
+{
+    tun_mq_pkt_t *p;
+    int wakeup;
+    char c = 0;
+
+    pthread_mutex_lock(&pending_lock);
+    if (npending >= TUN_MQ_MAX_PENDING) {
+        pending_drops++;
+        pthread_mutex_unlock(&pending_lock);
+        return (BAD);
+    }
+    pthread_mutex_unlock(&pending_lock);
+
+    p = xzalloc(sizeof(tun_mq_pkt_t));
+    p->worker = w;
+    p->miss = miss;
+    p->b = lbuf_new_with_headroom(lbuf_size(b), LBUF_STACK_OFFSET);
+    lbuf_put(p->b, lbuf_data(b), lbuf_size(b));
+    lbuf_reset_ip(p->b);
+
+    pthread_mutex_lock(&pending_lock);
+    wakeup = list_is_empty(&pending);
+    list_push_back(&pending, &p->list_elt);
+    npending++;
+    pthread_mutex_unlock(&pending_lock);
+
+    /* One byte is enough to wake up the control thread for all the packets
+     * queued before it processes the list */
+    if (wakeup && write(notify_pipe[1], &c, 1) < 0 && errno != EAGAIN) {
+        LMLOG(LDBG_2, "tun_mq_handoff: write error: %s", strerror(errno));
+    }
+
+    return (GOOD);
+}
+
+/* Add to the flow table of the worker the forwarding info resolved by the
+ * control thread */
+static void
+tun_worker_process_replies(tun_worker_t *w)
+{
+    struct ovs_list replies;
+    tun_mq_reply_t *r, *next;
+
+    pthread_mutex_lock(&w->replies_lock);
+    if (list_is_empty(&w->replies)) {
+        pthread_mutex_unlock(&w->replies_lock);
+        return;
+    }
+    list_move(&replies, &w->replies);
+    list_init(&w->replies);
+    pthread_mutex_unlock(&w->replies_lock);
+
+    LIST_FOR_EACH_SAFE(r, next, list_elt, &replies) {
+        /* Several misses of the same flow generate several replies */
+        if (ttable_lookup(&w->ttable, &r->tpl) == NULL) {
+            ttable_insert(&w->ttable, &r->tpl, r->fi);
+        } else {
+            fwd_info_del(r->fi, (fwd_info_data_del)fwd_entry_del);
+        }
+        free(r);
+    }
+}
+
+static void
+tun_worker_output(tun_worker_t *w, lbuf_t *b)
+{
+    packet_tuple_t tpl;
+    fwd_info_t *fi;
+
+    if (pkt_parse_5_tuple(b, &tpl) != GOOD) {
+        return;
+    }
+
+    /* SIMPLEMUX state is only accessed from the control thread */
+    if (tun_is_lisp_packet(&tpl)
+            || ip_addr_is_multicast(lisp_addr_ip(&tpl.dst_addr))
+            || numdsm > 0) {
+        tun_mq_handoff(w, b, FALSE);
+        return;
+    }
+
+    fi = ttable_lookup(&w->ttable, &tpl);
+    if (!fi) {
+        tun_mq_handoff(w, b, TRUE);
+        return;
+    }
+
+    tun_output_encap(&w->txq, b, &tpl, fi->fwd_info);
+}
+
+static void
+tun_worker_recv(tun_worker_t *w)
+{
+    lbuf_t *b;
+    int i, nread;
+
+    for (i = 0; i < data_batch_size; i++) {
+        b = &w->bufs[i];
+        lbuf_use_stack(b, w->recv_bufs + i * TUN_RECEIVE_SIZE,
+                TUN_RECEIVE_SIZE);
+        lbuf_reserve(b, LBUF_STACK_OFFSET);
+
+        nread = read(w->fd, lbuf_data(b), lbuf_tailroom(b));
+        if (nread <= 0) {
+            break;
+        }
+        lbuf_set_size(b, nread);
+        lbuf_reset_ip(b);
+        tun_worker_output(w, b);
+    }
+
+    if (i > 0) {
+        __sync_add_and_fetch(&w->stats.rx_batches, 1);
+        __sync_add_and_fetch(&w->stats.rx_pkts, i);
+        if (i > w->stats.rx_max_batch) {
+            w->stats.rx_max_batch = i;
+        }
+    }
+    tun_txq_flush(&w->txq);
+    ttable_age(&w->ttable, TTABLE_AGING_SLICE);
+}
+
+static void *
+tun_worker_run(void *arg)
+{
+    tun_worker_t *w = (tun_worker_t *)arg;
+    struct pollfd pfd;
+
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+
+    while (w->running) {
+        tun_worker_process_replies(w);
+
+        if (poll(&pfd, 1, TUN_WORKER_POLL_TIMEOUT) <= 0) {
+            ttable_age(&w->ttable, TTABLE_AGING_SLICE);
+        } else {
+            tun_worker_recv(w);
+        }
+
+        /* Quiescent point: the transmit queue has been flushed */
+        __sync_synchronize();
+        w->qs_seq++;
+    }
+
+    return (NULL);
+}
+
+/* Called by the control thread when workers have handed packets to it */
+static int
+tun_mq_process_pending(sock_t *sl)
+{
+    struct ovs_list pkts;
+    tun_mq_pkt_t *p, *next;
+    tun_mq_reply_t *r;
+    packet_tuple_t tpl;
+    fwd_info_t *fi;
+    char buf[64];
+
+    while (read(sl->fd, buf, sizeof(buf)) == sizeof(buf)) {
+        ;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    list_move(&pkts, &pending);
+    list_init(&pending);
+    npending = 0;
+    pthread_mutex_unlock(&pending_lock);
+
+    if (list_is_empty(&pkts)) {
+        return (GOOD);
+    }
+
+    LIST_FOR_EACH (p, list_elt, &pkts) {
+        if (!p->miss) {
+            tun_output(p->b);
+            continue;
+        }
+
+        if (pkt_parse_5_tuple(p->b, &tpl) != GOOD) {
+            continue;
+        }
+        fi = tun_output_get_fwd_info(&tpl);
+        if (fi == NULL) {
+            continue;
+        }
+        tun_output_with_fwd_info(p->b, &tpl, fi);
+
+        /* From now on the forwarding info belongs to the worker */
+        r = xzalloc(sizeof(tun_mq_reply_t));
+        r->tpl = tpl;
+        r->fi = fi;
+        pthread_mutex_lock(&p->worker->replies_lock);
+        list_push_back(&p->worker->replies, &r->list_elt);
+        pthread_mutex_unlock(&p->worker->replies_lock);
+    }
+
+    /* Queued packets point to the buffers of the list */
+    tun_output_flush();
+
+    LIST_FOR_EACH_SAFE (p, next, list_elt, &pkts) {
+        lbuf_del(p->b);
+        free(p);
+    }
+
+    return (GOOD);
+}
+
+static void
+tun_worker_uninit(tun_worker_t *w)
+{
+    tun_mq_reply_t *r, *next;
+
+    LIST_FOR_EACH_SAFE(r, next, list_elt, &w->replies) {
+        fwd_info_del(r->fi, (fwd_info_data_del)fwd_entry_del);
+        free(r);
+    }
+    pthread_mutex_destroy(&w->replies_lock);
+    ttable_uninit(&w->ttable);
+    tun_txq_uninit(&w->txq);
+    free(w->recv_bufs);
+    free(w->bufs);
+    /* The fd of the first queue is closed with the rest of the data plane */
+    if (w->fd != tun_receive_fd) {
+        close(w->fd);
+    }
+}
+
+int
+tun_mq_init(int nqueues)
+{
+    tun_worker_t *w;
+    int i;
+
+    list_init(&pending);
+    if (pipe(notify_pipe) == -1) {
+        LMLOG(LCRIT, "tun_mq_init: Error creating pipe: %s", strerror(errno));
+        return (BAD);
+    }
+    fcntl(notify_pipe[0], F_SETFL, fcntl(notify_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(notify_pipe[1], F_SETFL, fcntl(notify_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+    if (sockmstr_register_read_listener(smaster, tun_mq_process_pending, NULL,
+            notify_pipe[0]) == NULL) {
+        close(notify_pipe[0]);
+        close(notify_pipe[1]);
+        notify_pipe[0] = notify_pipe[1] = -1;
+        return (BAD);
+    }
+
+    /* Resolve the checksum implementation before the workers share it */
+    cksum_selected();
+
+    workers = xzalloc(nqueues * sizeof(tun_worker_t));
+
+    for (i = 0; i < nqueues; i++) {
+        w = &workers[i];
+        w->id = i;
+        w->fd = (i == 0) ? tun_receive_fd : tun_open_queue();
+        if (w->fd < 0) {
+            LMLOG(LCRIT, "tun_mq_init: Couldn't open queue %d of the tun", i);
+            tun_mq_uninit();
+            return (BAD);
+        }
+        w->recv_bufs = xmalloc(data_batch_size * TUN_RECEIVE_SIZE);
+        w->bufs = xzalloc(data_batch_size * sizeof(lbuf_t));
+        ttable_init(&w->ttable, flow_table_size);
+        tun_txq_init(&w->txq, data_batch_size, &w->stats);
+        pthread_mutex_init(&w->replies_lock, NULL);
+        list_init(&w->replies);
+        nworkers++;
+
+        w->running = TRUE;
+        if (pthread_create(&w->thread, NULL, tun_worker_run, w) != 0) {
+            LMLOG(LCRIT, "tun_mq_init: Couldn't create worker %d: %s", i,
+                    strerror(errno));
+            w->running = FALSE;
+            tun_mq_uninit();
+            return (BAD);
+        }
+    }
+
+    LMLOG(LDBG_1, "Multi queue tun: %d worker threads started", nworkers);
+
+    return (GOOD);
+}
+
+/* Stop the workers and release what tun_mq_init set up. Also used by
+ * tun_mq_init to undo a partial initialization */
+void
+tun_mq_uninit()
+{
+    tun_mq_pkt_t *p, *next;
+    sock_t *sl;
+    int i;
+
+    if (workers == NULL) {
+        return;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].running) {
+            workers[i].running = FALSE;
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    LIST_FOR_EACH_SAFE (p, next, list_elt, &pending) {
+        lbuf_del(p->b);
+        free(p);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        tun_worker_uninit(&workers[i]);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+
+    /* Closes the read end */
+    sl = sockmstr_register_get_by_fd(smaster, notify_pipe[0]);
+    if (sl != NULL) {
+        sockmstr_unregister_read_listenedr(smaster, sl);
+    }
+    close(notify_pipe[1]);
+    notify_pipe[0] = notify_pipe[1] = -1;
+}
+
+/* Wait until every worker has gone through a quiescent point. Shared
+ * resources unpublished before the call are no longer used by any worker
+ * when it returns. It takes at most TUN_WORKER_POLL_TIMEOUT ms */
+void
+tun_mq_synchronize()
+{
+    uint64_t *seqs;
+    int i;
+
+    if (nworkers == 0) {
+        return;
+    }
+
+    seqs = xmalloc(nworkers * sizeof(uint64_t));
+    __sync_synchronize();
+    for (i = 0; i < nworkers; i++) {
+        seqs[i] = workers[i].qs_seq;
+    }
+    for (i = 0; i < nworkers; i++) {
+        while (workers[i].running && workers[i].qs_seq == seqs[i]) {
+            usleep(1000);
+        }
+    }
+    free(seqs);
+}
+
+/* The counters are updated by the workers */
+static inline uint64_t
+tun_mq_stat_read(uint64_t *counter)
+{
+    return (__sync_fetch_and_add(counter, 0));
+}
+
+void
+tun_mq_stats_dump(int log_level)
+{
+    tun_batch_stats_t *st;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        st = &workers[i].stats;
+        LMLOG(log_level, "  Queue %d: RX %"PRIu64" packets in %"PRIu64
+                " batches, TX %"PRIu64" packets in %"PRIu64" batches, "
+                "%"PRIu64" errors", i, tun_mq_stat_read(&st->rx_pkts),
+                tun_mq_stat_read(&st->rx_batches),
+                tun_mq_stat_read(&st->tx_pkts),
+                tun_mq_stat_read(&st->tx_batches),
+                tun_mq_stat_read(&st->tx_errors));
+        ttable_stats_dump(&workers[i].ttable, log_level);
+    }
+    if (nworkers > 0) {
+        LMLOG(log_level, "  Packets dropped waiting for the control thread: "
+                "%"PRIu64, pending_drops);
+    }
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
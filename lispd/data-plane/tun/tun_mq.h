@@ -0,0 +1,83 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TUN_MQ_H_
+#define TUN_MQ_H_
+
+#include <pthread.h>
+#include "tun.h"
+#include "tun_output.h"
+#include "../../lib/ttable.h"
+#include "../../elibs/ovs/list.h"
+
+/* Time a worker waits for packets before checking for pending replies of
+ * the control thread and for termination (ms) */
+#define TUN_WORKER_POLL_TIMEOUT     100
+
+/* Maximum number of packets waiting to be processed by the control thread.
+ * Packets above this limit are dropped */
+#define TUN_MQ_MAX_PENDING          4096
+
+/*
+ * Multi queue tun. Each queue of the tun interface is served by a worker
+ * thread with its own receive buffers, flow table and transmit queue.
+ * Packets that can not be forwarded by a worker (flow table misses, LISP,
+ * multicast or SIMPLEMUX packets) are handed to the control thread which
+ * processes them with tun_output and, for misses, returns the forwarding
+ * information of the flow to the worker.
+ *
+ * The functions called by the workers only keep state in per-thread buffers
+ * or atomic counters. Resources the workers may be using, like the
+ * descriptors of the encapsulation sockets, are released by the control
+ * thread after tun_mq_synchronize.
+ */
+typedef struct tun_worker_ {
+    int id;
+    int fd;
+    pthread_t thread;
+    volatile int running;
+    /* Incremented each time the worker has sent all its queued packets and
+     * holds no reference to shared resources */
+    volatile uint64_t qs_seq;
+
+    uint8_t *recv_bufs;
+    lbuf_t *bufs;
+    ttable_t ttable;
+    tun_tx_queue_t txq;
+    tun_batch_stats_t stats;
+
+    /* Forwarding info resolved by the control thread to be added to the
+     * flow table */
+    pthread_mutex_t replies_lock;
+    struct ovs_list replies;
+} tun_worker_t;
+
+int tun_mq_init(int nqueues);
+void tun_mq_uninit();
+void tun_mq_synchronize();
+void tun_mq_stats_dump(int log_level);
+
+#endif /* TUN_MQ_H_ */
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
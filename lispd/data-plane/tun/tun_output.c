@@ -17,10 +17,16 @@
  *
  */
 
+/* Define _GNU_SOURCE in order to use struct mmsghdr */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <errno.h>
 
 #include "tun_output.h"
 #include "tun.h"
+#include "tun_encap.h"
 #include "../../fwd_policies/fwd_policy.h"
 #include "../../liblisp/liblisp.h"
 #include "../../lib/packets.h"
@@ -33,35 +39,198 @@
 /*SIMPLEMUX: definition*/
 #include "../../lib/simplemux.h"
 extern int numdsm;
-extern data_simplemux_t sm_conf[10];
 /*SIMPLEMUX: fin definition*/
 
 
-/* static buffer to receive packets */
-static uint8_t pkt_recv_buf[TUN_RECEIVE_SIZE];
-static lbuf_t pkt_buf;
+/* static buffers to receive a batch of packets */
+static uint8_t *pkt_recv_bufs = NULL;
+static lbuf_t *pkt_bufs = NULL;
 ttable_t ttable;
 
+static tun_tx_queue_t tx_queue;
+
 
 static int tun_output_multicast(lbuf_t *b, packet_tuple_t *tuple);
 static int tun_output_unicast(lbuf_t *b, packet_tuple_t *tuple);
-static int tun_forward_native(lbuf_t *b, lisp_addr_t *dst);
-static inline int is_lisp_packet(packet_tuple_t *tpl);
+static int tun_forward_native(tun_tx_queue_t *q, lbuf_t *b, lisp_addr_t *dst);
 
 void
 tun_output_init()
 {
-    ttable_init(&ttable);
+    ttable_init(&ttable, flow_table_size);
+
+    pkt_recv_bufs = xmalloc(data_batch_size * TUN_RECEIVE_SIZE);
+    pkt_bufs = xzalloc(data_batch_size * sizeof(lbuf_t));
+    tun_txq_init(&tx_queue, data_batch_size, &tun_bstats);
 }
 
 void
 tun_output_uninit()
 {
     ttable_uninit(&ttable);
+
+    free(pkt_recv_bufs);
+    free(pkt_bufs);
+    tun_txq_uninit(&tx_queue);
+}
+
+void
+tun_txq_init(tun_tx_queue_t *q, int len, tun_batch_stats_t *stats)
+{
+    q->len = len;
+    q->count = 0;
+    q->socks = xzalloc(len * sizeof(int));
+    q->addrs = xzalloc(len * sizeof(struct sockaddr_storage));
+    q->cmsgs = xzalloc(len * sizeof(tun_txq_cmsg_t));
+    q->iov = xzalloc(len * sizeof(struct iovec));
+    q->msgs = xzalloc(len * sizeof(struct mmsghdr));
+    q->burst = xzalloc(len * sizeof(struct mmsghdr));
+    q->sent = xzalloc(len * sizeof(uint8_t));
+    q->stats = stats;
+}
+
+void
+tun_txq_uninit(tun_tx_queue_t *q)
+{
+    free(q->socks);
+    free(q->addrs);
+    free(q->cmsgs);
+    free(q->iov);
+    free(q->msgs);
+    free(q->burst);
+    free(q->sent);
+    memset(q, 0, sizeof(tun_tx_queue_t));
+}
+
+/* Send all the queued packets. Packets are grouped by output socket and
+ * each group is sent with a single sendmmsg call keeping the order in which
+ * they were queued. Packets of connected sockets have no destination */
+void
+tun_txq_flush(tun_tx_queue_t *q)
+{
+    int i, j, sock, nmsgs, nsent;
+
+    if (q->count == 0) {
+        return;
+    }
+
+    memset(q->sent, 0, q->count);
+    for (i = 0; i < q->count; i++) {
+        if (q->sent[i]) {
+            continue;
+        }
+        sock = q->socks[i];
+        nmsgs = 0;
+        for (j = i; j < q->count; j++) {
+            if (!q->sent[j] && q->socks[j] == sock) {
+                q->burst[nmsgs++] = q->msgs[j];
+                q->sent[j] = TRUE;
+            }
+        }
+
+        if (q->burst[0].msg_hdr.msg_name == NULL) {
+            nsent = send_datagram_packet_batch(sock, q->burst, nmsgs);
+        } else {
+            nsent = send_raw_packet_batch(sock, q->burst, nmsgs);
+        }
+
+        __sync_add_and_fetch(&q->stats->tx_batches, 1);
+        __sync_add_and_fetch(&q->stats->tx_pkts, nsent);
+        __sync_add_and_fetch(&q->stats->tx_errors, nmsgs - nsent);
+        if (nmsgs > q->stats->tx_max_batch) {
+            q->stats->tx_max_batch = nmsgs;
+        }
+    }
+
+    q->count = 0;
+}
+
+/* Queue a packet to be sent when the queue is flushed. The content of the
+ * buffer should not be modified until then */
+int
+tun_txq_send(tun_tx_queue_t *q, int sock, lbuf_t *b, ip_addr_t *dst)
+{
+    struct msghdr *msg;
+    int idx, slen;
+
+    if (q->count == q->len) {
+        tun_txq_flush(q);
+    }
+
+    idx = q->count;
+    slen = sock_addr_from_ip(&q->addrs[idx], dst);
+    if (slen == 0) {
+        LMLOG(LDBG_2, "tun_txq_send: Unknown afi %d", ip_addr_afi(dst));
+        return (BAD);
+    }
+
+    q->iov[idx].iov_base = lbuf_data(b);
+    q->iov[idx].iov_len = lbuf_size(b);
+
+    msg = &q->msgs[idx].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = &q->addrs[idx];
+    msg->msg_namelen = slen;
+    msg->msg_iov = &q->iov[idx];
+    msg->msg_iovlen = 1;
+
+    q->socks[idx] = sock;
+    q->count++;
+
+    return (GOOD);
+}
+
+/* Queue a packet to be sent through a connected UDP socket. The outer
+ * headers are added by the kernel with the 'ttl' and 'tos' of the packet */
+int
+tun_txq_send_connected(tun_tx_queue_t *q, int sock, lbuf_t *b, int afi,
+        int ttl, int tos)
+{
+    struct msghdr *msg;
+    struct cmsghdr *cmsg;
+    int idx;
+
+    if (q->count == q->len) {
+        tun_txq_flush(q);
+    }
+
+    idx = q->count;
+    q->iov[idx].iov_base = lbuf_data(b);
+    q->iov[idx].iov_len = lbuf_size(b);
+
+    msg = &q->msgs[idx].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = &q->iov[idx];
+    msg->msg_iovlen = 1;
+    msg->msg_control = q->cmsgs[idx].buf;
+    msg->msg_controllen = sizeof(q->cmsgs[idx].buf);
+
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = (afi == AF_INET) ? IPPROTO_IP : IPPROTO_IPV6;
+    cmsg->cmsg_type = (afi == AF_INET) ? IP_TTL : IPV6_HOPLIMIT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ttl, sizeof(int));
+
+    cmsg = CMSG_NXTHDR(msg, cmsg);
+    cmsg->cmsg_level = (afi == AF_INET) ? IPPROTO_IP : IPPROTO_IPV6;
+    cmsg->cmsg_type = (afi == AF_INET) ? IP_TOS : IPV6_TCLASS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+
+    q->socks[idx] = sock;
+    q->count++;
+
+    return (GOOD);
+}
+
+void
+tun_output_flush()
+{
+    tun_txq_flush(&tx_queue);
 }
 
 static int
-tun_forward_native(lbuf_t *b, lisp_addr_t *dst)
+tun_forward_native(tun_tx_queue_t *q, lbuf_t *b, lisp_addr_t *dst)
 {
     int ret, sock, afi;
 
@@ -76,13 +245,13 @@ tun_forward_native(lbuf_t *b, lisp_addr_t *dst)
         return (BAD);
     }
 
-    ret = send_raw_packet(sock, lbuf_data(b), lbuf_size(b), lisp_addr_ip(dst));
+    ret = tun_txq_send(q, sock, b, lisp_addr_ip(dst));
     return (ret);
 }
 
 
-static inline int
-is_lisp_packet(packet_tuple_t *tpl)
+inline int
+tun_is_lisp_packet(packet_tuple_t *tpl)
 {
     /* Don't encapsulate LISP messages  */
     if (tpl->protocol != IPPROTO_UDP) {
@@ -181,49 +350,106 @@ tun_output_multicast(lbuf_t *b, packet_tuple_t *tuple)
     return (GOOD);
 }
 
-static int
-tun_output_unicast(lbuf_t *b, packet_tuple_t *tuple)
+/* Obtain from the control plane the forwarding information of a flow */
+fwd_info_t *
+tun_output_get_fwd_info(packet_tuple_t *tuple)
 {
     fwd_info_t *fi;
     fwd_entry_t *fe;
-    int result = 1; // SIMPLEMUX
 
-    fi = ttable_lookup(&ttable, tuple);
-    if (!fi) {
-        fi = (fwd_info_t *)ctrl_get_forwarding_info(tuple);
-        if (fi == NULL){
-            return (BAD);
+    fi = (fwd_info_t *)ctrl_get_forwarding_info(tuple);
+    if (fi == NULL){
+        return (NULL);
+    }
+    fe = fi->fwd_info;
+    if (fe && fe->srloc && fe->drloc)  {
+        fe->out_sock = get_out_socket_ptr_from_address(fe->srloc);
+        if (data_encap == DATA_ENCAP_UDP) {
+            fe->encap_sock = tun_encap_sock_get(fe->srloc, fe->drloc);
+            fe->encap_gen = fe->encap_sock ? fe->encap_sock->gen : 0;
         }
-        fe = fi->fwd_info;
-        if (fe && fe->srloc && fe->drloc)  {
-            fe->out_sock = get_out_socket_ptr_from_address(fe->srloc);
+        /* The template is only used without a connected socket. It is built
+         * once per forwarding entry */
+        if (fe->encap_tmpl.len == 0 && tun_encap_sock_fd(fe->encap_sock,
+                fe->encap_gen) == ERR_SOCKET) {
+            lisp_data_encap_tmpl_init(&fe->encap_tmpl, LISP_DATA_PORT,
+                    LISP_DATA_PORT, fe->srloc, fe->drloc);
         }
-        // XXX Should packets to be send natively be added to the table?
-        ttable_insert(&ttable, pkt_tuple_clone(tuple), fi);
-    }else{
-        fe = fi->fwd_info;
     }
+    return (fi);
+}
+
+/* Encapsulate the packet towards the RLOC of the forwarding entry and queue
+ * it in 'q'. Packets without RLOCs are forwarded natively */
+int
+tun_output_encap(tun_tx_queue_t *q, lbuf_t *b, packet_tuple_t *tuple,
+        fwd_entry_t *fe)
+{
+    int ttl = 128, tos = 0, sock;
 
     /* Packets with no/negative map cache entry AND no PETR
      * OR packets with missing src or dst RLOCs
      * forward them natively */
     if (!fe || !fe->srloc || !fe->drloc) {
-        return(tun_forward_native(b, &tuple->dst_addr));
+        return(tun_forward_native(q, b, &tuple->dst_addr));
+    }
+
+    LMLOG(LDBG_3,"OUTPUT: Sending encapsulated packet: RLOC %s -> %s\n",lisp_addr_to_char(fe->srloc),lisp_addr_to_char(fe->drloc));
+
+    /* Without a connected socket, the outer headers are built here. The
+     * control thread may close the socket: read the descriptor once */
+    sock = tun_encap_sock_fd(fe->encap_sock, fe->encap_gen);
+    if (sock != ERR_SOCKET) {
+        tun_encap_sock_touch(fe->encap_sock);
+        ip_hdr_ttl_and_tos(lbuf_data(b), &ttl, &tos);
+        lisp_data_push_hdr(b);
+        return(tun_txq_send_connected(q, sock, b,
+                lisp_addr_ip_afi(fe->drloc), ttl, tos));
+    }
+    if (fe->encap_tmpl.len != 0) {
+        lisp_data_encap_tmpl(b, &fe->encap_tmpl);
+    } else {
+        lisp_data_encap(b, LISP_DATA_PORT, LISP_DATA_PORT, fe->srloc, fe->drloc);
     }
+    return(tun_txq_send(q, *(fe->out_sock), b, lisp_addr_ip(fe->drloc)));
+}
+
+/* Forward a unicast packet whose forwarding info is already known */
+int
+tun_output_with_fwd_info(lbuf_t *b, packet_tuple_t *tuple, fwd_info_t *fi)
+{
+    fwd_entry_t *fe = fi->fwd_info;
+    int result = 1; // SIMPLEMUX
 
     /* SIMPLEMUX ***************************************/
-	if (numdsm  > 0) 
+	if (numdsm  > 0 && fe && fe->srloc && fe->drloc)
         result = mux_tun_output_unicast(b,tuple, fe);
     /* SIMPLEMUX ***************************************/
         
     if (result) { //Original
-		LMLOG(LDBG_3,"OUTPUT: Sending encapsulated packet: RLOC %s -> %s\n",lisp_addr_to_char(fe->srloc),lisp_addr_to_char(fe->drloc));
-		lisp_data_encap(b, LISP_DATA_PORT, LISP_DATA_PORT, fe->srloc, fe->drloc);
-		return(send_raw_packet(*(fe->out_sock), lbuf_data(b), lbuf_size(b),lisp_addr_ip(fe->drloc)));
+		return(tun_output_encap(&tx_queue, b, tuple, fe));
 	}
 	return (result);
 }
 
+static int
+tun_output_unicast(lbuf_t *b, packet_tuple_t *tuple)
+{
+    fwd_info_t *fi;
+
+    fi = ttable_lookup(&ttable, tuple);
+    if (!fi) {
+        fi = tun_output_get_fwd_info(tuple);
+        if (fi == NULL){
+            return (BAD);
+        }
+        // XXX Should packets to be send natively be added to the table?
+        ttable_insert(&ttable, tuple, fi);
+    }
+
+    return (tun_output_with_fwd_info(b, tuple, fi));
+}
+
 int
 tun_output(lbuf_t *b)
 {
@@ -239,9 +465,9 @@ tun_output(lbuf_t *b)
             tpl.protocol, tpl.src_port, tpl.dst_port);
 
     /* If already LISP packet, do not encapsulate again */
-    if (is_lisp_packet(&tpl)) {
+    if (tun_is_lisp_packet(&tpl)) {
         LMLOG(LDBG_3,"OUTPUT: Is a lisp packet, do not encapsulate again");
-        return (tun_forward_native(b, &tpl.dst_addr));
+        return (tun_forward_native(&tx_queue, b, &tpl.dst_addr));
     }
     if (ip_addr_is_multicast(lisp_addr_ip(&tpl.dst_addr))) {
         tun_output_multicast(b, &tpl);
@@ -252,17 +478,39 @@ tun_output(lbuf_t *b)
     return(GOOD);
 }
 
+/* Read from the tun, up to data_batch_size packets, all the packets queued
+ * in the interface. Encapsulated packets are sent together once all of them
+ * have been processed */
 int
 tun_output_recv(sock_t *sl)
 {
-    lbuf_use_stack(&pkt_buf, &pkt_recv_buf, TUN_RECEIVE_SIZE);
-    lbuf_reserve(&pkt_buf, LBUF_STACK_OFFSET);
+    lbuf_t *b;
+    int i, nread;
+
+    for (i = 0; i < data_batch_size; i++) {
+        b = &pkt_bufs[i];
+        lbuf_use_stack(b, pkt_recv_bufs + i * TUN_RECEIVE_SIZE,
+                TUN_RECEIVE_SIZE);
+        lbuf_reserve(b, LBUF_STACK_OFFSET);
+
+        nread = read(sl->fd, lbuf_data(b), lbuf_tailroom(b));
+        if (nread <= 0) {
+            if (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                LMLOG(LWRN, "OUTPUT: Error while reading from tun: %s",
+                        strerror(errno));
+            }
+            break;
+        }
+        lbuf_set_size(b, nread);
+        lbuf_reset_ip(b);
+        tun_output(b);
+    }
 
-    if (sock_recv(sl->fd, &pkt_buf) != GOOD) {
-        LMLOG(LWRN, "OUTPUT: Error while reading from tun!");
-        return (BAD);
+    if (i > 0) {
+        tun_bstats_rx(i);
     }
-    lbuf_reset_ip(&pkt_buf);
-    tun_output(&pkt_buf);
-    return (GOOD);
+    tun_output_flush();
+    ttable_age(&ttable, TTABLE_AGING_SLICE);
+
+    return (i > 0 ? GOOD : BAD);
 }
@@ -33,11 +33,53 @@
 #include "../../iface_list.h"
 #include "../../lispd_external.h"
 #include "../../lib/cksum.h"
+#include "../../lib/ttable.h"
+#include "tun.h"
 
+typedef struct fwd_info_ fwd_info_t;
+
+/* Ancillary data with the TTL and TOS of a packet sent through a connected
+ * socket */
+typedef union tun_txq_cmsg_ {
+    struct cmsghdr align;
+    char buf[2 * CMSG_SPACE(sizeof(int))];
+} tun_txq_cmsg_t;
+
+/* Packets pending to be sent. They are kept in the buffer where they were
+ * received until the queue is flushed */
+typedef struct tun_tx_queue_ {
+    int len;
+    int count;
+    int *socks;
+    struct sockaddr_storage *addrs;
+    tun_txq_cmsg_t *cmsgs;
+    struct iovec *iov;
+    struct mmsghdr *msgs;
+    struct mmsghdr *burst;      /* messages of the socket being flushed */
+    uint8_t *sent;
+    tun_batch_stats_t *stats;
+} tun_tx_queue_t;
+
+/* Flow table of the control thread */
+extern ttable_t ttable;
 
 int tun_output_recv(sock_t *sl);
 int tun_output(lbuf_t *);
+void tun_output_flush();
 void tun_output_init();
 void tun_output_uninit();
 
+inline int tun_is_lisp_packet(packet_tuple_t *tpl);
+fwd_info_t *tun_output_get_fwd_info(packet_tuple_t *tuple);
+int tun_output_with_fwd_info(lbuf_t *b, packet_tuple_t *tuple, fwd_info_t *fi);
+int tun_output_encap(tun_tx_queue_t *q, lbuf_t *b, packet_tuple_t *tuple,
+        fwd_entry_t *fe);
+
+void tun_txq_init(tun_tx_queue_t *q, int len, tun_batch_stats_t *stats);
+void tun_txq_uninit(tun_tx_queue_t *q);
+int tun_txq_send(tun_tx_queue_t *q, int sock, lbuf_t *b, ip_addr_t *dst);
+int tun_txq_send_connected(tun_tx_queue_t *q, int sock, lbuf_t *b, int afi,
+        int ttl, int tos);
+void tun_txq_flush(tun_tx_queue_t *q);
+
 #endif /*TUN_OUTPUT_H_*/
@@ -76,7 +76,10 @@ vpnapi_configure_data_plane(lisp_dev_type_e dev_type, ...)
     va_end(ap);
 
     data->tun_socket =tun_fd;
-    sockmstr_register_read_listener(smaster, vpnapi_output_recv, NULL,tun_fd);
+    if (sockmstr_register_read_listener(smaster, vpnapi_output_recv, NULL,
+            tun_fd) == NULL) {
+        return (BAD);
+    }
 
     switch (dev_type){
     case MN_MODE:
@@ -93,7 +96,10 @@ vpnapi_configure_data_plane(lisp_dev_type_e dev_type, ...)
 
     if (default_rloc_afi != AF_INET6){
         data->ipv4_data_socket = open_data_datagram_input_socket(AF_INET);
-        sockmstr_register_read_listener(smaster, cb_func, NULL,data->ipv4_data_socket);
+        if (sockmstr_register_read_listener(smaster, cb_func, NULL,
+                data->ipv4_data_socket) == NULL) {
+            return (BAD);
+        }
         lispd_jni_protect_socket(data->ipv4_data_socket);
     }else {
         data->ipv4_data_socket = ERR_SOCKET;
@@ -101,7 +107,10 @@ vpnapi_configure_data_plane(lisp_dev_type_e dev_type, ...)
 
     if (default_rloc_afi != AF_INET){
         data->ipv6_data_socket = open_data_datagram_input_socket(AF_INET6);
-        sockmstr_register_read_listener(smaster, cb_func, NULL,data->ipv6_data_socket);
+        if (sockmstr_register_read_listener(smaster, cb_func, NULL,
+                data->ipv6_data_socket) == NULL) {
+            return (BAD);
+        }
         lispd_jni_protect_socket(data->ipv6_data_socket);
     }else {
         data->ipv6_data_socket = ERR_SOCKET;
@@ -308,7 +317,12 @@ vpnapi_reset_socket(int fd, int afi)
     default:
         return (BAD);
     }
-    sockmstr_register_read_listener(smaster,old_sock->recv_cb,old_sock->arg,new_fd);
+    if (sockmstr_register_read_listener(smaster, old_sock->recv_cb,
+            old_sock->arg, new_fd) == NULL) {
+        /* Keep the old socket */
+        close(new_fd);
+        return (BAD);
+    }
     sockmstr_unregister_read_listenedr(smaster,old_sock);
     /* Protect the socket from loops in the system*/
     lispd_jni_protect_socket(new_fd);
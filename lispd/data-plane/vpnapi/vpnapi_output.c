@@ -42,7 +42,7 @@ static int vpnapi_forward_native(lbuf_t *b, lisp_addr_t *dst);
 void
 vpnapi_output_init()
 {
-    ttable_init(&ttable);
+    ttable_init(&ttable, flow_table_size);
 }
 
 void
@@ -107,7 +107,7 @@ vpnapi_output_unicast(lbuf_t *b, packet_tuple_t *tuple)
             }
         }
 
-        ttable_insert(&ttable, pkt_tuple_clone(tuple), fi);
+        ttable_insert(&ttable, tuple, fi);
     }else{
         fe = fi->fwd_info;
     }
@@ -168,6 +168,7 @@ vpnapi_output_recv(struct sock *sl)
     }
     lbuf_reset_ip(&pkt_buf);
     vpnapi_output(&pkt_buf);
+    ttable_age(&ttable, TTABLE_AGING_SLICE);
     return (GOOD);
 }
 
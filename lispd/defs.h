@@ -37,6 +37,10 @@ typedef enum {
 #define unlikely(x)     (x)
 #endif
 
+/* Static buffers of the functions also called by the data plane worker
+ * threads */
+#define THREAD_LOCAL    __thread
+
 typedef struct lisp_ctrl_dev lisp_ctrl_dev_t;
 typedef struct lisp_ctrl lisp_ctrl_t;
 typedef struct shash shash_t;
@@ -48,6 +52,7 @@ typedef struct htable_nonces_ htable_nonces_t;
 
 /* Protocols constants related with timeouts */
 #define LISPD_INITIAL_MRQ_TIMEOUT       2  // Initial expiration timer for the first MRq
+#define MREQ_BATCH_WINDOW               2  // ms a miss waits for others to be packed in its MRq
 #define LISPD_INITIAL_SMR_TIMEOUT       3  // Initial expiration timer for the first MRq SMR
 #define LISPD_INITIAL_MREG_TIMEOUT      3  // Initial expiration timer for the first Encapsulated Map Register
 #define LISPD_SMR_TIMEOUT               5  // Time since interface status change until balancing arrays and SMR is done
@@ -72,6 +77,18 @@ typedef struct htable_nonces_ htable_nonces_t;
 #define DEFAULT_DATA_CACHE_TTL                  10
 #define DEFAULT_SELECT_TIMEOUT                  1000/* ms */
 
+#define DEFAULT_DATA_BATCH_SIZE                 32  /* Data packets processed per wakeup */
+#define MAX_DATA_BATCH_SIZE                     1024
+#define DEFAULT_FLOW_TABLE_SIZE                 10000 /* Flows cached by the data plane */
+#define MIN_FLOW_TABLE_SIZE                     64
+#define MAX_FLOW_TABLE_SIZE                     4194304
+#define MAX_MAP_CACHE_SIZE                      4194304 /* KB */
+#define MAX_MAP_REQUEST_RATE                    100000 /* Map-Requests per second */
+#define MAX_DATA_QUEUES                         64  /* Queues of a multi queue tun */
+#define DATA_ENCAP_RAW                          0   /* Outer headers built by lispd */
+#define DATA_ENCAP_UDP                          1   /* Connected UDP socket per RLOC pair */
+#define MAX_ENCAP_SOCKETS                       1024 /* Open at the same time */
+
 #define FIELD_AFI_LEN                    2
 #define FIELD_PORT_LEN                   2
 
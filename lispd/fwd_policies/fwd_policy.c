@@ -93,7 +93,30 @@ policy_loct_parm_del(fwd_policy_loct_parm *pol_loct)
 fwd_info_t *
 fwd_info_new()
 {
-    return (xzalloc(sizeof(fwd_info_t)));
+    fwd_info_t *fi;
+
+    fi = xzalloc(sizeof(fwd_info_t));
+    return (fi);
+}
+
+/* Associate the forwarding info with the generation of the local mapping
+ * (src_gen) and the map cache entry (dst_gen) used to calculate it */
+void
+fwd_info_set_gens(fwd_info_t *fi, gen_counter_t *src_gen, gen_counter_t *dst_gen)
+{
+    fi->src_gen = src_gen;
+    fi->src_gen_val = src_gen ? gen_counter_val(src_gen) : 0;
+    fi->dst_gen = dst_gen;
+    fi->dst_gen_val = dst_gen ? gen_counter_val(dst_gen) : 0;
+}
+
+/* Associate the forwarding info with the generation of the PETRs entry, when
+ * the packets are sent to them or would have been if there were any */
+void
+fwd_info_set_petr_gen(fwd_info_t *fi, gen_counter_t *petr_gen)
+{
+    fi->petr_gen = petr_gen;
+    fi->petr_gen_val = petr_gen ? gen_counter_val(petr_gen) : 0;
 }
 
 void
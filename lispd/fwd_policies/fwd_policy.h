@@ -20,6 +20,7 @@
 #ifndef ROUTING_POLICY_H_
 #define ROUTING_POLICY_H_
 
+#include "../lib/gen_counter.h"
 #include "../lib/generic_list.h"
 #include "../lib/shash.h"
 #include "../liblisp/liblisp.h"
@@ -60,8 +61,25 @@ typedef struct fwd_policy_loct_parm_t{
 typedef struct fwd_info_{
     void *fwd_info;
     uint8_t temporal;
+    /* Generations of the state used to calculate the forwarding info. It
+     * is no longer valid when any of them changes */
+    gen_counter_t *src_gen;
+    uint32_t src_gen_val;
+    gen_counter_t *dst_gen;
+    uint32_t dst_gen_val;
+    gen_counter_t *petr_gen;    /* When the PETRs were considered */
+    uint32_t petr_gen_val;
 }fwd_info_t;
 
+static inline int
+fwd_info_is_valid(fwd_info_t *fi)
+{
+    return ((!fi->src_gen || gen_counter_val(fi->src_gen) == fi->src_gen_val)
+            && (!fi->dst_gen || gen_counter_val(fi->dst_gen) == fi->dst_gen_val)
+            && (!fi->petr_gen
+                    || gen_counter_val(fi->petr_gen) == fi->petr_gen_val));
+}
+
 
 /* functions to manipulate routing */
 typedef struct fwd_policy_class {
@@ -90,6 +108,9 @@ void fwd_policy_loct_parm_del(fwd_policy_loct_parm *pol_loct);
 
 fwd_policy_class *fwd_policy_class_find(char *lib);
 fwd_info_t *fwd_info_new();
+void fwd_info_set_gens(fwd_info_t *fi, gen_counter_t *src_gen,
+        gen_counter_t *dst_gen);
+void fwd_info_set_petr_gen(fwd_info_t *fi, gen_counter_t *petr_gen);
 void fwd_info_del(fwd_info_t * fwd_info,fwd_info_data_del del_fn);
 
 #endif /* ROUTING_POLICY_H_ */
@@ -26,25 +26,199 @@
 #include <netinet/ip6.h>
 #include <netinet/ip.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CKSUM_X86 1
+#endif
 
-uint16_t
-ip_checksum(uint16_t *buffer, int size)
+/* Below this length, like for IP headers, setting up the vectors costs more
+ * than it saves */
+#define CKSUM_VECTOR_MIN_LEN    128
+
+typedef uint64_t (*cksum_add_fn)(const uint8_t *, int, uint64_t);
+
+static uint64_t cksum_add_generic(const uint8_t *p, int len, uint64_t sum);
+static uint64_t cksum_add_first(const uint8_t *p, int len, uint64_t sum);
+
+/* Implementation of cksum_partial. Chosen by the first call */
+static cksum_add_fn cksum_add = cksum_add_first;
+static cksum_impl_e cksum_impl = CKSUM_GENERIC;
+
+static const char *cksum_impl_names[CKSUM_NIMPL] = {
+    "generic",
+    "sse2",
+    "avx2"
+};
+
+
+/* 32 bit words are added into a 64 bit accumulator, so carries only have to
+ * be folded at the end. As 2^16 = 1 modulo 0xffff, the folded sum of the 32
+ * bit words is the sum of the 16 bit words */
+static uint64_t
+cksum_add_generic(const uint8_t *p, int len, uint64_t sum)
 {
-    uint32_t cksum = 0;
+    uint32_t w[4];
+    uint16_t h;
+    union {
+        uint8_t b[2];
+        uint16_t w;
+    } tail;
+
+    while (len >= 16) {
+        memcpy(w, p, sizeof(w));
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        p += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        memcpy(w, p, sizeof(uint32_t));
+        sum += w[0];
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, sizeof(uint16_t));
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+    /* The last byte is padded with zero */
+    if (len) {
+        tail.b[0] = *p;
+        tail.b[1] = 0;
+        sum += tail.w;
+    }
+
+    return (sum);
+}
 
-    while (size > 1) {
-        cksum += *buffer++;
-        size -= sizeof(uint16_t);
+#ifdef CKSUM_X86
+
+/* The 32 bit words are widened to 64 bit lanes by interleaving them with
+ * zeros. The order of the words does not matter for the sum */
+static uint64_t
+cksum_add_sse2(const uint8_t *p, int len, uint64_t sum)
+{
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128(), v;
+    uint64_t lanes[2];
+
+    while (len >= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        len -= 16;
     }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += lanes[0];
+    sum += lanes[1];
 
-    if (size) {
-        cksum += *(uint8_t *) buffer;
+    return (cksum_add_generic(p, len, sum));
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+cksum_add_avx2(const uint8_t *p, int len, uint64_t sum)
+{
+    __m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256(), v;
+    uint64_t lanes[4];
+
+    while (len >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        len -= 32;
     }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    sum += lanes[0];
+    sum += lanes[1];
+    sum += lanes[2];
+    sum += lanes[3];
 
-    cksum = (cksum >> 16) + (cksum & 0xffff);
-    cksum += (cksum >> 16);
+    return (cksum_add_sse2(p, len, sum));
+}
+
+#endif /* CKSUM_X86 */
 
-    return ((uint16_t) (~cksum));
+/* Use the fastest implementation supported by the CPU */
+static uint64_t
+cksum_add_first(const uint8_t *p, int len, uint64_t sum)
+{
+    if (cksum_select(CKSUM_AVX2) != GOOD && cksum_select(CKSUM_SSE2) != GOOD) {
+        cksum_select(CKSUM_GENERIC);
+    }
+    return (cksum_add(p, len, sum));
+}
+
+/* Force an implementation. BAD if the CPU does not support it */
+int
+cksum_select(cksum_impl_e impl)
+{
+    switch (impl) {
+    case CKSUM_GENERIC:
+        cksum_add = cksum_add_generic;
+        break;
+#ifdef CKSUM_X86
+    case CKSUM_SSE2:
+        cksum_add = cksum_add_sse2;
+        break;
+    case CKSUM_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) {
+            return (BAD);
+        }
+        cksum_add = cksum_add_avx2;
+        break;
+#endif
+    default:
+        return (BAD);
+    }
+    cksum_impl = impl;
+    return (GOOD);
+}
+
+cksum_impl_e
+cksum_selected()
+{
+    if (cksum_add == cksum_add_first) {
+        cksum_add_first(NULL, 0, 0);
+    }
+    return (cksum_impl);
+}
+
+const char *
+cksum_impl_to_char(cksum_impl_e impl)
+{
+    if (impl >= CKSUM_NIMPL) {
+        return ("unknown");
+    }
+    return (cksum_impl_names[impl]);
+}
+
+/* Add the one's complement sum of the 'len' bytes of 'buf' to 'sum'. The
+ * result is folded to 16 bits */
+uint32_t
+cksum_partial(const void *buf, int len, uint32_t sum)
+{
+    uint64_t s;
+
+    if (len < CKSUM_VECTOR_MIN_LEN) {
+        s = cksum_add_generic((const uint8_t *)buf, len, sum);
+    } else {
+        s = cksum_add((const uint8_t *)buf, len, sum);
+    }
+    s = (s >> 32) + (s & 0xffffffff);
+    s = (s >> 32) + (s & 0xffffffff);
+    s = (s >> 16) + (s & 0xffff);
+    s = (s >> 16) + (s & 0xffff);
+    return ((uint32_t)s);
+}
+
+uint16_t
+ip_checksum(uint16_t *buffer, int size)
+{
+    return (cksum_fold(cksum_partial(buffer, size, 0)));
 }
 
 /*
@@ -66,88 +240,31 @@ uint16_t
 udp_ipv4_checksum(const void *b, unsigned int len,
         in_addr_t src, in_addr_t dst)
 {
-
-    const uint16_t *buf = b;
-    uint16_t *ip_src = (void *) &src;
-    uint16_t *ip_dst = (void *) &dst;
-    uint32_t length = len;
-    uint32_t sum = 0;
-
-    while (len > 1) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        len -= 2;
-    }
-
-    /* Add the padding if the packet length is odd */
-
-    if (len & 1)
-        sum += *((uint8_t *) buf);
+    uint32_t sum;
 
     /* Add the pseudo-header */
-
-    sum += *(ip_src++);
-    sum += *ip_src;
-
-    sum += *(ip_dst++);
-    sum += *ip_dst;
-
+    sum = cksum_partial(b, len, 0);
+    sum += (src >> 16) + (src & 0xffff);
+    sum += (dst >> 16) + (dst & 0xffff);
     sum += htons(IPPROTO_UDP);
-    sum += htons(length);
+    sum += htons(len);
 
-    /* Add the carries */
-
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    /* Return the one's complement of sum */
-
-    return ((uint16_t) (~sum));
+    return (cksum_fold(sum));
 }
 
 uint16_t
 udp_ipv6_checksum(const struct ip6_hdr *ip6, const struct udphdr *up,
         unsigned int len)
 {
-    size_t i;
-    register const u_int16_t *sp;
-    uint32_t sum;
-    union {
-        struct {
-            struct in6_addr ph_src;
-            struct in6_addr ph_dst;
-            u_int32_t ph_len;
-            u_int8_t ph_zero[3];
-            u_int8_t ph_nxt;
-        } ph;
-        u_int16_t pa[20];
-    } phu;
-
-    /* pseudo-header */
-    memset(&phu, 0, sizeof(phu));
-    phu.ph.ph_src = ip6->ip6_src;
-    phu.ph.ph_dst = ip6->ip6_dst;
-    phu.ph.ph_len = htonl(len);
-    phu.ph.ph_nxt = IPPROTO_UDP;
-
-    sum = 0;
-    for (i = 0; i < sizeof(phu.pa) / sizeof(phu.pa[0]); i++)
-        sum += phu.pa[i];
-
-    sp = (const u_int16_t *) up;
-
-    for (i = 0; i < (len & ~1); i += 2)
-        sum += *sp++;
-
-    if (len & 1)
-        sum += htons((*(const u_int8_t *) sp) << 8);
-
-    while (sum > 0xffff)
-        sum = (sum & 0xffff) + (sum >> 16);
-    sum = ~sum & 0xffff;
+    uint32_t sum, nlen;
 
-    return (sum);
+    /* pseudo-header: addresses, length and next header */
+    sum = cksum_partial(&ip6->ip6_src, 2 * sizeof(struct in6_addr), 0);
+    nlen = htonl(len);
+    sum += (nlen >> 16) + (nlen & 0xffff);
+    sum += htons(IPPROTO_UDP);
+
+    return (cksum_fold(cksum_partial(up, len, sum)));
 }
 
 /*
@@ -21,13 +21,60 @@
 #define CKSUM_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <netinet/udp.h>
 #include "../defs.h"
 
+/*
+ * Internet checksum (RFC 1071). Sums are kept in the byte order of the
+ * packet, so they can be folded and stored in a header without conversion.
+ * cksum_partial() adds up a buffer with the fastest implementation supported
+ * by the CPU, selected the first time it is used. cksum_update16() and
+ * cksum_update32() update a checksum when a field of the packet changes
+ * (RFC 1624) without summing the packet again.
+ */
+
+typedef enum cksum_impl {
+    CKSUM_GENERIC = 0,      /* 64 bit accumulator */
+    CKSUM_SSE2,
+    CKSUM_AVX2,
+    CKSUM_NIMPL
+} cksum_impl_e;
+
+uint32_t cksum_partial(const void *buf, int len, uint32_t sum);
+int cksum_select(cksum_impl_e impl);
+cksum_impl_e cksum_selected();
+const char *cksum_impl_to_char(cksum_impl_e impl);
+
 uint16_t ip_checksum(uint16_t *buffer, int size);
 
 /* Calculate the IPv4 or IPv6 UDP checksum */
 uint16_t udp_checksum(struct udphdr *udph, int udp_len, void *iphdr, int afi);
 
+/* Fold a sum into 16 bits and return its one's complement */
+static inline uint16_t
+cksum_fold(uint32_t sum)
+{
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return ((uint16_t)~sum);
+}
+
+/* Checksum 'check' after a 16 bit word of the packet changes from 'old' to
+ * 'new': HC' = ~(~HC + ~m + m'). A zero UDP checksum means that there is no
+ * checksum and must not be updated */
+static inline uint16_t
+cksum_update16(uint16_t check, uint16_t old, uint16_t new)
+{
+    return (cksum_fold((uint16_t)~check + (uint16_t)~old + (uint32_t)new));
+}
+
+/* Same as cksum_update16 for a 32 bit field, like an IPv4 address */
+static inline uint16_t
+cksum_update32(uint16_t check, uint32_t old, uint32_t new)
+{
+    return (cksum_fold((uint16_t)~check + (~old & 0xffff) + (~old >> 16)
+            + (new & 0xffff) + (new >> 16)));
+}
 
 #endif /* CKSUM_H_ */
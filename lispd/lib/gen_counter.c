@@ -0,0 +1,50 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "gen_counter.h"
+#include "util.h"
+
+/* Released counters. Only accessed from the control thread */
+static gen_counter_t *free_gens = NULL;
+
+gen_counter_t *
+gen_counter_new()
+{
+    gen_counter_t *gen;
+
+    if (free_gens != NULL) {
+        gen = free_gens;
+        free_gens = gen->next;
+        gen->next = NULL;
+        return (gen);
+    }
+
+    return (xzalloc(sizeof(gen_counter_t)));
+}
+
+void
+gen_counter_del(gen_counter_t *gen)
+{
+    if (gen == NULL) {
+        return;
+    }
+    gen_counter_bump(gen);
+    gen->next = free_gens;
+    free_gens = gen;
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef GEN_COUNTER_H_
+#define GEN_COUNTER_H_
+
+#include <stdint.h>
+
+/*
+ * Generation counter of a piece of control plane state. It is incremented
+ * each time the state changes, so anyone keeping a copy of the value can
+ * find out whether the information derived from the state is still valid.
+ * Counters are never released: when their owner is deleted they are
+ * incremented one last time and recycled. A reader holding a pointer to a
+ * counter never accesses freed memory, and a recycled counter never
+ * matches an old value.
+ */
+typedef struct gen_counter_ {
+    volatile uint32_t val;
+    struct gen_counter_ *next;  /* Free list */
+} gen_counter_t;
+
+gen_counter_t *gen_counter_new();
+void gen_counter_del(gen_counter_t *gen);
+
+static inline void
+gen_counter_bump(gen_counter_t *gen)
+{
+    gen->val++;
+}
+
+static inline uint32_t
+gen_counter_val(gen_counter_t *gen)
+{
+    return (gen->val);
+}
+
+#endif /* GEN_COUNTER_H_ */
@@ -101,7 +101,9 @@ lispd_log(int log_level, char *log_name, const char *format,
         va_list args)
 {
     time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
 
 #ifdef ANDROID
     __android_log_vprint(ANDROID_LOG_INFO, "LISPmob-C ==>", format,args);
@@ -0,0 +1,318 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string.h>
+
+#include "lpm.h"
+#include "../defs.h"
+#include "lmlog.h"
+#include "util.h"
+
+#define LPM_ROOT_SIZE       (1 << LPM_ROOT_BITS)
+#define LPM_MAX_DEPTH       ((128 - LPM_ROOT_BITS) / LPM_STRIDE)
+
+#define lpm_popcount(_x)    __builtin_popcount(_x)
+
+/* Bits of pref_map of the prefixes of 1 to 4 bits that contain each value of
+ * the next 4 bits of the address. Longer prefixes have higher bits */
+static const uint32_t lpm_match_mask[1 << LPM_STRIDE] = {
+    0x00004045, 0x00008045, 0x00010085, 0x00020085,
+    0x00040109, 0x00080109, 0x00100209, 0x00200209,
+    0x00400412, 0x00800412, 0x01000812, 0x02000812,
+    0x04001022, 0x08001022, 0x10002022, 0x20002022
+};
+
+
+static inline uint32_t
+lpm_bits(uint8_t *a, int bit)
+{
+    return ((a[bit / 8] >> (8 - LPM_STRIDE - bit % 8)) & 0xF);
+}
+
+static inline uint8_t
+lpm_max_plen(lpm_t *lpm)
+{
+    return (lpm->afi == AF_INET ? 32 : 128);
+}
+
+/* Child of node for the next 4 bits, created if it doesn't exist. It may
+ * move the rest of children of node */
+static lpm_node_t *
+lpm_node_child(lpm_t *lpm, lpm_node_t *node, uint32_t bits)
+{
+    int i = lpm_popcount(node->child_map & ((1 << bits) - 1));
+    int n = lpm_popcount(node->child_map);
+
+    if (!(node->child_map & (1 << bits))) {
+        node->children = xrealloc(node->children,
+                (n + 1) * sizeof(lpm_node_t));
+        memmove(&node->children[i + 1], &node->children[i],
+                (n - i) * sizeof(lpm_node_t));
+        memset(&node->children[i], 0, sizeof(lpm_node_t));
+        node->child_map |= 1 << bits;
+        lpm->n_nodes++;
+    }
+    return (&node->children[i]);
+}
+
+static void
+lpm_node_del_child(lpm_t *lpm, lpm_node_t *node, uint32_t bits)
+{
+    int i = lpm_popcount(node->child_map & ((1 << bits) - 1));
+    int n = lpm_popcount(node->child_map);
+
+    memmove(&node->children[i], &node->children[i + 1],
+            (n - i - 1) * sizeof(lpm_node_t));
+    node->child_map &= ~(1 << bits);
+    if (n == 1) {
+        free(node->children);
+        node->children = NULL;
+    }
+    lpm->n_nodes--;
+}
+
+static void
+lpm_node_free(lpm_node_t *node)
+{
+    int i;
+
+    for (i = 0; i < lpm_popcount(node->child_map); i++) {
+        lpm_node_free(&node->children[i]);
+    }
+    free(node->children);
+    free(node->data);
+}
+
+/* Set the entries of the root table of prefixes of length between min_plen
+ * and max_plen in the range of addr/plen */
+static void
+lpm_root_fill(lpm_t *lpm, uint8_t *a, uint8_t plen, uint8_t min_plen,
+        uint8_t max_plen, void *data, uint8_t data_plen)
+{
+    uint32_t span = 1 << (LPM_ROOT_BITS - plen);
+    uint32_t first = ((a[0] << 8) | a[1]) & ~(span - 1);
+    uint32_t i;
+
+    for (i = first; i < first + span; i++) {
+        if (lpm->root_plen[i] >= min_plen && lpm->root_plen[i] <= max_plen) {
+            lpm->root[i].data = data;
+            lpm->root_plen[i] = data_plen;
+        }
+    }
+}
+
+lpm_t *
+lpm_new(int afi)
+{
+    lpm_t *lpm;
+
+    if (afi != AF_INET && afi != AF_INET6) {
+        LMLOG(LDBG_1, "lpm_new: AFI %d not supported", afi);
+        return (NULL);
+    }
+
+    lpm = xzalloc(sizeof(lpm_t));
+    lpm->afi = afi;
+    return (lpm);
+}
+
+void
+lpm_del(lpm_t *lpm)
+{
+    int i;
+
+    if (!lpm) {
+        return;
+    }
+    if (lpm->root) {
+        for (i = 0; i < LPM_ROOT_SIZE; i++) {
+            if (lpm->root[i].child) {
+                lpm_node_free(lpm->root[i].child);
+                free(lpm->root[i].child);
+            }
+        }
+    }
+    free(lpm->root);
+    free(lpm->root_plen);
+    free(lpm);
+}
+
+/* Index data under addr/plen. The data of an indexed prefix is replaced */
+int
+lpm_add(lpm_t *lpm, ip_addr_t *addr, uint8_t plen, void *data)
+{
+    uint8_t *a = ip_addr_get_addr(addr);
+    lpm_root_t *r;
+    lpm_node_t *node;
+    uint32_t pos;
+    int bit, l, i, n;
+
+    if (plen > lpm_max_plen(lpm)) {
+        return (BAD);
+    }
+    if (!lpm->root) {
+        lpm->root = xzalloc(LPM_ROOT_SIZE * sizeof(lpm_root_t));
+        lpm->root_plen = xzalloc(LPM_ROOT_SIZE);
+    }
+
+    if (plen <= LPM_ROOT_BITS) {
+        lpm_root_fill(lpm, a, plen, 0, plen, data, plen);
+        return (GOOD);
+    }
+
+    r = &lpm->root[(a[0] << 8) | a[1]];
+    if (!r->child) {
+        r->child = xzalloc(sizeof(lpm_node_t));
+        lpm->n_nodes++;
+    }
+    node = r->child;
+    for (bit = LPM_ROOT_BITS; plen > bit + LPM_STRIDE; bit += LPM_STRIDE) {
+        node = lpm_node_child(lpm, node, lpm_bits(a, bit));
+    }
+
+    l = plen - bit;
+    pos = (1 << l) - 2 + (lpm_bits(a, bit) >> (LPM_STRIDE - l));
+    i = lpm_popcount(node->pref_map & ((1 << pos) - 1));
+    if (!(node->pref_map & (1 << pos))) {
+        n = lpm_popcount(node->pref_map);
+        node->data = xrealloc(node->data, (n + 1) * sizeof(void *));
+        memmove(&node->data[i + 1], &node->data[i], (n - i) * sizeof(void *));
+        node->pref_map |= 1 << pos;
+        lpm->n_prefixes++;
+    }
+    node->data[i] = data;
+    return (GOOD);
+}
+
+/* Remove addr/plen from the index. cover is the data of the longest prefix
+ * that contains it, of length cover_plen, or NULL if there is none */
+int
+lpm_remove(lpm_t *lpm, ip_addr_t *addr, uint8_t plen, void *cover,
+        uint8_t cover_plen)
+{
+    uint8_t *a = ip_addr_get_addr(addr);
+    lpm_node_t *path[LPM_MAX_DEPTH];
+    lpm_node_t *node;
+    lpm_root_t *r;
+    uint32_t pos;
+    int bit, l, i, n, depth = 0;
+
+    if (!lpm->root || plen > lpm_max_plen(lpm)) {
+        return (BAD);
+    }
+
+    /* Entries of the prefix go to the prefix that contains it */
+    if (plen <= LPM_ROOT_BITS) {
+        lpm_root_fill(lpm, a, plen, plen, plen, cover,
+                cover ? cover_plen : 0);
+        return (GOOD);
+    }
+
+    r = &lpm->root[(a[0] << 8) | a[1]];
+    node = r->child;
+    for (bit = LPM_ROOT_BITS; node && plen > bit + LPM_STRIDE;
+            bit += LPM_STRIDE) {
+        path[depth++] = node;
+        if (!(node->child_map & (1 << lpm_bits(a, bit)))) {
+            return (BAD);
+        }
+        node = lpm_node_child(lpm, node, lpm_bits(a, bit));
+    }
+    if (!node) {
+        return (BAD);
+    }
+
+    l = plen - bit;
+    pos = (1 << l) - 2 + (lpm_bits(a, bit) >> (LPM_STRIDE - l));
+    if (!(node->pref_map & (1 << pos))) {
+        return (BAD);
+    }
+    i = lpm_popcount(node->pref_map & ((1 << pos) - 1));
+    n = lpm_popcount(node->pref_map);
+    memmove(&node->data[i], &node->data[i + 1], (n - i - 1) * sizeof(void *));
+    node->pref_map &= ~(1 << pos);
+    if (n == 1) {
+        free(node->data);
+        node->data = NULL;
+    }
+    lpm->n_prefixes--;
+
+    /* Remove the nodes left empty, from the bottom up */
+    while (!node->pref_map && !node->child_map) {
+        if (depth == 0) {
+            free(r->child);
+            r->child = NULL;
+            lpm->n_nodes--;
+            break;
+        }
+        bit -= LPM_STRIDE;
+        node = path[--depth];
+        lpm_node_del_child(lpm, node, lpm_bits(a, bit));
+    }
+    return (GOOD);
+}
+
+void *
+lpm_lookup(lpm_t *lpm, ip_addr_t *addr)
+{
+    uint8_t *a = ip_addr_get_addr(addr);
+    lpm_root_t *r;
+    lpm_node_t *node;
+    uint32_t bits, match;
+    void *data;
+    int bit;
+
+    if (!lpm->root) {
+        return (NULL);
+    }
+    r = &lpm->root[(a[0] << 8) | a[1]];
+    data = r->data;
+    node = r->child;
+    for (bit = LPM_ROOT_BITS; node; bit += LPM_STRIDE) {
+        bits = lpm_bits(a, bit);
+        match = node->pref_map & lpm_match_mask[bits];
+        if (match) {
+            /* The longest match is the highest bit */
+            data = node->data[lpm_popcount(node->pref_map
+                    & ((1 << (31 - __builtin_clz(match))) - 1))];
+        }
+        if (!(node->child_map & (1 << bits))) {
+            break;
+        }
+        node = &node->children[lpm_popcount(node->child_map
+                & ((1 << bits) - 1))];
+    }
+    return (data);
+}
+
+/* Approximate bytes allocated by the index */
+size_t
+lpm_mem_size(lpm_t *lpm)
+{
+    return ((lpm->root ? LPM_ROOT_SIZE * (sizeof(lpm_root_t) + 1) : 0)
+            + lpm->n_nodes * sizeof(lpm_node_t)
+            + lpm->n_prefixes * sizeof(void *));
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
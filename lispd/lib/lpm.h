@@ -0,0 +1,81 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LPM_H_
+#define LPM_H_
+
+#include <stdint.h>
+
+#include "../liblisp/lisp_ip.h"
+
+/*
+ * Longest prefix match index of the IP prefixes of a mapping database.
+ *
+ * The first 16 bits of the address select an entry of a flat root table,
+ * which holds the longest prefix of up to 16 bits that contains it. Longer
+ * prefixes are kept below the entry in a tree bitmap of stride 4: each node
+ * has a bitmap of the prefixes of 1 to 4 more bits it stores and a bitmap of
+ * its children, and both the data and the children are packed in arrays
+ * indexed by the population count of the bitmaps. A lookup reads the root
+ * entry and then one small node per 4 bits, and the memory used grows with
+ * the number of prefixes, not with their length.
+ *
+ * The Patricia tree of the database is still the reference: the index is
+ * updated with it and only answers lookups.
+ */
+
+#define LPM_ROOT_BITS       16
+#define LPM_STRIDE          4
+
+typedef struct lpm_node {
+    uint32_t pref_map;          /* prefix of l bits, value v: bit 2^l - 2 + v */
+    uint16_t child_map;
+    struct lpm_node *children;
+    void **data;
+} lpm_node_t;
+
+typedef struct lpm_root {
+    void *data;                 /* longest prefix of up to 16 bits */
+    lpm_node_t *child;          /* longer prefixes */
+} lpm_root_t;
+
+typedef struct lpm {
+    int afi;
+    lpm_root_t *root;           /* allocated with the first prefix */
+    uint8_t *root_plen;         /* length of the prefix of each root entry */
+    uint32_t n_nodes;
+    uint32_t n_prefixes;        /* stored in the nodes */
+} lpm_t;
+
+lpm_t *lpm_new(int afi);
+void lpm_del(lpm_t *lpm);
+int lpm_add(lpm_t *lpm, ip_addr_t *addr, uint8_t plen, void *data);
+int lpm_remove(lpm_t *lpm, ip_addr_t *addr, uint8_t plen, void *cover,
+        uint8_t cover_plen);
+void *lpm_lookup(lpm_t *lpm, ip_addr_t *addr);
+size_t lpm_mem_size(lpm_t *lpm);
+
+#endif /* LPM_H_ */
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
@@ -34,6 +34,7 @@ mcache_entry_new()
 
     mce->active = NOT_ACTIVE;
     mce->timestamp = time(NULL);
+    mce->gen = gen_counter_new();
 
     return(mce);
 }
@@ -71,6 +72,8 @@ mcache_entry_del(mcache_entry_t *entry)
         entry->routing_inf_del(entry->routing_info);
     }
 
+    /* Invalidates the forwarding info of the data plane using the entry */
+    gen_counter_del(entry->gen);
     free(entry);
 }
 
@@ -84,6 +87,15 @@ mcache_has_locators(mcache_entry_t *m)
     }
 }
 
+/* Approximate bytes used by the entry */
+size_t
+mcache_entry_mem_size(mcache_entry_t *m)
+{
+    return (sizeof(mcache_entry_t) + sizeof(mapping_t) + MCE_MEM_OVERHEAD
+            + mapping_locator_count(m->mapping)
+                * (sizeof(locator_t) + sizeof(lisp_addr_t)));
+}
+
 
 void
 map_cache_entry_dump (mcache_entry_t *entry, int log_level)
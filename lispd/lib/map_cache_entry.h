@@ -20,7 +20,9 @@
 #ifndef MAP_CACHE_ENTRY_H_
 #define MAP_CACHE_ENTRY_H_
 
+#include "gen_counter.h"
 #include "timers.h"
+#include "../elibs/ovs/list.h"
 #include "../liblisp/lisp_mapping.h"
 
 /*
@@ -39,6 +41,10 @@ typedef enum mce_type {
 #define NOT_ACTIVE                      0
 #define ACTIVE                          1
 
+/* Memory of an entry not counted by mcache_entry_mem_size() from the sizes of
+ * its structures: nodes of the mapping db, timers and routing info */
+#define MCE_MEM_OVERHEAD                256
+
 typedef void (*routing_info_del_fct)(void *);
 
 typedef struct map_cache_entry_ {
@@ -53,6 +59,10 @@ typedef struct map_cache_entry_ {
     uint8_t active_witin_period;
     time_t timestamp;
 
+    /* Incremented each time the mapping or the state of its locators
+     * changes */
+    gen_counter_t *gen;
+
     /* Routing info */
     void *                  routing_info;
     routing_info_del_fct    routing_inf_del;
@@ -61,6 +71,12 @@ typedef struct map_cache_entry_ {
 
     /* EID that requested the mapping. Helps with timers */
     lisp_addr_t *requester;
+
+    /* Recency of the dynamic entries in the map-cache */
+    struct ovs_list lru_elt;
+    uint8_t in_lru;
+    uint8_t lru_low;        /* in the list of entries evicted first */
+    size_t mem_size;        /* accounted in the map-cache */
 } mcache_entry_t;
 
 mcache_entry_t *mcache_entry_new();
@@ -70,6 +86,7 @@ void mcache_entry_init_static(mcache_entry_t *, mapping_t *);
 
 void mcache_entry_del(mcache_entry_t *entry);
 void map_cache_entry_dump(mcache_entry_t *entry, int log_level);
+size_t mcache_entry_mem_size(mcache_entry_t *entry);
 
 static inline mapping_t *mcache_entry_mapping(mcache_entry_t*);
 static inline void mcache_entry_set_mapping(mcache_entry_t* , mapping_t *);
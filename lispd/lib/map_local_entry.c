@@ -65,6 +65,7 @@ map_local_entry_new()
 {
 	map_local_entry_t *mle;
 	mle = xzalloc(sizeof(map_local_entry_t));
+	mle->gen = gen_counter_new();
 
 	return (mle);
 }
@@ -80,6 +81,7 @@ map_local_entry_new_init(mapping_t *map)
         return (NULL);
     }
     mle->mapping = map;
+    mle->gen = gen_counter_new();
 
     return (mle);
 }
@@ -101,6 +103,7 @@ map_local_entry_del(map_local_entry_t *mle)
 	if (mle->fwd_info != NULL){
 	    mle->fwd_inf_del(mle->fwd_info);
 	}
+	gen_counter_del(mle->gen);
 	free(mle);
 }
 
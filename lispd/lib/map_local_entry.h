@@ -20,6 +20,7 @@
 #ifndef MAP_LOCAL_ENTRY_H_
 #define MAP_LOCAL_ENTRY_H_
 
+#include "gen_counter.h"
 #include "../liblisp/lisp_mapping.h"
 
 typedef void (*fwd_info_del_fct)(void *);
@@ -28,6 +29,9 @@ typedef struct map_local_entry_ {
     mapping_t *         mapping;
     void *              fwd_info;
     fwd_info_del_fct    fwd_inf_del;
+    /* Incremented each time the mapping or the state of its locators
+     * changes */
+    gen_counter_t *     gen;
 } map_local_entry_t;
 
 map_local_entry_t *map_local_entry_new();
@@ -71,6 +71,22 @@ get_ip_pt_from_afi(mdb_t *db, uint16_t afi)
     return (NULL);
 }
 
+static lpm_t *
+get_ip_lpm_from_afi(mdb_t *db, uint16_t afi)
+{
+    switch (afi) {
+    case AF_INET:
+        return (db->AF4_ip_lpm);
+    case AF_INET6:
+        return (db->AF6_ip_lpm);
+    default:
+        LMLOG(LDBG_1, "get_ip_lpm_from_afi: AFI %u not recognized!", afi);
+        break;
+    }
+
+    return (NULL);
+}
+
 static patricia_tree_t *
 get_mc_pt_from_afi(mdb_t *db, uint16_t afi)
 {
@@ -180,19 +196,73 @@ _get_grp_pt_for_mc_addr(patricia_tree_t *strie, lcaf_addr_t *mcaddr,
 static int
 _add_ippref_entry(mdb_t *db, void *entry, ip_prefix_t *ippref)
 {
-    if (pt_add_ippref(get_ip_pt_from_afi(db, ip_prefix_afi(ippref)), ippref,
-            entry) != GOOD) {
+    patricia_tree_t *pt = get_ip_pt_from_afi(db, ip_prefix_afi(ippref));
+    patricia_node_t *node;
+    int exists;
+
+    node = pt_find_ip_node_exact(pt, ip_prefix_addr(ippref),
+            ip_prefix_get_plen(ippref));
+    exists = node && node->data;
+
+    if (pt_add_ippref(pt, ippref, entry) != GOOD) {
         LMLOG(LDBG_3, "_add_ippref_entry: Attempting to insert (%s) in the "
                 "map-cache but couldn't add the entry to the pt!",
                 ip_prefix_to_char(ippref));
         return (BAD);
     }
 
+    /* The data of an existing prefix is not changed */
+    if (!exists && lpm_add(get_ip_lpm_from_afi(db, ip_prefix_afi(ippref)),
+            ip_prefix_addr(ippref), ip_prefix_get_plen(ippref), entry) != GOOD) {
+        LMLOG(LDBG_1, "_add_ippref_entry: couldn't index %s. Removed",
+                ip_prefix_to_char(ippref));
+        pt_remove_ippref(pt, ippref);
+        return (BAD);
+    }
+
     LMLOG(LDBG_3, "_add_ippref_entry: Added map cache data for %s",
             ip_prefix_to_char(ippref));
     return (GOOD);
 }
 
+/* Node of the longest prefix that contains addr/plen, other than itself */
+static patricia_node_t *
+_find_ip_cover_node(patricia_tree_t *pt, ip_addr_t *addr, uint8_t plen)
+{
+    patricia_node_t *cover = NULL;
+    prefix_t *prefix;
+
+    if (pt && plen > 0) {
+        prefix = pt_make_ip_prefix(addr, plen - 1);
+        cover = prefix ? patricia_search_best(pt, prefix) : NULL;
+        Deref_Prefix(prefix);
+    }
+    return (cover);
+}
+
+static void *
+_del_ippref_entry(mdb_t *db, ip_prefix_t *ippref)
+{
+    patricia_tree_t *pt = get_ip_pt_from_afi(db, ip_prefix_afi(ippref));
+    patricia_node_t *cover;
+    uint8_t plen = ip_prefix_get_plen(ippref);
+    void *data;
+
+    data = pt_remove_ippref(pt, ippref);
+    if (!data) {
+        return (NULL);
+    }
+
+    /* The entries of the prefix in the index go to the longest prefix that
+     * contains it */
+    cover = _find_ip_cover_node(pt, ip_prefix_addr(ippref), plen);
+    lpm_remove(get_ip_lpm_from_afi(db, ip_prefix_afi(ippref)),
+            ip_prefix_addr(ippref), plen, cover ? cover->data : NULL,
+            cover ? cover->prefix->bitlen : 0);
+
+    return (data);
+}
+
 static int
 _add_mc_entry(mdb_t *db, void *entry, lcaf_addr_t *mcaddr)
 {
@@ -308,6 +378,9 @@ mdb_new()
     db->AF4_mc_db = New_Patricia(sizeof(struct in_addr) * 8);
     db->AF6_mc_db = New_Patricia(sizeof(struct in6_addr) * 8);
 
+    db->AF4_ip_lpm = lpm_new(AF_INET);
+    db->AF6_ip_lpm = lpm_new(AF_INET6);
+
     if (!db->AF4_ip_db->head->data || !db->AF6_ip_db->head->data
         || !db->AF4_mc_db || !db->AF6_mc_db) {
         LMLOG(LCRIT, "mdb_init: Unable to allocate memory for mdb");
@@ -329,6 +402,9 @@ mdb_del(mdb_t *db, mdb_del_fct del_fct)
     Destroy_Patricia(db->AF6_ip_db->head->data, del_fct);
     Destroy_Patricia(db->AF6_ip_db, NULL);
 
+    lpm_del(db->AF4_ip_lpm);
+    lpm_del(db->AF6_ip_lpm);
+
     if (db->AF4_mc_db->head) {
         PATRICIA_WALK(db->AF4_mc_db->head, node) {
             Destroy_Patricia(node->data, del_fct);
@@ -390,13 +466,11 @@ mdb_remove_entry(mdb_t *db, lisp_addr_t *laddr)
         taddr = lisp_addr_clone(laddr);
         lisp_addr_ip_to_ippref(taddr);
         ippref = lisp_addr_get_ippref(taddr);
-        ret = pt_remove_ippref(get_ip_pt_from_afi(db, ip_prefix_afi(ippref)), ippref);
+        ret = _del_ippref_entry(db, ippref);
         lisp_addr_del(taddr);
         break;
     case LM_AFI_IPPREF:
-        ippref = lisp_addr_get_ippref(laddr);
-        ret = pt_remove_ippref(
-                get_ip_pt_from_afi(db, ip_prefix_afi(ippref)), ippref);
+        ret = _del_ippref_entry(db, lisp_addr_get_ippref(laddr));
         break;
     case LM_AFI_LCAF:
         ret = _del_lcaf_entry(db, lisp_addr_get_lcaf(laddr));
@@ -417,6 +491,16 @@ void *
 mdb_lookup_entry(mdb_t *db, lisp_addr_t *laddr)
 {
     patricia_node_t *node;
+    lpm_t *lpm;
+
+    switch (lisp_addr_lafi(laddr)) {
+    case LM_AFI_IP:
+    case LM_AFI_IPPREF:
+        lpm = get_ip_lpm_from_afi(db, lisp_addr_ip_afi(laddr));
+        return (lpm ? lpm_lookup(lpm, lisp_addr_ip_get_addr(laddr)) : NULL);
+    default:
+        break;
+    }
 
     node = _find_node(db, laddr, NOT_EXACT);
     if (node)
@@ -436,6 +520,56 @@ mdb_lookup_entry_exact(mdb_t *db, lisp_addr_t *laddr)
         return(NULL);
 }
 
+/*
+ * Entry of the longest IP prefix that contains 'laddr', other than the one of
+ * 'laddr' itself. Only IP addresses and prefixes are supported
+ */
+void *
+mdb_lookup_less_specific(mdb_t *db, lisp_addr_t *laddr)
+{
+    patricia_node_t *node;
+
+    if (lisp_addr_lafi(laddr) != LM_AFI_IP
+            && lisp_addr_lafi(laddr) != LM_AFI_IPPREF) {
+        return (NULL);
+    }
+
+    node = _find_ip_cover_node(get_ip_pt_from_afi(db, lisp_addr_ip_afi(laddr)),
+            lisp_addr_ip_get_addr(laddr), lisp_addr_ip_get_plen(laddr));
+    if (node)
+        return(node->data);
+    else
+        return(NULL);
+}
+
+/*
+ * Entries of the IP prefixes contained in 'laddr', not including the one of
+ * 'laddr' itself. Only IP prefixes are supported
+ */
+glist_t *
+mdb_lookup_more_specifics(mdb_t *db, lisp_addr_t *laddr)
+{
+    glist_t *entries = glist_new();
+    patricia_node_t *top, *node;
+
+    if (lisp_addr_lafi(laddr) != LM_AFI_IPPREF) {
+        return (entries);
+    }
+
+    top = _find_ip_node(db, laddr, EXACT);
+    if (!top) {
+        return (entries);
+    }
+
+    PATRICIA_WALK(top, node) {
+        if (node != top && node->data) {
+            glist_add(node->data, entries);
+        }
+    } PATRICIA_WALK_END;
+
+    return (entries);
+}
+
 inline int
 mdb_n_entries(mdb_t *mdb) {
     return(mdb->n_entries);
@@ -28,19 +28,23 @@
 
 #include "../elibs/patricia/patricia.h"
 #include "../liblisp/lisp_address.h"
+#include "lpm.h"
 
 #define NOT_EXACT 0
 #define EXACT 1
 
 /*
  *  Patricia tree based databases
- *  for IP/IP-prefix and multicast addresses
+ *  for IP/IP-prefix and multicast addresses. Lookups of IP addresses
+ *  use the compiled index of the IP prefixes
  */
 typedef struct {
     patricia_tree_t *AF4_ip_db;
     patricia_tree_t *AF6_ip_db;
     patricia_tree_t *AF4_mc_db;
     patricia_tree_t *AF6_mc_db;
+    lpm_t *AF4_ip_lpm;
+    lpm_t *AF6_ip_lpm;
     int n_entries;
 } mdb_t;
 
@@ -52,6 +56,8 @@ int mdb_add_entry(mdb_t *db, lisp_addr_t *addr, void *data);
 void *mdb_remove_entry(mdb_t *db, lisp_addr_t *laddr);
 void *mdb_lookup_entry(mdb_t *db, lisp_addr_t *laddr);
 void *mdb_lookup_entry_exact(mdb_t *db, lisp_addr_t *laddr);
+void *mdb_lookup_less_specific(mdb_t *db, lisp_addr_t *laddr);
+glist_t *mdb_lookup_more_specifics(mdb_t *db, lisp_addr_t *laddr);
 inline int mdb_n_entries(mdb_t *);
 
 patricia_tree_t *_get_local_db_for_lcaf_addr(mdb_t *db, lcaf_addr_t *lcaf);
@@ -0,0 +1,414 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "mux_classifier.h"
+#include "simplemux.h"
+#include "util.h"
+#include "lmlog.h"
+
+
+static int
+mux_key_init(flow_key_t *key, ip_addr_t *a, ip_addr_t *b)
+{
+    memset(key, 0, sizeof(flow_key_t));
+    key->afi = ip_addr_afi(a);
+    if (key->afi != AF_INET && key->afi != AF_INET6) {
+        return (BAD);
+    }
+    ip_addr_copy_to(key->src, a);
+    if (b) {
+        if (ip_addr_afi(b) != key->afi) {
+            return (BAD);
+        }
+        ip_addr_copy_to(key->dst, b);
+    }
+    return (GOOD);
+}
+
+/* Keep the first rule inserted with a key */
+static void
+mux_key_add(khash_t(mux_key) *h, ip_addr_t *a, ip_addr_t *b, int rule)
+{
+    flow_key_t key;
+    khiter_t k;
+    int ret;
+
+    if (mux_key_init(&key, a, b) != GOOD) {
+        return;
+    }
+    k = kh_put(mux_key, h, key, &ret);
+    if (ret != 0) {
+        kh_value(h, k) = rule;
+    }
+}
+
+static int
+mux_key_find(khash_t(mux_key) *h, ip_addr_t *a, ip_addr_t *b)
+{
+    flow_key_t key;
+    khiter_t k;
+
+    if (mux_key_init(&key, a, b) != GOOD) {
+        return (-1);
+    }
+    k = kh_get(mux_key, h, key);
+    if (k == kh_end(h)) {
+        return (-1);
+    }
+    return (kh_value(h, k));
+}
+
+static void
+mux_port_add(khash_t(mux_port) *h, uint32_t port, int rule)
+{
+    khiter_t k;
+    int ret;
+
+    k = kh_put(mux_port, h, port, &ret);
+    if (ret != 0) {
+        kh_value(h, k) = rule;
+    }
+}
+
+static int
+mux_port_find(khash_t(mux_port) *h, uint32_t port)
+{
+    khiter_t k;
+
+    k = kh_get(mux_port, h, port);
+    if (k == kh_end(h)) {
+        return (-1);
+    }
+    return (kh_value(h, k));
+}
+
+/* First of two matching rules. -1 means no match */
+static inline int
+mux_first(int r1, int r2)
+{
+    if (r1 < 0) {
+        return (r2);
+    }
+    if (r2 < 0 || r1 < r2) {
+        return (r1);
+    }
+    return (r2);
+}
+
+static int
+mux_afi_pos(int afi)
+{
+    switch (afi) {
+    case AF_INET:
+        return (0);
+    case AF_INET6:
+        return (1);
+    default:
+        return (-1);
+    }
+}
+
+/* A net is configured when its mask is not 0 and fits its address family */
+static int
+mux_net_is_set(ip_addr_t *net, int plen)
+{
+    return (mux_afi_pos(ip_addr_afi(net)) >= 0 && plen > 0
+            && plen <= ip_addr_afi_to_default_mask(net));
+}
+
+static int
+mux_net_match(ip_addr_t *net, int plen, ip_addr_t *addr)
+{
+    uint8_t *n, *a;
+    int bytes, bits;
+
+    if (ip_addr_afi(net) != ip_addr_afi(addr)) {
+        return (FALSE);
+    }
+    n = ip_addr_get_addr(net);
+    a = ip_addr_get_addr(addr);
+    bytes = plen / 8;
+    bits = plen % 8;
+    if (memcmp(n, a, bytes) != 0) {
+        return (FALSE);
+    }
+    if (bits && ((n[bytes] ^ a[bytes]) & (0xff << (8 - bits)))) {
+        return (FALSE);
+    }
+    return (TRUE);
+}
+
+static void
+mux_net_add(patricia_tree_t *pt, ip_addr_t *net, int plen, int rule)
+{
+    patricia_node_t *node;
+    prefix_t *prefix;
+    mux_rule_set_t *set;
+
+    prefix = New_Prefix(ip_addr_afi(net), ip_addr_get_addr(net), plen);
+    node = patricia_lookup(pt, prefix);
+    Deref_Prefix(prefix);
+    if (!node) {
+        LMLOG(LWRN, "mux_net_add: Couldn't add net %s/%d", ip_addr_to_char(net),
+                plen);
+        return;
+    }
+
+    set = node->data;
+    if (!set) {
+        set = xzalloc(sizeof(mux_rule_set_t));
+        node->data = set;
+    }
+    set->rules = xrealloc(set->rules, (set->n + 1) * sizeof(int));
+    set->rules[set->n++] = rule;
+}
+
+static void
+mux_rule_set_del(mux_rule_set_t *set)
+{
+    free(set->rules);
+    free(set);
+}
+
+/* Most specific net containing addr. The rest of nets containing it are
+ * its ancestors in the trie */
+static patricia_node_t *
+mux_net_find(patricia_tree_t **pts, ip_addr_t *addr)
+{
+    prefix_t prefix;
+    int pos;
+
+    pos = mux_afi_pos(ip_addr_afi(addr));
+    if (pos < 0 || !pts[pos]->head) {
+        return (NULL);
+    }
+    prefix.family = ip_addr_afi(addr);
+    prefix.bitlen = ip_addr_afi_to_default_mask(addr);
+    prefix.ref_count = 0;
+    ip_addr_copy_to(&prefix.add, addr);
+    return (patricia_search_best(pts[pos], &prefix));
+}
+
+/* First rule whose source net contains src and whose destination net
+ * contains dst */
+static int
+mux_nets_find_both(mux_classifier_t *mc, ip_addr_t *src, ip_addr_t *dst)
+{
+    patricia_node_t *node;
+    mux_rule_set_t *set;
+    mux_tuple_t *mt;
+    int i, r, first = -1;
+
+    node = mux_net_find(mc->src_nets, src);
+    for (; node; node = node->parent) {
+        if (!node->prefix || !(set = node->data)) {
+            continue;
+        }
+        for (i = 0; i < set->n; i++) {
+            r = set->rules[i];
+            if (first >= 0 && r >= first) {
+                break;
+            }
+            mt = &mc->rules[r].mux_tuple;
+            if (mux_net_is_set(&mt->dst_net, mt->dst_mask)
+                    && mux_net_match(&mt->dst_net, mt->dst_mask, dst)) {
+                first = r;
+                break;
+            }
+        }
+    }
+    return (first);
+}
+
+/* First rule with a net (source or destination) containing addr */
+static int
+mux_nets_find_any(patricia_tree_t **pts, ip_addr_t *addr)
+{
+    patricia_node_t *node;
+    mux_rule_set_t *set;
+    int first = -1;
+
+    node = mux_net_find(pts, addr);
+    for (; node; node = node->parent) {
+        if (node->prefix && (set = node->data)) {
+            first = mux_first(first, set->rules[0]);
+        }
+    }
+    return (first);
+}
+
+mux_classifier_t *
+mux_classifier_new(data_simplemux_t *rules, int nrules)
+{
+    mux_classifier_t *mc;
+    mux_tuple_t *mt;
+    int i;
+
+    mc = xzalloc(sizeof(mux_classifier_t));
+    mc->hosts = kh_init(mux_key);
+    mc->src_hosts = kh_init(mux_key);
+    mc->dst_hosts = kh_init(mux_key);
+    mc->rlocs = kh_init(mux_key);
+    mc->srlocs = kh_init(mux_key);
+    mc->drlocs = kh_init(mux_key);
+    mc->ports = kh_init(mux_port);
+    mc->src_ports = kh_init(mux_port);
+    mc->dst_ports = kh_init(mux_port);
+    for (i = 0; i < 2; i++) {
+        mc->src_nets[i] = New_Patricia(i == 0 ? 32 : 128);
+        mc->dst_nets[i] = New_Patricia(i == 0 ? 32 : 128);
+    }
+    mc->rules = rules;
+    mc->nrules = nrules;
+
+    /* Rules are added in order so the first rule of each key is kept */
+    for (i = 0; i < nrules; i++) {
+        mt = &rules[i].mux_tuple;
+
+        mux_key_add(mc->hosts, &mt->src_addr, &mt->dst_addr, i);
+        mux_key_add(mc->src_hosts, &mt->src_addr, NULL, i);
+        mux_key_add(mc->dst_hosts, &mt->dst_addr, NULL, i);
+
+        if (mux_net_is_set(&mt->src_net, mt->src_mask)) {
+            mux_net_add(mc->src_nets[mux_afi_pos(ip_addr_afi(&mt->src_net))],
+                    &mt->src_net, mt->src_mask, i);
+        }
+        if (mux_net_is_set(&mt->dst_net, mt->dst_mask)) {
+            mux_net_add(mc->dst_nets[mux_afi_pos(ip_addr_afi(&mt->dst_net))],
+                    &mt->dst_net, mt->dst_mask, i);
+        }
+
+        mux_key_add(mc->rlocs, &mt->srloc.ip, &mt->drloc.ip, i);
+        mux_key_add(mc->srlocs, &mt->srloc.ip, NULL, i);
+        mux_key_add(mc->drlocs, &mt->drloc.ip, NULL, i);
+
+        if (rules[i].port_src >= 0 && rules[i].port_src <= 0xffff
+                && rules[i].port_dst >= 0 && rules[i].port_dst <= 0xffff) {
+            mux_port_add(mc->ports,
+                    rules[i].port_src + ((uint32_t)rules[i].port_dst << 16), i);
+        }
+        if (rules[i].port_src >= 0 && rules[i].port_src <= 0xffff) {
+            mux_port_add(mc->src_ports, rules[i].port_src, i);
+        }
+        if (rules[i].port_dst >= 0 && rules[i].port_dst <= 0xffff) {
+            mux_port_add(mc->dst_ports, rules[i].port_dst, i);
+        }
+    }
+
+    LMLOG(LDBG_1, "Simplemux classifier built with %d rules", nrules);
+    return (mc);
+}
+
+void
+mux_classifier_del(mux_classifier_t *mc)
+{
+    int i;
+
+    if (!mc) {
+        return;
+    }
+    kh_destroy(mux_key, mc->hosts);
+    kh_destroy(mux_key, mc->src_hosts);
+    kh_destroy(mux_key, mc->dst_hosts);
+    kh_destroy(mux_key, mc->rlocs);
+    kh_destroy(mux_key, mc->srlocs);
+    kh_destroy(mux_key, mc->drlocs);
+    kh_destroy(mux_port, mc->ports);
+    kh_destroy(mux_port, mc->src_ports);
+    kh_destroy(mux_port, mc->dst_ports);
+    for (i = 0; i < 2; i++) {
+        Destroy_Patricia(mc->src_nets[i], (void_fn_t)mux_rule_set_del);
+        Destroy_Patricia(mc->dst_nets[i], (void_fn_t)mux_rule_set_del);
+    }
+    free(mc);
+}
+
+/* Simplemux rule to be used with a packet of the flow tpl forwarded with
+ * fe. NULL if no rule matches */
+data_simplemux_t *
+mux_classifier_lookup(mux_classifier_t *mc, packet_tuple_t *tpl,
+        fwd_entry_t *fe)
+{
+    ip_addr_t *src = lisp_addr_ip(&tpl->src_addr);
+    ip_addr_t *dst = lisp_addr_ip(&tpl->dst_addr);
+    int r;
+
+    /* Source AND destination host */
+    r = mux_key_find(mc->hosts, src, dst);
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source OR destination host */
+    r = mux_first(mux_key_find(mc->src_hosts, src, NULL),
+            mux_key_find(mc->dst_hosts, dst, NULL));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source AND destination net */
+    r = mux_nets_find_both(mc, src, dst);
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source OR destination net */
+    r = mux_first(mux_nets_find_any(mc->src_nets, src),
+            mux_nets_find_any(mc->dst_nets, dst));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source AND destination RLOC */
+    r = mux_key_find(mc->rlocs, lisp_addr_ip(fe->srloc),
+            lisp_addr_ip(fe->drloc));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source OR destination RLOC */
+    r = mux_first(mux_key_find(mc->srlocs, lisp_addr_ip(fe->srloc), NULL),
+            mux_key_find(mc->drlocs, lisp_addr_ip(fe->drloc), NULL));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source AND destination port */
+    r = mux_port_find(mc->ports,
+            tpl->src_port + ((uint32_t)tpl->dst_port << 16));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    /* Source OR destination port */
+    r = mux_first(mux_port_find(mc->src_ports, tpl->src_port),
+            mux_port_find(mc->dst_ports, tpl->dst_port));
+    if (r >= 0) {
+        return (&mc->rules[r]);
+    }
+
+    return (NULL);
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
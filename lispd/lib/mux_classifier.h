@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef MUX_CLASSIFIER_H_
+#define MUX_CLASSIFIER_H_
+
+#include "../elibs/khash/khash.h"
+#include "../elibs/patricia/patricia.h"
+#include "packets.h"
+#include "sockets.h"
+
+struct config_simplemux;
+
+/* Addresses (or pairs of addresses) are keyed with the fixed size key of
+ * the flow table: src and dst words plus the afi */
+static inline khint_t
+mux_key_hash(flow_key_t key)
+{
+    return (flow_key_hash(&key));
+}
+#define mux_key_equal(a, b) (memcmp(&(a), &(b), sizeof(flow_key_t)) == 0)
+
+/* Values are the position of the first rule with the key */
+KHASH_INIT(mux_key, flow_key_t, int, 1, mux_key_hash, mux_key_equal)
+KHASH_INIT(mux_port, uint32_t, int, 1, kh_int_hash_func, kh_int_hash_equal)
+
+/* Rules of a prefix of the source or destination tries, in configuration
+ * order */
+typedef struct mux_rule_set {
+    int *rules;
+    int n;
+} mux_rule_set_t;
+
+/*
+ * Simplemux rules compiled into hash tables and patricia tries. Rules are
+ * matched with the precedence of the configuration: both hosts, any host,
+ * both nets, any net, both RLOCs, any RLOC, both ports and any port. Within
+ * each step the first configured rule wins. A lookup does a constant number
+ * of hash lookups plus two longest prefix walks.
+ */
+typedef struct mux_classifier {
+    khash_t(mux_key) *hosts;        /* src + dst */
+    khash_t(mux_key) *src_hosts;
+    khash_t(mux_key) *dst_hosts;
+    patricia_tree_t *src_nets[2];   /* IPv4, IPv6. Data is a mux_rule_set_t */
+    patricia_tree_t *dst_nets[2];
+    khash_t(mux_key) *rlocs;        /* srloc + drloc */
+    khash_t(mux_key) *srlocs;
+    khash_t(mux_key) *drlocs;
+    khash_t(mux_port) *ports;       /* src_port + (dst_port << 16) */
+    khash_t(mux_port) *src_ports;
+    khash_t(mux_port) *dst_ports;
+
+    struct config_simplemux *rules;
+    int nrules;
+} mux_classifier_t;
+
+mux_classifier_t *mux_classifier_new(struct config_simplemux *rules,
+        int nrules);
+void mux_classifier_del(mux_classifier_t *mc);
+struct config_simplemux *mux_classifier_lookup(mux_classifier_t *mc,
+        packet_tuple_t *tpl, fwd_entry_t *fe);
+
+#endif /* MUX_CLASSIFIER_H_ */
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
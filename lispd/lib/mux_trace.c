@@ -0,0 +1,134 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mux_trace.h"
+#include "defs.h"
+#include "lmlog.h"
+
+static mux_trace_hdr_t *trace_hdr = NULL;
+static mux_trace_rec_t *trace_recs = NULL;
+static size_t trace_len = 0;
+
+
+/* Create the trace file and map it. Without a trace, mux_trace() does
+ * nothing */
+int
+mux_trace_open(const char *path, uint32_t nrecs)
+{
+    void *map;
+    size_t len;
+    int fd;
+
+    mux_trace_close();
+
+    len = MUX_TRACE_HDR_SIZE + (size_t)nrecs * sizeof(mux_trace_rec_t);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LMLOG(LERR, "mux_trace_open: cannot open %s: %s", path,
+                strerror(errno));
+        return (BAD);
+    }
+    if (ftruncate(fd, len) < 0) {
+        LMLOG(LERR, "mux_trace_open: cannot size %s: %s", path,
+                strerror(errno));
+        close(fd);
+        return (BAD);
+    }
+
+    /* The pages are faulted in now, not when the first packets arrive */
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LMLOG(LERR, "mux_trace_open: cannot map %s: %s", path,
+                strerror(errno));
+        return (BAD);
+    }
+
+    trace_hdr = map;
+    trace_recs = (mux_trace_rec_t *)((uint8_t *)map + MUX_TRACE_HDR_SIZE);
+    trace_len = len;
+
+    memcpy(trace_hdr->magic, MUX_TRACE_MAGIC, sizeof(trace_hdr->magic));
+    trace_hdr->version = MUX_TRACE_VERSION;
+    trace_hdr->rec_size = sizeof(mux_trace_rec_t);
+    trace_hdr->nrecs = nrecs;
+    trace_hdr->head = 0;
+
+    LMLOG(LDBG_1, "Simplemux events traced in %s (%u records)", path, nrecs);
+    return (GOOD);
+}
+
+void
+mux_trace_close()
+{
+    if (trace_hdr == NULL) {
+        return;
+    }
+    msync(trace_hdr, trace_len, MS_ASYNC);
+    munmap(trace_hdr, trace_len);
+    trace_hdr = NULL;
+    trace_recs = NULL;
+    trace_len = 0;
+}
+
+void
+mux_trace(uint8_t event, uint8_t reason, uint64_t ts, uint32_t size,
+        uint64_t counter, uint16_t npkts, uint32_t tunnel, ip_addr_t *rloc)
+{
+    mux_trace_rec_t *rec;
+    uint64_t head;
+
+    if (trace_hdr == NULL) {
+        return;
+    }
+
+    head = trace_hdr->head;
+    rec = &trace_recs[head % trace_hdr->nrecs];
+    rec->ts = ts;
+    rec->counter = counter;
+    rec->size = size;
+    rec->tunnel = tunnel;
+    rec->npkts = npkts;
+    rec->event = event;
+    rec->reason = reason;
+    if (rloc != NULL) {
+        rec->afi = ip_addr_afi(rloc);
+        ip_addr_copy_to(rec->rloc, rloc);
+    } else {
+        rec->afi = 0;
+    }
+
+    /* A reader of a live trace only looks at the records before head */
+    __sync_synchronize();
+    trace_hdr->head = head + 1;
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
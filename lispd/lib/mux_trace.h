@@ -0,0 +1,104 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef MUX_TRACE_H_
+#define MUX_TRACE_H_
+
+#include <stdint.h>
+#include "../liblisp/lisp_ip.h"
+
+/*
+ * Event trace of simplemux. Events are written as fixed size records into a
+ * ring mapped from a file, so tracing never blocks the data path: the kernel
+ * writes the pages back on its own. When the ring is full the oldest records
+ * are overwritten. tools/mux_trace_decode converts a trace file into the tab
+ * separated lines of the old simplemux log.
+ */
+
+#define MUX_TRACE_MAGIC         "SMXTRACE"
+#define MUX_TRACE_VERSION       1
+#define MUX_TRACE_HDR_SIZE      64      /* records start at this offset */
+#define MUX_TRACE_NRECS         262144  /* 12 MB of records */
+#define MUX_TRACE_NO_TUNNEL     0xFFFFFFFF
+
+typedef enum mux_trace_ev {
+    MUX_EV_REC_NATIVE = 1,      /* packet read from the tun */
+    MUX_EV_COMPR_FAILED,        /* ROHC failed, the native packet is sent */
+    MUX_EV_SENT_MUXED,          /* bundle sent. reason: MUX_TRIG_* mask */
+    MUX_EV_DEMUX_BAD_LENGTH,    /* separator beyond the end of the bundle */
+    MUX_EV_DROP_NO_ROHC,        /* ROHC packet received without ROHC mode */
+    MUX_EV_REC_ROHC_FEEDBACK,   /* nothing decompressed */
+    MUX_EV_DECOMP_FAILED,       /* reason: MUX_DECOMP_* */
+    MUX_EV_SENT_DEMUXED,        /* packet written to the tun */
+    MUX_EV_DROP_BULK_FULL       /* queue of the bulk class full */
+} mux_trace_ev_e;
+
+/* What triggered the sending of a bundle */
+#define MUX_TRIG_NUMPACKET      0x01
+#define MUX_TRIG_SIZE           0x02
+#define MUX_TRIG_TIMEOUT        0x04
+#define MUX_TRIG_MTU            0x08
+#define MUX_TRIG_PERIOD         0x10
+#define MUX_TRIG_BULK           0x20    /* threshold or period of the bulk class */
+
+typedef enum mux_trace_decomp {
+    MUX_DECOMP_NO_CONTEXT = 0,
+    MUX_DECOMP_OUTPUT_TOO_SMALL,
+    MUX_DECOMP_MALFORMED,
+    MUX_DECOMP_BAD_CRC,
+    MUX_DECOMP_OTHER
+} mux_trace_decomp_e;
+
+typedef struct mux_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t nrecs;
+    uint32_t pad;
+    /* records written since the trace was created. The last one is at
+     * position (head - 1) % nrecs */
+    volatile uint64_t head;
+} mux_trace_hdr_t;
+
+typedef struct mux_trace_rec {
+    uint64_t ts;            /* microseconds since the epoch */
+    uint64_t counter;       /* packets read from the tun or from the net */
+    uint32_t size;          /* bytes */
+    uint32_t tunnel;        /* position of the rule, or MUX_TRACE_NO_TUNNEL */
+    uint16_t npkts;         /* packets in the bundle */
+    uint8_t event;          /* mux_trace_ev_e */
+    uint8_t reason;         /* MUX_TRIG_* mask or mux_trace_decomp_e */
+    uint8_t afi;            /* of rloc: AF_INET, AF_INET6 or 0 */
+    uint8_t pad[3];
+    uint8_t rloc[16];       /* remote RLOC of the tunnel */
+} mux_trace_rec_t;
+
+int mux_trace_open(const char *path, uint32_t nrecs);
+void mux_trace_close();
+void mux_trace(uint8_t event, uint8_t reason, uint64_t ts, uint32_t size,
+        uint64_t counter, uint16_t npkts, uint32_t tunnel, ip_addr_t *rloc);
+
+#endif /* MUX_TRACE_H_ */
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
@@ -40,12 +40,11 @@
 
 uint16_t ip_id = 0;
 
-/* Returns IP ID for the packet */
+/* Returns IP ID for the packet. Shared by the data plane worker threads */
 static inline uint16_t
 get_IP_ID()
 {
-    ip_id++;
-    return (ip_id);
+    return (__sync_add_and_fetch(&ip_id, 1));
 }
 
 
@@ -177,9 +176,9 @@ pkt_push_ip(lbuf_t *b, ip_addr_t *src, ip_addr_t *dst, int proto)
     return(iph);
 }
 
-int
-pkt_push_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
-        ip_addr_t *dip)
+static int
+_pkt_push_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
+        ip_addr_t *dip, int ipv4_udp_sum)
 {
     uint16_t udpsum;
     struct udphdr *uh;
@@ -198,6 +197,10 @@ pkt_push_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
 
     lbuf_reset_ip(b);
 
+    if (ip_addr_afi(sip) == AF_INET && !ipv4_udp_sum) {
+        return(GOOD);
+    }
+
     uh = lbuf_udp(b);
     udpsum = udp_checksum(uh, ntohs(uh->len), lbuf_ip(b), ip_addr_afi(sip));
     if (udpsum == -1) {
@@ -208,6 +211,152 @@ pkt_push_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
     return(GOOD);
 }
 
+int
+pkt_push_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
+        ip_addr_t *dip)
+{
+    return(_pkt_push_udp_and_ip(b, sp, dp, sip, dip, TRUE));
+}
+
+/* Same as pkt_push_udp_and_ip but the UDP checksum is set to zero with IPv4,
+ * as in the packets built with a template (RFC 6830 5.3) */
+int
+pkt_push_tunnel_udp_and_ip(lbuf_t *b, uint16_t sp, uint16_t dp, ip_addr_t *sip,
+        ip_addr_t *dip)
+{
+    return(_pkt_push_udp_and_ip(b, sp, dp, sip, dip, FALSE));
+}
+
+/* Build the template of the headers of the packets sent from 'sip':'sp' to
+ * 'dip':'dp'. The fields that change per packet are left to zero. The IPv4
+ * checksum of a packet is obtained by updating the one of the template with
+ * the words that differ (RFC 1624) */
+int
+pkt_hdr_tmpl_init(pkt_hdr_tmpl_t *tmpl, ip_addr_t *sip, ip_addr_t *dip,
+        uint16_t sp, uint16_t dp, void *tun_hdr, int tun_hdr_len)
+{
+    struct ip *iph;
+    struct ip6_hdr *ip6h;
+    struct udphdr *uh;
+    uint16_t *w;
+    int i;
+
+    memset(tmpl, 0, sizeof(pkt_hdr_tmpl_t));
+    if (ip_addr_afi(sip) != ip_addr_afi(dip)
+            || tun_hdr_len > MAX_TUNNEL_HDR_LEN || tun_hdr_len % 2 != 0) {
+        return (BAD);
+    }
+
+    switch (ip_addr_afi(sip)) {
+    case AF_INET:
+        iph = (struct ip *)tmpl->hdr;
+        iph->ip_hl = 5;
+        iph->ip_v = IPVERSION;
+        /* Do not fragment flag. See 5.4.1 in LISP RFC (6830) */
+        iph->ip_off = htons(IP_DF);
+        iph->ip_p = IPPROTO_UDP;
+        ip_addr_copy_to(&iph->ip_src, sip);
+        ip_addr_copy_to(&iph->ip_dst, dip);
+        tmpl->ip_len = sizeof(struct ip);
+        break;
+    case AF_INET6:
+        ip6h = (struct ip6_hdr *)tmpl->hdr;
+        ip6h->ip6_vfc = (IP6VERSION << 4);
+        ip6h->ip6_nxt = IPPROTO_UDP;
+        ip_addr_copy_to(&ip6h->ip6_src, sip);
+        ip_addr_copy_to(&ip6h->ip6_dst, dip);
+        tmpl->ip_len = sizeof(struct ip6_hdr);
+        break;
+    default:
+        return (BAD);
+    }
+
+    uh = (struct udphdr *)CO(tmpl->hdr, tmpl->ip_len);
+    uh->source = htons(sp);
+    uh->dest = htons(dp);
+    memcpy(CO(uh, sizeof(struct udphdr)), tun_hdr, tun_hdr_len);
+    tmpl->len = tmpl->ip_len + sizeof(struct udphdr) + tun_hdr_len;
+
+    if (ip_addr_afi(sip) == AF_INET) {
+        iph = (struct ip *)tmpl->hdr;
+        iph->ip_sum = ip_checksum((uint16_t *)iph, sizeof(struct ip));
+    } else {
+        /* The UDP checksum is mandatory with IPv6 */
+        w = (uint16_t *)&((struct ip6_hdr *)tmpl->hdr)->ip6_src;
+        for (i = 0; i < 2 * sizeof(struct in6_addr) / sizeof(uint16_t); i++) {
+            tmpl->sum += w[i];
+        }
+        tmpl->sum += htons(IPPROTO_UDP);
+        w = (uint16_t *)uh;
+        for (i = 0; i < (tmpl->len - tmpl->ip_len) / 2; i++) {
+            tmpl->sum += w[i];
+        }
+    }
+    tmpl->afi = ip_addr_afi(sip);
+
+    return (GOOD);
+}
+
+/* Push the headers of the template in front of the payload of 'b'. The UDP
+ * checksum is set to zero with IPv4 (RFC 6830 5.3) */
+void *
+pkt_push_hdr_tmpl(lbuf_t *b, pkt_hdr_tmpl_t *tmpl, int ttl, int tos)
+{
+    struct ip *iph;
+    struct ip6_hdr *ip6h;
+    struct udphdr *uh;
+    uint16_t *w, *tw;
+    uint32_t sum;
+    int plen, udp_len;
+
+    plen = lbuf_size(b);
+    udp_len = tmpl->len - tmpl->ip_len + plen;
+    uh = lbuf_push_uninit(b, tmpl->len - tmpl->ip_len);
+    lbuf_reset_udp(b);
+    lbuf_push_uninit(b, tmpl->ip_len);
+    lbuf_reset_ip(b);
+    memcpy(lbuf_data(b), tmpl->hdr, tmpl->len);
+    uh->len = htons(udp_len);
+
+    /*XXX It seems that there is a bug in uClibc that causes ttl=0 in
+     * OpenWRT. This is a quick workaround */
+    if (ttl == 0) {
+        ttl = 255;
+    }
+
+    if (tmpl->afi == AF_INET) {
+        iph = lbuf_data(b);
+        iph->ip_tos = tos;
+        iph->ip_len = htons(lbuf_size(b));
+        iph->ip_id = htons(get_IP_ID());
+        iph->ip_ttl = ttl;
+
+        /* Update the checksum with the words of tos, len, id and ttl. len
+         * and id are 0 in the template */
+        w = (uint16_t *)iph;
+        tw = (uint16_t *)tmpl->hdr;
+        iph->ip_sum = cksum_update16(iph->ip_sum, tw[0], w[0]);
+        iph->ip_sum = cksum_update16(iph->ip_sum, 0, w[1]);
+        iph->ip_sum = cksum_update16(iph->ip_sum, 0, w[2]);
+        iph->ip_sum = cksum_update16(iph->ip_sum, tw[4], w[4]);
+    } else {
+        ip6h = lbuf_data(b);
+        ip6h->ip6_plen = htons(udp_len);
+        ip6h->ip6_hops = ttl;
+        IPV6_SET_TC(ip6h, tos);
+
+        /* Length of the pseudo header and of the UDP header */
+        sum = tmpl->sum + 2 * htons(udp_len);
+        uh->check = cksum_fold(cksum_partial(CO(uh, tmpl->len - tmpl->ip_len),
+                plen, sum));
+        if (uh->check == 0) {
+            uh->check = 0xffff;
+        }
+    }
+
+    return (lbuf_data(b));
+}
+
 /* Fill the tuple with the 5 tuples of a packet:
  * (SRC IP, DST IP, PROTOCOL, SRC PORT, DST PORT) */
 int
@@ -257,60 +406,92 @@ pkt_parse_5_tuple(lbuf_t *b, packet_tuple_t *tuple)
         tuple->src_port = 0;
         tuple->dst_port = 0;
     }
+
+    pkt_tuple_set_key(tuple);
+
     return (GOOD);
 }
 
+/* Fill the flow key of the tuple from its fields and calculate its hash.
+ * It should be called each time the fields of the tuple are modified */
+void
+pkt_tuple_set_key(packet_tuple_t *tuple)
+{
+    flow_key_t *key = &tuple->key;
 
-/* Calculate the hash of the 5 tuples of a packet */
+    memset(key, 0, sizeof(flow_key_t));
+    key->afi = lisp_addr_ip_afi(&tuple->src_addr);
+    switch (key->afi){
+    case AF_INET:
+        memcpy(key->src, ip_addr_get_addr(lisp_addr_ip(&tuple->src_addr)),
+                sizeof(struct in_addr));
+        memcpy(key->dst, ip_addr_get_addr(lisp_addr_ip(&tuple->dst_addr)),
+                sizeof(struct in_addr));
+        break;
+    case AF_INET6:
+        memcpy(key->src, ip_addr_get_addr(lisp_addr_ip(&tuple->src_addr)),
+                sizeof(struct in6_addr));
+        memcpy(key->dst, ip_addr_get_addr(lisp_addr_ip(&tuple->dst_addr)),
+                sizeof(struct in6_addr));
+        break;
+    }
+    key->ports = tuple->src_port + ((uint32_t)tuple->dst_port << 16);
+    key->protocol = tuple->protocol;
+
+    tuple->hash = flow_key_hash(key);
+}
+
+/* Calculate the hash of a flow key */
 uint32_t
-pkt_tuple_hash(packet_tuple_t *tuple)
+flow_key_hash(flow_key_t *key)
 {
-    int hash = 0;
+    uint32_t words[10];
     int len = 0;
-    int port = tuple->src_port;
-    uint32_t *tuples = NULL;
 
-    port = port + ((int)tuple->dst_port << 16);
-    switch (lisp_addr_ip_afi(&tuple->src_addr)){
+    switch (key->afi){
     case AF_INET:
         /* 1 integer src_addr
          * + 1 integer dst_adr
          * + 1 integer (ports)
          * + 1 integer protocol */
+        words[0] = key->src[0];
+        words[1] = key->dst[0];
+        words[2] = key->ports;
+        words[3] = key->protocol;
         len = 4;
-        tuples = xmalloc(len * sizeof(uint32_t));
-        lisp_addr_copy_to(&tuples[0], &tuple->src_addr);
-        lisp_addr_copy_to(&tuples[1], &tuple->dst_addr);
-        tuples[2] = port;
-        tuples[3] = tuple->protocol;
         break;
     case AF_INET6:
         /* 4 integer src_addr
          * + 4 integer dst_adr
          * + 1 integer (ports)
          * + 1 integer protocol */
+        memcpy(&words[0], key->src, sizeof(key->src));
+        memcpy(&words[4], key->dst, sizeof(key->dst));
+        words[8] = key->ports;
+        words[9] = key->protocol;
         len = 10;
-        tuples = xmalloc(len * sizeof(uint32_t));
-        lisp_addr_copy_to(&tuples[0], &tuple->src_addr);
-        lisp_addr_copy_to(&tuples[4], &tuple->dst_addr);
-        tuples[8] = port;
-        tuples[9] = tuple->protocol;
         break;
+    default:
+        return (0);
     }
 
     /* XXX: why 2013 used as initial value? */
-    hash = hashword(tuples, len, 2013);
-    free(tuples);
-    return (hash);
+    return (hashword(words, len, 2013));
+}
+
+/* Hash of the 5 tuples of a packet. It is calculated once when the tuple
+ * is parsed */
+uint32_t
+pkt_tuple_hash(packet_tuple_t *tuple)
+{
+    return (tuple->hash);
 }
 
 int
 pkt_tuple_cmp(packet_tuple_t *t1, packet_tuple_t *t2)
 {
-    return(t1->src_port == t2->src_port
-           && t1->dst_port == t2->dst_port
-           && (lisp_addr_cmp(&t1->src_addr, &t2->src_addr) == 0)
-           && (lisp_addr_cmp(&t1->dst_addr, &t2->dst_addr) == 0));
+    return(t1->hash == t2->hash
+           && memcmp(&t1->key, &t2->key, sizeof(flow_key_t)) == 0);
 }
 
 packet_tuple_t *
@@ -322,6 +503,8 @@ pkt_tuple_clone(packet_tuple_t *tpl)
     cpy->protocol = tpl->protocol;
     lisp_addr_copy(&cpy->src_addr, &tpl->src_addr);
     lisp_addr_copy(&cpy->dst_addr, &tpl->dst_addr);
+    cpy->key = tpl->key;
+    cpy->hash = tpl->hash;
     return(cpy);
 }
 
@@ -337,8 +520,8 @@ pkt_tuple_del(packet_tuple_t *tpl)
 char *
 pkt_tuple_to_char(packet_tuple_t *tpl)
 {
-    static char buf[2][200];
-    static int i=0;
+    static THREAD_LOCAL char buf[2][200];
+    static THREAD_LOCAL int i=0;
     /* hack to allow more than one locator per line */
     i++; i = i % 2;
     *buf[i] = '\0';
@@ -375,8 +558,13 @@ int
 ip_hdr_set_ttl_and_tos(struct iphdr *iph, int ttl, int tos)
 {
     struct ip6_hdr *ip6h;
+    uint16_t *w = (uint16_t *)iph;
+    uint16_t old_tos, old_ttl;
 
     if (iph->version == 4) {
+        old_tos = w[0];
+        old_ttl = w[4];
+
         /*XXX It seems that there is a bug in uClibc that causes ttl=0 in
          * OpenWRT. This is a quick workaround */
         if (ttl != 0) {
@@ -385,13 +573,10 @@ ip_hdr_set_ttl_and_tos(struct iphdr *iph, int ttl, int tos)
 
         iph->tos = tos;
 
-        /* We need to recompute the checksum since we have changed the TTL
-         * and TOS header fields.
-         *
-         * New checksum must be computed with the checksum header field
-         * with 0s */
-        iph->check = 0;
-        iph->check = ip_checksum((uint16_t*) iph, sizeof(struct iphdr));
+        /* Update the checksum with the words of the TTL and TOS header
+         * fields (RFC 1624) */
+        iph->check = cksum_update16(iph->check, old_tos, w[0]);
+        iph->check = cksum_update16(iph->check, old_ttl, w[4]);
 
     } else if (iph->version == 6) {
         ip6h = (struct ip6_hdr *) iph;
@@ -587,7 +772,7 @@ build_ip_udp_pcket(uint8_t *orig_pkt, int orig_pkt_len,lisp_addr_t *addr_from,
 char *
 ip_src_and_dst_to_char(struct iphdr *iph, char *fmt)
 {
-    static char buf[150];
+    static THREAD_LOCAL char buf[150];
     struct ip6_hdr *ip6h;
 
     *buf = '\0';
@@ -38,6 +38,34 @@
 #define MAX_IP_PKT_LEN          4096
 #define MAX_IP_HDR_LEN          40  /* without options or IPv6 hdr extensions */
 #define UDP_HDR_LEN             8
+#define MAX_TUNNEL_HDR_LEN      8   /* header of the tunnel above UDP */
+
+/* Outer IP and UDP headers, followed by the tunnel header, of the packets
+ * sent between two addresses. It is built once, so that encapsulating a
+ * packet only copies it and sets the lengths, the IPv4 ID, the TTL, the TOS
+ * and the checksums */
+typedef struct pkt_hdr_tmpl {
+    uint8_t                         hdr[MAX_IP_HDR_LEN + UDP_HDR_LEN
+                                        + MAX_TUNNEL_HDR_LEN];
+    uint8_t                         len;    /* 0 if not initialized */
+    uint8_t                         ip_len;
+    uint8_t                         afi;
+    /* IPv6: sum of the pseudo header, without the length, and of the UDP
+     * and tunnel headers */
+    uint32_t                        sum;
+} pkt_hdr_tmpl_t;
+
+/* Fixed size key of a flow. Addresses are stored inline so that the key
+ * can be hashed and compared without allocations. IPv4 addresses only use
+ * the first word of src and dst */
+typedef struct flow_key {
+    uint32_t                        src[4];
+    uint32_t                        dst[4];
+    uint32_t                        ports;  /* src_port + (dst_port << 16) */
+    uint8_t                         afi;
+    uint8_t                         protocol;
+    uint16_t                        pad;
+} flow_key_t;
 
 /* shared between data and control */
 typedef struct packet_tuple {
@@ -46,6 +74,8 @@ typedef struct packet_tuple {
     uint16_t                        src_port;
     uint16_t                        dst_port;
     uint8_t                         protocol;
+    flow_key_t                      key;
+    uint32_t                        hash;   /* hash of key */
 } packet_tuple_t;
 
 
@@ -77,10 +107,17 @@ void *pkt_push_udp(lbuf_t *, uint16_t , uint16_t);
 void *pkt_push_ip(lbuf_t *, ip_addr_t *, ip_addr_t *, int proto);
 int pkt_push_udp_and_ip(lbuf_t *, uint16_t, uint16_t, ip_addr_t *,
         ip_addr_t *);
+int pkt_push_tunnel_udp_and_ip(lbuf_t *, uint16_t, uint16_t, ip_addr_t *,
+        ip_addr_t *);
+int pkt_hdr_tmpl_init(pkt_hdr_tmpl_t *tmpl, ip_addr_t *sip, ip_addr_t *dip,
+        uint16_t sp, uint16_t dp, void *tun_hdr, int tun_hdr_len);
+void *pkt_push_hdr_tmpl(lbuf_t *b, pkt_hdr_tmpl_t *tmpl, int ttl, int tos);
 int ip_hdr_set_ttl_and_tos(struct iphdr *, int ttl, int tos);
 int ip_hdr_ttl_and_tos(struct iphdr *, int *ttl, int *tos);
 
 int pkt_parse_5_tuple(lbuf_t *b, packet_tuple_t *tuple);
+void pkt_tuple_set_key(packet_tuple_t *tuple);
+uint32_t flow_key_hash(flow_key_t *key);
 uint32_t pkt_tuple_hash(packet_tuple_t *tuple);
 int pkt_tuple_cmp(packet_tuple_t *t1, packet_tuple_t *t2);
 packet_tuple_t *pkt_tuple_clone(packet_tuple_t *);
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <inttypes.h>			// for printing uint_64 numbers
@@ -12,20 +14,50 @@
 #include <rohc/rohc_comp.h>
 #include <rohc/rohc_decomp.h>
 #include "simplemux.h"
+#include "mux_classifier.h"
 #include "../liblisp/liblisp.h"
 #include "lmlog.h"
-
-extern data_simplemux_t conf_sm[10],conf_sm_pre[10]; // save previous config
-extern int numdsm;
-
-/* compression */
-
-static struct rohc_comp *compressor;           					// the ROHC compressor
-static struct rohc_decomp *decompressor;           				// the ROHC decompressor
+#include "mux_trace.h"
+
+/* the bundle of a rule, after the headroom for the tunnel headers */
+#define BUNDLE(ds) ((ds)->bundle_buf + MUX_STACK_OFFSET)
+
+data_simplemux_t *conf_sm = NULL;					// simplemux rules, in configuration order
+int numdsm = 0;										// number of simplemux rules
+static data_simplemux_t *conf_sm_pre = NULL;		// save previous config
+static int numdsm_pre = 0;
+static data_simplemux_t *conf_sm_staged = NULL;		// rules parsed, to be applied by muxed_rules_apply
+static int numdsm_staged = 0;
+
+/* rules compiled for the lookup. The result of the lookup is cached in the forwarding entry of
+ * each flow together with the generation of the classifier, which changes every time it is built */
+static mux_classifier_t *classifier = NULL;
+static uint32_t classifier_gen = 1;
+
+/* flush deadlines. The rules with packets stored are kept in a min-heap ordered by the expiration
+ * of their period, and a timerfd registered with the socket master is armed with the earliest one */
+static data_simplemux_t **flush_heap = NULL;
+static int flush_heap_len = 0;
+static int flush_timer_fd = -1;
+static uint64_t flush_timer_deadline = 0;		// deadline the timerfd is armed with. 0 if disarmed
+static void muxed_deadline_update(data_simplemux_t *data_simplemux);
+static void muxed_rule_flush(data_simplemux_t *data_simplemux);
+static void muxed_rule_drain(data_simplemux_t *data_simplemux);
+static int muxed_flush_timer_process(sock_t *sl);
+
+/* compression. Each tunnel has its own ROHC contexts, kept in a bounded pool */
+static rohc_ctx_t *rohc_ctx_of_rule(data_simplemux_t *data_simplemux);
+static rohc_ctx_t *rohc_ctx_get(ip_addr_t *local_rloc, ip_addr_t *remote_rloc);
+static struct rohc_comp *rohc_ctx_compressor(rohc_ctx_t *ctx);
+static struct rohc_decomp *rohc_ctx_decompressor(rohc_ctx_t *ctx, int ROHC_mode);
+static void rohc_pool_sweep(uint64_t now);
+static bool rtp_detect(const unsigned char *const ip, const unsigned char *const udp, const unsigned char *const payload,
+		const unsigned int payload_size, void *const rtp_private);
 
 
 /*  Info log*/
-static FILE *log_file;											// file descriptor of the log file 
+#define MUX_TUNNEL(ds) ((uint32_t)((ds) - conf_sm))						// tunnel id of the events traced
+#define MUX_DRLOC(ds) (lisp_addr_ip(&(ds)->mux_tuple.drloc))
 static unsigned long int tun2net;								// number of packets read from tun
 static unsigned long int net2tun;								// number of packets read from net
 
@@ -185,158 +217,389 @@ int date_and_time(char buffer[25])
 
 
 /**************************************************************************
- *                   build the multiplexed packet                         *
+ *               write the separator of a packet                          *
  **************************************************************************/
-// it takes all the variables where packets are stored, and builds a multiplexed packet
-// the variables are:
-//	- prot[MAXPKTS][SIZE_PROTOCOL_FIELD]	the protocol byte of each packet
-//	- size_separators_to_mux[MAXPKTS]		the size of each separator (1 or 2 bytes). Protocol byte not included
-//	- separators_to_mux[MAXPKTS][2]			the separators
-//	- size_packets_to_mux[MAXPKTS]			the size of each packet to be multiplexed
-//	- packets_to_mux[MAXPKTS][BUFSIZE]		the packet to be multiplexed
-
-// the multiplexed packet is stored in mux_packet[BUFSIZE]
-// the length of the multiplexed packet is returned by this function
-uint16_t build_multiplexed_packet ( int num_packets, int single_prot, unsigned char prot[MAXPKTS][SIZE_PROTOCOL_FIELD], uint16_t size_separators_to_mux[MAXPKTS], unsigned char separators_to_mux[MAXPKTS][3], uint16_t size_packets_to_mux[MAXPKTS], unsigned char packets_to_mux[MAXPKTS][BUFSIZE], unsigned char mux_packet[BUFSIZE])
+// writes in 'separator' the Simplemux separator ('Protocol' field not included) of a packet of 'length' bytes
+//   - It is 1 byte if the length is smaller than 64 (or 128 for non-first separators)
+//   - It is 2 bytes if the length is 64 (or 128 for non-first separators) or more
+//   - It is 3 bytes if the length is 8192 (or 16384 for non-first separators) or more
+// the Single Protocol Bit of the first separator is not set here. It is added when the bundle is sent
+// the size of the separator is returned by this function
+static int write_separator (unsigned char separator[3], uint16_t length, int first_header)
 {
-	int k, l;
-	int length = 0;
+	int maximum_packet_length;		// the maximum lentgh of a packet. It may be 64 (first header) or 128 (non-first header)
+	int limit_length_two_bytes;		// the maximum length of a packet in order to express it in 2 bytes. It may be 8192 or 16384 (non-first header)
+	int lxt;						// value of the LXT bit in the first byte. 64 for a first header, 128 for a non-first one
+
+	if (first_header) {
+		maximum_packet_length = 64;
+		limit_length_two_bytes = 8192;
+		lxt = 64;
+	} else {
+		maximum_packet_length = 128;
+		limit_length_two_bytes = 16384;
+		lxt = 128;
+	}
+
+	// one-byte separator. Since the value is < maximum_packet_length, the most significant bits will always be 0
+	if (length < maximum_packet_length) {
+		separator[0] = length;
+		return 1;
+	}
+
+	// two-byte separator: LXT=1 and the most significant bits of the length in the first byte,
+	// the 7 less significant bits (LXT=0) in the second one
+	if (length < limit_length_two_bytes) {
+		separator[0] = (length / 128) + lxt;
+		separator[1] = length % 128;
+		return 2;
+	}
 
-	// for each packet, write the protocol field (if required), the separator and the packet itself
-	for (k = 0; k < num_packets ; k++) {
+	// three-byte separator: the second byte also has its LXT bit set to 1
+	separator[0] = (length / 16384) + lxt;
+	separator[1] = ((length / 128) % 128) + 128;
+	separator[2] = length % 128;
+	return 3;
+}
+
+
+/**************************************************************************
+ *      add the 'Protocol' field to every separator of the bundle         *
+ **************************************************************************/
+// while all the stored packets belong to the same protocol, only the first separator carries the 'Protocol' field.
+// When a packet of a different protocol arrives, the field is inserted in the rest of separators.
+// The packets are moved backwards (from the last one), so each byte is moved only once
+static void bundle_add_protocol_fields (data_simplemux_t *data_simplemux)
+{
+	int k;
+	int start, end, insert;
 
+	end = data_simplemux->size_muxed_packet;
+	for (k = data_simplemux->num_pkts_stored_from_tun - 1; k > 0; k--) {
+		start = data_simplemux->offset_in_bundle[k];
 		if ( PROTOCOL_FIRST ) {
-			// add the 'Protocol' field if necessary
-			if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-				for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-					mux_packet[length] = prot[k][l];
-					length ++;
-				}
-			}
-	
-			// add the separator
-			for (l = 0; l < size_separators_to_mux[k] ; l++) {
-				mux_packet[length] = separators_to_mux[k][l];
-				length ++;
-			}
+			insert = start;
 		} else {
-			// add the separator
-			for (l = 0; l < size_separators_to_mux[k] ; l++) {
-				mux_packet[length] = separators_to_mux[k][l];
-				length ++;
-			}
-			// add the 'Protocol' field if necessary
-			if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-				for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-					mux_packet[length] = prot[k][l];
-					length ++;
-				}
-			}
+			insert = start + data_simplemux->size_separators_to_multiplex[k];
 		}
 
-		// add the bytes of the packet itself
-		for (l = 0; l < size_packets_to_mux[k] ; l++) {
-			mux_packet[length] = packets_to_mux[k][l];
-			length ++;
-		}
+		// k 'Protocol' fields go before the bytes behind the insertion point, k-1 before the rest
+		memmove(&BUNDLE(data_simplemux)[insert + k*SIZE_PROTOCOL_FIELD], &BUNDLE(data_simplemux)[insert], end - insert);
+		memmove(&BUNDLE(data_simplemux)[start + (k-1)*SIZE_PROTOCOL_FIELD], &BUNDLE(data_simplemux)[start], insert - start);
+		memcpy(&BUNDLE(data_simplemux)[insert + (k-1)*SIZE_PROTOCOL_FIELD], data_simplemux->protocol[k], SIZE_PROTOCOL_FIELD);
+
+		end = start;
+		data_simplemux->offset_in_bundle[k] = start + (k-1)*SIZE_PROTOCOL_FIELD;
 	}
-	return length;
+	data_simplemux->size_muxed_packet = data_simplemux->size_muxed_packet + (data_simplemux->num_pkts_stored_from_tun - 1) * SIZE_PROTOCOL_FIELD;
+	data_simplemux->single_protocol = 0;
 }
 
 
 /**************************************************************************
- *       predict the size of the multiplexed packet                       *
+ *            append a packet to the bundle                               *
  **************************************************************************/
-// it takes all the variables where packets are stored, and predicts the size of a multiplexed packet including all of them
-// the variables are:
-//	- prot[MAXPKTS][SIZE_PROTOCOL_FIELD]	the protocol byte of each packet
-//	- size_separators_to_mux[MAXPKTS]		the size of each separator (1 or 2 bytes). Protocol byte not included
-//	- separators_to_mux[MAXPKTS][2]			the separators
-//	- size_packets_to_mux[MAXPKTS]			the size of each packet to be multiplexed
-//	- packets_to_mux[MAXPKTS][BUFSIZE]		the packet to be multiplexed
+// the separator, the 'Protocol' field (if required) and the packet are written at their final position.
+// 'arrival' is the moment the packet was read from tun, for the delay counters
+static void bundle_append (data_simplemux_t *data_simplemux, unsigned char separator[3], int size_separator, unsigned char prot[SIZE_PROTOCOL_FIELD], unsigned char *packet, uint16_t size_packet, uint64_t arrival)
+{
+	int n = data_simplemux->num_pkts_stored_from_tun;
+	int length = data_simplemux->size_muxed_packet;
+	int add_protocol;
+
+	// the protocol field is always present in the first separator, and in the rest if the protocols are mixed
+	add_protocol = (n == 0) || (data_simplemux->single_protocol == 0);
+
+	data_simplemux->offset_in_bundle[n] = length;
+	data_simplemux->size_separators_to_multiplex[n] = size_separator;
+	memcpy(data_simplemux->protocol[n], prot, SIZE_PROTOCOL_FIELD);
 
+	if ( PROTOCOL_FIRST && add_protocol ) {
+		memcpy(&BUNDLE(data_simplemux)[length], prot, SIZE_PROTOCOL_FIELD);
+		length = length + SIZE_PROTOCOL_FIELD;
+	}
+	memcpy(&BUNDLE(data_simplemux)[length], separator, size_separator);
+	length = length + size_separator;
+	if ( !PROTOCOL_FIRST && add_protocol ) {
+		memcpy(&BUNDLE(data_simplemux)[length], prot, SIZE_PROTOCOL_FIELD);
+		length = length + SIZE_PROTOCOL_FIELD;
+	}
+	memcpy(&BUNDLE(data_simplemux)[length], packet, size_packet);
+	length = length + size_packet;
+
+	data_simplemux->size_muxed_packet = length;
+	data_simplemux->num_pkts_stored_from_tun = n + 1;
+	data_simplemux->first_header_written = 1;
+
+	data_simplemux->stat_payload_bytes += size_packet;
+	data_simplemux->arrival_sum += arrival;
+}
+
+
+/**************************************************************************
+ *            send the bundle and empty it                                *
+ **************************************************************************/
+// the bundle already is the multiplexed packet: only the Single Protocol Bit has to be set.
+// 'mux_packet' is pointed to the bundle, with its headroom for the tunnel headers, so it is sent
+// without copies. The bundle stays valid until the next packet is stored
 // the length of the multiplexed packet is returned by this function
-uint16_t predict_size_multiplexed_packet ( int num_packets, int single_prot, unsigned char prot[MAXPKTS][SIZE_PROTOCOL_FIELD], uint16_t size_separators_to_mux[MAXPKTS], unsigned char separators_to_mux[MAXPKTS][3], uint16_t size_packets_to_mux[MAXPKTS], unsigned char packets_to_mux[MAXPKTS][BUFSIZE])
+static uint16_t bundle_flush (data_simplemux_t *data_simplemux, lbuf_t *mux_packet)
 {
-	int k, l;
-	int length = 0;
+	uint16_t total_length = data_simplemux->size_muxed_packet;
+
+	// add the Single Protocol Bit in the first header (the most significant bit)
+	// it is '1' if all the multiplexed packets belong to the same protocol
+	if (data_simplemux->single_protocol == 1) {
+		BUNDLE(data_simplemux)[PROTOCOL_FIRST ? SIZE_PROTOCOL_FIELD : 0] |= 0x80;
+	}
+	lbuf_use_stack(mux_packet, data_simplemux->bundle_buf, (uint32_t)sizeof(data_simplemux->bundle_buf));
+	lbuf_reserve(mux_packet, MUX_STACK_OFFSET);
+	lbuf_set_size(mux_packet, total_length);
+
+	// the delay of each packet is the time from its arrival until now
+	data_simplemux->stat_bundles++;
+	data_simplemux->stat_packets += data_simplemux->num_pkts_stored_from_tun;
+	data_simplemux->stat_sent_bytes += total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE;
+	data_simplemux->stat_delay_sum += data_simplemux->num_pkts_stored_from_tun * GetTimeStamp() - data_simplemux->arrival_sum;
+	data_simplemux->arrival_sum = 0;
+
+	// I have sent a packet, so I set to 0 the "first_header_written" bit
+	// and reset the length and the number of packets
+	data_simplemux->first_header_written = 0;
+	data_simplemux->size_muxed_packet = 0;
+	data_simplemux->num_pkts_stored_from_tun = 0;
+	data_simplemux->single_protocol = 1;
+
+	return total_length;
+}
 
-	// for each packet, read the protocol field (if present), the separator and the packet itself
-	for (k = 0; k < num_packets ; k++) {
 
-		// count the 'Protocol' field if necessary
-		if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-				for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-					length ++;
-				}
-		}
-	
-		// count the separator
-		for (l = 0; l < size_separators_to_mux[k] ; l++) {
-			length ++;
-		}
+/**************************************************************************
+ *            size of the bundle with one more packet                     *
+ **************************************************************************/
+// 'mixed_protocols' is set to 1 if the packet breaks the 'single protocol' condition of the bundle. In that
+// case, a 'Protocol' field has to be added to each non-first separator
+static int bundle_predicted_size (data_simplemux_t *data_simplemux, int size_separator, uint16_t size_packet, unsigned char prot[SIZE_PROTOCOL_FIELD], int *mixed_protocols)
+{
+	int n = data_simplemux->num_pkts_stored_from_tun;
+	int predicted_size;
 
-		// count the bytes of the packet itself
-		for (l = 0; l < size_packets_to_mux[k] ; l++) {
-			length ++;
-		}
+	*mixed_protocols = (n > 0) && (data_simplemux->single_protocol == 1)
+			&& (memcmp(prot, data_simplemux->protocol[0], SIZE_PROTOCOL_FIELD) != 0);
+
+	// the bundle is stored with its final layout, so its size is already known
+	predicted_size = data_simplemux->size_muxed_packet + size_separator + size_packet;
+	if ((n == 0) || (data_simplemux->single_protocol == 0) || *mixed_protocols) {
+		predicted_size = predicted_size + SIZE_PROTOCOL_FIELD;
+	}
+	if (*mixed_protocols) {
+		predicted_size = predicted_size + (n - 1) * SIZE_PROTOCOL_FIELD;
 	}
-	return length;
+	return predicted_size;
 }
 
 
+/**************************************************************************
+ *            class scheduling: the queue of the bulk packets             *
+ **************************************************************************/
+// maximum size of a bundle (without the tunnel headers), and the size of the bulk packets queued
+// that triggers the sending. It can not be bigger than a bundle
+static int muxed_size_max (data_simplemux_t *data_simplemux)
+{
+	int selected_mtu = (data_simplemux->user_mtu > 0) ? data_simplemux->user_mtu : data_simplemux->interface_mtu;
+
+	return selected_mtu - IPv4_HEADER_SIZE - UDP_HEADER_SIZE - LISP_HEADER_SIZE;
+}
+
+static int muxed_bulk_threshold (data_simplemux_t *data_simplemux)
+{
+	int size_max = muxed_size_max(data_simplemux);
 
-/**************************************************************************************/	
+	if ((data_simplemux->bulk_threshold <= 0) || (data_simplemux->bulk_threshold > size_max))
+		return size_max;
+	return data_simplemux->bulk_threshold;
+}
+
+// a native packet is realtime if its DSCP is CS4 or higher, or if it goes to one of the RTP ports
+// of the compressor. The rest of the packets are bulk
+static int mux_packet_realtime (unsigned char *packet, uint16_t size_packet)
+{
+	const unsigned char *udp = NULL;
+	int dscp;
+	int ihl;
+
+	if ((size_packet >= 20) && ((packet[0] >> 4) == 4)) {
+		dscp = packet[1] >> 2;
+		ihl = (packet[0] & 0x0f) * 4;
+		// the ports are only in the first fragment
+		if ((packet[9] == IPPROTO_UDP) && (ihl >= 20) && (size_packet >= ihl + UDP_HEADER_SIZE)
+				&& ((packet[6] & 0x1f) == 0) && (packet[7] == 0))
+			udp = packet + ihl;
+	} else if ((size_packet >= 40) && ((packet[0] >> 4) == 6)) {
+		dscp = ((packet[0] & 0x0f) << 2) | (packet[1] >> 6);
+		if ((packet[6] == IPPROTO_UDP) && (size_packet >= 40 + UDP_HEADER_SIZE))
+			udp = packet + 40;
+	} else {
+		return 0;
+	}
+
+	if (dscp >= MUX_DSCP_REALTIME)
+		return 1;
+	return (udp != NULL) && rtp_detect(packet, udp, udp + UDP_HEADER_SIZE, size_packet - (udp - packet) - UDP_HEADER_SIZE, NULL);
+}
+
+static void bulk_enqueue (data_simplemux_t *data_simplemux, unsigned char prot[SIZE_PROTOCOL_FIELD], unsigned char *packet, uint16_t size_packet)
+{
+	int n = data_simplemux->bulk_count;
+
+	memcpy(&data_simplemux->bulk_buf[data_simplemux->bulk_bytes], packet, size_packet);
+	memcpy(data_simplemux->bulk_protocol[n], prot, SIZE_PROTOCOL_FIELD);
+	data_simplemux->bulk_size[n] = size_packet;
+	data_simplemux->bulk_arrival[n] = GetTimeStamp();
+	data_simplemux->bulk_bytes += size_packet;
+	data_simplemux->bulk_count = n + 1;
+}
+
+// the bulk packets fill the room the realtime ones leave in the bundle, in order of arrival. They are
+// not reordered to fill the bundle better: the packets of a flow must reach the decompressor in the order
+// they were compressed. The first packet of an empty bundle is always taken, so the queue always moves
+static void bundle_fill_bulk (data_simplemux_t *data_simplemux, int size_max)
+{
+	unsigned char separator[3];
+	int size_separator;
+	int predicted_size;
+	int mixed_protocols;
+	int taken = 0;
+	int offset = 0;
+
+	while ((taken < data_simplemux->bulk_count) && (data_simplemux->num_pkts_stored_from_tun < MAXPKTS)) {
+		size_separator = write_separator (separator, data_simplemux->bulk_size[taken], data_simplemux->first_header_written == 0);
+		predicted_size = bundle_predicted_size (data_simplemux, size_separator, data_simplemux->bulk_size[taken], data_simplemux->bulk_protocol[taken], &mixed_protocols);
+		if ((data_simplemux->num_pkts_stored_from_tun > 0) && (predicted_size > size_max))
+			break;
+		if (mixed_protocols) {
+			bundle_add_protocol_fields (data_simplemux);
+		}
+		bundle_append (data_simplemux, separator, size_separator, data_simplemux->bulk_protocol[taken], &data_simplemux->bulk_buf[offset],
+				data_simplemux->bulk_size[taken], data_simplemux->bulk_arrival[taken]);
+		offset += data_simplemux->bulk_size[taken];
+		taken++;
+	}
+	if (taken == 0)
+		return;
+
+	// the packets left go to the front of the queue
+	data_simplemux->bulk_count -= taken;
+	data_simplemux->bulk_bytes -= offset;
+	memmove(data_simplemux->bulk_buf, &data_simplemux->bulk_buf[offset], data_simplemux->bulk_bytes);
+	memmove(data_simplemux->bulk_protocol, data_simplemux->bulk_protocol[taken], data_simplemux->bulk_count * SIZE_PROTOCOL_FIELD);
+	memmove(data_simplemux->bulk_size, &data_simplemux->bulk_size[taken], data_simplemux->bulk_count * sizeof(uint16_t));
+	memmove(data_simplemux->bulk_arrival, &data_simplemux->bulk_arrival[taken], data_simplemux->bulk_count * sizeof(uint64_t));
+}
+
+
+
+/**************************************************************************
+ *            adaptive mode: estimate the traffic of the rule             *
+ **************************************************************************/
+// the samples of the time between packets are limited to the latency budget: a longer gap
+// (e.g. a silence) would ask for a single packet per bundle anyway, and the estimation
+// recovers faster when the traffic starts again
+static void muxed_adaptive_sample (data_simplemux_t *data_simplemux, uint16_t size_packet)
+{
+	uint64_t now = GetTimeStamp();
+	double interarrival;
+
+	if (data_simplemux->last_arrival != 0) {
+		interarrival = (double)(now - data_simplemux->last_arrival);
+		if ((data_simplemux->latency_budget > 0) && (interarrival > data_simplemux->latency_budget))
+			interarrival = data_simplemux->latency_budget;
+		if (data_simplemux->ewma_interarrival == 0)
+			data_simplemux->ewma_interarrival = interarrival;
+		else
+			data_simplemux->ewma_interarrival += (interarrival - data_simplemux->ewma_interarrival) / MUX_EWMA_WEIGHT;
+	}
+	data_simplemux->last_arrival = now;
+
+	if (data_simplemux->ewma_size == 0)
+		data_simplemux->ewma_size = size_packet;
+	else
+		data_simplemux->ewma_size += ((double)size_packet - data_simplemux->ewma_size) / MUX_EWMA_WEIGHT;
+}
+
+// number of packets of a bundle: as many as are expected to arrive within the latency budget after
+// the first one, so the tunnel headers are shared by as many packets as possible without delaying
+// any of them more than the budget. The bundle must also fit in the MTU
+static int muxed_adaptive_numpackets (data_simplemux_t *data_simplemux, int size_max)
+{
+	int numpackets = 1;
+	int numpackets_mtu;
+
+	if (data_simplemux->ewma_interarrival > 0)
+		numpackets = 1 + (int)(data_simplemux->latency_budget / data_simplemux->ewma_interarrival);
+
+	// each packet needs a separator of up to 2 bytes and, perhaps, a 'Protocol' field
+	if (data_simplemux->ewma_size > 0) {
+		numpackets_mtu = size_max / ((int)data_simplemux->ewma_size + 2 + SIZE_PROTOCOL_FIELD);
+		if (numpackets > numpackets_mtu)
+			numpackets = numpackets_mtu;
+	}
+
+	if (numpackets > MAXPKTS)
+		numpackets = MAXPKTS;
+	if (numpackets < 1)
+		numpackets = 1;
+
+	data_simplemux->adaptive_numpackets = numpackets;
+	return (numpackets);
+}
+
+
+/**************************************************************************************/
 /***************** TUN to NET: compress and multiplex *********************************/
 /**************************************************************************************/
 
 // This function return: 0 if a muxed packet is NOT built
-//	 1, if a muxed packet is built to be sent	
-//	 2, if a previous muxed packet is built to be sent because maximum size is reached. This function must be called again, using the same input parameters. 
+//	 1, if a muxed packet is built to be sent
+//	 2, if a previous muxed packet is built to be sent because maximum size is reached. This function must be called again, using the same input parameters.
 
-int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplemux_t *data_simplemux, unsigned char *out_muxed_packet, uint16_t *out_total_length)
+int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplemux_t *data_simplemux, lbuf_t *out_muxed_packet)
 {
-//LMLOG(LINF, "entro en mux_packets");
 	// value to return by this function
-	int result = 0;											
-	
+	int result = 0;
+
 	// variables for controlling the arrival and departure of packets
 
-	int interface_mtu;						// the maximum transfer unit of the interface 
-	int user_mtu;							// the MTU specified by the user (it must be <= interface_mtu) 
+	int interface_mtu;						// the maximum transfer unit of the interface
+	int user_mtu;							// the MTU specified by the user (it must be <= interface_mtu)
 	int selected_mtu;						// the MTU that will be used in the program
 
 	int limit_numpackets_tun;					// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
-	int size_threshold;						// if the number of bytes stored is higher than this, a muxed packet is sent  
-	int size_max;							// maximum value of the packet size               
-
-	uint64_t timeout;						// (microseconds) if a packet arrives and the timeout has expired (time from the   
-									// previous sending), the sending is triggered. default 100 seconds 
-	uint64_t period;						// period. If it expires, a packet is sent  
+	int size_threshold;						// if the number of bytes stored is higher than this, a muxed packet is sent
+	int size_max;							// maximum value of the packet size
 
-	uint64_t time_last_sent_in_microsec;				// moment when the last multiplexed packet was sent
+	uint64_t timeout;						// (microseconds) if a packet arrives and the timeout has expired (time from the
+									// previous sending), the sending is triggered. default 100 seconds
+	uint64_t period;						// period. If it expires, a packet is sent
 
 
-	// variables for storing the packets to multiplex
+	// variables for the packet to multiplex
 
-	int num_pkts_stored_from_tun;					// number of packets received and not sent from tun (stored)
 	uint16_t total_length;						// total length of the built multiplexed packet
-	unsigned char protocol[MAXPKTS][SIZE_PROTOCOL_FIELD];		// protocol field of each packet
-	uint16_t size_separators_to_multiplex[MAXPKTS];			// stores the size of the Simplemux separator. It does not include the "Protocol" field
-	unsigned char separators_to_multiplex[MAXPKTS][3];		// stores the header ('protocol' not included) received from tun, before sending it to the network
-	uint16_t size_packets_to_multiplex[MAXPKTS];			// stores the size of the received packet
-	unsigned char packets_to_multiplex[MAXPKTS][BUFSIZE];		// stores the packets received from tun, before storing it or sending it to the network
-	unsigned char muxed_packet[BUFSIZE];				// stores the multiplexed packet
-	int size_muxed_packet;						// acumulated size of the multiplexed packet
-	int first_header_written;					// it indicates if the first header has been written or not
+	unsigned char *packet;						// the packet to be multiplexed (native or ROHC-compressed)
+	uint16_t size_packet;						// size of the packet to be multiplexed
+	unsigned char prot[SIZE_PROTOCOL_FIELD];			// protocol field of the packet
+	unsigned char separator[3];					// separator of the packet ('protocol' not included)
+	int size_separator;						// size of the separator
 	int drop_packet = 0;
 	int predicted_size_muxed_packet;				// size of the muxed packet if the arrived packet was added to it
-	int single_protocol;						// it is 1 when the Single-Protocol-Bit of the first header is 1
-	int maximum_packet_length;					// the maximum lentgh of a packet. It may be 64 (first header) or 128 (non-first header)
-	int limit_length_two_bytes;					// the maximum length of a packet in order to express it in 2 bytes. It may be 8192 or 16384 (non-first header)
+	int mixed_protocols;						// it is 1 if the arrived packet makes the bundle multi-protocol
+	int num_pkts_stored_from_tun;
+	uint8_t trigger;						// what triggered the sending of the bundle (MUX_TRIG_*)
+	int bulk_packet;						// it is 1 if the packet waits in the queue of the bulk class
 
 	//indexes and counters
-	int l,j,k;
+	int l;
 
 	// very long unsigned integers for storing the system clock in microseconds
 	uint64_t time_in_microsec;							// current time
@@ -345,35 +608,36 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 	/* variables for the log file */
 	bool bits[8];									// it is used for printing the bits of a byte in debug mode
 
-	// ROHC header compression variables			
-	int ROHC_mode;									// it is 0 if ROHC is not used   
+	// ROHC header compression variables
+	int ROHC_mode;									// it is 0 if ROHC is not used
 											// it is 1 for ROHC Unidirectional mode (headers are to be compressed/decompressed)
 											// it is 2 for ROHC Bidirectional Optimistic mode
 											// it is 3 for ROHC Bidirectional Reliable mode (not implemented yet)
 
 	unsigned char ip_buffer[BUFSIZE];						// the buffer that will contain the IPv4 packet to compress
-	struct rohc_buf ip_packet = rohc_buf_init_empty(ip_buffer, BUFSIZE);	
+	struct rohc_buf ip_packet = rohc_buf_init_empty(ip_buffer, BUFSIZE);
 	unsigned char rohc_buffer[BUFSIZE];						// the buffer that will contain the resulting ROHC packet
 	struct rohc_buf rohc_packet = rohc_buf_init_empty(rohc_buffer, BUFSIZE);
 	rohc_status_t status;
+	rohc_ctx_t *rohc_ctx;								// ROHC contexts of the tunnel
+	struct rohc_comp *compressor;						// the ROHC compressor of the tunnel
 
 
 	// Begin Initialize -----------------------------------------------------------------
 	//-----------------------------------------------------------------------------------
 
-	ROHC_mode = data_simplemux->ROHC_mode;	
+	ROHC_mode = data_simplemux->ROHC_mode;
 
 	limit_numpackets_tun = data_simplemux->limit_numpackets_tun;		// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
-										// limit of the number of packets for triggering a muxed packet 
+										// limit of the number of packets for triggering a muxed packet
 
 	timeout = data_simplemux->timeout;					// timeout for triggering a muxed packet
-										// (microseconds) if a packet arrives and the timeout has expired (time from the  
+										// (microseconds) if a packet arrives and the timeout has expired (time from the
 										// previous sending), the sending is triggered. default 100 seconds
 
-	period = data_simplemux->period;							//Period for triggering a muxed packet 
-	time_last_sent_in_microsec = data_simplemux->time_last_sent_in_microsec;		// moment when the last multiplexed packet was sent
+	period = data_simplemux->period;							//Period for triggering a muxed packet
+
 
-	
 	interface_mtu = data_simplemux->interface_mtu;	// the maximum transfer unit of the interface
 	user_mtu = data_simplemux->user_mtu;			// the MTU specified by the user (it must be <= interface_mtu)
 	/*** check if the user has specified a bad MTU ***/
@@ -402,7 +666,7 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 
 	size_max = selected_mtu - IPv4_HEADER_SIZE - UDP_HEADER_SIZE - LISP_HEADER_SIZE;
 	size_threshold = data_simplemux->size_threshold;	// if the number of bytes stored is higher than this, a muxed packet is sent
-	   							// the size threshold has not been established by the user 
+	   							// the size threshold has not been established by the user
 	if (size_threshold == 0 ) {
 		size_threshold = size_max;
 		//LMLOG (LDBG_1, "Size threshold established to the maximum: %i.", size_max);
@@ -412,7 +676,16 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 		LMLOG (LDBG_1, "Warning: Size threshold too big: %i. Automatically set to the maximum: %i", size_threshold, size_max);
 		size_threshold = size_max;
 	}
-		
+
+
+	// adaptive mode: the triggers are chosen from the traffic observed. The bundle is sent when the
+	// expected number of packets has been stored or when its first packet has waited the latency budget
+	if (data_simplemux->latency_budget > 0) {
+		limit_numpackets_tun = muxed_adaptive_numpackets (data_simplemux, size_max);
+		size_threshold = size_max;
+		timeout = MAXTIMEOUT;
+		period = data_simplemux->latency_budget;
+	}
 
 	/*** set the triggering parameters according to user selections (or default values) ***/
 	// there are four possibilities for triggering the sending of the packets:
@@ -421,7 +694,7 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 	//			but not the MTU. In this case, a packet is sent and a new period is started with the
 	//			buffer empty.
 	//		-	the size of the multiplexed packet has exceeded the MTU (and the size threshold consequently).
-	//			In this case, a packet is sent without the last one. A new period is started, and the last 
+	//			In this case, a packet is sent without the last one. A new period is started, and the last
 	//			packet is stored as the first packet of the next period.
 	// - a number of packets
 	// - a timeout. A packet arrives. If the timeout has been reached, a muxed packet is triggered
@@ -438,8 +711,12 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 	if (( (size_threshold == size_max) && (timeout == MAXTIMEOUT) && (period == MAXTIMEOUT)) && (limit_numpackets_tun == 0))
 		limit_numpackets_tun = 1;
 
+	// the bundle can not hold more than MAXPKTS packets
+	if (limit_numpackets_tun > MAXPKTS)
+		limit_numpackets_tun = MAXPKTS;
+
 	LMLOG(LDBG_1, "Multiplexing policies: size threshold: %i. numpackets: %i. timeout: %d period: %d", size_threshold, limit_numpackets_tun, timeout, period);
-	
+
 
 	switch(ROHC_mode) {
 		case 0:
@@ -456,77 +733,67 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 			break;*/
 	}
 
-	// variables for storing the packets to multiplex
-	size_muxed_packet = data_simplemux->size_muxed_packet;						// acumulated size of the multiplexed packet
-	first_header_written = data_simplemux->first_header_written;				// it indicates if the first header has been written or not
-
-
-	num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun ;	// number of packets received and not sent from tun (stored)
-
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(protocol[j], data_simplemux->protocol[j], SIZE_PROTOCOL_FIELD*sizeof(unsigned char)); // protocol field of each packet
-	
-	memcpy(size_separators_to_multiplex, data_simplemux->size_separators_to_multiplex, MAXPKTS*sizeof(uint16_t));	// stores the size of the Simplemux separator. It does not include the "Protocol" field
-
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(separators_to_multiplex[j], data_simplemux->separators_to_multiplex[j], 3*sizeof(unsigned char)); // stores the header ('protocol' not included) received from tun, before sending it to the network
-	
-	memcpy(size_packets_to_multiplex, data_simplemux->size_packets_to_multiplex, MAXPKTS*sizeof(uint16_t));			// stores the size of the received packet
-	
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(packets_to_multiplex[j], data_simplemux->packets_to_multiplex[j], BUFSIZE*sizeof(unsigned char)); // stores the packets received from tun, before storing it or sending it to the network
-
-	
 	// End Initialize--------------------------------------------------------------------
 	//-----------------------------------------------------------------------------------
 
-	/**************************************************************************************/	
+	/**************************************************************************************/
 	/***************** TUN to NET: compress and multiplex *********************************/
 	/**************************************************************************************/
 
 	if ((packet_in != NULL) && (size_packet_in != 0)) {
-	
-		//LMLOG(LINF, "Entro porque ha llegado un pkt");
-		// data arrived at tun: read it, and check if the stored packets should be written to the network  
 
-		/* read the packet from tun, store it in the array, and store its size */
-		memcpy(packets_to_multiplex[num_pkts_stored_from_tun], packet_in, size_packet_in);
-		size_packets_to_multiplex[num_pkts_stored_from_tun] = size_packet_in;
-	
+		// data arrived at tun: check if the stored packets should be written to the network
+		packet = packet_in;
+		size_packet = size_packet_in;
+
 		/* increase the counter of the number of packets read from tun*/
-		tun2net++;	
+		tun2net++;
+
+		// class scheduling: the class is chosen with the native headers
+		bulk_packet = (data_simplemux->bulk_period > 0) && !mux_packet_realtime (packet, size_packet);
+
+		// the period only runs while there are packets stored. If the bundle is empty, the period is
+		// restarted at its last boundary, as if the expirations without packets had been processed
+		// in adaptive mode, the budget of the bundle starts with its first packet
+		if (data_simplemux->num_pkts_stored_from_tun == 0) {
+			time_in_microsec = GetTimeStamp();
+			time_difference = time_in_microsec - data_simplemux->time_last_sent_in_microsec;
+			if (data_simplemux->latency_budget > 0)
+				data_simplemux->time_last_sent_in_microsec = time_in_microsec;
+			else if ((period > 0) && (time_difference > period))
+				data_simplemux->time_last_sent_in_microsec += (time_difference / period) * period;
+		}
 
 		if (debug_level > 1 ) LMLOG (LDBG_2,"\n");
-		LMLOG(LDBG_1, "NATIVE PACKET #%d: Read packet from tun: %d bytes\n", tun2net, size_packets_to_multiplex[num_pkts_stored_from_tun]);
+		LMLOG(LDBG_1, "NATIVE PACKET #%d: Read packet from tun: %d bytes\n", tun2net, size_packet);
 
 		// print the native packet received
 		if (debug_level) {
 			LMLOG(LDBG_2, "   ");
 			// dump the newly-created IP packet on terminal
-			dump_packet ( size_packets_to_multiplex[num_pkts_stored_from_tun], packets_to_multiplex[num_pkts_stored_from_tun] );
+			dump_packet ( size_packet, packet );
 		}
 
-		// write in the log file
-		if ( log_file != NULL ) {
-			fprintf (log_file, "%"PRIu64"\trec\tnative\t%i\t%lu\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun], tun2net);
-			fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-		}
+		// trace the event
+		mux_trace (MUX_EV_REC_NATIVE, 0, GetTimeStamp(), size_packet, tun2net, 0, MUX_TUNNEL(data_simplemux), NULL);
 
 		// check if this packet (plus the tunnel and simplemux headers ) is bigger than the MTU. Drop it in that case
-		drop_packet = 0;	
-		if ( size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE + 3 > selected_mtu ) {
+		drop_packet = 0;
+		if ( size_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE + 3 > selected_mtu ) {
 				drop_packet = 1;
 
-				LMLOG(LDBG_1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE + 3, selected_mtu);
-
-				// write the log file
-				if ( log_file != NULL ) {
-					//fprintf (log_file, "%"PRIu64"\tdrop\ttoo_long\t%i\t%lu\tto\t%s\t%i\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE + 3, 
-					//tun2net, inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), /*ntohs(remote.sin_port),*/ num_pkts_stored_from_tun);
-					fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-				}
+				LMLOG(LDBG_1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE + 3, selected_mtu);
 			}
 
+		// a bulk packet is dropped if its queue is full. It is checked before the compression, since
+		// a packet compressed and not sent would desynchronize the contexts of the tunnel
+		if ((drop_packet == 0) && bulk_packet && ((data_simplemux->bulk_count == MAXPKTS)
+				|| (data_simplemux->bulk_bytes + size_packet > (int)sizeof(data_simplemux->bulk_buf)))) {
+			LMLOG(LDBG_1, " Warning: Packet dropped (bulk queue full: %i packets, %i bytes)\n", data_simplemux->bulk_count, data_simplemux->bulk_bytes);
+			mux_trace (MUX_EV_DROP_BULK_FULL, 0, GetTimeStamp(), size_packet, tun2net, 0, MUX_TUNNEL(data_simplemux), NULL);
+			return(0);
+		}
+
 		// the length of the packet is adequate
 		if ( drop_packet == 0 ) {
 
@@ -535,16 +802,22 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 				// header compression has been selected by the user
 
 				// copy the length read from tun to the buffer where the packet to be compressed is stored
-				ip_packet.len = size_packets_to_multiplex[num_pkts_stored_from_tun];
+				ip_packet.len = size_packet;
 
 				// copy the packet
-				memcpy(rohc_buf_data_at(ip_packet, 0), packets_to_multiplex[num_pkts_stored_from_tun], size_packets_to_multiplex[num_pkts_stored_from_tun]);
+				memcpy(rohc_buf_data_at(ip_packet, 0), packet, size_packet);
 
 				// reset the buffer where the rohc packet is to be stored
 				rohc_buf_reset (&rohc_packet);
 
-				// compress the IP packet
-				status = rohc_compress4(compressor, ip_packet, &rohc_packet);
+				// compress the IP packet with the compressor of the tunnel
+				rohc_ctx = rohc_ctx_of_rule(data_simplemux);
+				compressor = rohc_ctx_compressor(rohc_ctx);
+				if (compressor != NULL) {
+					status = rohc_compress4(compressor, ip_packet, &rohc_packet);
+				} else {
+					status = ROHC_STATUS_ERROR;
+				}
 
 				// check the result of the compression
 				if(status == ROHC_STATUS_SEGMENT) {
@@ -564,17 +837,19 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 					// since this packet has been compressed with ROHC, its protocol number must be 142
 					// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
 					if ( SIZE_PROTOCOL_FIELD == 1 ) {
-						protocol[num_pkts_stored_from_tun][0] = 142;
-					} else {	// SIZE_PROTOCOL_FIELD == 2 
-						protocol[num_pkts_stored_from_tun][0] = 0;
-						protocol[num_pkts_stored_from_tun][1] = 142;
+						prot[0] = 142;
+					} else {	// SIZE_PROTOCOL_FIELD == 2
+						prot[0] = 0;
+						prot[1] = 142;
 					}
 
-					// Copy the compressed length and the compressed packet over the packet read from tun
-					size_packets_to_multiplex[num_pkts_stored_from_tun] = rohc_packet.len;
-					for (l = 0; l < size_packets_to_multiplex[num_pkts_stored_from_tun] ; l++) {
-						packets_to_multiplex[num_pkts_stored_from_tun][l] = rohc_buf_byte_at(rohc_packet, l);
-					}
+					rohc_ctx->comp_packets++;
+					rohc_ctx->comp_bytes_in += size_packet;
+					rohc_ctx->comp_bytes_out += rohc_packet.len;
+
+					// the compressed packet is the one to be multiplexed
+					packet = rohc_buf_data_at(rohc_packet, 0);
+					size_packet = rohc_packet.len;
 
 					/* dump the ROHC packet on terminal */
 					if (debug_level >= 1 ) {
@@ -589,362 +864,158 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 					/* compressor failed to compress the IP packet */
 					/* Send it in its native form */
 
-					// I don't have to copy the native length and the native packet, because they
-					// have already been stored in 'size_packets_to_multiplex[num_pkts_stored_from_tun]' and 'packets_to_multiplex[num_pkts_stored_from_tun]'
-
 					// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP'
 					// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
 					if ( SIZE_PROTOCOL_FIELD == 1 ) {
-						protocol[num_pkts_stored_from_tun][0] = 4;
-					} else {	// SIZE_PROTOCOL_FIELD == 2 
-						protocol[num_pkts_stored_from_tun][0] = 0;
-						protocol[num_pkts_stored_from_tun][1] = 4;
+						prot[0] = 4;
+					} else {	// SIZE_PROTOCOL_FIELD == 2
+						prot[0] = 0;
+						prot[1] = 4;
 					}
+					rohc_ctx->comp_failures++;
 					fprintf(stderr, "compression of IP packet failed\n");
 
-					// print in the log file
-					if ( log_file != NULL ) {
-						fprintf (log_file, "%"PRIu64"\terror\tcompr_failed. Native packet sent\t%i\t%lu\\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun], tun2net);
-						fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-					}
+					// trace the event
+					mux_trace (MUX_EV_COMPR_FAILED, 0, GetTimeStamp(), size_packet, tun2net, 0, MUX_TUNNEL(data_simplemux), NULL);
 
-					LMLOG(LDBG_2, "  ROHC did not work. Native packet sent: %i bytes:\n   ", size_packets_to_multiplex[num_pkts_stored_from_tun]);
-					//goto release_compressor;
+					LMLOG(LDBG_2, "  ROHC did not work. Native packet sent: %i bytes:\n   ", size_packet);
 				}
 
 			} else {
 				// header compression has not been selected by the user
 
-				// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP' 
+				// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP'
 				// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
 				if ( SIZE_PROTOCOL_FIELD == 1 ) {
-					protocol[num_pkts_stored_from_tun][0] = 4;
-				} else {	// SIZE_PROTOCOL_FIELD == 2 
-					protocol[num_pkts_stored_from_tun][0] = 0;
-					protocol[num_pkts_stored_from_tun][1] = 4;
+					prot[0] = 4;
+				} else {	// SIZE_PROTOCOL_FIELD == 2
+					prot[0] = 0;
+					prot[1] = 4;
 				}
 			}
-			
-			/*** Calculate if the size limit will be reached when multiplexing the present packet ***/
-			// if the addition of the present packet will imply a multiplexed packet bigger than the size limit:
-			// - I send the previously stored packets
-			// - I store the present one
-			// - I reset the period
 
-			// calculate if all the packets belong to the same protocol
-			single_protocol = 1;
-			for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-				for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-					if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
+			// class scheduling: a bulk packet waits in the queue of its class. The bundle is sent when the bulk
+			// packets queued exceed their threshold or the first one has waited the bulk period, and they fill
+			// the room left by the realtime packets. The room in the queue has been checked with the native packet
+			if (bulk_packet) {
+				if (data_simplemux->bulk_bytes + size_packet > (int)sizeof(data_simplemux->bulk_buf)) {
+					// the compressed packet is longer than the native one (e.g. it carries a full context). The
+					// native packet is queued instead
+					packet = packet_in;
+					size_packet = size_packet_in;
+					if ( SIZE_PROTOCOL_FIELD == 1 ) {
+						prot[0] = 4;
+					} else {	// SIZE_PROTOCOL_FIELD == 2
+						prot[0] = 0;
+						prot[1] = 4;
+					}
 				}
-			}
+				bulk_enqueue (data_simplemux, prot, packet, size_packet);
+				LMLOG(LDBG_1, " Packet queued in the bulk class: %d pkts: %d bytes\n", data_simplemux->bulk_count, data_simplemux->bulk_bytes);
 
-			// calculate the size without the present packet
-			predicted_size_muxed_packet = predict_size_multiplexed_packet (num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex);
+				time_in_microsec = GetTimeStamp();
+				if ((data_simplemux->bulk_bytes > muxed_bulk_threshold (data_simplemux)) || (data_simplemux->bulk_count == MAXPKTS)
+						|| (time_in_microsec - data_simplemux->bulk_arrival[0] > data_simplemux->bulk_period)) {
 
-			// I add the length of the present packet:
+					bundle_fill_bulk (data_simplemux, size_max);
+					num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
-			// separator and length of the present packet
-			if (first_header_written == 0) {
-				// this is the first header, so the maximum length is 64
-				if (size_packets_to_multiplex[num_pkts_stored_from_tun] < 64 ) {
-					predicted_size_muxed_packet = predicted_size_muxed_packet + 1 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-				} else {
-					predicted_size_muxed_packet = predicted_size_muxed_packet + 2 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-				}
-			} else {
-				// this is not the first header, so the maximum length is 128
-				if (size_packets_to_multiplex[num_pkts_stored_from_tun] < 128 ) {
-					predicted_size_muxed_packet = predicted_size_muxed_packet + 1 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-				} else {
-					predicted_size_muxed_packet = predicted_size_muxed_packet + 2 + size_packets_to_multiplex[num_pkts_stored_from_tun];
+					LMLOG(LDBG_2, "\n");
+					LMLOG(LDBG_1, "SENDING TRIGGERED: bulk class threshold or period reached\n");
+					LMLOG(LDBG_1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, data_simplemux->size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
+
+					total_length = bundle_flush (data_simplemux, out_muxed_packet);
+					result = 1;
+
+					// trace the event
+					mux_trace (MUX_EV_SENT_MUXED, MUX_TRIG_BULK, GetTimeStamp(), total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net,
+							num_pkts_stored_from_tun, MUX_TUNNEL(data_simplemux), MUX_DRLOC(data_simplemux));
+
+					// the realtime packets stored have been sent too, so the period is restarted
+					data_simplemux->time_last_sent_in_microsec = time_in_microsec;
 				}
+				return(result);
 			}
 
-			if (predicted_size_muxed_packet > size_max ) {
-				// if the present packet is muxed, the max size of the packet will be overriden. So I first empty the buffer
-				//i.e. I build and send a multiplexed packet not including the current one
+			num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
-				LMLOG(LDBG_2, "\n");			 
-				LMLOG(LDBG_1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
+			// build the separator of the present packet
+			size_separator = write_separator (separator, size_packet, data_simplemux->first_header_written == 0);
 
+			/*** Calculate if the size limit will be reached when multiplexing the present packet ***/
+			// if the addition of the present packet will imply a multiplexed packet bigger than the size limit:
+			// - I send the previously stored packets
+			// - I store the present one
+			// - I reset the period
 
+			// check if the present packet breaks the 'single protocol' condition of the bundle. In that case,
+			// a 'Protocol' field is added to each non-first separator
+			predicted_size_muxed_packet = bundle_predicted_size (data_simplemux, size_separator, size_packet, prot, &mixed_protocols);
 
-				// add the Single Protocol Bit in the first header (the most significant bit)
-				// it is '1' if all the multiplexed packets belong to the same protocol
-				if (single_protocol == 1) {
-					separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-					size_muxed_packet = size_muxed_packet + 1;								// one byte corresponding to the 'protocol' field of the first header
-				} else {
-					size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;		// one byte per packet, corresponding to the 'protocol' field
-				}
+			if ((num_pkts_stored_from_tun > 0) && (predicted_size_muxed_packet > size_max)) {
+				// if the present packet is muxed, the max size of the packet will be overriden. So I first empty the buffer
+				//i.e. I send a multiplexed packet not including the current one
 
-				// build the multiplexed packet without the current one
-				total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
+				// the bulk packets queued that fit go with it
+				bundle_fill_bulk (data_simplemux, size_max);
+				num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
-				if (single_protocol) {
+				LMLOG(LDBG_2, "\n");
+				LMLOG(LDBG_1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
+
+				if (data_simplemux->single_protocol) {
 					LMLOG(LDBG_2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
 				} else {
 					LMLOG(LDBG_2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
 				}
-				LMLOG(LDBG_2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
-				LMLOG(LDBG_1, " Sending muxed packet without this one: %i bytes\n", size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
 
-
-				/************************************************************* RETURN ***********************************************************************/
-				// send the multiplexed packet without the current one 
-				memcpy(out_muxed_packet, muxed_packet,total_length);
-				*out_total_length = total_length; 
+				// send the multiplexed packet without the current one
+				total_length = bundle_flush (data_simplemux, out_muxed_packet);
 				result = 2;
-				// write the log file
-				if ( log_file != NULL ) {
-						fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t%i\tMTU\n", GetTimeStamp(), total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net, 
-							inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), /*ntohs(remote.sin_port),*/ num_pkts_stored_from_tun);
-						fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-				}
-
-				/************************************************************************************************************************************/
 
-				// I have sent a packet, so I restart the period: update the time of the last packet sent
-				time_in_microsec = GetTimeStamp();
-				time_last_sent_in_microsec = time_in_microsec;
-
-
-				// I have emptied the buffer, so I have to
-				//move the current packet to the first position of the 'packets_to_multiplex' array
-				for (l = 0; l < BUFSIZE; l++ ) {
-					packets_to_multiplex[0][l]=packets_to_multiplex[num_pkts_stored_from_tun][l];
-				}
-
-				// move the current separator to the first position of the array
-				for (l = 0; l < 2; l++ ) {
-					separators_to_multiplex[0][l]=separators_to_multiplex[num_pkts_stored_from_tun][l];
-				}
-
-				// move the length to the first position of the array
-				size_packets_to_multiplex[0] = size_packets_to_multiplex[num_pkts_stored_from_tun];
-				size_separators_to_multiplex[0] = size_separators_to_multiplex[num_pkts_stored_from_tun];
-				for (j=1; j < MAXPKTS; j++) size_packets_to_multiplex [j] = 0;
-
-
-				// I have sent a packet, so I set to 0 the "first_header_written" bit
-				first_header_written = 0;
-
-				// reset the length and the number of packets
-				size_muxed_packet = 0;
-				num_pkts_stored_from_tun = 0;
-
-				// Update simplemux data  -----------------------------------------------------------
-				//-----------------------------------------------------------------------------------
-
-				data_simplemux->time_last_sent_in_microsec = time_last_sent_in_microsec;	// moment when the last multiplexed packet was sent
-
-				// variables for storing the packets to multiplex
-				data_simplemux->size_muxed_packet = size_muxed_packet;						// acumulated size of the multiplexed packet
-				data_simplemux->first_header_written = first_header_written;				// it indicates if the first header has been written or not
-
-				data_simplemux->num_pkts_stored_from_tun = num_pkts_stored_from_tun ;		// number of packets received and not sent from tun (stored)
-
-				for (j = 0 ; j < MAXPKTS ; ++j) 
-					memcpy(data_simplemux->protocol[j], protocol[j], SIZE_PROTOCOL_FIELD*sizeof(unsigned char)); // protocol field of each packet
-	
-				memcpy(data_simplemux->size_separators_to_multiplex, size_separators_to_multiplex, MAXPKTS*sizeof(uint16_t));
-                                 	// stores the size of the Simplemux separator. It does not include the "Protocol" field
+				LMLOG(LDBG_2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
+				LMLOG(LDBG_1, " Sending muxed packet without this one: %i bytes\n", total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
 
-				for (j = 0 ; j < MAXPKTS ; ++j) 
-					memcpy(data_simplemux->separators_to_multiplex[j], separators_to_multiplex[j], 3*sizeof(unsigned char));
-                                       // stores the header ('protocol' not included) received from tun, before sending it to the network
-	
-				memcpy(data_simplemux->size_packets_to_multiplex, size_packets_to_multiplex, MAXPKTS*sizeof(uint16_t));
-                		       // stores the size of the received packet
-	
-				for (j = 0 ; j < MAXPKTS ; ++j) 
-					memcpy(data_simplemux->packets_to_multiplex[j], packets_to_multiplex[j], BUFSIZE*sizeof(unsigned char));
-                                              // stores the packets received from tun, before storing it or sending it to the network
+				// trace the event
+				mux_trace (MUX_EV_SENT_MUXED, MUX_TRIG_MTU, GetTimeStamp(), total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net,
+						num_pkts_stored_from_tun, MUX_TUNNEL(data_simplemux), MUX_DRLOC(data_simplemux));
 
-				// End Update simplemux data --------------------------------------------------------
-				//-----------------------------------------------------------------------------------
+				// I have sent a packet, so I restart the period: update the time of the last packet sent
+				data_simplemux->time_last_sent_in_microsec = GetTimeStamp();
 
-//LMLOG(LINF, "salgo de mux_packet I %d\n",result);
 				return(result);
 
 			}	/*** end check if size limit would be reached ***/
 
-
-			// update the size of the muxed packet, adding the size of the current one
-			size_muxed_packet = size_muxed_packet + size_packets_to_multiplex[num_pkts_stored_from_tun];
-
-			// I have to add the multiplexing separator.
-			//   - It is 1 byte if the length is smaller than 64 (or 128 for non-first separators) 
-			//   - It is 2 bytes if the length is 64 (or 128 for non-first separators) or more
-			//   - It is 3 bytes if the length is 8192 (or 16384 for non-first separators) or more
-			if (first_header_written == 0) {
-				// this is the first header
-				maximum_packet_length = 64;
-				limit_length_two_bytes = 8192;
-			} else {
-				// this is a non-first header
-				maximum_packet_length = 128;
-				limit_length_two_bytes = 16384;
+			if (mixed_protocols) {
+				bundle_add_protocol_fields (data_simplemux);
 			}
 
-			// check if the length has to be one, two or three bytes
-			// I am assuming that a packet will never be bigger than 1048576 (2^20) bytes for a first header,
-			// or 2097152 (2^21) bytes for a non-first one)
-
-			// one-byte separator
-			if (size_packets_to_multiplex[num_pkts_stored_from_tun] < maximum_packet_length ) {
-
-				// the length can be written in the first byte of the separator (expressed in 6 or 7 bits)
-				size_separators_to_multiplex[num_pkts_stored_from_tun] = 1;
-
-				// add the length to the string.
-				// since the value is < maximum_packet_length, the most significant bits will always be 0
-				separators_to_multiplex[num_pkts_stored_from_tun][0] = size_packets_to_multiplex[num_pkts_stored_from_tun];
-
-				// increase the size of the multiplexed packet
-				size_muxed_packet ++;
-
-
-				// print the  Mux separator (only one byte)
-				if(debug_level) {
-					FromByte(separators_to_multiplex[num_pkts_stored_from_tun][0], bits);
-					LMLOG(LDBG_2, " Mux separator of 1 byte: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-					if (first_header_written == 0) {
-						PrintByte(LDBG_2, 7, bits);			// first header
-					} else {
-						PrintByte(LDBG_2, 8, bits);			// non-first header
-					}
-					LMLOG(LDBG_2, "\n");
-				}
-
-
-			// two-byte separator
-			} else if (size_packets_to_multiplex[num_pkts_stored_from_tun] < limit_length_two_bytes ) {
-
-				// the length requires a two-byte separator (length expressed in 13 or 14 bits)
-				size_separators_to_multiplex[num_pkts_stored_from_tun] = 2;
-
-				// first byte of the Mux separator
-				// It can be:
-				// - first-header: SPB bit, LXT=1 and 6 bits with the most significant bits of the length
-				// - non-first-header: LXT=1 and 7 bits with the most significant bits of the length
-				// get the most significant bits by dividing by 128 (the 7 less significant bits will go in the second byte)
-				// add 64 (or 128) in order to put a '1' in the second (or first) bit
-				if (first_header_written == 0) {
-					separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 128 ) + 64;	// first header
-				} else {
-					separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 128 ) + 128;	// non-first header
-				}
-
-				// second byte of the Mux separator
-				// Length: the 7 less significant bytes of the length. Use modulo 128
-				separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 128;
-
-				// LXT bit has to be set to 0, because this is the last byte of the length
-				// if I do nothing, it will be 0, since I have used modulo 128
-
-				// increase the size of the multiplexed packet
-				size_muxed_packet = size_muxed_packet + 2;
-
-				// print the two bytes of the separator
-				if(debug_level) {
-					// first byte
-					FromByte(separators_to_multiplex[0][num_pkts_stored_from_tun], bits);
-					LMLOG(LDBG_2, " Mux separator of 2 bytes: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-					if (first_header_written == 0) {
-						PrintByte(LDBG_2, 7, bits);			// first header
-					} else {
-						PrintByte(LDBG_2, 8, bits);			// non-first header
-					}
-
-					// second byte
-					FromByte(separators_to_multiplex[num_pkts_stored_from_tun][1], bits);
-					LMLOG(LDBG_2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][1]);
-					PrintByte(LDBG_2, 8, bits);
-					LMLOG(LDBG_2, "\n");
-				}	
-
-
-			// three-byte separator
-			} else {
-
-				// the length requires a three-byte separator (length expressed in 20 or 21 bits)
-				size_separators_to_multiplex[num_pkts_stored_from_tun] = 3;
-//FIXME
-				// first byte of the Mux separator
-				// It can be:
-				// - first-header: SPB bit, LXT=1 and 6 bits with the most significant bits of the length
-				// - non-first-header: LXT=1 and 7 bits with the most significant bits of the length
-				// get the most significant bits by dividing by 128 (the 7 less significant bits will go in the second byte)
-				// add 64 (or 128) in order to put a '1' in the second (or first) bit
-
-				if (first_header_written == 0) {
-					// first header
-					separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 16384 ) + 64;
-
-				} else {
-					// non-first header
-					separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 16384 ) + 128;	
-				}
-
-
-				// second byte of the Mux separator
-				// Length: the 7 second significant bytes of the length. Use modulo 16384
-				separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 16384;
-
-				// LXT bit has to be set to 1, because this is not the last byte of the length
-				separators_to_multiplex[num_pkts_stored_from_tun][0] = separators_to_multiplex[num_pkts_stored_from_tun][0] + 128;
-
-
-				// third byte of the Mux separator
-				// Length: the 7 less significant bytes of the length. Use modulo 128
-				separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 128;
-
-				// LXT bit has to be set to 0, because this is the last byte of the length
-				// if I do nothing, it will be 0, since I have used modulo 128
-
-
-				// increase the size of the multiplexed packet
-				size_muxed_packet = size_muxed_packet + 3;
-
-				// print the three bytes of the separator
-				if(debug_level) {
-					// first byte
-					FromByte(separators_to_multiplex[0][num_pkts_stored_from_tun], bits);
-					LMLOG(LDBG_2, " Mux separator of 2 bytes: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-					if (first_header_written == 0) {
+			// print the Mux separator
+			if (debug_level) {
+				for (l = 0; l < size_separator; l++) {
+					FromByte(separator[l], bits);
+					LMLOG(LDBG_2, " Mux separator of %i bytes: (%02x) ", size_separator, separator[l]);
+					if ((l == 0) && (data_simplemux->first_header_written == 0)) {
 						PrintByte(LDBG_2, 7, bits);			// first header
 					} else {
 						PrintByte(LDBG_2, 8, bits);			// non-first header
 					}
-
-					// second byte
-					FromByte(separators_to_multiplex[num_pkts_stored_from_tun][1], bits);
-					LMLOG(LDBG_2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][1]);
-					PrintByte(LDBG_2, 8, bits);
-					LMLOG(LDBG_2, "\n");
-
-					// third byte
-					FromByte(separators_to_multiplex[num_pkts_stored_from_tun][2], bits);
-					LMLOG(LDBG_2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][2]);
-					PrintByte(LDBG_2, 8, bits);
 					LMLOG(LDBG_2, "\n");
 				}
 			}
 
+			// update the estimations of the traffic with the packet to be multiplexed. Not done before the
+			// MTU check: in that case this function is called again with the same packet
+			muxed_adaptive_sample (data_simplemux, size_packet);
 
-			// I have finished storing the packet, so I increase the number of stored packets
-			num_pkts_stored_from_tun ++;
+			// write the separator, the 'Protocol' field and the packet at their final position in the bundle
+			bundle_append (data_simplemux, separator, size_separator, prot, packet, size_packet, GetTimeStamp());
+			num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
-			// I have written a header of the multiplexed bundle, so I have to set to 1 the "first header written bit"
-			if (first_header_written == 0) first_header_written = 1;
-			
-
-			//LMLOG (LDBG_1,"\n");
-			LMLOG(LDBG_1, " Packet stopped and multiplexed: accumulated %d pkts: %d bytes.", num_pkts_stored_from_tun , size_muxed_packet);
+			LMLOG(LDBG_1, " Packet stopped and multiplexed: accumulated %d pkts: %d bytes.", num_pkts_stored_from_tun , data_simplemux->size_muxed_packet);
 			time_in_microsec = GetTimeStamp();
-			time_difference = time_in_microsec - time_last_sent_in_microsec;		
+			time_difference = time_in_microsec - data_simplemux->time_last_sent_in_microsec;
 			LMLOG(LDBG_1, " Time since last trigger: %" PRIu64 " usec\n", time_difference);//PRIu64 is used for printing uint64_t numbers
 
 
@@ -952,154 +1023,92 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 
 			// if the packet limit or the size threshold are reached, send all the stored packets to the network
 			// do not worry about the MTU. if it is reached, a number of packets will be sent
-			if ((num_pkts_stored_from_tun == limit_numpackets_tun) || (size_muxed_packet > size_threshold) || (time_difference > timeout )) {
-
-				// a multiplexed packet has to be sent
+			if ((num_pkts_stored_from_tun >= limit_numpackets_tun) || (data_simplemux->size_muxed_packet > size_threshold) || (time_difference > timeout )) {
 
-				// calculate if all the packets belong to the same protocol
-				single_protocol = 1;
-				for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-					for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-						if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
-					}
-				}
+				trigger = 0;
+				if (num_pkts_stored_from_tun >= limit_numpackets_tun)
+					trigger |= MUX_TRIG_NUMPACKET;
+				if (data_simplemux->size_muxed_packet > size_threshold)
+					trigger |= MUX_TRIG_SIZE;
+				if (time_difference > timeout)
+					trigger |= MUX_TRIG_TIMEOUT;
 
-
-				// Add the Single Protocol Bit in the first header (the most significant bit)
-				// It is 1 if all the multiplexed packets belong to the same protocol
-				if (single_protocol == 1) {
-					separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-					size_muxed_packet = size_muxed_packet + 1;				// one byte corresponding to the 'protocol' field of the first header
-				} else {
-					size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;	// one byte per packet, corresponding to the 'protocol' field
-				}
+				// the bulk packets queued that fit go with the realtime ones
+				bundle_fill_bulk (data_simplemux, size_max);
+				num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
 				// write the debug information
 				if (debug_level) {
 					LMLOG(LDBG_2, "\n");
 					LMLOG(LDBG_1, "SENDING TRIGGERED: ");
-					if (num_pkts_stored_from_tun == limit_numpackets_tun)
+					if (trigger & MUX_TRIG_NUMPACKET)
 						LMLOG(LDBG_1, "num packet limit reached\n");
-					if (size_muxed_packet > size_threshold)
+					if (trigger & MUX_TRIG_SIZE)
 						LMLOG(LDBG_1," size threshold reached\n");
-					if (time_difference > timeout)
+					if (trigger & MUX_TRIG_TIMEOUT)
 						LMLOG(LDBG_1, "timeout reached\n");
 
-					if (single_protocol) {
+					if (data_simplemux->single_protocol) {
 						LMLOG(LDBG_2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
 					} else {
 						LMLOG(LDBG_2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
 					}
 					LMLOG(LDBG_2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
-					LMLOG(LDBG_1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);								
+					LMLOG(LDBG_1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, data_simplemux->size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
 				}
 
-				// build the multiplexed packet including the current one
-				total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
+				// trace the event
+				mux_trace (MUX_EV_SENT_MUXED, trigger, GetTimeStamp(), data_simplemux->size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net,
+						num_pkts_stored_from_tun, MUX_TUNNEL(data_simplemux), MUX_DRLOC(data_simplemux));
 
-
-				/************************************************************* RETURN ***********************************************************************/
-				// send the multiplexed packet  
-				memcpy(out_muxed_packet, muxed_packet,total_length);
-				*out_total_length = total_length;
+				// send the multiplexed packet including the current one
+				bundle_flush (data_simplemux, out_muxed_packet);
 				result = 1;
 
-				// write the log file
-				if ( log_file != NULL ) {
-					fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t%i", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net, 
-					inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), /*ntohs(remote.sin_port),*/ num_pkts_stored_from_tun);
-					if (num_pkts_stored_from_tun == limit_numpackets_tun)
-						fprintf(log_file, "\tnumpacket_limit");
-					if (size_muxed_packet > size_threshold)
-						fprintf(log_file, "\tsize_limit");
-					if (time_difference > timeout)
-						fprintf(log_file, "\ttimeout");
-					fprintf(log_file, "\n");
-					fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-				}
-                /************************************************************************************/
-
-				// I have sent a packet, so I set to 0 the "first_header_written" bit
-				first_header_written = 0;
-
-				// reset the length and the number of packets
-				size_muxed_packet = 0 ;
-				num_pkts_stored_from_tun = 0;
-
 				// restart the period: update the time of the last packet sent
-				time_last_sent_in_microsec = time_in_microsec;
+				data_simplemux->time_last_sent_in_microsec = time_in_microsec;
 			}
 		}
 	}
-	/*************************************************************************************/	
+	/*************************************************************************************/
 	/******************** Period expired: multiplex **************************************/
-	/*************************************************************************************/	
+	/*************************************************************************************/
 	else if ((packet_in == NULL) && (size_packet_in == 0)) {
-		//LMLOG(LINF, "Entro porque se ha cumplido el periodo");
 		// The period has expired
 		// Check if there is something stored, and send it
 		// since there is no new packet, here it is not necessary to compress anything
 
 		time_in_microsec = GetTimeStamp();
-		if ( num_pkts_stored_from_tun > 0 ) {
+		num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
+		if (( num_pkts_stored_from_tun > 0 ) || (data_simplemux->bulk_count > 0)) {
 
-			// There are some packets stored
+			// There are some packets stored. If there are no realtime packets, the deadline of the bulk class expired
+			trigger = (num_pkts_stored_from_tun > 0) ? MUX_TRIG_PERIOD : MUX_TRIG_BULK;
+			bundle_fill_bulk (data_simplemux, size_max);
+			num_pkts_stored_from_tun = data_simplemux->num_pkts_stored_from_tun;
 
 			// calculate the time difference
-			time_difference = time_in_microsec - time_last_sent_in_microsec;		
-			
-			// calculate if all the packets belong to the same protocol
-			single_protocol = 1;
-			for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-				for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-					if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
-				}
-			}
+			time_difference = time_in_microsec - data_simplemux->time_last_sent_in_microsec;
+
 			if (debug_level) {
 				LMLOG(LDBG_2, "\n");
 				LMLOG(LDBG_1, "SENDING TRIGGERED. Period expired. Time since last trigger: %" PRIu64 " usec\n", time_difference);
-				if (single_protocol) {
+				if (data_simplemux->single_protocol) {
 					LMLOG(LDBG_2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
 				} else {
 					LMLOG(LDBG_2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
 				}
 				LMLOG(LDBG_2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
-				LMLOG(LDBG_1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);	
+				LMLOG(LDBG_1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, data_simplemux->size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE);
 			}
 
-
-			// Add the Single Protocol Bit in the first header (the most significant bit)
-			// It is 1 if all the multiplexed packets belong to the same protocol
-			if (single_protocol == 1) {
-				separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-				size_muxed_packet = size_muxed_packet + 1;								// one byte corresponding to the 'protocol' field of the first header
-			} else {
-				size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;		// one byte per packet, corresponding to the 'protocol' field
-			}
-
-			// build the multiplexed packet
-			total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
-
-			/************************************************************* RETURN ***********************************************************************/
-			// send the multiplexed packet  
-			memcpy(out_muxed_packet, muxed_packet,total_length);
-			*out_total_length = total_length;
-			//LMLOG(LINF," total_length periodo:%d",*out_total_length);
+			// send the multiplexed packet
+			total_length = bundle_flush (data_simplemux, out_muxed_packet);
 			result = 1;
 
-			// write the log file
-			if ( log_file != NULL ) {
-				fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t\t%i\tperiod\n", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net, 
-				inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), num_pkts_stored_from_tun);	
-			}              
-            /************************************************************************************/
-
-			// I have sent a packet, so I set to 0 the "first_header_written" bit
-			first_header_written = 0;
-
-			// reset the length and the number of packets
-			size_muxed_packet = 0 ;
-			num_pkts_stored_from_tun = 0;
+			// trace the event
+			mux_trace (MUX_EV_SENT_MUXED, trigger, GetTimeStamp(), total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, tun2net,
+					num_pkts_stored_from_tun, MUX_TUNNEL(data_simplemux), MUX_DRLOC(data_simplemux));
 
 		} else {
 			// No packet arrived
@@ -1107,7 +1116,7 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 		}
 
 		// restart the period
-		time_last_sent_in_microsec = time_in_microsec;
+		data_simplemux->time_last_sent_in_microsec = time_in_microsec;
 
 	}
 	else {
@@ -1115,38 +1124,6 @@ int mux_packets (unsigned char *packet_in, uint32_t size_packet_in, data_simplem
 		exit(1);
 	}
 
-	// Update simplemux data  -----------------------------------------------------------
-	//-----------------------------------------------------------------------------------
-
-	data_simplemux->time_last_sent_in_microsec = time_last_sent_in_microsec;	// moment when the last multiplexed packet was sent
-
-	// variables for storing the packets to multiplex
-	data_simplemux->size_muxed_packet = size_muxed_packet;				// acumulated size of the multiplexed packet
-	data_simplemux->first_header_written = first_header_written;			// it indicates if the first header has been written or not
-
-	data_simplemux->num_pkts_stored_from_tun = num_pkts_stored_from_tun ;		// number of packets received and not sent from tun (stored)
-
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(data_simplemux->protocol[j], protocol[j], SIZE_PROTOCOL_FIELD*sizeof(unsigned char)); // protocol field of each packet
-	
-	memcpy(data_simplemux->size_separators_to_multiplex, size_separators_to_multiplex, MAXPKTS*sizeof(uint16_t));	
-              // stores the size of the Simplemux separator. It does not include the "Protocol" field
-
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(data_simplemux->separators_to_multiplex[j], separators_to_multiplex[j], 3*sizeof(unsigned char)); 
-                      // stores the header ('protocol' not included) received from tun, before sending it to the network
-	
-	memcpy(data_simplemux->size_packets_to_multiplex, size_packets_to_multiplex, MAXPKTS*sizeof(uint16_t));
-	      // stores the size of the received packet
-	
-	for (j = 0 ; j < MAXPKTS ; ++j) 
-		memcpy(data_simplemux->packets_to_multiplex[j], packets_to_multiplex[j], BUFSIZE*sizeof(unsigned char)); 
-                      // stores the packets received from tun, before storing it or sending it to the network
-	
-	// End Update simplemux data --------------------------------------------------------
-	//-----------------------------------------------------------------------------------
-
-//LMLOG(LINF, "salgo de mux_packets II %d\n",result);
 	return(result);
 
 }
@@ -1242,34 +1219,21 @@ static void print_rohc_traces(void *const priv_ctxt,
 }
 
 /*
- Initialize ROHC
+ Create a ROHC compressor
  */
 
-void initialize_compressor_and_decompressor ()
+static struct rohc_comp *rohc_comp_create ()
 {
-	unsigned int seed;
-	rohc_status_t status;
+	struct rohc_comp *compressor;
 
-	int ROHC_mode = 1;	/* FIXME: now only is 1	*/	
-									// it is 0 if ROHC is not used
-									// it is 1 for ROHC Unidirectional mode (headers are to be compressed/decompressed)
-									// it is 2 for ROHC Bidirectional Optimistic mode
-									// it is 3 for ROHC Bidirectional Reliable mode (not implemented yet)
-
-
-	// If ROHC has been selected, I have to initialize it
 	// see the API here: https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/
 
-	//* initialize the random generator
-	seed = time(NULL);
-	srand(seed);
-
-	// Create a ROHC compressor with Large CIDs and the largest MAX_CID possible for large CIDs 
+	// Create a ROHC compressor with Large CIDs and the largest MAX_CID possible for large CIDs
 	compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL);
 	if(compressor == NULL)
 	{
-		LMLOG(LCRIT, "failed create the ROHC compressor\n");
-		goto error;
+		LMLOG(LERR, "failed create the ROHC compressor\n");
+		return (NULL);
 	}
 
 	LMLOG(LDBG_1, "ROHC compressor created. Profiles: ");
@@ -1279,21 +1243,21 @@ void initialize_compressor_and_decompressor ()
 	// In our case we will consider as RTP the UDP packets belonging to certain ports
 	if(!rohc_comp_set_rtp_detection_cb(compressor, rtp_detect, NULL))
 	{
-		        LMLOG(LCRIT, "failed to set RTP detection callback\n");
-		        goto error;
+		LMLOG(LERR, "failed to set RTP detection callback\n");
+		goto release_compressor;
 	}
 
 	// set the function that will manage the ROHC compressing traces (it will be 'print_rohc_traces')
 	if(!rohc_comp_set_traces_cb2(compressor, print_rohc_traces, NULL))
 	{
-		LMLOG(LCRIT, "failed to set the callback for traces on compressor\n");
+		LMLOG(LERR, "failed to set the callback for traces on compressor\n");
 		goto release_compressor;
 	}
 
-	// Enable the ROHC compression profiles 
+	// Enable the ROHC compression profiles
 	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_UNCOMPRESSED))
 	{
-		LMLOG(LCRIT, "failed to enable the Uncompressed compression profile\n");
+		LMLOG(LERR, "failed to enable the Uncompressed compression profile\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "Uncompressed. ");
@@ -1301,7 +1265,7 @@ void initialize_compressor_and_decompressor ()
 
 	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_IP))
 	{
-		LMLOG(LCRIT, "failed to enable the IP-only compression profile\n");
+		LMLOG(LERR, "failed to enable the IP-only compression profile\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "IP-only. ");
@@ -1309,7 +1273,7 @@ void initialize_compressor_and_decompressor ()
 
 	if(!rohc_comp_enable_profiles(compressor, ROHC_PROFILE_UDP, ROHC_PROFILE_UDPLITE, -1))
 	{
-		LMLOG(LCRIT, "failed to enable the IP/UDP and IP/UDP-Lite compression profiles\n");
+		LMLOG(LERR, "failed to enable the IP/UDP and IP/UDP-Lite compression profiles\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "IP/UDP. IP/UDP-Lite. ");
@@ -1317,7 +1281,7 @@ void initialize_compressor_and_decompressor ()
 
 	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_RTP))
 	{
-		LMLOG(LCRIT, "failed to enable the RTP compression profile\n");
+		LMLOG(LERR, "failed to enable the RTP compression profile\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "RTP (UDP ports 1234, 36780, 33238, 5020, 5002). ");
@@ -1325,7 +1289,7 @@ void initialize_compressor_and_decompressor ()
 
 	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_ESP))
 	{
-		LMLOG(LCRIT, "failed to enable the ESP compression profile\n");
+		LMLOG(LERR, "failed to enable the ESP compression profile\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "ESP. ");
@@ -1333,18 +1297,35 @@ void initialize_compressor_and_decompressor ()
 
 	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_TCP))
 	{
-		LMLOG(LCRIT, "failed to enable the TCP compression profile\n");
+		LMLOG(LERR, "failed to enable the TCP compression profile\n");
 		goto release_compressor;
 	} else {
 		LMLOG(LDBG_1, "TCP. ");
 	}
 	LMLOG(LDBG_1, "\n");
 
+	return (compressor);
+
+//******* labels ************
+release_compressor:
+	rohc_comp_free(compressor);
+	return (NULL);
+}
+
+/*
+ Create a ROHC decompressor
+ */
+
+static struct rohc_decomp *rohc_decomp_create (int ROHC_mode)
+{
+	struct rohc_decomp *decompressor = NULL;
+	rohc_status_t status;
+
 	// Create a ROHC decompressor to operate:
 	//  - with large CIDs use ROHC_LARGE_CID, ROHC_LARGE_CID_MAX
 	//  - with small CIDs use ROHC_SMALL_CID, ROHC_SMALL_CID_MAX maximum of 5 streams (MAX_CID = 4),
 	//  - ROHC_O_MODE: Bidirectional Optimistic mode (O-mode)
-	//  - ROHC_U_MODE: Unidirectional mode (U-mode).    
+	//  - ROHC_U_MODE: Unidirectional mode (U-mode).
 	if ( ROHC_mode == 1 ) {
 		decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_U_MODE);		// Unidirectional mode
 	} else if ( ROHC_mode == 2 ) {
@@ -1355,8 +1336,8 @@ void initialize_compressor_and_decompressor ()
 
 	if(decompressor == NULL)
 	{
-		LMLOG(LCRIT, "failed create the ROHC decompressor\n");
-		goto release_decompressor;
+		LMLOG(LERR, "failed create the ROHC decompressor\n");
+		return (NULL);
 	}
 
 	LMLOG(LDBG_1, "ROHC decompressor created. Profiles: ");
@@ -1364,7 +1345,7 @@ void initialize_compressor_and_decompressor ()
 	// set the function that will manage the ROHC decompressing traces (it will be 'print_rohc_traces')
 	if(!rohc_decomp_set_traces_cb2(decompressor, print_rohc_traces, NULL))
 	{
-		LMLOG(LCRIT, "failed to set the callback for traces on decompressor\n");
+		LMLOG(LERR, "failed to set the callback for traces on decompressor\n");
 		goto release_decompressor;
 	}
 
@@ -1372,7 +1353,7 @@ void initialize_compressor_and_decompressor ()
 	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UNCOMPRESSED, -1);
 	if(!status)
 	{
-		LMLOG(LCRIT, "failed to enable the Uncompressed decompression profile\n");
+		LMLOG(LERR, "failed to enable the Uncompressed decompression profile\n");
 		goto release_decompressor;
 	} else {
 		LMLOG(LDBG_1, "Uncompressed. ");
@@ -1381,7 +1362,7 @@ void initialize_compressor_and_decompressor ()
 	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_IP, -1);
 	if(!status)
 	{
-		LMLOG(LCRIT, "failed to enable the IP-only decompression profile\n");
+		LMLOG(LERR, "failed to enable the IP-only decompression profile\n");
 		goto release_decompressor;
 	} else {
 		LMLOG(LDBG_1, "IP-only. ");
@@ -1390,7 +1371,7 @@ void initialize_compressor_and_decompressor ()
 	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDP, -1);
 	if(!status)
 	{
-		LMLOG(LCRIT, "failed to enable the IP/UDP decompression profile\n");
+		LMLOG(LERR, "failed to enable the IP/UDP decompression profile\n");
 		goto release_decompressor;
 	} else {
 		LMLOG(LDBG_1, "IP/UDP. ");
@@ -1399,56 +1380,300 @@ void initialize_compressor_and_decompressor ()
 	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDPLITE, -1);
 	if(!status)
 	{
-		LMLOG(LCRIT, "failed to enable the IP/UDP-Lite decompression profile\n");
+		LMLOG(LERR, "failed to enable the IP/UDP-Lite decompression profile\n");
 		goto release_decompressor;
 	} else {
 		LMLOG(LDBG_1, "IP/UDP-Lite. ");
 	}
 
-	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_RTP, -1);
-	if(!status)
-	{
-		LMLOG(LCRIT, "failed to enable the RTP decompression profile\n");
-		goto release_decompressor;
-	} else {
-		LMLOG(LDBG_1, "RTP. ");
-	}
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_RTP, -1);
+	if(!status)
+	{
+		LMLOG(LERR, "failed to enable the RTP decompression profile\n");
+		goto release_decompressor;
+	} else {
+		LMLOG(LDBG_1, "RTP. ");
+	}
+
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_ESP,-1);
+	if(!status)
+	{
+		LMLOG(LERR, "failed to enable the ESP decompression profile\n");
+		goto release_decompressor;
+	} else {
+		LMLOG(LDBG_1, "ESP. ");
+	}
+
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_TCP, -1);
+	if(!status)
+	{
+		LMLOG(LERR, "failed to enable the TCP decompression profile\n");
+		goto release_decompressor;
+	} else {
+		LMLOG(LDBG_1, "TCP. ");
+	}
+
+	LMLOG(LDBG_1, "\n");
+
+	return (decompressor);
+
+//******* labels ************
+release_decompressor:
+	rohc_decomp_free(decompressor);
+	return (NULL);
+}
+
+
+/*************************************************************************
+ * ROHC contexts of the simplemux tunnels ********************************
+ *************************************************************************/
+
+// Each tunnel (pair of local and remote RLOCs) has its own compressor and decompressor, so the header
+// streams of different peers do not share a ROHC context. The pool is bounded: when it is full, the
+// contexts of the least recently used tunnel are released
+static rohc_ctx_t rohc_pool[ROHC_CTX_POOL_SIZE];
+static khash_t(mux_key) *rohc_pool_index = NULL;		// tunnel -> position in the pool
+static uint64_t rohc_pool_last_sweep = 0;				// last time the idle contexts were searched
+
+static void rohc_ctx_key(flow_key_t *key, ip_addr_t *local_rloc, ip_addr_t *remote_rloc)
+{
+	memset(key, 0, sizeof(flow_key_t));
+	key->afi = ip_addr_afi(local_rloc);
+	ip_addr_copy_to(key->src, local_rloc);
+	ip_addr_copy_to(key->dst, remote_rloc);
+}
+
+static void rohc_ctx_stats_log(rohc_ctx_t *ctx, int log_level)
+{
+	float comp_saved = 0;
+
+	if (ctx->comp_bytes_in > 0) {
+		comp_saved = 100.0 * (1.0 - (float)ctx->comp_bytes_out / (float)ctx->comp_bytes_in);
+	}
+
+	LMLOG(log_level, "ROHC tunnel %s <-> %s: compressed %"PRIu64" packets, %"PRIu64" -> %"PRIu64" bytes (%.1f%% saved), %"PRIu64" failures. "
+			"Decompressed %"PRIu64" packets, %"PRIu64" -> %"PRIu64" bytes, %"PRIu64" failures",
+			ip_addr_to_char(&ctx->local_rloc), ip_addr_to_char(&ctx->remote_rloc),
+			ctx->comp_packets, ctx->comp_bytes_in, ctx->comp_bytes_out, comp_saved, ctx->comp_failures,
+			ctx->decomp_packets, ctx->decomp_bytes_in, ctx->decomp_bytes_out, ctx->decomp_failures);
+}
+
+// Free the compressor and decompressor of a tunnel and leave its slot free. The generation of the
+// slot changes, so the rules that cached it look the tunnel up again
+static void rohc_ctx_release(rohc_ctx_t *ctx)
+{
+	khiter_t k;
+	uint32_t gen;
+
+	rohc_ctx_stats_log(ctx, LDBG_1);
+
+	if (ctx->compressor != NULL) {
+		rohc_comp_free(ctx->compressor);
+	}
+	if (ctx->decompressor != NULL) {
+		rohc_decomp_free(ctx->decompressor);
+	}
+
+	k = kh_get(mux_key, rohc_pool_index, ctx->key);
+	if (k != kh_end(rohc_pool_index)) {
+		kh_del(mux_key, rohc_pool_index, k);
+	}
+
+	gen = ctx->gen;
+	memset(ctx, 0, sizeof(rohc_ctx_t));
+	ctx->gen = gen + 1;
+}
+
+// Get the contexts of a tunnel. If the tunnel has none, a free slot of the pool is taken or, if the
+// pool is full, the one of the least recently used tunnel. The compressor and the decompressor are
+// not created here, but when the first packet is compressed or decompressed
+static rohc_ctx_t *rohc_ctx_get(ip_addr_t *local_rloc, ip_addr_t *remote_rloc)
+{
+	flow_key_t key;
+	khiter_t k;
+	rohc_ctx_t *ctx = NULL;
+	int i, ret;
+
+	rohc_ctx_key(&key, local_rloc, remote_rloc);
+	k = kh_get(mux_key, rohc_pool_index, key);
+	if (k != kh_end(rohc_pool_index)) {
+		ctx = &rohc_pool[kh_value(rohc_pool_index, k)];
+		ctx->last_used = GetTimeStamp();
+		return (ctx);
+	}
+
+	for (i = 0; i < ROHC_CTX_POOL_SIZE; i++) {
+		if (!rohc_pool[i].in_use) {
+			ctx = &rohc_pool[i];
+			break;
+		}
+		if (ctx == NULL || rohc_pool[i].last_used < ctx->last_used) {
+			ctx = &rohc_pool[i];
+		}
+	}
+
+	if (ctx->in_use) {
+		LMLOG(LDBG_1, "ROHC context pool full (%d tunnels). Releasing the contexts of %s <-> %s",
+				ROHC_CTX_POOL_SIZE, ip_addr_to_char(&ctx->local_rloc), ip_addr_to_char(&ctx->remote_rloc));
+		rohc_ctx_release(ctx);
+	}
+
+	ctx->in_use = 1;
+	ctx->key = key;
+	ip_addr_copy(&ctx->local_rloc, local_rloc);
+	ip_addr_copy(&ctx->remote_rloc, remote_rloc);
+	ctx->last_used = GetTimeStamp();
+
+	k = kh_put(mux_key, rohc_pool_index, key, &ret);
+	kh_value(rohc_pool_index, k) = ctx - rohc_pool;
+
+	LMLOG(LDBG_1, "ROHC contexts assigned to the tunnel %s <-> %s",
+			ip_addr_to_char(local_rloc), ip_addr_to_char(remote_rloc));
+
+	return (ctx);
+}
+
+// Contexts of the tunnel used by a rule. The last one is cached in the rule, since consecutive
+// packets of a rule usually go through the same tunnel
+static rohc_ctx_t *rohc_ctx_of_rule(data_simplemux_t *data_simplemux)
+{
+	rohc_ctx_t *ctx = data_simplemux->rohc_ctx;
+	ip_addr_t *local_rloc = lisp_addr_ip(&(data_simplemux->mux_tuple.srloc));
+	ip_addr_t *remote_rloc = lisp_addr_ip(&(data_simplemux->mux_tuple.drloc));
+
+	if (ctx != NULL && ctx->gen == data_simplemux->rohc_ctx_gen
+			&& ip_addr_cmp(&ctx->local_rloc, local_rloc) == 0
+			&& ip_addr_cmp(&ctx->remote_rloc, remote_rloc) == 0) {
+		ctx->last_used = GetTimeStamp();
+		return (ctx);
+	}
+
+	ctx = rohc_ctx_get(local_rloc, remote_rloc);
+	data_simplemux->rohc_ctx = ctx;
+	data_simplemux->rohc_ctx_gen = ctx->gen;
+	return (ctx);
+}
+
+static struct rohc_comp *rohc_ctx_compressor(rohc_ctx_t *ctx)
+{
+	if (ctx->compressor == NULL) {
+		ctx->compressor = rohc_comp_create();
+	}
+	return (ctx->compressor);
+}
+
+static struct rohc_decomp *rohc_ctx_decompressor(rohc_ctx_t *ctx, int ROHC_mode)
+{
+	if (ctx->decompressor == NULL) {
+		ctx->decompressor = rohc_decomp_create(ROHC_mode);
+	}
+	return (ctx->decompressor);
+}
+
+// Release the contexts of the tunnels that have not been used for ROHC_CTX_IDLE_TIMEOUT
+static void rohc_pool_sweep(uint64_t now)
+{
+	int i;
+
+	if (now - rohc_pool_last_sweep < ROHC_CTX_SWEEP_PERIOD) {
+		return;
+	}
+	rohc_pool_last_sweep = now;
+
+	for (i = 0; i < ROHC_CTX_POOL_SIZE; i++) {
+		if (rohc_pool[i].in_use && now > rohc_pool[i].last_used
+				&& now - rohc_pool[i].last_used > ROHC_CTX_IDLE_TIMEOUT) {
+			LMLOG(LDBG_1, "Releasing the idle ROHC contexts of %s <-> %s",
+					ip_addr_to_char(&rohc_pool[i].local_rloc), ip_addr_to_char(&rohc_pool[i].remote_rloc));
+			rohc_ctx_release(&rohc_pool[i]);
+		}
+	}
+}
+
+void rohc_ctx_stats_dump(int log_level)
+{
+	int i;
+
+	for (i = 0; i < ROHC_CTX_POOL_SIZE; i++) {
+		if (rohc_pool[i].in_use) {
+			rohc_ctx_stats_log(&rohc_pool[i], log_level);
+		}
+	}
+}
+
+/*
+ Initialize ROHC
+ */
+
+void initialize_compressor_and_decompressor ()
+{
+	unsigned int seed;
+
+	//* initialize the random generator
+	seed = time(NULL);
+	srand(seed);
+
+	// the contexts of each tunnel are created when its first packet is compressed or decompressed
+	memset(rohc_pool, 0, sizeof(rohc_pool));
+	rohc_pool_index = kh_init(mux_key);
+	rohc_pool_last_sweep = GetTimeStamp();
+}
+
+
+
+/*************************************************************************
+ * Default values of a simplemux rule ************************************
+ *************************************************************************/
+
+static void muxed_rule_init(data_simplemux_t *data_simplemux)
+{
+	int afi;
+	struct in_addr ipbin;
+
+	afi = ip_afi_from_char("0.0.0.0");
+	inet_pton(afi,"0.0.0.0",&ipbin);
+
+	memset(data_simplemux, 0, sizeof(data_simplemux_t));
+
+	// Initialize ROCH mode  -----------------------------------------------------------------
+	data_simplemux->ROHC_mode = 0;
+
+	// initialize addresses
+	ip_addr_init(&(data_simplemux->mux_tuple.src_addr),&ipbin,afi);
+	ip_addr_init(&(data_simplemux->mux_tuple.dst_addr),&ipbin,afi);
+	ip_addr_init(&(data_simplemux->mux_tuple.srloc.ip),&ipbin,afi);
+	ip_addr_init(&(data_simplemux->mux_tuple.drloc.ip),&ipbin,afi);
+	ip_addr_init(&(data_simplemux->mux_tuple.src_net),&ipbin,afi);
+	ip_addr_init(&(data_simplemux->mux_tuple.dst_net),&ipbin,afi);
+	data_simplemux->port_dst = 0;
+	data_simplemux->port_src = 0;
+
+	// Initialize limits  -----------------------------------------------------------------
+
+	data_simplemux->limit_numpackets_tun = 0;	// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
+							// limit of the number of packets for triggering a muxed packet
 
-	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_ESP,-1);
-	if(!status)
-	{
-		LMLOG(LCRIT, "failed to enable the ESP decompression profile\n");
-		goto release_decompressor;
-	} else {
-		LMLOG(LDBG_1, "ESP. ");
-	}
+	data_simplemux->timeout = MAXTIMEOUT;		// timeout for triggering a muxed packet
+							// (microseconds) if a packet arrives and the timeout has expired (time from the
+							// previous sending), the sending is triggered. default 100 seconds
 
-	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_TCP, -1);
-	if(!status)
-	{
-		LMLOG(LCRIT, "failed to enable the TCP decompression profile\n");
-		goto release_decompressor;
-	} else {
-		LMLOG(LDBG_1, "TCP. ");
-	}
+	data_simplemux->period = MAXTIMEOUT;					//Period for triggering a muxed packet
+	data_simplemux->time_last_sent_in_microsec = GetTimeStamp();		// moment when the last multiplexed packet was sent
 
-	LMLOG(LDBG_1, "\n");
-	
-	return;
 
-//******* labels ************
-release_compressor:
-	rohc_comp_free(compressor);
+	data_simplemux->interface_mtu = 0;			// the maximum transfer unit of the interface
+	data_simplemux->user_mtu = 0;				// the MTU specified by the user (it must be <= interface_mtu)
 
-release_decompressor:
-	rohc_decomp_free(decompressor);
-	
-error:
-	LMLOG(LCRIT, "an error occured during program execution, abort program\n");
-	exit(1);
-}
 
+	data_simplemux->size_threshold = 0;			// if the number of bytes stored is higher than this, a muxed packet is sent
 
+	// Variables for storing the packets to multiplex
+	data_simplemux->size_muxed_packet = 0;		// acumulated size of the multiplexed packet
+	data_simplemux->first_header_written = 0;	// it indicates if the first header has been written or not
+	data_simplemux->num_pkts_stored_from_tun = 0;	// number of packets received and not sent from tun (stored)
+	data_simplemux->single_protocol = 1;			// an empty bundle carries a single protocol
+	data_simplemux->heap_pos = -1;				// an empty bundle has no flush deadline
+}
 
 /*************************************************************************
  * Function for muxed data initilization *******************************
@@ -1456,88 +1681,34 @@ error:
 
 void muxed_init() 
 {
-	int i,j;
-	char log_file_name[25]="";            				
+	char trace_file_name[32]="";
 
 	// Initialize ROCH -----------------------------------------------------------------
-	compressor = NULL;           				// the ROHC compressor
-	
-	decompressor = NULL;           				// the ROHC decompressor
-
 	initialize_compressor_and_decompressor();
 
-	// Info log (name of the log file is assigned automatically)
+	// Flush timer: a timerfd fires when the period of the earliest bundle expires -----
+	flush_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (flush_timer_fd < 0) {
+		LMLOG(LERR, "muxed_init: timerfd_create error: %s. Bundles are flushed when the main loop wakes up", strerror(errno));
+	} else if (sockmstr_register_read_listener(smaster, muxed_flush_timer_process, NULL, flush_timer_fd) == NULL) {
+		LMLOG(LERR, "muxed_init: Couldn't listen to the flush timer. Bundles are flushed when the main loop wakes up");
+		close(flush_timer_fd);
+		flush_timer_fd = -1;
+	}
 
-	log_file = NULL;
+	// Event trace (name of the trace file is assigned automatically). tools/mux_trace_decode
+	// converts it into the tab separated log
 	tun2net = 0;				
 	net2tun = 0;				
 
-	date_and_time(log_file_name);
-	log_file = fopen(log_file_name, "w");
-	if (log_file == NULL) 
-			LMLOG(LERR,"Error: cannot open the log file simplemux!\n");
-	int afi,res;
-	struct in_addr ipbin;
-	
-	afi = ip_afi_from_char("0.0.0.0");
-    res=inet_pton(afi,"0.0.0.0",&ipbin);
-
-	for (i = 0 ; i < 10 ; i++) { /* FIXME: use realloc to include more than 10 elements */
-		// Initialize ROCH mode  -----------------------------------------------------------------
-			
-		conf_sm[i].ROHC_mode = 0;
-		
-		// initialize addresses
-		ip_addr_init(&(conf_sm[i].mux_tuple.src_addr),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.dst_addr),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.srloc.ip),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.drloc.ip),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.src_net),&ipbin,afi);	
-		ip_addr_init(&(conf_sm[i].mux_tuple.dst_net),&ipbin,afi);
-		conf_sm[0].port_dst = 0;
-		conf_sm[0].port_src = 0;	
-		
-		// Initialize limits  -----------------------------------------------------------------
-		
-		conf_sm[i].limit_numpackets_tun = 0;		// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
-								// limit of the number of packets for triggering a muxed packet 
-
-		conf_sm[i].timeout = MAXTIMEOUT;		// timeout for triggering a muxed packet
-								// (microseconds) if a packet arrives and the timeout has expired (time from the  
-								// previous sending), the sending is triggered. default 100 seconds
-
-		conf_sm[i].period = MAXTIMEOUT;					//Period for triggering a muxed packet 
-		conf_sm[i].time_last_sent_in_microsec = GetTimeStamp();		// moment when the last multiplexed packet was sent
-
-		
-		conf_sm[i].interface_mtu = 0;				// the maximum transfer unit of the interface
-		conf_sm[i].user_mtu = 0;				// the MTU specified by the user (it must be <= interface_mtu)
-
-
-		conf_sm[i].size_threshold = 0;				// if the number of bytes stored is higher than this, a muxed packet is sent
-			
-		// Variables for storing the packets to multiplex
-		conf_sm[i].size_muxed_packet = 0;		// acumulated size of the multiplexed packet
-		conf_sm[i].first_header_written = 0;		// it indicates if the first header has been written or not
-
-
-		conf_sm[i].num_pkts_stored_from_tun = 0;	// number of packets received and not sent from tun (stored)
-
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].protocol[j], 0, SIZE_PROTOCOL_FIELD*sizeof(unsigned char)); // protocol field of each packet
-		
-		memset(conf_sm[i].size_separators_to_multiplex, 0, MAXPKTS*sizeof(uint16_t));     	// stores the size of the Simplemux separator. It does not include the "Protocol" field
-
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].separators_to_multiplex[j], 0, 3*sizeof(unsigned char));	// stores the header ('protocol' not included) received from tun, before sending it to the network
-		
-		memset(conf_sm[i].size_packets_to_multiplex, 0, MAXPKTS*sizeof(uint16_t));		// stores the size of the received packet
-		
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].packets_to_multiplex[j], 0, BUFSIZE*sizeof(unsigned char));	// stores the packets received from tun, before storing it or sending it to the network
-	}
-	// End Initialize--------------------------------------------------------------------
-	//-----------------------------------------------------------------------------------
+	date_and_time(trace_file_name);
+	strcat(trace_file_name, ".smtrace");
+	if (mux_trace_open(trace_file_name, MUX_TRACE_NRECS) != GOOD)
+			LMLOG(LERR,"Error: cannot open the trace file simplemux!\n");
+
+	// The rules are allocated when the configuration is parsed
+	conf_sm = NULL;
+	numdsm = 0;
 }
 
 /*************************************************************************
@@ -1546,71 +1717,183 @@ void muxed_init()
 
 void muxed_reset() 
 {
-	int i,j; 
+	muxed_rules_alloc(0);
+}
 
-	int afi,res;
-	struct in_addr ipbin;
-	
-	afi = ip_afi_from_char("0.0.0.0");
-    res=inet_pton(afi,"0.0.0.0",&ipbin); 
-
-	for (i = 0 ; i < 10 ; i++) { /* FIXME: use realloc to include more than 10 elements */
-		// Initialize ROCH mode  -----------------------------------------------------------------
-			
-		conf_sm[i].ROHC_mode = 0;
-		
-		//reset addresses
-		ip_addr_init(&(conf_sm[i].mux_tuple.src_addr),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.dst_addr),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.srloc.ip),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.drloc.ip),&ipbin,afi);
-		ip_addr_init(&(conf_sm[i].mux_tuple.src_net),&ipbin,afi);	
-		ip_addr_init(&(conf_sm[i].mux_tuple.dst_net),&ipbin,afi);
-		
-		conf_sm[0].port_dst = 0;
-		conf_sm[0].port_src = 0;
-		
-		// Initialize limits  -----------------------------------------------------------------
-		
-		conf_sm[i].limit_numpackets_tun = 0;		// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
-								// limit of the number of packets for triggering a muxed packet 
-
-		conf_sm[i].timeout = MAXTIMEOUT;		// timeout for triggering a muxed packet
-								// (microseconds) if a packet arrives and the timeout has expired (time from the  
-								// previous sending), the sending is triggered. default 100 seconds
-
-		conf_sm[i].period = MAXTIMEOUT;					//Period for triggering a muxed packet 
-		conf_sm[i].time_last_sent_in_microsec = GetTimeStamp();		// moment when the last multiplexed packet was sent
-
-		
-		conf_sm[i].interface_mtu = 0;				// the maximum transfer unit of the interface
-		conf_sm[i].user_mtu = 0;				// the MTU specified by the user (it must be <= interface_mtu)
-
-
-		conf_sm[i].size_threshold = 0;				// if the number of bytes stored is higher than this, a muxed packet is sent
-			
-		// Variables for storing the packets to multiplex
-		conf_sm[i].size_muxed_packet = 0;		// acumulated size of the multiplexed packet
-		conf_sm[i].first_header_written = 0;		// it indicates if the first header has been written or not
-
-
-		conf_sm[i].num_pkts_stored_from_tun = 0;	// number of packets received and not sent from tun (stored)
-
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].protocol[j], 0, SIZE_PROTOCOL_FIELD*sizeof(unsigned char)); // protocol field of each packet
-		
-		memset(conf_sm[i].size_separators_to_multiplex, 0, MAXPKTS*sizeof(uint16_t));     	// stores the size of the Simplemux separator. It does not include the "Protocol" field
-
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].separators_to_multiplex[j], 0, 3*sizeof(unsigned char));	// stores the header ('protocol' not included) received from tun, before sending it to the network
-		
-		memset(conf_sm[i].size_packets_to_multiplex, 0, MAXPKTS*sizeof(uint16_t));		// stores the size of the received packet
-		
-		for (j = 0 ; j < MAXPKTS ; ++j) 
-			memset(conf_sm[i].packets_to_multiplex[j], 0, BUFSIZE*sizeof(unsigned char));	// stores the packets received from tun, before storing it or sending it to the network
+/*************************************************************************
+ * Allocate the simplemux rules with their default values ***************
+ *************************************************************************/
+
+void muxed_rules_alloc(int n)
+{
+	int i;
+
+	// the classifier points to the previous rules
+	mux_classifier_del(classifier);
+	classifier = NULL;
+	classifier_gen++;
+
+	// the heap of flush deadlines too. The packets stored in the previous rules are discarded
+	flush_heap_len = 0;
+	muxed_deadline_update(NULL);
+
+	free(conf_sm);
+	conf_sm = NULL;
+	numdsm = 0;
+	if (n <= 0) {
+		return;
 	}
-	// End Initialize--------------------------------------------------------------------
-	//-----------------------------------------------------------------------------------
+
+	conf_sm = xmalloc(n * sizeof(data_simplemux_t));
+	flush_heap = xrealloc(flush_heap, n * sizeof(data_simplemux_t *));
+	for (i = 0 ; i < n ; i++) {
+		muxed_rule_init(&conf_sm[i]);
+	}
+	numdsm = n;
+}
+
+/*************************************************************************
+ * Compile the simplemux rules once they are configured *****************
+ *************************************************************************/
+
+void muxed_rules_compile()
+{
+	mux_classifier_del(classifier);
+	classifier = mux_classifier_new(conf_sm, numdsm);
+	// the rules cached in the forwarding entries are no longer valid
+	classifier_gen++;
+}
+
+/*************************************************************************
+ * Reconfigure the simplemux rules keeping the state of the unchanged ones
+ *************************************************************************/
+
+// Allocate n rules with the default values, to be filled by the configuration and installed by
+// muxed_rules_apply
+data_simplemux_t *muxed_rules_stage(int n)
+{
+	int i;
+
+	free(conf_sm_staged);
+	conf_sm_staged = NULL;
+	numdsm_staged = 0;
+	if (n <= 0) {
+		return (NULL);
+	}
+
+	conf_sm_staged = xmalloc(n * sizeof(data_simplemux_t));
+	for (i = 0 ; i < n ; i++) {
+		muxed_rule_init(&conf_sm_staged[i]);
+	}
+	numdsm_staged = n;
+	return (conf_sm_staged);
+}
+
+// The packets matched by both rules are the same
+static int muxed_rule_same_match(data_simplemux_t *a, data_simplemux_t *b)
+{
+	return (ip_addr_cmp(&a->mux_tuple.src_addr, &b->mux_tuple.src_addr) == 0
+			&& ip_addr_cmp(&a->mux_tuple.dst_addr, &b->mux_tuple.dst_addr) == 0
+			&& ip_addr_cmp(&a->mux_tuple.src_net, &b->mux_tuple.src_net) == 0
+			&& a->mux_tuple.src_mask == b->mux_tuple.src_mask
+			&& ip_addr_cmp(&a->mux_tuple.dst_net, &b->mux_tuple.dst_net) == 0
+			&& a->mux_tuple.dst_mask == b->mux_tuple.dst_mask
+			&& ip_addr_cmp(lisp_addr_ip(&a->mux_tuple.srloc), lisp_addr_ip(&b->mux_tuple.srloc)) == 0
+			&& ip_addr_cmp(lisp_addr_ip(&a->mux_tuple.drloc), lisp_addr_ip(&b->mux_tuple.drloc)) == 0
+			&& a->port_src == b->port_src
+			&& a->port_dst == b->port_dst);
+}
+
+// Both rules build the same bundles
+static int muxed_rule_same_params(data_simplemux_t *a, data_simplemux_t *b)
+{
+	return (a->ROHC_mode == b->ROHC_mode
+			&& a->limit_numpackets_tun == b->limit_numpackets_tun
+			&& a->timeout == b->timeout
+			&& a->period == b->period
+			&& a->interface_mtu == b->interface_mtu
+			&& a->user_mtu == b->user_mtu
+			&& a->size_threshold == b->size_threshold
+			&& a->latency_budget == b->latency_budget
+			&& a->bulk_period == b->bulk_period
+			&& a->bulk_threshold == b->bulk_threshold);
+}
+
+// Install the rules staged by muxed_rules_stage. A new rule that matches the same packets as a current
+// one takes its state: the packets stored, the period, the adaptive estimations, the counters and the
+// ROHC contexts. If its triggers changed, the bundle stored is sent first, since it was built with the
+// previous ones. The bundles of the rules removed are sent too
+void muxed_rules_apply()
+{
+	data_simplemux_t *rules = conf_sm_staged;
+	data_simplemux_t params;
+	int *taken = NULL;
+	int kept = 0, updated = 0, removed = 0;
+	int i, j;
+
+	if (numdsm > 0) {
+		taken = xzalloc(numdsm * sizeof(int));
+	}
+
+	for (i = 0 ; i < numdsm_staged ; i++) {
+		for (j = 0 ; j < numdsm ; j++) {
+			if (!taken[j] && muxed_rule_same_match(&conf_sm[j], &rules[i])) {
+				break;
+			}
+		}
+		if (j == numdsm) {
+			continue;
+		}
+		taken[j] = 1;
+
+		if (muxed_rule_same_params(&conf_sm[j], &rules[i])) {
+			kept++;
+		} else {
+			muxed_rule_drain(&conf_sm[j]);
+			updated++;
+		}
+
+		// the state moves to the new rule, with the triggers of the new configuration
+		memcpy(&params, &rules[i], sizeof(data_simplemux_t));
+		memcpy(&rules[i], &conf_sm[j], sizeof(data_simplemux_t));
+		rules[i].ROHC_mode = params.ROHC_mode;
+		rules[i].limit_numpackets_tun = params.limit_numpackets_tun;
+		rules[i].timeout = params.timeout;
+		rules[i].period = params.period;
+		rules[i].interface_mtu = params.interface_mtu;
+		rules[i].user_mtu = params.user_mtu;
+		rules[i].size_threshold = params.size_threshold;
+		rules[i].latency_budget = params.latency_budget;
+		rules[i].bulk_period = params.bulk_period;
+		rules[i].bulk_threshold = params.bulk_threshold;
+		if (rules[i].heap_pos >= 0) {
+			flush_heap[rules[i].heap_pos] = &rules[i];
+		}
+	}
+
+	for (j = 0 ; j < numdsm ; j++) {
+		if (!taken[j]) {
+			muxed_rule_drain(&conf_sm[j]);
+			removed++;
+		}
+	}
+
+	LMLOG(LDBG_1, "Simplemux rules: %d unchanged, %d with new triggers, %d added, %d removed",
+			kept, updated, numdsm_staged - kept - updated, removed);
+
+	free(taken);
+	free(conf_sm);
+	conf_sm = rules;
+	numdsm = numdsm_staged;
+	conf_sm_staged = NULL;
+	numdsm_staged = 0;
+
+	// the heap holds at most one entry per rule
+	if (numdsm > 0) {
+		flush_heap = xrealloc(flush_heap, numdsm * sizeof(data_simplemux_t *));
+	}
+	muxed_rules_compile();
+	muxed_deadline_update(NULL);
 }
 
 /**************************************************************************
@@ -1648,12 +1931,13 @@ int mux_output_unicast (lbuf_t *b, data_simplemux_t *data_simplemux)
  *       Back up the previous config params               				  *
  **************************************************************************/
 void muxed_param_backup ()
-{	int i;
-
-	for (i = 0 ; i < 10 ; i++) { /* FIXME: use realloc to include more than 10 elements */
-	
-		conf_sm_pre[i] = conf_sm[i]; // save previous config
-		
+{
+	free(conf_sm_pre);
+	conf_sm_pre = NULL;
+	numdsm_pre = numdsm;
+	if (numdsm > 0) {
+		conf_sm_pre = xmalloc(numdsm * sizeof(data_simplemux_t));
+		memcpy(conf_sm_pre, conf_sm, numdsm * sizeof(data_simplemux_t)); // save previous config
 	}
 }
 
@@ -1663,267 +1947,391 @@ void muxed_param_backup ()
 void muxed_param_changed ()
 {	
 	int i;
+	int n;
+	data_simplemux_t *pre;
+	data_simplemux_t *cur;
+	data_simplemux_t default_rule;	// compared with the rules that only exist in one of the configs
+
+	muxed_rule_init(&default_rule);
+	n = (numdsm > numdsm_pre) ? numdsm : numdsm_pre;
+	for (i = 0 ; i < n ; i++) {
 	
-	for (i = 0 ; i < 10 ; i++) { /* FIXME: use realloc to include more than 10 elements */
-	
+	pre = (i < numdsm_pre) ? &conf_sm_pre[i] : &default_rule;
+	cur = (i < numdsm) ? &conf_sm[i] : &default_rule;
 	int ruleChanged = 0;
 	
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.src_addr),ip_addr_to_char(&conf_sm[i].mux_tuple.src_addr)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.src_addr),ip_addr_to_char(&cur->mux_tuple.src_addr)) != 0) {
 		LMLOG(LINF, "Rule %d changed",i);
 		ruleChanged = 1;
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.src_addr),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tIpsrc: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.src_addr));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.src_addr),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tIpsrc: %s",ip_addr_to_char(&cur->mux_tuple.src_addr));
 	}
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.dst_addr),ip_addr_to_char(&conf_sm[i].mux_tuple.dst_addr)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.dst_addr),ip_addr_to_char(&cur->mux_tuple.dst_addr)) != 0) {
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.dst_addr),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tIpdst: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.dst_addr));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.dst_addr),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tIpdst: %s",ip_addr_to_char(&cur->mux_tuple.dst_addr));
 	}
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.srloc.ip),ip_addr_to_char(&conf_sm[i].mux_tuple.srloc.ip)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.srloc.ip),ip_addr_to_char(&cur->mux_tuple.srloc.ip)) != 0) {
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.srloc.ip),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tLispsrc: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.srloc.ip));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.srloc.ip),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tLispsrc: %s",ip_addr_to_char(&cur->mux_tuple.srloc.ip));
 	}
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.drloc.ip),ip_addr_to_char(&conf_sm[i].mux_tuple.drloc.ip)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.drloc.ip),ip_addr_to_char(&cur->mux_tuple.drloc.ip)) != 0) {
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.drloc.ip),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tLispdst: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.drloc.ip));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.drloc.ip),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tLispdst: %s",ip_addr_to_char(&cur->mux_tuple.drloc.ip));
 	}
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.src_net),ip_addr_to_char(&conf_sm[i].mux_tuple.src_net)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.src_net),ip_addr_to_char(&cur->mux_tuple.src_net)) != 0) {
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.src_net),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tNetsrc: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.src_net));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.src_net),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tNetsrc: %s",ip_addr_to_char(&cur->mux_tuple.src_net));
 	}
-	if(strcmp(ip_addr_to_char(&conf_sm_pre[i].mux_tuple.dst_net),ip_addr_to_char(&conf_sm[i].mux_tuple.dst_net)) != 0) {
+	if(strcmp(ip_addr_to_char(&pre->mux_tuple.dst_net),ip_addr_to_char(&cur->mux_tuple.dst_net)) != 0) {
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		if(strcmp(ip_addr_to_char(&conf_sm[i].mux_tuple.dst_addr),"0.0.0.0")!=0)
-			LMLOG(LINF, "\tNetdst: %s",ip_addr_to_char(&conf_sm[i].mux_tuple.dst_net));
+		if(strcmp(ip_addr_to_char(&cur->mux_tuple.dst_addr),"0.0.0.0")!=0)
+			LMLOG(LINF, "\tNetdst: %s",ip_addr_to_char(&cur->mux_tuple.dst_net));
 	}
-	if(conf_sm_pre[i].limit_numpackets_tun!=conf_sm[i].limit_numpackets_tun){
+	if(pre->limit_numpackets_tun!=cur->limit_numpackets_tun){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		LMLOG(LINF, "\tNum-pkt: %d",conf_sm[i].limit_numpackets_tun);
+		LMLOG(LINF, "\tNum-pkt: %d",cur->limit_numpackets_tun);
 	}
-	if(conf_sm_pre[i].user_mtu!=conf_sm[i].user_mtu){
+	if(pre->user_mtu!=cur->user_mtu){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		LMLOG(LINF, "\tMtu-user: %d",conf_sm[i].user_mtu);
+		LMLOG(LINF, "\tMtu-user: %d",cur->user_mtu);
 	}
-	if(conf_sm_pre[i].interface_mtu!=conf_sm[i].interface_mtu){
+	if(pre->interface_mtu!=cur->interface_mtu){
+		if(ruleChanged == 0){
+			LMLOG(LINF, "Rule %d changed",i);
+			ruleChanged = 1;
+		}
+	LMLOG(LINF, "\tMtu-int: %d",cur->interface_mtu);}
+	if(pre->size_threshold!=cur->size_threshold){
+		if(ruleChanged == 0){
+			LMLOG(LINF, "Rule %d changed",i);
+			ruleChanged = 1;
+		}
+	LMLOG(LINF, "\tThreshold: %d",cur->size_threshold);}
+	if(pre->timeout!=cur->timeout){
+		if(ruleChanged == 0){
+			LMLOG(LINF, "Rule %d changed",i);
+			ruleChanged = 1;
+		}
+	LMLOG(LINF, "\tTimeout: %d",cur->timeout);}
+	if(pre->period!=cur->period){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tMtu-int: %d",conf_sm[i].interface_mtu);}
-	if(conf_sm_pre[i].size_threshold!=conf_sm[i].size_threshold){
+	LMLOG(LINF, "\tPeriod: %d",cur->period);}
+	if(pre->latency_budget!=cur->latency_budget){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tThreshold: %d",conf_sm[i].size_threshold);}
-	if(conf_sm_pre[i].timeout!=conf_sm[i].timeout){
+	LMLOG(LINF, "\tLatency-budget: %d",cur->latency_budget);}
+	if(pre->bulk_period!=cur->bulk_period){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tTimeout: %d",conf_sm[i].timeout);}
-	if(conf_sm_pre[i].period!=conf_sm[i].period){
+	LMLOG(LINF, "\tBulk-period: %d",cur->bulk_period);}
+	if(pre->bulk_threshold!=cur->bulk_threshold){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tPeriod: %d",conf_sm[i].period);}
-	if(conf_sm_pre[i].ROHC_mode!=conf_sm[i].ROHC_mode){
+	LMLOG(LINF, "\tBulk-threshold: %d",cur->bulk_threshold);}
+	if(pre->ROHC_mode!=cur->ROHC_mode){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tROHC-mode: %d",conf_sm[i].ROHC_mode);}
-	if(conf_sm_pre[i].port_dst!=conf_sm[i].port_dst){
+	LMLOG(LINF, "\tROHC-mode: %d",cur->ROHC_mode);}
+	if(pre->port_dst!=cur->port_dst){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-	LMLOG(LINF, "\tPort-dst: %d",conf_sm[i].port_dst);}
-	if(conf_sm_pre[i].port_src!=conf_sm[i].port_src){
+	LMLOG(LINF, "\tPort-dst: %d",cur->port_dst);}
+	if(pre->port_src!=cur->port_src){
 		if(ruleChanged == 0){
 			LMLOG(LINF, "Rule %d changed",i);
 			ruleChanged = 1;
 		}
-		LMLOG(LINF, "\tPort-src: %d",conf_sm[i].port_src);
+		LMLOG(LINF, "\tPort-src: %d",cur->port_src);
 	}
 	}
 	LMLOG(LINF, "");
 }	
 
 /**************************************************************************
- *       Process the timers of all "simplemux data structs"               *
+ *        Heap of flush deadlines of the rules with packets stored        *
  **************************************************************************/
-	
-void muxed_timer_process_all ()
+
+static void flush_heap_set(int pos, data_simplemux_t *data_simplemux)
 {
-	int i;
-	uint64_t time_in_microsec;					// current time
-	unsigned char out_muxed_packet[BUFSIZE];	// stores the multiplexed packet
-	uint16_t out_total_length = 0;					// total length of the built multiplexed packet
-
-	unsigned char lisp_mux_buffer[BUFSIZE];		// buffer lisp to send mux packet	
-	lbuf_t lisp_buffer;							// buffer lisp to send mux packet	
-	uint32_t lisp_data_length = 0;					// length of the built multiplexed packet
-
-
-	time_in_microsec = GetTimeStamp();
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if (conf_sm[i].period < (time_in_microsec - conf_sm[i].time_last_sent_in_microsec)) {
-			/*LMLOG(LINF,"Se cumple periodo, time: %" PRIu64 ", sent: %" PRIu64 ", period: %" PRIu64 ", indice i %d",
-		              time_in_microsec, conf_sm[i].time_last_sent_in_microsec, conf_sm[i].period, i);
-                        */
-			//if (mux_packets (NULL, 0, &(conf_sm[i]), out_muxed_packet, (uint16_t *)(&out_total_length)) == 1){	
-			if (mux_packets (NULL, 0, &(conf_sm[i]), out_muxed_packet, &out_total_length) == 1){	
-				//Build lisp buffer	
-				//LMLOG(LINF," total_length periodo:%d",out_total_length);
-		 		lbuf_use_stack(&lisp_buffer, &lisp_mux_buffer, (uint32_t)BUFSIZE);
-				lbuf_reserve(&lisp_buffer, MUX_STACK_OFFSET);
-				memcpy (lbuf_data(&lisp_buffer), out_muxed_packet, out_total_length);
-				lisp_data_length = out_total_length;
-				lbuf_set_size(&lisp_buffer, lisp_data_length);				
-				//Encapsulate output multiplexed packet in a LISP packet and sent it
-				mux_output_unicast(&lisp_buffer,&conf_sm[i]);  
-			}
-		}
-	}
+	flush_heap[pos] = data_simplemux;
+	data_simplemux->heap_pos = pos;
 }
 
+static void flush_heap_up(int pos)
+{
+	data_simplemux_t *ds = flush_heap[pos];
+	int parent;
 
-/**************************************************************************
- *        Lookup mux_tuple from packet tuple and forward entry            *
- **************************************************************************/
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (flush_heap[parent]->flush_deadline <= ds->flush_deadline)
+			break;
+		flush_heap_set(pos, flush_heap[parent]);
+		pos = parent;
+	}
+	flush_heap_set(pos, ds);
+}
 
-//int lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe, data_simplemux_t *data_simplemux)
-data_simplemux_t * lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe)
+static void flush_heap_down(int pos)
 {
-	int i;
-	ip_addr_t src_net;
-	ip_addr_t dst_net;
-	struct in_addr src_sin_addr;
-	struct in_addr dst_sin_addr;
-
-//LMLOG(LINF,"entro en lookup");
-
-	// Lookup by IP source address of the packet AND IP destination address of the packet
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if ( (ip_addr_cmp(&(conf_sm[i].mux_tuple.src_addr), &(tpl->src_addr.ip)) == 0) &&
-			 (ip_addr_cmp(&(conf_sm[i].mux_tuple.dst_addr), &(tpl->dst_addr.ip)) == 0) ) {
-			return (&(conf_sm [i]));
-		}
+	data_simplemux_t *ds = flush_heap[pos];
+	int child;
+
+	while ((child = 2 * pos + 1) < flush_heap_len) {
+		if ((child + 1 < flush_heap_len) && (flush_heap[child + 1]->flush_deadline < flush_heap[child]->flush_deadline))
+			child++;
+		if (ds->flush_deadline <= flush_heap[child]->flush_deadline)
+			break;
+		flush_heap_set(pos, flush_heap[child]);
+		pos = child;
 	}
-//LMLOG(LINF,"ha pasado comp 2 dir and");
+	flush_heap_set(pos, ds);
+}
 
-	// Lookup by IP source address of the packet OR IP destination address of the packet
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if ( (ip_addr_cmp(&(conf_sm[i].mux_tuple.src_addr), &(tpl->src_addr.ip)) == 0) ||
-			 (ip_addr_cmp(&(conf_sm[i].mux_tuple.dst_addr), &(tpl->dst_addr.ip)) == 0) ) {
-			return (&(conf_sm [i]));
-		}
+static void flush_heap_remove(data_simplemux_t *data_simplemux)
+{
+	int pos = data_simplemux->heap_pos;
+
+	data_simplemux->heap_pos = -1;
+	flush_heap_len--;
+	if (pos == flush_heap_len)
+		return;
+
+	// the last element takes the place of the removed one
+	flush_heap_set(pos, flush_heap[flush_heap_len]);
+	flush_heap_up(pos);
+	flush_heap_down(flush_heap[pos]->heap_pos);
+}
+
+// Arm the timerfd with the earliest deadline of the heap, or disarm it if the heap is empty.
+// The timer is only reprogrammed when the earliest deadline changes
+static void flush_timer_arm()
+{
+	struct itimerspec its;
+	uint64_t deadline = 0;
+	uint64_t now;
+	uint64_t delay;
+
+	if (flush_timer_fd < 0)
+		return;
+
+	if (flush_heap_len > 0)
+		deadline = flush_heap[0]->flush_deadline;
+	if (deadline == flush_timer_deadline)
+		return;
+	flush_timer_deadline = deadline;
+
+	memset(&its, 0, sizeof(its));
+	if (deadline != 0) {
+		now = GetTimeStamp();
+		delay = (deadline > now) ? deadline - now : 1;	// an expired deadline fires as soon as possible
+		its.it_value.tv_sec = delay / 1000000;
+		its.it_value.tv_nsec = (delay % 1000000) * 1000;
+	}
+	if (timerfd_settime(flush_timer_fd, 0, &its, NULL) == -1)
+		LMLOG(LERR, "flush_timer_arm: timerfd_settime error: %s", strerror(errno));
+}
+
+// Keep the rule in the heap while it has packets stored, with the expiration of its period as
+// deadline. With class scheduling, the deadline of the bulk packets queued counts too: the first
+// one must not wait more than the bulk period, and the queue is sent at once if it is over its
+// threshold. The timer is not reprogrammed
+static void muxed_deadline_set(data_simplemux_t *data_simplemux)
+{
+	uint64_t bulk_deadline;
+
+	if ((data_simplemux->num_pkts_stored_from_tun == 0) && (data_simplemux->bulk_count == 0)) {
+		if (data_simplemux->heap_pos >= 0)
+			flush_heap_remove(data_simplemux);
+		return;
 	}
-//LMLOG(LINF,"ha pasado comp 2 dir or ");
 
-	// IP source address AND IP destination address of the packet belong to one source net AND one destination net, respectively
-	for (i = 0 ; i < numdsm ;  ++i) {
-		src_sin_addr.s_addr = htonl(ntohl((tpl->src_addr.ip.addr.v4.s_addr) & (0xFFFFFFFF >> (32 - conf_sm[i].mux_tuple.src_mask))));  // Get source net in struct in_addr format 
-		ip_addr_init (&src_net, &src_sin_addr, AF_INET); // Get source net in ip_address_t format 
-	
-		dst_sin_addr.s_addr = htonl(ntohl((tpl->dst_addr.ip.addr.v4.s_addr) & (0xFFFFFFFF >> (32 - conf_sm[i].mux_tuple.dst_mask))));  // Get destination net in struct in_addr format 
-		ip_addr_init (&dst_net, &dst_sin_addr, AF_INET); // Get destination net in ip_address_t format 
+	data_simplemux->flush_deadline = UINT64_MAX;
+	if (data_simplemux->num_pkts_stored_from_tun > 0) {
+		if (data_simplemux->latency_budget > 0)
+			data_simplemux->flush_deadline = data_simplemux->time_last_sent_in_microsec + data_simplemux->latency_budget;
+		else
+			data_simplemux->flush_deadline = data_simplemux->time_last_sent_in_microsec + data_simplemux->period;
+	}
+	if (data_simplemux->bulk_count > 0) {
+		if (data_simplemux->bulk_bytes > muxed_bulk_threshold(data_simplemux))
+			bulk_deadline = GetTimeStamp();
+		else
+			bulk_deadline = data_simplemux->bulk_arrival[0] + data_simplemux->bulk_period;
+		if (bulk_deadline < data_simplemux->flush_deadline)
+			data_simplemux->flush_deadline = bulk_deadline;
+	}
 
-		if ( (ip_addr_cmp(&(conf_sm[i].mux_tuple.src_net),&src_net) == 0) &&
-			 (ip_addr_cmp(&(conf_sm[i].mux_tuple.dst_net),&dst_net)) == 0)  {
-			return (&(conf_sm [i]));
-		}
+	if (data_simplemux->heap_pos < 0) {
+		flush_heap_set(flush_heap_len++, data_simplemux);
+		flush_heap_up(data_simplemux->heap_pos);
+	} else {
+		flush_heap_up(data_simplemux->heap_pos);
+		flush_heap_down(data_simplemux->heap_pos);
 	}
-//LMLOG(LINF,"ha pasado comp 2 redes and "   );
+}
 
-	// IP source address AND IP destination address of the packet belong to one source net OR one destination net, respectively
-	for (i = 0 ; i < numdsm ;  ++i) {
-		src_sin_addr.s_addr = htonl(ntohl((tpl->src_addr.ip.addr.v4.s_addr) & (0xFFFFFFFF >> (32 - conf_sm[i].mux_tuple.src_mask))));  // Get source net in struct in_addr format 
-		ip_addr_init (&src_net, &src_sin_addr, AF_INET); // Get source net in ip_address_t format 
-	
-		dst_sin_addr.s_addr = htonl(ntohl((tpl->dst_addr.ip.addr.v4.s_addr) & (0xFFFFFFFF >> (32 - conf_sm[i].mux_tuple.dst_mask))));  // Get destination net in struct in_addr format 
-		ip_addr_init (&dst_net, &dst_sin_addr, AF_INET); // Get destination net in ip_address_t format 
-		if ( (ip_addr_cmp(&(conf_sm[i].mux_tuple.src_net),&src_net) == 0) ||
-			 (ip_addr_cmp(&(conf_sm[i].mux_tuple.dst_net),&dst_net)) == 0)  {
-			return (&(conf_sm [i]));
-		}
+// NULL only reprograms the timer
+static void muxed_deadline_update(data_simplemux_t *data_simplemux)
+{
+	if (data_simplemux != NULL)
+		muxed_deadline_set(data_simplemux);
+	flush_timer_arm();
+}
+
+// Send the bundles whose period has expired
+static void muxed_flush_expired()
+{
+	data_simplemux_t *data_simplemux;
+
+	while ((flush_heap_len > 0) && (flush_heap[0]->flush_deadline <= GetTimeStamp())) {
+		data_simplemux = flush_heap[0];
+		muxed_rule_flush(data_simplemux);
+		// the bulk packets that did not fit in the bundle wait for the next one
+		muxed_deadline_set(data_simplemux);
 	}
-//LMLOG(LINF,"ha pasado comp 2 redes or "   );
-  
-	// Dir fuente y dir destino del tnel 
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if((strcmp(ip_addr_to_char(&(conf_sm[i].mux_tuple.srloc.ip)),lisp_addr_to_char(fe->srloc))==0) &&
-			(strcmp(ip_addr_to_char(&(conf_sm[i].mux_tuple.drloc.ip)),lisp_addr_to_char(fe->drloc))==0)) {
-		/*if ( (lisp_addr_cmp(&(conf_sm[i].mux_tuple.srloc), fe->srloc) == 0) &&
-			 (lisp_addr_cmp(&(conf_sm[i].mux_tuple.drloc), fe->drloc) == 0)) {*/
-			return (&(conf_sm [i]));
-		}
+	flush_timer_arm();
+}
+
+// Send the bundle of a rule, if it has packets stored, and take the rule out of the heap. Some bulk
+// packets may be left in their queue. The timer is not reprogrammed
+static void muxed_rule_flush(data_simplemux_t *data_simplemux)
+{
+	lbuf_t lisp_buffer;							// points to the bundle to be sent
+
+	if (data_simplemux->heap_pos >= 0) {
+		flush_heap_remove(data_simplemux);
 	}
-	
-//LMLOG(LINF,"ha pasado comp 2 redes and "   );
-  
-	// Dir fuente y dir destino del tnel 
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if((strcmp(ip_addr_to_char(&(conf_sm[i].mux_tuple.srloc.ip)),lisp_addr_to_char(fe->srloc))==0) ||
-			(strcmp(ip_addr_to_char(&(conf_sm[i].mux_tuple.drloc.ip)),lisp_addr_to_char(fe->drloc))==0)) {
-		/*if ( (lisp_addr_cmp(&(conf_sm[i].mux_tuple.srloc), fe->srloc) == 0) &&
-			 (lisp_addr_cmp(&(conf_sm[i].mux_tuple.drloc), fe->drloc) == 0)) {*/
-			return (&(conf_sm [i]));
-		}
+	if (((data_simplemux->num_pkts_stored_from_tun > 0) || (data_simplemux->bulk_count > 0))
+			&& (mux_packets (NULL, 0, data_simplemux, &lisp_buffer) == 1)) {
+		//Encapsulate output multiplexed packet in a LISP packet and sent it
+		mux_output_unicast(&lisp_buffer, data_simplemux);
 	}
-	
-//LMLOG(LINF,"ha pasado comp 2 redes or "   );
-  
-	// Puerto fuente y Puerto destino 
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if (( conf_sm[i].port_src == tpl->src_port) &&
-			 (conf_sm[i].port_dst == tpl->dst_port)) {
-			return (&(conf_sm [i]));
-		}
+}
+
+// Send all the packets stored by a rule, in as many bundles as needed
+static void muxed_rule_drain(data_simplemux_t *data_simplemux)
+{
+	do {
+		muxed_rule_flush(data_simplemux);
+	} while (data_simplemux->bulk_count > 0);
+}
+
+static int muxed_flush_timer_process(sock_t *sl)
+{
+	uint64_t expirations;
+
+	if (read(sl->fd, &expirations, sizeof(expirations)) != sizeof(expirations) && errno != EAGAIN)
+		LMLOG(LDBG_2, "muxed_flush_timer_process: read error: %s", strerror(errno));
+
+	// the timer is one-shot, so it is not armed any more
+	flush_timer_deadline = 0;
+	muxed_flush_expired();
+	return (GOOD);
+}
+
+/**************************************************************************
+ *       Process the timers of all "simplemux data structs"               *
+ **************************************************************************/
+
+// The bundles are normally flushed by the timerfd. Checking the earliest deadline here is cheap
+// and keeps the bundles flowing if the timerfd could not be created
+void muxed_timer_process_all ()
+{
+	static uint64_t last_stats = 0;
+	uint64_t time_in_microsec = GetTimeStamp();
+
+	rohc_pool_sweep(time_in_microsec);
+	muxed_flush_expired();
+
+	if (time_in_microsec - last_stats > MUX_STATS_PERIOD) {
+		if (last_stats != 0)
+			muxed_stats_dump(LDBG_1);
+		last_stats = time_in_microsec;
 	}
-	
-//LMLOG(LINF,"ha pasado comp 2 puertos and "   );
-  
-	// Puerto fuente y Puerto destino 
-	for (i = 0 ; i < numdsm ;  ++i) {
-		if (( conf_sm[i].port_src == tpl->src_port) ||
-			 (conf_sm[i].port_dst == tpl->dst_port)) {
-			return (&(conf_sm [i]));
+}
+
+/**************************************************************************
+ *       Efficiency and delay of the bundles sent by each rule            *
+ **************************************************************************/
+
+// the efficiency is the share of the bytes sent that belong to the packets multiplexed. It is
+// compared with the one of sending each packet in its own tunnel
+void muxed_stats_dump (int log_level)
+{
+	data_simplemux_t *ds;
+	double efficiency;
+	double efficiency_native;
+	int i;
+
+	for (i = 0 ; i < numdsm ; i++) {
+		ds = &conf_sm[i];
+		if (ds->stat_bundles == 0)
+			continue;
+
+		efficiency = 100.0 * ds->stat_payload_bytes / ds->stat_sent_bytes;
+		efficiency_native = 100.0 * ds->stat_payload_bytes /
+				(ds->stat_payload_bytes + ds->stat_packets * (IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE));
+
+		LMLOG(log_level, "Simplemux rule %d: %"PRIu64" bundles, %.1f packets per bundle, efficiency %.1f%% (%.1f%% without multiplexing), "
+				"mean added delay %"PRIu64" usec", i, ds->stat_bundles, (double)ds->stat_packets / ds->stat_bundles,
+				efficiency, efficiency_native, ds->stat_delay_sum / ds->stat_packets);
+		if (ds->latency_budget > 0) {
+			LMLOG(log_level, "\tadaptive: latency budget %d usec, interarrival %.0f usec, packet size %.0f bytes, %d packets per bundle",
+					ds->latency_budget, ds->ewma_interarrival, ds->ewma_size, ds->adaptive_numpackets);
 		}
 	}
+}
 
-//LMLOG(LINF,"ha pasado comp 2 puertos or "   );
 
-//LMLOG(LINF,"ha pasado todos los comp tunel"   );
+/**************************************************************************
+ *        Lookup mux_tuple from packet tuple and forward entry            *
+ **************************************************************************/
 
-	//return (-1);
-	return (NULL);
+data_simplemux_t * lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe)
+{
+	if (classifier == NULL) {
+		return (NULL);
+	}
+	return (mux_classifier_lookup(classifier, tpl, fe));
 }
 
 
@@ -1933,74 +2341,65 @@ data_simplemux_t * lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe)
 
 int mux_tun_output_unicast (lbuf_t *b, packet_tuple_t *tuple, fwd_entry_t *fe)
 {
-	unsigned char out_muxed_packet[BUFSIZE];	// stores the multiplexed packet
-	uint16_t out_total_length = 0;				// total length of the built multiplexed packet
-	
-
-	unsigned char lisp_mux_buffer[BUFSIZE];		// buffer lisp to send mux packet	
-	lbuf_t lisp_buffer;							// buffer lisp to send mux packet	
-	uint32_t lisp_data_length = 0;					// length of the built multiplexed packet
+	lbuf_t lisp_buffer;							// points to the bundle to be sent
+	int result;
 
 
 	data_simplemux_t *data_simplemux = NULL;	// stores the data simplemux lookup
-	// Lookup mux_tuple from packet tuple and forward entry
-	if ((data_simplemux = lookup_mux_tuple (tuple, fe)) != NULL) {
-		// Put tunnel data in data_simplemux_t
-		lisp_addr_copy(&(data_simplemux->mux_tuple.srloc), fe->srloc); 
-		lisp_addr_copy(&(data_simplemux->mux_tuple.drloc), fe->drloc); 
-		data_simplemux->mux_tuple.out_sock = *(fe->out_sock);
-        // Multiplex packets
-		switch(mux_packets ((unsigned char*)lbuf_data(b), lbuf_size(b), data_simplemux, out_muxed_packet, &out_total_length)) 
+	// Lookup mux_tuple from packet tuple and forward entry. The result is cached in the
+	// forwarding entry of the flow until the rules change
+	if (fe->mux_gen != classifier_gen) {
+		fe->mux_rule = lookup_mux_tuple (tuple, fe);
+		fe->mux_gen = classifier_gen;
+	}
+	if ((data_simplemux = fe->mux_rule) == NULL) {
+		LMLOG(LERR, "mux_tuple has not been lookup\n");
+		return (-1);
+	}
+
+	// The packets stored were compressed with the contexts of their tunnel and the bundle has a
+	// single tunnel header. If the flow goes through another tunnel, they are sent first
+	if (((data_simplemux->num_pkts_stored_from_tun > 0) || (data_simplemux->bulk_count > 0))
+			&& ((lisp_addr_cmp(&(data_simplemux->mux_tuple.srloc), fe->srloc) != 0)
+			|| (lisp_addr_cmp(&(data_simplemux->mux_tuple.drloc), fe->drloc) != 0))) {
+		LMLOG(LDBG_1, "Tunnel of the rule changed. Sending the packets stored\n");
+		muxed_rule_drain(data_simplemux);
+	}
+
+	// Put tunnel data in data_simplemux_t
+	lisp_addr_copy(&(data_simplemux->mux_tuple.srloc), fe->srloc); 
+	lisp_addr_copy(&(data_simplemux->mux_tuple.drloc), fe->drloc); 
+	data_simplemux->mux_tuple.out_sock = *(fe->out_sock);
+
+	// Multiplex packets. The bundle is built in the rule, after the room reserved for the LISP headers
+	result = mux_packets ((unsigned char*)lbuf_data(b), lbuf_size(b), data_simplemux, &lisp_buffer);
+	if (result == 0) {
+		// A muxed packet is NOT built. The packet is stored until a trigger or the end of the period
+		muxed_deadline_update(data_simplemux);
+		return(0);
+	}
+
+	// A muxed packet is built to be sent. Encapsulate it in a LISP packet and send it. It must be sent
+	// before mux_packets is called again, since the next packet is stored in the same bundle
+	mux_output_unicast(&lisp_buffer,data_simplemux); 
+
+	if (result == 2) {
+		// A previous muxed packet has been sent because maximum size is reached. Multiplex again
+		switch(mux_packets ((unsigned char*)lbuf_data(b), lbuf_size(b), data_simplemux, &lisp_buffer))
 		{
-		 case 0: // A muxed packet is NOT built
-			break;
-		 case 1: // A muxed packet is built to be sent
-			// Build lisp buffer
-		 	lbuf_use_stack(&lisp_buffer, &lisp_mux_buffer, (uint32_t)BUFSIZE);
-			lbuf_reserve(&lisp_buffer,MUX_STACK_OFFSET);
-			memcpy (lbuf_data(&lisp_buffer), out_muxed_packet, out_total_length);
-			lisp_data_length = out_total_length;
-			lbuf_set_size(&lisp_buffer, lisp_data_length);
-			// Encapsulate output multiplexed packet in a LISP packet and sent it
-			mux_output_unicast(&lisp_buffer,data_simplemux); 
+		 case 0:
 			break;
-		 case 2: // A previous muxed packet is built to be sent because maximum size is reached. This function must be called again, using the same input parameters.
-			// Build lisp buffer
-		 	lbuf_use_stack(&lisp_buffer, &lisp_mux_buffer, (uint32_t)BUFSIZE);
-			lbuf_reserve(&lisp_buffer,MUX_STACK_OFFSET);
-			memcpy (lbuf_data(&lisp_buffer), out_muxed_packet, out_total_length);
-			lisp_data_length = out_total_length;
-			lbuf_set_size(&lisp_buffer, lisp_data_length);
-			// Encapsulate output multiplexed packet in a LISP packet and sent it
+		 case 1:
 			mux_output_unicast(&lisp_buffer,data_simplemux); 
-			// Multiplex again
-			switch(mux_packets ((unsigned char*)lbuf_data(b), lbuf_size(b), data_simplemux, out_muxed_packet, &out_total_length))
-			{
-			 case 0:
-				break;
-			 case 1:
-				// Build lisp buffer
-		 		lbuf_use_stack(&lisp_buffer, &lisp_mux_buffer, (uint32_t)BUFSIZE);
-				lbuf_reserve(&lisp_buffer,MUX_STACK_OFFSET);
-				memcpy (lbuf_data(&lisp_buffer), out_muxed_packet, out_total_length);
-				lisp_data_length = out_total_length;
-				lbuf_set_size(&lisp_buffer, lisp_data_length);
-				// Encapsulate output multiplexed packet in a LISP packet and sent it
-				mux_output_unicast(&lisp_buffer,data_simplemux); 
-				break;
-			 case 2:
-				LMLOG(LCRIT, "Invalid loop when mux_packets function is called\n");
-				return (-1);
-				break;
-			}
 			break;
-		}
-	}
-	else { 
-			LMLOG(LERR, "mux_tuple has not been lookup\n");
+		 case 2:
+			LMLOG(LCRIT, "Invalid loop when mux_packets function is called\n");
+			muxed_deadline_update(data_simplemux);
 			return (-1);
+		}
 	}
 
+	muxed_deadline_update(data_simplemux);
 	return(0);
 }
 
@@ -2009,13 +2408,33 @@ int mux_tun_output_unicast (lbuf_t *b, packet_tuple_t *tuple, fwd_entry_t *fe)
 /***************** NET to tun. demux and decompress **************************/
 /*****************************************************************************/
 
-void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_receive_fd)
+// the packets decompressed from a bundle are written here, one after the other, until they are
+// written to tun
+static unsigned char demux_arena[DEMUX_ARENA_SIZE];
+
+// write to tun the packets demultiplexed from a bundle. A tun device takes a single packet in
+// each write, so each one needs its own system call
+static void demux_write_batch (int tun_receive_fd, struct iovec *packets, int num_packets)
+{
+	int i;
+
+	for (i = 0; i < num_packets; i++) {
+		if (write(tun_receive_fd, packets[i].iov_base, packets[i].iov_len) < 0) {
+			LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
+		}
+	}
+}
+
+void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_receive_fd, ip_addr_t *local_rloc, ip_addr_t *remote_rloc)
 {
 	// variables for storing the packets to demultiplex
 	uint16_t nread_from_net;					// number of bytes read from network which will be demultiplexed
-	unsigned char buffer_from_net[BUFSIZE];				// stores the packet received from the network, before sending it to tun
+	unsigned char *buffer_from_net;					// the packet received from the network. It is parsed in place
         unsigned char protocol_rec;	
-	unsigned char demuxed_packet[BUFSIZE];				// stores each demultiplexed packet
+	unsigned char *demuxed_packet;					// each demultiplexed packet, in the bundle or, if decompressed, in the arena
+	struct iovec demux_out[MAXPKTS];				// packets to be written to tun
+	int num_demux_out = 0;
+	int arena_used = 0;						// bytes of the arena used by the packets in 'demux_out'
 	int num_demuxed_packets;					// a counter of the number of packets inside a muxed one
 	int first_header_read;						// it is 0 when the first header has not been read
 	int position;							// for reading the arrived multiplexed packet
@@ -2024,9 +2443,6 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 	int maximum_packet_length;					// the maximum lentgh of a packet. It may be 64 (first header) or 128 (non-first header)
 	int packet_length;						// the length of each packet inside the multiplexed bundle
 
-	//indexes and counters
-	int l;
-
 	/* variables for the log file */
 	bool bits[8];							// it is used for printing the bits of a byte in debug mode
 
@@ -2036,11 +2452,11 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 									// it is 2 for ROHC Bidirectional Optimistic mode
 									// it is 3 for ROHC Bidirectional Reliable mode (not implemented yet)
 
-	unsigned char ip_buffer_d[BUFSIZE];				// the buffer that will contain the resulting IP decompressed packet
-	struct rohc_buf ip_packet_d = rohc_buf_init_empty(ip_buffer_d, BUFSIZE);
-	unsigned char rohc_buffer_d[BUFSIZE];				// the buffer that will contain the ROHC packet to decompress
-	struct rohc_buf rohc_packet_d = rohc_buf_init_empty(rohc_buffer_d, BUFSIZE);
+	struct rohc_buf ip_packet_d = rohc_buf_init_empty(demux_arena, BUFSIZE);	// the resulting IP decompressed packet, in the arena
+	struct rohc_buf rohc_packet_d = rohc_buf_init_empty(NULL, 0);			// the ROHC packet to decompress, in the bundle
 	rohc_status_t status;
+	rohc_ctx_t *rohc_ctx = NULL;					// ROHC contexts of the tunnel the packet comes from
+	struct rohc_decomp *decompressor;				// the ROHC decompressor of the tunnel
 
 
 	/* structures to handle ROHC feedback */
@@ -2053,19 +2469,13 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 	// data arrived at the network interface: read, demux, decompress and forward it
 
 	nread_from_net = size_packet_in;
-	memcpy(buffer_from_net, packet_in, size_packet_in);
+	buffer_from_net = packet_in;
 	
 	/* increase the counter of the number of packets read from the network */
 	net2tun++;
 
 	//LMLOG(LDBG_1, "MUXED PACKET #%lu: Read muxed packet from %s: %i bytes\n", net2tun, inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), /*ntohs(remote.sin_port),*/ nread_from_net + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE );				
 
-	// write the log file
-	if ( log_file != NULL ) {
-		//fprintf (log_file, "%"PRIu64"\trec\tmuxed\t%i\t%lu\tfrom\n", GetTimeStamp(), nread_from_net  + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE, net2tun/*, inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), ntohs(remote.sin_port)*/);
-		fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing Ctrl+C.
-	}
-
 	// if the packet comes from the multiplexing port, I have to demux it and write each packet to the tun interface
 	position = 0; //this is the index for reading the packet/frame
 	num_demuxed_packets = 0;
@@ -2368,10 +2778,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 			}
 		}
 
-		// copy the packet to a new string
-		for (l = 0; l < packet_length ; l++) {
-			demuxed_packet[l] = buffer_from_net[l + position ];
-		}
+		// the packet is not copied: it is written to tun from the bundle
+		demuxed_packet = &buffer_from_net[position];
 		position = position + packet_length;
 
 		// Check if the position has gone beyond the size of the packet (wrong packet)
@@ -2379,12 +2787,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 			// The last length read from the separator goes beyond the end of the packet
 			LMLOG (LDBG_1, "  The length of the packet does not fit. Packet discarded\n");
 
-			// write the log file
-			if ( log_file != NULL ) {
-				// the packet is bad so I add a line
-				fprintf (log_file, "%"PRIu64"\terror\tdemux_bad_length\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun );	
-				fflush(log_file);
-			}
+			// trace the event. The packet is bad
+			mux_trace (MUX_EV_DEMUX_BAD_LENGTH, 0, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 						
 		} else {
 
@@ -2408,26 +2812,31 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 				if ( ROHC_mode == 0 ) {
 					LMLOG(LDBG_1," ROHC packet received, but not in ROHC mode. Packet dropped\n");
 
-					// write the log file
-					if ( log_file != NULL ) {
-						fprintf (log_file, "%"PRIu64"\tdrop\tno_ROHC_mode\t%i\t%lu\n", GetTimeStamp(), packet_length, net2tun);	// the packet may be good, but the decompressor is not in ROHC mode
-						fflush(log_file);
-					}
+					// trace the event. The packet may be good, but the decompressor is not in ROHC mode
+					mux_trace (MUX_EV_DROP_NO_ROHC, 0, GetTimeStamp(), packet_length, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 				} else {
-					// reset the buffers where the rohc packets, ip packets and feedback info are to be stored
-					rohc_buf_reset (&ip_packet_d);
-					rohc_buf_reset (&rohc_packet_d);
+					// the decompressed packet is written in the arena. If it may not fit, the packets
+					// demultiplexed so far are written to tun first
+					if (DEMUX_ARENA_SIZE - arena_used < BUFSIZE) {
+						demux_write_batch (tun_receive_fd, demux_out, num_demux_out);
+						num_demux_out = 0;
+						arena_used = 0;
+					}
+					ip_packet_d.data = demux_arena + arena_used;
+					ip_packet_d.max_len = BUFSIZE;
+					ip_packet_d.offset = 0;
+					ip_packet_d.len = 0;
+
+					// the ROHC packet is decompressed from the bundle
+					rohc_packet_d.data = demuxed_packet;
+					rohc_packet_d.max_len = packet_length;
+					rohc_packet_d.offset = 0;
+					rohc_packet_d.len = packet_length;
+
+					// reset the buffers where the feedback info is to be stored
 					rohc_buf_reset (&rcvd_feedback);
 					rohc_buf_reset (&feedback_send);
 
-					// Copy the compressed length and the compressed packet
-					rohc_packet_d.len = packet_length;
-						
-					// Copy the packet itself
-					for (l = 0; l < packet_length ; l++) {
-						rohc_buf_byte_at(rohc_packet_d, l) = demuxed_packet[l];
-					}
-
 					// dump the ROHC packet on terminal
 					if (debug_level == 1) {
 						LMLOG(LDBG_1, " ROHC. ");
@@ -2438,8 +2847,25 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						dump_packet (packet_length, demuxed_packet);
 					}
 
-					// decompress the packet
-					status = rohc_decompress3 (decompressor, rohc_packet_d, &ip_packet_d, &rcvd_feedback, &feedback_send);
+					// decompress the packet with the decompressor of the tunnel. All the packets of a bundle
+					// come from the same tunnel
+					if (rohc_ctx == NULL) {
+						rohc_ctx = rohc_ctx_get(local_rloc, remote_rloc);
+					}
+					decompressor = rohc_ctx_decompressor(rohc_ctx, ROHC_mode);
+					if (decompressor != NULL) {
+						status = rohc_decompress3 (decompressor, rohc_packet_d, &ip_packet_d, &rcvd_feedback, &feedback_send);
+					} else {
+						status = ROHC_STATUS_ERROR;
+					}
+
+					if (status == ROHC_STATUS_OK) {
+						rohc_ctx->decomp_packets++;
+						rohc_ctx->decomp_bytes_in += packet_length;
+						rohc_ctx->decomp_bytes_out += ip_packet_d.len;
+					} else {
+						rohc_ctx->decomp_failures++;
+					}
 
 					// if bidirectional mode has been set, check the feedback
 					if ( ROHC_mode > 1 ) {
@@ -2457,7 +2883,7 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 
 							// deliver the feedback received to the local compressor
 							//https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/group__rohc__comp.html
-							if ( rohc_comp_deliver_feedback2 ( compressor, rcvd_feedback ) == false ) {
+							if ( rohc_ctx->compressor == NULL || rohc_comp_deliver_feedback2 ( rohc_ctx->compressor, rcvd_feedback ) == false ) {
 								LMLOG(LDBG_3, "Error delivering feedback received from the remote compressor to the compressor\n");
 							} else {
 								LMLOG(LDBG_3, "Feedback from the remote compressor delivered to the compressor: %i bytes\n", rcvd_feedback.len);
@@ -2498,8 +2924,9 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 							// ip_packet.len bytes of decompressed IP data available in ip_packet
 							packet_length = ip_packet_d.len;
 
-							// copy the packet
-							memcpy(demuxed_packet, rohc_buf_data_at(ip_packet_d, 0), packet_length);
+							// the packet stays in the arena until it is written to tun
+							demuxed_packet = rohc_buf_data_at(ip_packet_d, 0);
+							arena_used = arena_used + packet_length;
 
 							//dump the IP packet on the standard output
 							LMLOG(LDBG_2, "  ");
@@ -2521,11 +2948,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 								*    feedback information, so there was nothing to decompress */
 							LMLOG(LDBG_1, "  no IP packet decompressed\n");
 
-							// write the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\trec\tROHC_feedback\t%i\t%lu\tfrom\n", GetTimeStamp(), nread_from_net, net2tun/*, inet_ntoa(data_simplemux->mux_tuple.drloc.ip.addr.v4), ntohs(remote.sin_port)*/);	// the packet is bad so I add a line
-								fflush(log_file);
-							}
+							// trace the event
+							mux_trace (MUX_EV_REC_ROHC_FEEDBACK, 0, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 						}
 					}
 
@@ -2535,12 +2959,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						LMLOG(LDBG_1, "  decompression of ROHC packet failed. No context\n");
 						//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
 
-						// write the log file
-						if ( log_file != NULL ) {
-							// the packet is bad
-							fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-							fflush(log_file);
-						}
+						// trace the event. The packet is bad
+						mux_trace (MUX_EV_DECOMP_FAILED, MUX_DECOMP_NO_CONTEXT, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 					}
 
 					else if ( status == ROHC_STATUS_OUTPUT_TOO_SMALL ) {	// the output buffer is too small for the compressed packet
@@ -2549,12 +2969,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						LMLOG(LDBG_1, "  decompression of ROHC packet failed. Output buffer is too small\n");
 						//fprintf(stderr, "  decompression of ROHC packet failed. Output buffer is too small\n");
 
-						// write the log file
-						if ( log_file != NULL ) {
-							// the packet is bad
-							fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Output buffer is too small\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-							fflush(log_file);
-						}
+						// trace the event. The packet is bad
+						mux_trace (MUX_EV_DECOMP_FAILED, MUX_DECOMP_OUTPUT_TOO_SMALL, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 					}
 
 					else if ( status == ROHC_STATUS_MALFORMED ) {			// the decompression failed because the ROHC packet is malformed 
@@ -2563,12 +2979,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						LMLOG(LDBG_1, "  decompression of ROHC packet failed. No context\n");
 						//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
 
-						// write the log file
-						if ( log_file != NULL ) {
-							// the packet is bad
-							fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. No context\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-							fflush(log_file);
-						}
+						// trace the event. The packet is bad
+						mux_trace (MUX_EV_DECOMP_FAILED, MUX_DECOMP_MALFORMED, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 					}
 
 					else if ( status == ROHC_STATUS_BAD_CRC ) {			// the CRC detected a transmission or decompression problem
@@ -2577,12 +2989,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						LMLOG(LDBG_1, "  decompression of ROHC packet failed. Bad CRC\n");
 						//fprintf(stderr, "  decompression of ROHC packet failed. Bad CRC\n");
 
-						// write the log file
-						if ( log_file != NULL ) {
-							// the packet is bad
-							fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Bad CRC\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-							fflush(log_file);
-						}
+						// trace the event. The packet is bad
+						mux_trace (MUX_EV_DECOMP_FAILED, MUX_DECOMP_BAD_CRC, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 					}
 
 					else if ( status == ROHC_STATUS_ERROR ) {				// another problem occurred
@@ -2591,12 +2999,8 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 						LMLOG(LDBG_1, "  decompression of ROHC packet failed. Other error\n");
 						//fprintf(stderr, "  decompression of ROHC packet failed. Other error\n");
 
-						// write the log file
-						if ( log_file != NULL ) {
-							// the packet is bad
-							fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Other error\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-							fflush(log_file);
-						}
+						// trace the event. The packet is bad
+						mux_trace (MUX_EV_DECOMP_FAILED, MUX_DECOMP_OTHER, GetTimeStamp(), nread_from_net, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 					}
 				}
 
@@ -2608,19 +3012,22 @@ void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_r
 
 				LMLOG(LDBG_2, "\n");
 
-				// write the demuxed packet to the network
-				if ((write(tun_receive_fd, demuxed_packet, packet_length)) < 0) {
-					LMLOG(LDBG_2, "lisp_input: write error: %s\n ", strerror(errno));
+				// the demuxed packets are written to tun when the whole bundle has been parsed
+				if (num_demux_out == MAXPKTS) {
+					demux_write_batch (tun_receive_fd, demux_out, num_demux_out);
+					num_demux_out = 0;
 				}
+				demux_out[num_demux_out].iov_base = demuxed_packet;
+				demux_out[num_demux_out].iov_len = packet_length;
+				num_demux_out++;
 
-				// write the log file
-				if ( log_file != NULL ) {
-					fprintf (log_file, "%"PRIu64"\tsent\tdemuxed\t%i\t%lu\n", GetTimeStamp(), packet_length, net2tun);	// the packet is good
-					fflush(log_file);
-				}
+				// trace the event. The packet is good
+				mux_trace (MUX_EV_SENT_DEMUXED, 0, GetTimeStamp(), packet_length, net2tun, 0, MUX_TRACE_NO_TUNNEL, remote_rloc);
 			}
 		}
 	}
+
+	demux_write_batch (tun_receive_fd, demux_out, num_demux_out);
 }
 
 
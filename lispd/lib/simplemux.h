@@ -18,6 +18,18 @@
 
 #define MAXPKTS 100				// maximum number of packets to store
 #define MAXTIMEOUT 100000000.0	// maximum value of the timeout (microseconds). (default 100 seconds)
+#define DEMUX_ARENA_SIZE (4 * BUFSIZE)	// buffer for the packets decompressed from the bundles received
+
+
+#define MUX_DSCP_REALTIME 32			// class scheduling: packets with this DSCP (CS4) or higher are realtime
+
+
+#define MUX_EWMA_WEIGHT 8				// adaptive mode: a new sample weights 1/MUX_EWMA_WEIGHT in the estimations
+#define MUX_STATS_PERIOD 60000000		// (microseconds) period of the report of the bundles sent by each rule
+
+#define ROHC_CTX_POOL_SIZE 64				// maximum number of tunnels with ROHC contexts
+#define ROHC_CTX_IDLE_TIMEOUT 60000000	// (microseconds) the contexts of a tunnel not used for this time are released
+#define ROHC_CTX_SWEEP_PERIOD 1000000	// (microseconds) period of the search of idle contexts
 
 
 #define IPv4_HEADER_SIZE 20
@@ -111,40 +123,111 @@ typedef struct config_simplemux {
 
 	int size_threshold;						// if the number of bytes stored is higher than this, a muxed packet is sent
 
+	int latency_budget;						// (microseconds) adaptive mode: maximum delay added to a packet. 0: the static triggers are used
+
+	uint64_t bulk_period;					// (microseconds) class scheduling: maximum time a bulk packet waits. 0: a single class
+	int bulk_threshold;						// class scheduling: a bundle is sent when the bulk packets queued exceed this size
+
+	// adaptive mode: estimations of the traffic of the rule (EWMA)
+	double ewma_interarrival;				// (microseconds) time between consecutive packets
+	double ewma_size;						// (bytes) size of the packets, once compressed
+	uint64_t last_arrival;					// (microseconds) arrival of the last packet
+	int adaptive_numpackets;				// packets per bundle chosen with the last estimations
+
+	// counters of the bundles sent
+	uint64_t arrival_sum;					// sum of the arrival times of the packets stored, to compute their delay
+	uint64_t stat_bundles;					// bundles sent
+	uint64_t stat_packets;					// packets sent in the bundles
+	uint64_t stat_payload_bytes;			// bytes of the packets sent in the bundles
+	uint64_t stat_sent_bytes;				// bytes of the bundles, including the tunnel headers
+	uint64_t stat_delay_sum;				// (microseconds) sum of the delays added to the packets
+
 	
 	mux_tuple_t mux_tuple;					// Tuple to detect the simplemux configuration to be used
 
-	// variables for storing the packets to multiplex
-	unsigned char protocol[MAXPKTS][SIZE_PROTOCOL_FIELD];	// protocol field of each packet
-	uint16_t size_separators_to_multiplex[MAXPKTS];			// stores the size of the Simplemux separator. It does not include the "Protocol" field
-	unsigned char separators_to_multiplex[MAXPKTS][3];		// stores the header ('protocol' not included) received from tun, before sending it to the network
-	uint16_t size_packets_to_multiplex[MAXPKTS];			// stores the size of the received packet
-	unsigned char packets_to_multiplex[MAXPKTS][BUFSIZE];	// stores the packets received from tun, before storing it or sending it to the network
+	// per-tunnel bundle. Separators, 'Protocol' fields and packets are appended at their final offsets
+	// as packets arrive, so the bundle is the multiplexed packet to be sent when a trigger fires. It is
+	// stored after MUX_STACK_OFFSET bytes of headroom, where the LISP, UDP and IP headers are pushed
+	unsigned char bundle_buf[MUX_STACK_OFFSET + BUFSIZE];	// headroom + the multiplexed packet being built
+	unsigned char protocol[MAXPKTS][SIZE_PROTOCOL_FIELD];	// protocol field of each stored packet
+	uint16_t offset_in_bundle[MAXPKTS];						// offset in the bundle where each stored packet (separator or 'Protocol' field) begins
+	uint8_t size_separators_to_multiplex[MAXPKTS];			// stores the size of the Simplemux separator. It does not include the "Protocol" field
+	int single_protocol;										// it is 1 while all the stored packets belong to the same protocol
 	int num_pkts_stored_from_tun;							// number of packets received and not sent from tun (stored)
-	int size_muxed_packet;									// acumulated size of the multiplexed packet
+	int size_muxed_packet;									// bytes written in the bundle
 	int first_header_written;								// it indicates if the first header has been written or not
 
+	// class scheduling. The realtime packets (DSCP CS4 or higher, or RTP) are stored in the bundle with the
+	// triggers above. The bulk packets wait, already compressed, in a queue with their own triggers, and
+	// fill the room the realtime packets leave in each bundle sent
+	unsigned char bulk_buf[2 * BUFSIZE];					// bulk packets queued, one after the other
+	unsigned char bulk_protocol[MAXPKTS][SIZE_PROTOCOL_FIELD];	// protocol field of each queued packet
+	uint16_t bulk_size[MAXPKTS];							// size of each queued packet
+	uint64_t bulk_arrival[MAXPKTS];							// (microseconds) arrival of each queued packet
+	int bulk_count;											// number of bulk packets queued
+	int bulk_bytes;											// bytes of the bulk packets queued
+
+	uint64_t flush_deadline;				// (microseconds) expiration of the period while there are packets stored
+	int heap_pos;							// position in the heap of flush deadlines. -1 if the bundle is empty
+
+	struct rohc_ctx *rohc_ctx;				// ROHC contexts of the last tunnel used by the rule
+	uint32_t rohc_ctx_gen;					// generation of the slot of 'rohc_ctx' when it was taken
+
 } data_simplemux_t;
 
 
+// ROHC contexts of a simplemux tunnel (a pair of local and remote RLOCs). The compressor and the decompressor
+// are created the first time they are needed, and released when the tunnel is idle or the pool is full
+typedef struct rohc_ctx {
+	int in_use;								// 0 if the slot of the pool is free
+	uint32_t gen;							// it changes every time the slot is released
+	flow_key_t key;							// local (src) and remote (dst) RLOCs
+	ip_addr_t local_rloc;
+	ip_addr_t remote_rloc;
+	struct rohc_comp *compressor;			// compresses the packets sent to the remote RLOC
+	struct rohc_decomp *decompressor;		// decompresses the packets received from the remote RLOC
+	uint64_t last_used;						// (microseconds) last time a packet of the tunnel was compressed or decompressed
+
+	// counters
+	uint64_t comp_packets;					// packets compressed
+	uint64_t comp_bytes_in;					// bytes before the compression
+	uint64_t comp_bytes_out;				// bytes after the compression
+	uint64_t comp_failures;					// packets that could not be compressed (sent native)
+	uint64_t decomp_packets;				// packets decompressed
+	uint64_t decomp_bytes_in;				// bytes before the decompression
+	uint64_t decomp_bytes_out;				// bytes after the decompression
+	uint64_t decomp_failures;				// packets that could not be decompressed (dropped)
+} rohc_ctx_t;
+
+
+extern data_simplemux_t *conf_sm;		// simplemux rules, in configuration order
+extern int numdsm;						// number of simplemux rules
+
 void muxed_init();						// Initialize simplemux data
 void muxed_reset();						// Initialize simplemux data
+void muxed_rules_alloc(int n);			// Allocate n rules with the default values
+void muxed_rules_compile();				// Build the classifier of the configured rules
+data_simplemux_t *muxed_rules_stage(int n);	// Allocate n rules with the default values, to be configured
+void muxed_rules_apply();				// Install the staged rules, keeping the state of the unchanged ones
 
-void muxed_timer_process_all();			// Process the timers of all "simplemux data structs"
+void muxed_timer_process_all();			// Flush the bundles whose period has expired and release idle ROHC contexts
 
 void muxed_param_backup();  			// Save config parameters
 void muxed_param_changed();  			// Show in console the parameters that have changed
 
+void muxed_stats_dump(int log_level);		// Show the efficiency and the delay of the bundles of each rule
+void rohc_ctx_stats_dump(int log_level);	// Show the counters of the ROHC contexts of each tunnel
+
 int mux_tun_output_unicast (lbuf_t *b, packet_tuple_t *tuple, fwd_entry_t *fe);	// Multiplex the received packets from tun
 
-int mux_packets(unsigned char *packet_in, uint32_t size_packet_in, data_simplemux_t *data_simplemux, unsigned char *out_muxed_packet, uint16_t *out_total_length); // Aggregation of packets (compress and multiplex)
+int mux_packets(unsigned char *packet_in, uint32_t size_packet_in, data_simplemux_t *data_simplemux, lbuf_t *out_muxed_packet); // Aggregation of packets (compress and multiplex)
 
 //int lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe, data_simplemux_t *data_simplemux);	// Lookup mux_tuple from packet tuple and forward entry
 data_simplemux_t * lookup_mux_tuple (packet_tuple_t *tpl, fwd_entry_t *fe); // Lookup mux_tuple from packet tuple and forward entry
 
 int mux_output_unicast(lbuf_t *b, data_simplemux_t *data_simplemux);	// Send multiplexed packet encapsulated in LISP packet
 
-void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_receive_fd);  // Demuxtiplexer of packets (demultiplexer and (if necessary) decompression)
+void demux_packets (unsigned char *packet_in, uint32_t size_packet_in, int tun_receive_fd, ip_addr_t *local_rloc, ip_addr_t *remote_rloc);  // Demuxtiplexer of packets (demultiplexer and (if necessary) decompression)
 
 
 #endif /*SIMPELMUX_H_*/
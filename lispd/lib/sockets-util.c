@@ -17,6 +17,11 @@
  *
  */
 
+/* Define _GNU_SOURCE in order to use sendmmsg */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -125,6 +130,52 @@ open_udp_datagram_socket(int afi)
     return sock;
 }
 
+/* Open a UDP socket bound to 'src_addr' and connected to port 'dst_port' of
+ * 'dst_addr'. The kernel chooses the source port and caches the route of the
+ * destination */
+int
+open_udp_connected_socket(lisp_addr_t *src_addr, lisp_addr_t *dst_addr,
+        int dst_port)
+{
+    struct sockaddr_storage ss;
+    int sock, afi, slen;
+
+    afi = lisp_addr_ip_afi(dst_addr);
+    slen = sock_addr_from_ip(&ss, lisp_addr_ip(dst_addr));
+    if (slen == 0 || lisp_addr_ip_afi(src_addr) != afi) {
+        LMLOG(LDBG_2, "open_udp_connected_socket: Wrong addresses %s -> %s",
+                lisp_addr_to_char(src_addr), lisp_addr_to_char(dst_addr));
+        return (ERR_SOCKET);
+    }
+    if (afi == AF_INET) {
+        ((struct sockaddr_in *)&ss)->sin_port = htons(dst_port);
+    } else {
+        ((struct sockaddr_in6 *)&ss)->sin6_port = htons(dst_port);
+    }
+
+    if ((sock = socket(afi, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        LMLOG(LERR, "open_udp_connected_socket: socket: %s", strerror(errno));
+        return (ERR_SOCKET);
+    }
+
+    if (bind_socket(sock, afi, src_addr, 0) != GOOD) {
+        close(sock);
+        return (ERR_SOCKET);
+    }
+
+    if (connect(sock, (struct sockaddr *)&ss, slen) < 0) {
+        LMLOG(LDBG_1, "open_udp_connected_socket: connect to %s: %s",
+                lisp_addr_to_char(dst_addr), strerror(errno));
+        close(sock);
+        return (ERR_SOCKET);
+    }
+
+    LMLOG(LDBG_3, "open_udp_connected_socket: Socket %d connected %s -> %s",
+            sock, lisp_addr_to_char(src_addr), lisp_addr_to_char(dst_addr));
+
+    return (sock);
+}
+
 /* XXX: binding might not work on all devices */
 inline int
 socket_bindtodevice(int sock, char *device)
@@ -250,36 +301,43 @@ bind_socket(int sock, int afi, lisp_addr_t *src_addr, int src_port)
 }
 
 
+/* Fill 'ss' with the address 'ip'. Returns its length, 0 if the AFI is unknown */
+int
+sock_addr_from_ip(struct sockaddr_storage *ss, ip_addr_t *ip)
+{
+    struct sockaddr_in *sa4;
+    struct sockaddr_in6 *sa6;
+
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+    switch (ip_addr_afi(ip)) {
+    case AF_INET:
+        sa4 = (struct sockaddr_in *)ss;
+        sa4->sin_family = AF_INET;
+        ip_addr_copy_to(&sa4->sin_addr, ip);
+        return (sizeof(struct sockaddr_in));
+    case AF_INET6:
+        sa6 = (struct sockaddr_in6 *)ss;
+        sa6->sin6_family = AF_INET6;
+        ip_addr_copy_to(&sa6->sin6_addr, ip);
+        return (sizeof(struct sockaddr_in6));
+    default:
+        return (0);
+    }
+}
+
 /* Sends a raw packet out the socket file descriptor 'sfd'  */
 int
 send_raw_packet(int socket, const void *pkt, int plen, ip_addr_t *dip)
 {
-    struct sockaddr *saddr = NULL;
+    struct sockaddr_storage ss;
     int slen, nbytes;
 
-    struct sockaddr_in sa4;
-    struct sockaddr_in6 sa6;
-
     /* build sock addr */
-    switch (ip_addr_afi(dip)) {
-    case AF_INET:
-        memset(&sa4, 0, sizeof(sa4));
-        sa4.sin_family = AF_INET;
-        ip_addr_copy_to(&sa4.sin_addr, dip);
-        slen = sizeof(struct sockaddr_in);
-        saddr = (struct sockaddr *)&sa4;
-        break;
-    case AF_INET6:
-        memset(&sa6, 0, sizeof(sa6));
-        sa6.sin6_family = AF_INET6;
-        ip_addr_copy_to(&sa6.sin6_addr, dip);
-        slen = sizeof(struct sockaddr_in6);
-        saddr = (struct sockaddr *)&sa6;
-        break;
-    }
+    slen = sock_addr_from_ip(&ss, dip);
 
     /*SIMPLEMUX: MSG_DONTROUTE only for direct routed*/
-    nbytes = sendto(socket, pkt, plen, MSG_DONTROUTE, saddr, slen);
+    nbytes = sendto(socket, pkt, plen, MSG_DONTROUTE, (struct sockaddr *)&ss,
+            slen);
     /*nbytes = sendto(socket, pkt, plen, 0, saddr, slen);*/
     if (nbytes != plen) {
         LMLOG(LDBG_2, "send_raw_packet: send packet to %s using fail descriptor %d failed -> %s", ip_addr_to_char(dip),
@@ -290,6 +348,45 @@ send_raw_packet(int socket, const void *pkt, int plen, ip_addr_t *dip)
     return (GOOD);
 }
 
+/* Send the 'n' packets described in 'msgs' through 'socket' using as few
+ * sendmmsg calls as possible. A packet that can not be sent is skipped.
+ * Returns the number of packets sent */
+static int
+send_packet_batch(int socket, struct mmsghdr *msgs, int n, int flags)
+{
+    int i = 0, sent = 0, ret;
+
+    while (i < n) {
+        ret = sendmmsg(socket, msgs + i, n - i, flags);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            LMLOG(LDBG_2, "send_packet_batch: send packet using "
+                    "descriptor %d failed -> %s", socket, strerror(errno));
+            i++;
+            continue;
+        }
+        i += ret;
+        sent += ret;
+    }
+
+    return (sent);
+}
+
+int
+send_raw_packet_batch(int socket, struct mmsghdr *msgs, int n)
+{
+    return (send_packet_batch(socket, msgs, n, MSG_DONTROUTE));
+}
+
+/* Packets sent through a connected socket are routed by the kernel */
+int
+send_datagram_packet_batch(int socket, struct mmsghdr *msgs, int n)
+{
+    return (send_packet_batch(socket, msgs, n, 0));
+}
+
 int
 send_datagram_packet (int sock, const void *packet, int packet_length,
         lisp_addr_t *addr_dest, int port_dest)
@@ -21,17 +21,25 @@
 #ifndef SOCKETS_UTIL_H_
 #define SOCKETS_UTIL_H_
 
+#include <sys/socket.h>
 #include "../liblisp/lisp_address.h"
 
+struct mmsghdr;
+
 int open_ip_raw_socket(int afi);
 int open_udp_raw_socket(int afi);
 
 int open_udp_datagram_socket(int afi);
+int open_udp_connected_socket(lisp_addr_t *src_addr, lisp_addr_t *dst_addr,
+        int dst_port);
 inline int socket_bindtodevice(int sock, char *device);
 inline int socket_conf_req_ttl_tos(int sock, int afi);
 
 int bind_socket(int sock,int afi, lisp_addr_t *src_addr, int src_port);
+int sock_addr_from_ip(struct sockaddr_storage *ss, ip_addr_t *ip);
 int send_raw_packet(int, const void *, int, ip_addr_t *);
+int send_raw_packet_batch(int socket, struct mmsghdr *msgs, int n);
+int send_datagram_packet_batch(int socket, struct mmsghdr *msgs, int n);
 int send_datagram_packet (int sock, const void *packet, int packet_length,
         lisp_addr_t *addr_dest, int port_dest);
 
@@ -61,7 +61,15 @@ sockmstr_t *
 sockmstr_create()
 {
     sockmstr_t *sm;
+
     sm = xzalloc(sizeof(sockmstr_t));
+    sm->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sm->epoll_fd < 0) {
+        LMLOG(LCRIT, "sockmstr_create: epoll_create1 error: %s",
+                strerror(errno));
+        free(sm);
+        return (NULL);
+    }
     return (sm);
 }
 
@@ -96,45 +104,36 @@ sock_list_add(sock_list_t *lst, sock_t *sock)
 
     lst->tail = sock;
     lst->count++;
-    if (sock->fd > lst->maxfd) {
-        lst->maxfd = sock->fd;
-    }
-
 }
 
 static inline void
 sock_list_remove(sock_list_t *lst, struct sock *sock)
 {
-    int fd;
     if (sock->prev == NULL){
         lst->head = sock->next;
-        if (sock->next != NULL){
-            sock->next->prev = NULL;
-        }
     }else{
         sock->prev->next = sock->next;
-        if (sock->next != NULL){
-            sock->next->prev = sock->prev;
-        }
     }
-    fd = sock->fd;
-    close(sock->fd);
-    free(sock);
-
+    if (sock->next == NULL){
+        lst->tail = sock->prev;
+    }else{
+        sock->next->prev = sock->prev;
+    }
     lst->count--;
+}
 
-    if (fd == lst->maxfd){
-        sock= lst->head;
-        if (sock == NULL){
-            lst->maxfd = 0;
-        }
-        while (sock != NULL){
-            if (sock->fd > lst->maxfd) {
-                lst->maxfd = sock->fd;
-            }
-            sock = sock->next;
-        }
+static void
+sock_free_unregistered(sockmstr_t *m)
+{
+    sock_t *sk, *next;
+
+    sk = m->unregistered;
+    while (sk) {
+        next = sk->next;
+        free(sk);
+        sk = next;
     }
+    m->unregistered = NULL;
 }
 
 
@@ -145,6 +144,8 @@ sockmstr_destroy(sockmstr_t *sm)
         return;
     }
     sock_list_remove_all(&sm->read);
+    sock_free_unregistered(sm);
+    close(sm->epoll_fd);
     free(sm);
     LMLOG(LDBG_1,"Sockets closed");
 }
@@ -176,11 +177,26 @@ sockmstr_register_read_listener(sockmstr_t *m,int (*func)(struct sock *),
         void *arg, int fd)
 {
     struct sock *sock;
+    struct epoll_event ev;
+
     sock = xzalloc(sizeof(struct sock));
     sock->recv_cb = func;
     sock->type = SOCK_READ;
     sock->arg = arg;
     sock->fd = fd;
+
+    /* Level triggered: a callback that does not drain its fd is called
+     * again in the next wakeup */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = sock;
+    if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LMLOG(LERR, "sockmstr_register_read_listener: epoll_ctl error on "
+                "fd %d: %s", fd, strerror(errno));
+        free(sock);
+        return (NULL);
+    }
+
     sock_list_add(&m->read, sock);
     return (sock);
 }
@@ -188,54 +204,49 @@ sockmstr_register_read_listener(sockmstr_t *m,int (*func)(struct sock *),
 int
 sockmstr_unregister_read_listenedr(sockmstr_t *m, struct sock *sock)
 {
-   sock_list_remove(&m->read, sock);
-   return (GOOD);
-}
-
-
-static void
-sock_process_fd(struct sock_list *lst, fd_set *fdset)
-{
-    struct sock *sit;
+    epoll_ctl(m->epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL);
+    sock_list_remove(&m->read, sock);
+    close(sock->fd);
 
-    for (sit = lst->head; sit; sit = sit->next) {
-        if (FD_ISSET(sit->fd, fdset))
-            (*sit->recv_cb)(sit);
+    /* An event of the sock may still be pending in this wakeup */
+    if (m->processing) {
+        sock->recv_cb = NULL;
+        sock->next = m->unregistered;
+        m->unregistered = sock;
+    } else {
+        free(sock);
     }
+    return (GOOD);
 }
 
+
 void
 sockmstr_process_all(sockmstr_t *m)
 {
-    struct timeval tv;
-
-    tv.tv_sec = 0;
-    tv.tv_usec = DEFAULT_SELECT_TIMEOUT;
-
-    while (1) {
-        if (select(m->read.maxfd + 1, &m->readfds, NULL, NULL, &tv) == -1) {
-            if (errno == EINTR) {
-                continue;
-            } else {
-                LMLOG(LDBG_2, "sock_process_all: select error: %s",
-                        strerror(errno));
-                return;
-            }
-        } else {
-            break;
+    struct sock *sock;
+    int i, nready;
+
+    /* Every source of work has a descriptor, so the timeout only bounds
+     * the time between the periodic tasks of the main loop */
+    nready = epoll_wait(m->epoll_fd, m->events, SOCKMSTR_MAX_EVENTS,
+            DEFAULT_SELECT_TIMEOUT);
+    if (nready == -1) {
+        if (errno != EINTR) {
+            LMLOG(LDBG_2, "sock_process_all: epoll_wait error: %s",
+                    strerror(errno));
         }
+        return;
     }
 
-    sock_process_fd(&m->read, &m->readfds);
-}
-
-void
-sockmstr_wait_on_all_read(sockmstr_t *m)
-{
-    struct sock *sit;
-    for (sit = m->read.head; sit; sit = sit->next) {
-        FD_SET(sit->fd, &m->readfds);
+    m->processing = TRUE;
+    for (i = 0; i < nready; i++) {
+        sock = m->events[i].data.ptr;
+        if (sock->recv_cb != NULL) {
+            (*sock->recv_cb)(sock);
+        }
     }
+    m->processing = FALSE;
+    sock_free_unregistered(m);
 }
 
 int
@@ -411,20 +422,59 @@ sock_ctrl_recv(int sock, struct lbuf *buf, uconn_t *uc)
     return (GOOD);
 }
 
+/* Space for TTL and TOS data */
+union data_control {
+    struct cmsghdr cmsg;
+    u_char data[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(int))];
+};
+
+/* Read the afi of the packet and its TTL and TOS from the ancillary data */
+static void
+sock_data_parse_cmsg(struct msghdr *msg, union sockunion *su, int *afi,
+        uint8_t *ttl, uint8_t *tos)
+{
+    struct cmsghdr *cmsgptr = NULL;
+
+    if (su->s4.sin_family == AF_INET) {
+        for (cmsgptr = CMSG_FIRSTHDR(msg); cmsgptr != NULL; cmsgptr =
+                CMSG_NXTHDR(msg, cmsgptr)) {
+
+            if (cmsgptr->cmsg_level == IPPROTO_IP
+                    && cmsgptr->cmsg_type == IP_TTL) {
+                *ttl = *((uint8_t *) CMSG_DATA(cmsgptr));
+            }
+
+            if (cmsgptr->cmsg_level == IPPROTO_IP
+                    && cmsgptr->cmsg_type == IP_TOS) {
+                *tos = *((uint8_t *) CMSG_DATA(cmsgptr));
+            }
+        }
+        *afi = AF_INET;
+    } else {
+        for (cmsgptr = CMSG_FIRSTHDR(msg); cmsgptr != NULL; cmsgptr =
+                CMSG_NXTHDR(msg, cmsgptr)) {
+
+            if (cmsgptr->cmsg_level == IPPROTO_IPV6
+                    && cmsgptr->cmsg_type == IPV6_HOPLIMIT) {
+                *ttl = *((uint8_t *) CMSG_DATA(cmsgptr));
+            }
+
+            if (cmsgptr->cmsg_level == IPPROTO_IPV6
+                    && cmsgptr->cmsg_type == IPV6_TCLASS) {
+                *tos = *((uint8_t *) CMSG_DATA(cmsgptr));
+            }
+        }
+        *afi = AF_INET6;
+    }
+}
+
 int
 sock_data_recv(int sock, lbuf_t *b, int *afi, uint8_t *ttl, uint8_t *tos)
 {
-    /* Space for TTL and TOS data */
-    union control_data {
-        struct cmsghdr cmsg;
-        u_char data[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(int))];
-    };
-
     union sockunion su;
     struct msghdr msg;
     struct iovec iov[1];
-    union control_data cmsg;
-    struct cmsghdr *cmsgptr = NULL;
+    union data_control cmsg;
     int nbytes = 0;
 
     iov[0].iov_base = lbuf_data(b);
@@ -446,39 +496,86 @@ sock_data_recv(int sock, lbuf_t *b, int *afi, uint8_t *ttl, uint8_t *tos)
 
     lbuf_set_size(b, lbuf_size(b) + nbytes);
 
-    if (su.s4.sin_family == AF_INET) {
-        for (cmsgptr = CMSG_FIRSTHDR(&msg); cmsgptr != NULL; cmsgptr =
-                CMSG_NXTHDR(&msg, cmsgptr)) {
+    sock_data_parse_cmsg(&msg, &su, afi, ttl, tos);
 
-            if (cmsgptr->cmsg_level == IPPROTO_IP
-                    && cmsgptr->cmsg_type == IP_TTL) {
-                *ttl = *((uint8_t *) CMSG_DATA(cmsgptr));
-            }
+    return (GOOD);
+}
 
-            if (cmsgptr->cmsg_level == IPPROTO_IP
-                    && cmsgptr->cmsg_type == IP_TOS) {
-                *tos = *((uint8_t *) CMSG_DATA(cmsgptr));
-            }
-        }
-        *afi = AF_INET;
-    } else {
-        for (cmsgptr = CMSG_FIRSTHDR(&msg); cmsgptr != NULL; cmsgptr =
-                CMSG_NXTHDR(&msg, cmsgptr)) {
+sock_batch_t *
+sock_batch_new(int len)
+{
+    sock_batch_t *sb;
+
+    sb = xzalloc(sizeof(sock_batch_t));
+    sb->len = len;
+    sb->msgs = xzalloc(len * sizeof(struct mmsghdr));
+    sb->iov = xzalloc(len * sizeof(struct iovec));
+    sb->su = xzalloc(len * sizeof(union sockunion));
+    sb->ctrl = xzalloc(len * sizeof(union data_control));
+    return (sb);
+}
 
-            if (cmsgptr->cmsg_level == IPPROTO_IPV6
-                    && cmsgptr->cmsg_type == IPV6_HOPLIMIT) {
-                *ttl = *((uint8_t *) CMSG_DATA(cmsgptr));
-            }
+void
+sock_batch_del(sock_batch_t *sb)
+{
+    if (sb == NULL){
+        return;
+    }
+    free(sb->msgs);
+    free(sb->iov);
+    free(sb->su);
+    free(sb->ctrl);
+    free(sb);
+}
 
-            if (cmsgptr->cmsg_level == IPPROTO_IPV6
-                    && cmsgptr->cmsg_type == IPV6_TCLASS) {
-                *tos = *((uint8_t *) CMSG_DATA(cmsgptr));
-            }
+/* Batched version of sock_data_recv. Reads with a single recvmmsg call up to
+ * 'n' packets already queued in the socket. The i-th packet is stored in
+ * bufs[i] and its afi, TTL and TOS in afi[i], ttl[i] and tos[i].
+ * Returns the number of packets read */
+int
+sock_data_recv_batch(int sock, sock_batch_t *sb, lbuf_t *bufs, int n,
+        int *afi, uint8_t *ttl, uint8_t *tos)
+{
+    union data_control *cmsg = (union data_control *)sb->ctrl;
+    struct msghdr *msg;
+    int i, nmsgs;
+
+    if (n > sb->len) {
+        n = sb->len;
+    }
+
+    for (i = 0; i < n; i++) {
+        sb->iov[i].iov_base = lbuf_data(&bufs[i]);
+        sb->iov[i].iov_len = lbuf_tailroom(&bufs[i]);
+
+        msg = &sb->msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(struct msghdr));
+        msg->msg_iov = &sb->iov[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = &cmsg[i];
+        msg->msg_controllen = sizeof(union data_control);
+        msg->msg_name = &sb->su[i];
+        msg->msg_namelen = sizeof(union sockunion);
+    }
+
+    nmsgs = recvmmsg(sock, sb->msgs, n, MSG_DONTWAIT, NULL);
+    if (nmsgs == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LMLOG(LWRN, "sock_data_recv_batch: recvmmsg error: %s",
+                    strerror(errno));
         }
-        *afi = AF_INET6;
+        return (0);
     }
 
-    return (GOOD);
+    for (i = 0; i < nmsgs; i++) {
+        ttl[i] = 0;
+        tos[i] = 0;
+        lbuf_set_size(&bufs[i], lbuf_size(&bufs[i]) + sb->msgs[i].msg_len);
+        sock_data_parse_cmsg(&sb->msgs[i].msg_hdr, &sb->su[i], &afi[i],
+                &ttl[i], &tos[i]);
+    }
+
+    return (nmsgs);
 }
 
 inline int
@@ -20,6 +20,8 @@
 #ifndef SOCKETS_H_
 #define SOCKETS_H_
 
+#include <sys/epoll.h>
+
 #include "../defs.h"
 #include "sockets-util.h"
 #include "packets.h"
@@ -43,7 +45,6 @@ typedef struct sock_list {
     struct sock *head;
     struct sock *tail;
     int count;
-    int maxfd;
 }sock_list_t;
 
 typedef struct sock {
@@ -63,13 +64,24 @@ typedef struct uconn {
     uint16_t rp;        /* remote port */
 } uconn_t;
 
+/* Max number of ready fds returned by a single wait */
+#define SOCKMSTR_MAX_EVENTS     64
+
+/*
+ * The fds are registered in an epoll instance, with their sock_t in the
+ * epoll_data, so a wakeup only costs the fds that are ready. The read list
+ * is kept to look up and release the socks
+ */
 typedef struct sockmstr {
     sock_list_t read;
 //    struct sock_list *write;
 //    struct sock_list *netlink;
-    fd_set readfds;
-//    fd_set *writefds;
-//    fd_set *netlinkfds;
+    int epoll_fd;
+    struct epoll_event events[SOCKMSTR_MAX_EVENTS];
+    /* socks unregistered while the ready ones are processed. They are
+     * released once all the callbacks of the wakeup have been called */
+    struct sock *unregistered;
+    uint8_t processing;
 } sockmstr_t;
 
 union sockunion {
@@ -77,11 +89,32 @@ union sockunion {
     struct sockaddr_in6 s6;
 };
 
+/* Reusable state to read several packets with a single recvmmsg call */
+typedef struct sock_batch {
+    int len;                    /* max number of packets per call */
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    union sockunion *su;
+    void *ctrl;                 /* ancillary data of each packet */
+} sock_batch_t;
+
+struct config_simplemux;
+struct tun_encap_sock_;
 
 typedef struct fwd_entry {
     lisp_addr_t *srloc;
     lisp_addr_t *drloc;
     int *out_sock;
+    /* Socket connected to the RLOC pair, used instead of out_sock when
+     * data-encap is udp while it keeps the generation encap_gen */
+    struct tun_encap_sock_ *encap_sock;
+    uint32_t encap_gen;
+    /* Outer headers of the packets sent with out_sock */
+    pkt_hdr_tmpl_t encap_tmpl;
+    /* Simplemux rule of the flow. Only valid while mux_gen matches the
+     * generation of the simplemux classifier */
+    struct config_simplemux *mux_rule;
+    uint32_t mux_gen;
 } fwd_entry_t;
 
 inline fwd_entry_t *fwd_entry_new_init(lisp_addr_t *srloc, lisp_addr_t *drloc,
@@ -98,7 +131,6 @@ struct sock *sockmstr_register_read_listener(sockmstr_t *m,
         int (*)(struct sock *), void *arg, int fd);
 int sockmstr_unregister_read_listenedr(sockmstr_t *m, struct sock *sock);
 void sockmstr_process_all(sockmstr_t *m);
-void sockmstr_wait_on_all_read(sockmstr_t *m);
 
 int open_data_raw_input_socket(int afi);
 int open_data_datagram_input_socket(int afi);
@@ -107,6 +139,10 @@ int open_control_input_socket(int afi);
 int sock_recv(int, lbuf_t *);
 int sock_ctrl_recv(int, lbuf_t *, uconn_t *);
 int sock_data_recv(int sock, lbuf_t *b, int *afi, uint8_t *ttl, uint8_t *tos);
+sock_batch_t *sock_batch_new(int len);
+void sock_batch_del(sock_batch_t *sb);
+int sock_data_recv_batch(int sock, sock_batch_t *sb, lbuf_t *bufs, int n,
+        int *afi, uint8_t *ttl, uint8_t *tos);
 inline int uconn_init(uconn_t *uc, int lp, int rp, lisp_addr_t *la,
         lisp_addr_t *ra);
 
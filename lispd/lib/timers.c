@@ -129,8 +129,11 @@ lmtimers_init()
 
 
     /* register timer fd with the socket master */
-    sockmstr_register_read_listener(smaster, process_timer_signal, NULL,
-            timers_fd);
+    if (sockmstr_register_read_listener(smaster, process_timer_signal, NULL,
+            timers_fd) == NULL) {
+        LMLOG(LCRIT, "Failed to listen to the timers.");
+        return(BAD);
+    }
 
     return(GOOD);
 }
@@ -26,13 +26,16 @@ typedef enum {
     EXPIRE_MAP_CACHE_TIMER,
     MAP_REGISTER_TIMER,
     MAP_REQUEST_RETRY_TIMER,
+    MAP_REQUEST_BATCH_TIMER,
     RLOC_PROBING_TIMER,
     SMR_TIMER,
     SMR_INV_RETRY_TIMER,
     INFO_REPLY_TTL_TIMER,
     RE_UPSTREAM_JOIN_TIMER,
     RE_ITR_RESOLUTION_TIMER,
-    REG_SITE_EXPRY_TIMER
+    REG_SITE_EXPRY_TIMER,
+    DATA_PLANE_STATS_TIMER,
+    DATA_PLANE_ENCAP_TIMER
 } timer_type;
 
 #define TIMER_NAME_LEN          64
@@ -17,6 +17,8 @@
  *
  */
 
+#include <inttypes.h>
+
 #include "ttable.h"
 #include "util.h"
 #include "packets.h"
@@ -25,74 +27,175 @@
 #include "../fwd_policies/fwd_policy.h"
 #include "../liblisp/liblisp.h"
 
-/* Time after which an entry is considered to have timed out and
- * is removed from the table */
-#define TIMEOUT 3
-
 /* Time after which a negative entry is considered to have timed
- * out and is removed from the table */
-#define NEGATIVE_TIMEOUT 0.1
-
-/* Maximum size of the tuple table */
-#define MAX_SIZE 10000
-#define OLD_ENTRIES 1000
+ * out and is removed from the table (ms) */
+#define NEGATIVE_TIMEOUT 100
+
+/* The coarse clock is read from the vDSO without a system call. Its
+ * resolution (a few ms) is enough for the timeouts of the table */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define TTABLE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define TTABLE_CLOCK CLOCK_MONOTONIC
+#endif
+
+static inline uint32_t
+ttable_now()
+{
+    struct timespec now;
+    clock_gettime(TTABLE_CLOCK, &now);
+    return ((uint32_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
 
-static void ttable_remove_with_khiter(ttable_t *tt, khiter_t k);
+/* Negative entries expire after a fixed time. The rest are kept until the
+ * control plane state they were calculated from changes */
+static inline int
+tslot_expired(ttable_slot_t *ts, uint32_t now)
+{
+    if (ts->fi->temporal) {
+        return (now - ts->ts > NEGATIVE_TIMEOUT);
+    }
+    return (!fwd_info_is_valid(ts->fi));
+}
 
-static double
-time_diff(struct timespec *x , struct timespec *y)
+static inline int
+tslot_match(ttable_slot_t *ts, packet_tuple_t *tpl)
 {
-    double x_s, y_s, diff;
+    return (ts->hash == tpl->hash
+            && memcmp(&ts->key, &tpl->key, sizeof(flow_key_t)) == 0);
+}
 
-    x_s = (double)x->tv_sec + 1.0e-9*x->tv_nsec;
-    y_s = (double)y->tv_sec + 1.0e-9*y->tv_nsec;
+/* Return the slot of the flow or NULL if it is not in the table */
+static ttable_slot_t *
+ttable_find(ttable_t *tt, packet_tuple_t *tpl)
+{
+    ttable_slot_t *ts;
+    uint32_t i;
 
-    diff = (double)y_s - (double)x_s;
+    for (i = tpl->hash & tt->mask; ; i = (i + 1) & tt->mask) {
+        ts = &tt->slots[i];
+        if (!ts->used) {
+            return (NULL);
+        }
+        if (tslot_match(ts, tpl)) {
+            return (ts);
+        }
+    }
+}
 
-    return diff;
+/* Empty a slot. Entries of the same probe sequence placed after it are
+ * shifted back so that lookups don't need tombstones */
+static void
+ttable_remove_slot(ttable_t *tt, ttable_slot_t *ts)
+{
+    uint32_t i, j, home;
+
+    fwd_info_del(ts->fi,(fwd_info_data_del)fwd_entry_del);
+    tt->size--;
+
+    i = ts - tt->slots;
+    j = i;
+    for (;;) {
+        tt->slots[i].used = FALSE;
+        for (;;) {
+            j = (j + 1) & tt->mask;
+            if (!tt->slots[j].used) {
+                return;
+            }
+            /* The entry in j can be moved to i if its home position is not
+             * cyclically in (i, j] */
+            home = tt->slots[j].hash & tt->mask;
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+                break;
+            }
+        }
+        tt->slots[i] = tt->slots[j];
+        i = j;
+    }
 }
 
-static double
-time_elapsed(struct timespec *time_node)
+/* Advance the CLOCK hand until an entry that has not been used since the
+ * last pass, or that has expired, is found and remove it. After
+ * TTABLE_EVICT_MAX_SCAN slots the next entry is removed whatever its state */
+static void
+ttable_evict(ttable_t *tt)
 {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    return(time_diff(time_node, &now));
+    ttable_slot_t *ts;
+    uint32_t now = ttable_now();
+    int scanned = 0;
+
+    for (;;) {
+        ts = &tt->slots[tt->hand];
+        tt->hand = (tt->hand + 1) & tt->mask;
+        if (!ts->used) {
+            continue;
+        }
+        if (ts->ref && !tslot_expired(ts, now)
+                && ++scanned < TTABLE_EVICT_MAX_SCAN) {
+            ts->ref = FALSE;
+            continue;
+        }
+        ttable_remove_slot(tt, ts);
+        tt->stats.evicted++;
+        return;
+    }
 }
 
 static void
-ttable_node_del(ttable_node_t *tn)
+ttable_account_insert(ttable_t *tt, struct timespec *start)
 {
-    pkt_tuple_del(tn->tpl);
-    fwd_info_del(tn->fi,(fwd_info_data_del)fwd_entry_del);
-    free(tn);
+    struct timespec end;
+    uint64_t ns;
+    int bucket = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000
+            + end.tv_nsec - start->tv_nsec;
+    for (ns >>= 7; ns > 0 && bucket < TTABLE_LAT_BUCKETS - 1; ns >>= 1) {
+        bucket++;
+    }
+    tt->stats.inserts++;
+    tt->stats.insert_lat[bucket]++;
 }
 
 void
-ttable_init(ttable_t *tt)
+ttable_init(ttable_t *tt, int max_flows)
 {
-    tt->htable =  kh_init(ttable);
-    list_init(&tt->head_list);
+    uint32_t nslots = 1;
+
+    /* Keep the load factor below 3/4 */
+    while (nslots < (uint32_t)max_flows + max_flows / 3 + 1) {
+        nslots <<= 1;
+    }
+    tt->slots = xzalloc(nslots * sizeof(ttable_slot_t));
+    tt->mask = nslots - 1;
+    tt->size = 0;
+    tt->max_flows = max_flows;
+    tt->hand = 0;
+    tt->age_pos = 0;
+    memset(&tt->stats, 0, sizeof(ttable_stats_t));
 }
 
 void
 ttable_uninit(ttable_t *tt)
 {
-    khiter_t k;
+    uint32_t i;
 
-    for (k = kh_begin(tt->htable); k != kh_end(tt->htable); ++k){
-        if (kh_exist(tt->htable, k)){
-            ttable_node_del(kh_value(tt->htable,k));
+    for (i = 0; i <= tt->mask; i++) {
+        if (tt->slots[i].used) {
+            fwd_info_del(tt->slots[i].fi,(fwd_info_data_del)fwd_entry_del);
         }
     }
-    kh_destroy(ttable, tt->htable);
+    free(tt->slots);
+    tt->slots = NULL;
+    tt->size = 0;
 }
 
 ttable_t *
-ttable_create()
+ttable_create(int max_flows)
 {
    ttable_t *tt = xzalloc(sizeof(ttable_t));
-   ttable_init(tt);
+   ttable_init(tt, max_flows);
    return(tt);
 }
 
@@ -103,118 +206,132 @@ ttable_destroy(ttable_t *tt)
     free(tt);
 }
 
-static int
-tnode_expired(ttable_node_t *tn)
-{
-    return(time_elapsed(&tn->ts) > TIMEOUT);
-}
-
+/* Add the forwarding info of a flow. The key of the tuple is copied to the
+ * table while the forwarding info is owned by the table from now on */
 void
 ttable_insert(ttable_t *tt, packet_tuple_t *tpl, fwd_info_t *fi)
 {
-    khiter_t k;
-    int ret,i,removed,to_remove;
-    ttable_node_t *node;
-    struct ovs_list *list_elt;
-
-    /* If table is full, lookup and remove expired entries. If it is still
-     * full, remove old entries */
-    if (kh_size(tt->htable) >= MAX_SIZE) {
-        LMLOG(LDBG_1,"ttable_insert: Max size of forwarding table reached. Removing expired entries");
-        removed = 0;
-        for (k = kh_begin(tt->htable); k != kh_end(tt->htable); ++k){
-            if (!kh_exist(tt->htable, k)){
-                continue;
-            }
-            if (tnode_expired(kh_value(tt->htable,k))){
-                ttable_remove_with_khiter(tt,k);
-                removed++;
-            }
+    ttable_slot_t *ts;
+    struct timespec start;
+    uint32_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    ts = ttable_find(tt, tpl);
+    if (ts) {
+        fwd_info_del(ts->fi,(fwd_info_data_del)fwd_entry_del);
+    } else {
+        if (tt->size >= tt->max_flows) {
+            LMLOG(LDBG_3,"ttable_insert: Max size of forwarding table reached. "
+                    "Replacing an old entry");
+            ttable_evict(tt);
         }
-        if (removed <  OLD_ENTRIES){
-            LMLOG(LDBG_1,"ttable_insert: Max size of forwarding table reached. Removing older entries");
-            to_remove = OLD_ENTRIES - removed;
-            for (i = 0 ; i < to_remove ; i++){
-                list_elt = list_back(&tt->head_list);
-                node = CONTAINER_OF(list_elt, ttable_node_t, list_elt);
-                ttable_remove(tt, node->tpl);
-            }
+        for (i = tpl->hash & tt->mask; tt->slots[i].used;
+                i = (i + 1) & tt->mask) {
+            ;
         }
+        ts = &tt->slots[i];
+        ts->key = tpl->key;
+        ts->hash = tpl->hash;
+        ts->used = TRUE;
+        tt->size++;
     }
 
-    node = xzalloc(sizeof(ttable_node_t));
-    node->fi = fi;
-    node->tpl = tpl;
-    clock_gettime(CLOCK_MONOTONIC, &node->ts);
-
-    list_init(&node->list_elt);
-    list_push_front(&tt->head_list, &node->list_elt);
-
-    k = kh_put(ttable,tt->htable,tpl,&ret);
-    kh_value(tt->htable, k) = node;
+    ts->fi = fi;
+    ts->ts = ttable_now();
+    ts->ref = FALSE;
+    ttable_account_insert(tt, &start);
     LMLOG(LDBG_3,"ttable_insert: Inserted tupla: %s ", pkt_tuple_to_char(tpl));
 }
 
 void
 ttable_remove(ttable_t *tt, packet_tuple_t *tpl)
 {
-    khiter_t k;
-    ttable_node_t *tn;
+    ttable_slot_t *ts;
 
-    k = kh_get(ttable,tt->htable, tpl);
-    if (k == kh_end(tt->htable)){
+    ts = ttable_find(tt, tpl);
+    if (!ts){
         return;
     }
-    tn = kh_value(tt->htable,k);
-    LMLOG(LDBG_3,"ttable_remove: Remove tupla: %s ", pkt_tuple_to_char(tn->tpl));
-    list_remove(&tn->list_elt);
-    ttable_node_del(tn);
-    kh_del(ttable,tt->htable,k);
+    LMLOG(LDBG_3,"ttable_remove: Remove tupla: %s ", pkt_tuple_to_char(tpl));
+    ttable_remove_slot(tt, ts);
 }
 
-static void
-ttable_remove_with_khiter(ttable_t *tt, khiter_t k)
+fwd_info_t *
+ttable_lookup(ttable_t *tt, packet_tuple_t *tpl)
 {
-    ttable_node_t *node;
+    ttable_slot_t *ts;
 
-    node = kh_value(tt->htable,k);
-    LMLOG(LDBG_3,"ttable_remove_with_khiter: Remove tupla: %s ", pkt_tuple_to_char(node->tpl));
-    list_remove(&node->list_elt);
-    ttable_node_del(node);
-    kh_del(ttable,tt->htable,k);
+    ts = ttable_find(tt, tpl);
+    if (!ts){
+        return (NULL);
+    }
+
+    if (tslot_expired(ts, ttable_now())){
+        ttable_remove_slot(tt, ts);
+        tt->stats.expired++;
+        return (NULL);
+    }
+
+    ts->ref = TRUE;
+    return (ts->fi);
 }
 
-fwd_info_t *
-ttable_lookup(ttable_t *tt, packet_tuple_t *tpl)
+/* Check the next nslots slots of the table and remove the expired entries */
+void
+ttable_age(ttable_t *tt, int nslots)
 {
-    ttable_node_t *tn;
-    khiter_t k;
-    double elapsed;
+    ttable_slot_t *ts;
+    uint32_t now;
 
-    k = kh_get(ttable,tt->htable, tpl);
-    if (k == kh_end(tt->htable)){
-        return (NULL);
+    if (tt->size == 0) {
+        return;
     }
-    tn = kh_value(tt->htable,k);
 
-    elapsed = time_elapsed(&tn->ts);
-    if (!tn->fi->temporal){
-        if (elapsed > TIMEOUT){
-            goto expired;
-        }
-    }else{
-        if (elapsed > NEGATIVE_TIMEOUT){
-            goto expired;
+    now = ttable_now();
+    while (nslots-- > 0) {
+        ts = &tt->slots[tt->age_pos];
+        if (ts->used && tslot_expired(ts, now)) {
+            /* The following entry of the probe sequence may have been moved
+             * to this slot. Check it again */
+            ttable_remove_slot(tt, ts);
+            tt->stats.expired++;
+            continue;
         }
+        tt->age_pos = (tt->age_pos + 1) & tt->mask;
     }
+}
+
+void
+ttable_stats_dump(ttable_t *tt, int log_level)
+{
+    char buf[512];
+    int i, len = 0;
 
-    list_remove(&tn->list_elt);
-    list_push_front(&tt->head_list, &tn->list_elt);
+    if (!is_loggable(log_level)) {
+        return;
+    }
 
-    return (tn->fi);
+    LMLOG(log_level, "  Flow table: %u/%u flows, %"PRIu64" inserts, "
+            "%"PRIu64" evicted, %"PRIu64" expired", tt->size, tt->max_flows,
+            tt->stats.inserts, tt->stats.evicted, tt->stats.expired);
 
-expired:
-    ttable_remove_with_khiter(tt, k);
-    return(NULL);
+    for (i = 0; i < TTABLE_LAT_BUCKETS; i++) {
+        if (tt->stats.insert_lat[i] == 0) {
+            continue;
+        }
+        if (i < TTABLE_LAT_BUCKETS - 1) {
+            len += snprintf(buf + len, sizeof(buf) - len, " <%luns:%"PRIu64,
+                    128UL << i, tt->stats.insert_lat[i]);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len, " >=%luns:%"PRIu64,
+                    128UL << (i - 1), tt->stats.insert_lat[i]);
+        }
+        if (len >= sizeof(buf)) {
+            break;
+        }
+    }
+    if (len > 0) {
+        LMLOG(log_level, "  Flow table insert time:%s", buf);
+    }
 }
-
@@ -22,32 +22,65 @@
 
 #include <time.h>
 #include "packets.h"
-#include "../elibs/khash/khash.h"
-#include "../elibs/ovs/list.h"
 
 typedef struct fwd_info_ fwd_info_t;
 
-typedef struct ttable_node {
-    struct ovs_list list_elt;
-    packet_tuple_t *tpl;
+/* Slots checked for expired entries by each call to ttable_age */
+#define TTABLE_AGING_SLICE      64
+
+/* Slots visited by the CLOCK hand before an entry is replaced even if it
+ * has been recently used */
+#define TTABLE_EVICT_MAX_SCAN   32
+
+/* Buckets of the histogram of insertion times. Bucket 0 counts insertions
+ * faster than 128 ns and each following bucket doubles the limit */
+#define TTABLE_LAT_BUCKETS      16
+
+/* Slot of the flow table. The key of the flow is stored inline together with
+ * its hash, so a lookup only touches one slot per probe */
+typedef struct ttable_slot {
+    flow_key_t key;
     fwd_info_t *fi;
-    struct timespec ts;
-} ttable_node_t;
+    uint32_t hash;
+    uint32_t ts;        /* Insertion time (ms) */
+    uint8_t used;
+    uint8_t ref;        /* Set on each hit. Cleared by the CLOCK hand */
+} ttable_slot_t;
 
-KHASH_INIT(ttable, packet_tuple_t *, ttable_node_t *, 1, pkt_tuple_hash, pkt_tuple_cmp)
+typedef struct ttable_stats {
+    uint64_t inserts;
+    uint64_t evicted;   /* Replaced because the table was full */
+    uint64_t expired;   /* Removed when timed out or invalidated */
+    uint64_t insert_lat[TTABLE_LAT_BUCKETS];
+} ttable_stats_t;
 
+/*
+ * Flow table of the data plane. It is an open addressing hash table with
+ * linear probing. Up to max_flows flows are stored in a power of two array
+ * of slots with a load factor of at most 3/4. When the table is full, the
+ * entry to be replaced is selected with the CLOCK algorithm. Expired
+ * entries are removed incrementally by ttable_age, which the data plane calls
+ * after each batch of packets, so inserts never scan the whole table.
+ */
 typedef struct ttable {
-    khash_t(ttable) *htable;
-    struct ovs_list head_list; /* To order flows */
+    ttable_slot_t *slots;
+    uint32_t mask;      /* Number of slots - 1 */
+    uint32_t size;      /* Number of flows in the table */
+    uint32_t max_flows;
+    uint32_t hand;      /* Position of the CLOCK hand */
+    uint32_t age_pos;   /* Next slot to be checked by ttable_age */
+    ttable_stats_t stats;
 } ttable_t;
 
-void ttable_init(ttable_t *tt);
+void ttable_init(ttable_t *tt, int max_flows);
 void ttable_uninit(ttable_t *tt);
-ttable_t *ttable_create();
+ttable_t *ttable_create(int max_flows);
 void ttable_destroy(ttable_t *tt);
 void ttable_insert(ttable_t *, packet_tuple_t *tpl, fwd_info_t *fe);
 void ttable_remove(ttable_t *tt, packet_tuple_t *tpl);
 fwd_info_t *ttable_lookup(ttable_t *tt, packet_tuple_t *tpl);
+void ttable_age(ttable_t *tt, int nslots);
+void ttable_stats_dump(ttable_t *tt, int log_level);
 
 
 #endif /* TTABLE_H_ */
@@ -756,14 +756,40 @@ lisp_data_encap(lbuf_t *b, int lp, int rp, lisp_addr_t *la, lisp_addr_t *ra)
     /* push lisp data hdr */
     lisp_data_push_hdr(b);
 
-    /* push outer UDP and IP */
-    pkt_push_udp_and_ip(b, lp, rp, lisp_addr_ip(la), lisp_addr_ip(ra));
+    /* push outer UDP and IP. Same checksums as lisp_data_encap_tmpl */
+    pkt_push_tunnel_udp_and_ip(b, lp, rp, lisp_addr_ip(la), lisp_addr_ip(ra));
 
     ip_hdr_set_ttl_and_tos(lbuf_data(b), ttl, tos);
 
     return(lbuf_data(b));
 }
 
+/* Build the template of the outer headers of the data packets sent from
+ * 'la':'lp' to 'ra':'rp' */
+int
+lisp_data_encap_tmpl_init(pkt_hdr_tmpl_t *tmpl, int lp, int rp, lisp_addr_t *la,
+        lisp_addr_t *ra)
+{
+    lisphdr_t lhdr;
+
+    memset(&lhdr, 0, sizeof(lisphdr_t));
+    lisp_data_hdr_init(&lhdr);
+    return(pkt_hdr_tmpl_init(tmpl, lisp_addr_ip(la), lisp_addr_ip(ra), lp, rp,
+            &lhdr, sizeof(lisphdr_t)));
+}
+
+/* Same as lisp_data_encap but with the outer headers of a template */
+void *
+lisp_data_encap_tmpl(lbuf_t *b, pkt_hdr_tmpl_t *tmpl)
+{
+    int ttl = 128, tos = 0;
+
+    /* read ttl and tos */
+    ip_hdr_ttl_and_tos(lbuf_data(b), &ttl, &tos);
+
+    return(pkt_push_hdr_tmpl(b, tmpl, ttl, tos));
+}
+
 void *
 lisp_data_pull_hdr(lbuf_t *b)
 {
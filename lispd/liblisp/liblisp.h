@@ -27,12 +27,15 @@
 #include "lisp_data.h"
 #include "../lib/generic_list.h"
 #include "../lib/lbuf.h"
+#include "../lib/packets.h"
 
 
 #define LISP_DATA_HDR_LEN       8
 #define LISP_ECM_HDR_LEN        4
 #define MAX_LISP_MSG_ENCAP_LEN  2*(MAX_IP_HDR_LEN + UDP_HDR_LEN)+ LISP_ECM_HDR_LEN
 #define MAX_LISP_PKT_ENCAP_LEN  MAX_IP_HDR_LEN + UDP_HDR_LEN + LISP_DATA_HDR_LEN
+/* Messages packed with records, encapsulated or not, fit a 1500 bytes MTU */
+#define MAX_LISP_MSG_LEN        1400
 
 #define LISP_CONTROL_PORT               4342
 #define LISP_DATA_PORT                  4341
@@ -87,6 +90,9 @@ void *lisp_msg_pull_auth_field(lbuf_t *b);
 void *lisp_data_push_hdr(lbuf_t *b);
 void *lisp_data_pull_hdr(lbuf_t *b);
 void *lisp_data_encap(lbuf_t *, int, int, lisp_addr_t *, lisp_addr_t *);
+int lisp_data_encap_tmpl_init(pkt_hdr_tmpl_t *, int, int, lisp_addr_t *,
+        lisp_addr_t *);
+void *lisp_data_encap_tmpl(lbuf_t *, pkt_hdr_tmpl_t *);
 
 static inline glist_t *laddr_list_new();
 static inline void laddr_list_init(glist_t *);
@@ -263,11 +263,38 @@ ip_prefix_copy(ip_prefix_t *dst, ip_prefix_t *src)
     ip_addr_copy(ip_prefix_addr(dst), ip_prefix_addr(src));
 }
 
+/* TRUE if the prefix 'ip'/'plen' is contained in 'pref' */
+int
+ip_prefix_contains(ip_prefix_t *pref, ip_addr_t *ip, uint8_t plen)
+{
+    uint8_t *a, *b;
+    uint8_t pref_plen = ip_prefix_get_plen(pref);
+    int i;
+
+    if (ip_prefix_afi(pref) != ip_addr_afi(ip) || pref_plen > plen) {
+        return(FALSE);
+    }
+
+    a = ip_addr_get_addr(ip_prefix_addr(pref));
+    b = ip_addr_get_addr(ip);
+    for (i = 0; i < pref_plen / 8; i++) {
+        if (a[i] != b[i]) {
+            return(FALSE);
+        }
+    }
+    if (pref_plen % 8 != 0
+            && ((a[i] ^ b[i]) & (0xff << (8 - pref_plen % 8)) & 0xff) != 0) {
+        return(FALSE);
+    }
+
+    return(TRUE);
+}
+
 char *
 ip_prefix_to_char(ip_prefix_t *pref)
 {
-    static char address[10][INET6_ADDRSTRLEN+5];
-    static unsigned int i;
+    static THREAD_LOCAL char address[10][INET6_ADDRSTRLEN+5];
+    static THREAD_LOCAL unsigned int i;
 
     /* Hack to allow more than one addresses per printf line.
      * Now maximum = 5 */
@@ -345,8 +372,8 @@ ip_prefix_from_char(char *addr, ip_prefix_t *ippref)
 char *
 ip_to_char(void *ip, int afi)
 {
-    static char address[10][INET6_ADDRSTRLEN+1];
-    static unsigned int i;
+    static THREAD_LOCAL char address[10][INET6_ADDRSTRLEN+1];
+    static THREAD_LOCAL unsigned int i;
     i++; i = i % 10;
     *address[i] = '\0';
     switch (afi) {
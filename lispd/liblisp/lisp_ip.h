@@ -89,6 +89,7 @@ inline void ip_prefix_set(ip_prefix_t *pref, ip_addr_t *ipaddr, uint8_t plen);
 inline void ip_prefix_set_plen(ip_prefix_t *pref, uint8_t plen);
 inline void ip_prefix_set_afi(ip_prefix_t *pref, int afi);
 inline void ip_prefix_copy(ip_prefix_t *dst, ip_prefix_t *src);
+int ip_prefix_contains(ip_prefix_t *pref, ip_addr_t *ip, uint8_t plen);
 
 char *ip_prefix_to_char(ip_prefix_t *pref);
 
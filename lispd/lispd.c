@@ -21,8 +21,10 @@
 #include <linux/capability.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <sys/inotify.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <libgen.h>
 #include <time.h>
 
 #include "lispd.h"
@@ -30,6 +32,7 @@
 /********************************************/
 /**********  SIMPLEMUX  *********************/
 #include "lib/simplemux.h"
+#include "lib/mux_trace.h"
 extern int numdsm;
 /**********  SIMPLEMUX***********************/
 /********************************************/
@@ -75,6 +78,14 @@ char    *config_file                        = NULL;
 int      debug_level                        = -1;
 int      default_rloc_afi                   = AF_UNSPEC;
 int      daemonize                          = FALSE;
+int      data_batch_size                    = DEFAULT_DATA_BATCH_SIZE;
+int      flow_table_size                    = DEFAULT_FLOW_TABLE_SIZE;
+int      data_queues                        = 1;
+int      data_encap                         = DATA_ENCAP_RAW;
+int      map_cache_max_entries              = 0;  /* no limit */
+int      map_cache_max_size                 = 0;  /* KB. no limit */
+int      map_request_rate                   = 0;  /* per second and Map-Resolver. no limit */
+int      map_request_burst                  = 0;  /* the rate */
 
 uint32_t iseed                              = 0;  /* initial random number generator */
 
@@ -295,6 +306,8 @@ exit_cleanup(void) {
         free(config_file);
     }
 	/* SIMPLEMUX close config file */
+	/* SIMPLEMUX close the event trace */
+	mux_trace_close();
     close_log_file();
 #ifndef VPNAPI
     LMLOG(LINF,"Exiting ...");
@@ -399,6 +412,10 @@ init_netlink()
 
     nl_sl = sockmstr_register_read_listener(smaster, process_netlink_msg, NULL,
             netlink_fd);
+    if (nl_sl == NULL) {
+        LMLOG(LCRIT, "Couldn't listen to the netlink socket");
+        exit_cleanup();
+    }
 
     /* Request to dump the routing tables to obtain the gatways when
      * processing the netlink messages  */
@@ -422,6 +439,102 @@ parse_config_file()
     return (err);
 }
 
+#if !defined(ANDROID) && !defined(OPENWRT)
+/* SIMPLEMUX: the directory of the config file is watched, since editors
+ * usually replace the file instead of writing it */
+static char *config_file_name = NULL;
+
+static void
+simplemux_config_reload()
+{
+    LMLOG(LINF, "Conf file changed");
+    muxed_stats_dump(LINF);
+    muxed_param_backup();
+
+    /* Only the simplemux rules are configured again. The rules that did not
+     * change keep their packets and ROHC contexts */
+    if (handle_simplemux_config_file(config_file) != GOOD) {
+        return;
+    }
+
+    LMLOG(LINF, "****************************************");
+    LMLOG(LINF, "");
+    LMLOG(LINF, "Number of SM rules: %d",numdsm);
+    LMLOG(LINF, "");
+
+    muxed_param_changed();
+    rohc_ctx_stats_dump(LINF);
+
+    LMLOG(LINF, "****************************************");
+}
+
+static int
+config_file_process(sock_t *sl)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    int changed = FALSE;
+    ssize_t len;
+    char *ptr;
+
+    while ((len = read(sl->fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + len;
+                ptr += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)ptr;
+            if (event->len > 0 && strcmp(event->name, config_file_name) == 0) {
+                changed = TRUE;
+            }
+        }
+    }
+
+    /* Several events of the same change are applied once */
+    if (changed) {
+        simplemux_config_reload();
+    }
+    return (GOOD);
+}
+
+static void
+config_file_watch()
+{
+    char *path, *dir;
+    int fd;
+
+    if (config_file == NULL) {
+        return;
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LMLOG(LERR, "config_file_watch: inotify_init1 error: %s. Changes of "
+                "the config file are not applied", strerror(errno));
+        return;
+    }
+
+    path = strdup(config_file);
+    dir = dirname(path);
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        LMLOG(LERR, "config_file_watch: cannot watch %s: %s. Changes of the "
+                "config file are not applied", dir, strerror(errno));
+        free(path);
+        close(fd);
+        return;
+    }
+    free(path);
+
+    path = strdup(config_file);
+    config_file_name = strdup(basename(path));
+    free(path);
+
+    if (sockmstr_register_read_listener(smaster, config_file_process, NULL,
+            fd) == NULL) {
+        LMLOG(LERR, "config_file_watch: Changes of the config file are not "
+                "applied");
+        close(fd);
+    }
+}
+#endif
+
 static void
 initial_setup()
 {
@@ -472,21 +585,6 @@ initial_setup()
 int
 main(int argc, char **argv)
 {
-	/*SIMPLEMUX */
-	
-	int checkConfig = 500; // config file check period
-	double seconds;
-	struct stat sb;
-	time_t t_1;
-	time_t t_2;
-	if (stat(argv[2], &sb) == -1) {
-        perror("stat");
-        exit(EXIT_FAILURE);
-    }
-	t_1 = sb.st_mtime; // Time of last modification of config file
-	
-	/*SIMPLEMUX */
-	
     lisp_dev_type_e dev_type;
 
     initial_setup();
@@ -497,8 +595,12 @@ main(int argc, char **argv)
     demonize_start();
 
     /* create socket master, timer wheel, initialize interfaces */
-    smaster = sockmstr_create();
-    lmtimers_init();
+    if ((smaster = sockmstr_create()) == NULL){
+        exit_cleanup();
+    }
+    if (lmtimers_init() != GOOD){
+        exit_cleanup();
+    }
     ifaces_init();
 	
 	/********************************************/
@@ -525,10 +627,15 @@ main(int argc, char **argv)
 
     dev_type = ctrl_dev_mode(ctrl_dev);
     if (dev_type == xTR_MODE || dev_type == RTR_MODE || dev_type == MN_MODE) {
-        data_plane->datap_init(dev_type);
+        if (data_plane->datap_init(dev_type) != GOOD){
+            LMLOG(LCRIT, "Couldn't initialize the data plane");
+            exit_cleanup();
+        }
     }
 
-    ctrl_init(lctrl);
+    if (ctrl_init(lctrl) != GOOD){
+        exit_cleanup();
+    }
     init_netlink();
 
     /* run lisp control device xtr/ms */
@@ -543,53 +650,24 @@ main(int argc, char **argv)
 #ifndef ANDROID
     /* Initialize API for external access */
     lmapi_init_server(&lmapi_connection);
+#ifndef OPENWRT
+    /* SIMPLEMUX: reload the simplemux rules when the config file changes */
+    config_file_watch();
+#endif
 
+    /* The loop sleeps until a descriptor is ready: the API requests and the
+     * expiration of the bundles wake it up through their own descriptors */
     for (;;) {
-        sockmstr_wait_on_all_read(smaster);
         sockmstr_process_all(smaster);
 
 		/********************************************/
 		/**********  SIMPLEMUX **********************/
 		muxed_timer_process_all();
-		if(checkConfig==0){
-			/* Check time of changes in conf file */
-				if (stat(argv[2], &sb) == -1) {
-					perror("stat");
-					exit(EXIT_FAILURE);
-				}
-				t_2 = sb.st_mtime; // last changes
-				seconds = difftime(t_2, t_1);
-				if (seconds > 0) { // changes done
-					LMLOG(LINF, "Conf file changed");
-					muxed_param_backup();
-					t_1 = t_2;
-					
-					muxed_reset(); // reset conf_sm[i]
-
-					if (parse_config_file() != GOOD){
-						exit_cleanup();
-					}
-					
-					LMLOG(LINF, "****************************************");
-					LMLOG(LINF, "");
-					LMLOG(LINF, "Number of SM rules: %d",numdsm);
-					LMLOG(LINF, "");
-					
-					muxed_param_changed ();
-					
-					LMLOG(LINF, "****************************************");
-				}
-				checkConfig = 500;
-		}
-		checkConfig--;
 		/**********  SIMPLEMUX **********************/
 		/********************************************/
-
-		lmapi_loop(&lmapi_connection);
     }
 #else
     for (;;) {
-        sockmstr_wait_on_all_read(smaster);
         sockmstr_process_all(smaster);
     }
 #endif
@@ -598,7 +676,6 @@ main(int argc, char **argv)
 
     /* EVENT LOOP */
     for (;;) {
-        sockmstr_wait_on_all_read(smaster);
         sockmstr_process_all(smaster);
 #ifndef ANDROID
         lmapi_loop(&lmapi_connection);
@@ -631,7 +708,10 @@ JNIEXPORT jint JNICALL Java_org_lispmob_noroot_LISPmob_1JNI_startLispd
 
     /* create socket master, timer wheel, initialize interfaces */
     smaster = sockmstr_create();
-    lmtimers_init();
+    if (smaster == NULL || lmtimers_init() != GOOD){
+        exit_cleanup();
+        return (BAD);
+    }
     ifaces_init();
 
     /* create control. Only one instance for now */
@@ -659,10 +739,17 @@ JNIEXPORT jint JNICALL Java_org_lispmob_noroot_LISPmob_1JNI_startLispd
 
     dev_type = ctrl_dev_mode(ctrl_dev);
     if (dev_type == xTR_MODE || dev_type == RTR_MODE || dev_type == MN_MODE) {
-        data_plane->datap_init(dev_type, vpn_tun_fd);
+        if (data_plane->datap_init(dev_type, vpn_tun_fd) != GOOD){
+            LMLOG(LCRIT, "Couldn't initialize the data plane");
+            exit_cleanup();
+            return (BAD);
+        }
     }
 
-    ctrl_init(lctrl);
+    if (ctrl_init(lctrl) != GOOD){
+        exit_cleanup();
+        return (BAD);
+    }
     init_netlink();
 
     /* run lisp control device xtr/ms */
@@ -682,7 +769,6 @@ JNIEXPORT void JNICALL Java_org_lispmob_noroot_LISPmob_1JNI_lispd_1loop(JNIEnv *
 
     /* EVENT LOOP */
     while (lispd_running) {
-        sockmstr_wait_on_all_read(smaster);
         sockmstr_process_all(smaster);
     }
 
@@ -20,7 +20,9 @@
 #include "lispd_api_internals.h"
 
 #include "lispd_config_functions.h"
+#include "lispd_external.h"
 #include "lib/lmlog.h"
+#include "lib/sockets.h"
 #include "liblisp/liblisp.h"
 #include "lib/util.h"
 #include <libxml/tree.h>
@@ -396,11 +398,33 @@ lxml_update_map_server_list(xmlNodePtr xml_map_servers, uint8_t proxy_reply,
 }
 
 
+/* The descriptor of a zmq socket only signals that its state may have
+ * changed. Process the requests until there is nothing left to read */
+static int
+lmapi_sock_process(sock_t *sl)
+{
+    lmapi_connection_t *conn = (lmapi_connection_t *)sl->arg;
+    int events;
+    size_t len;
+
+    for (;;) {
+        len = sizeof(events);
+        if (zmq_getsockopt(conn->socket, ZMQ_EVENTS, &events, &len) != 0
+                || !(events & ZMQ_POLLIN)) {
+            break;
+        }
+        lmapi_loop(conn);
+    }
+    return (GOOD);
+}
+
 int
 lmapi_init_server(lmapi_connection_t *conn)
 {
 
 	int error;
+    int fd;
+    size_t fd_len = sizeof(fd);
 
     conn->context = zmq_ctx_new();
     LMLOG(LDBG_3,"LMAPI: zmq_ctx_new errno: %s\n",zmq_strerror (errno));
@@ -417,6 +441,15 @@ lmapi_init_server(lmapi_connection_t *conn)
     	goto err;
     }
 
+    //The main loop is woken up by the socket when there are requests
+    if (zmq_getsockopt(conn->socket, ZMQ_FD, &fd, &fd_len) != 0){
+        LMLOG(LDBG_2,"LMAPI: Error while getting the ZMQ descriptor: %s\n",zmq_strerror (errno));
+        goto err;
+    }
+    if (sockmstr_register_read_listener(smaster, lmapi_sock_process, conn, fd) == NULL){
+        goto err;
+    }
+
     LMLOG(LDBG_2,"LMAPI: API server initiated using ZMQ\n");
 
     return (GOOD);
@@ -888,6 +921,7 @@ lmapi_xtr_petrs_create(lmapi_connection_t *conn, lmapi_msg_hdr_t *hdr,
         str_addr = (char *)glist_entry_data(addr_it);
         add_proxy_etr_entry(xtr->petrs,str_addr,1,100);
     }
+    gen_counter_bump(xtr->petrs->gen);
 
     xtr->fwd_policy->updated_map_cache_inf(
             xtr->fwd_policy_dev_parm,
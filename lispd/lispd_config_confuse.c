@@ -46,8 +46,6 @@ struct in_addr lispsrcbin;
 struct in_addr lispdstbin;
 struct in_addr netipsrcbin;
 struct in_addr netipdstbin;
-int numdsm;
-data_simplemux_t conf_sm[10],conf_sm_pre[10]; // FIXME: use realloc to allow more simplemux configs
 /*SIMPLEMUX: variables and includes for simplemux*/
 
 
@@ -633,6 +631,92 @@ configure_xtr(cfg_t *cfg)
     return(GOOD);
 }
 
+/*SIMPLEMUX: simplemux rules*/
+/* Parse the simplemux sections. The rules are applied keeping the state of
+ * the ones that did not change, so it is also used to reload them */
+static void
+configure_simplemux(cfg_t *cfg)
+{
+    data_simplemux_t *rules;
+    int i, n;
+
+    n = cfg_size(cfg, "simplemux");
+    rules = muxed_rules_stage(n);
+    for (i = 0; i < n; i++) 
+    {
+        int afi;
+        char *token;
+        
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc")!=NULL)
+           {
+           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc"));
+           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc"),&ipsrcbin); 
+           ip_addr_init(&(rules[i].mux_tuple.src_addr),&ipsrcbin,afi);
+           } 
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst")!=NULL)
+           {
+           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst"));
+           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst"),&ipdstbin); 
+           ip_addr_init(&(rules[i].mux_tuple.dst_addr),&ipdstbin,afi);
+           } 
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc")!=NULL)
+           {
+           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc"));
+           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc"),&lispsrcbin);
+           lisp_addr_set_lafi(&(rules[i].mux_tuple.srloc),afi);
+           ip_addr_init(&(rules[i].mux_tuple.srloc.ip),&lispsrcbin,afi);
+           } 
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst")!=NULL)
+           {
+           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst"));
+           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst"),&lispdstbin);
+           lisp_addr_set_lafi(&(rules[i].mux_tuple.drloc),afi);
+           ip_addr_init(&(rules[i].mux_tuple.drloc.ip),&lispdstbin,afi);
+           } 
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netsrc")!=NULL)
+           {
+           token=strtok(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netsrc"),"/");
+           afi = ip_afi_from_char(token);
+           res=inet_pton(afi,token,&netipsrcbin); 
+           ip_addr_init(&(rules[i].mux_tuple.src_net),&netipsrcbin,afi);
+           token=strtok(NULL,"/");
+           rules[i].mux_tuple.src_mask=atoi(token);
+           } 
+        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netdst")!=NULL)
+           {
+           token=strtok(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netdst"),"/");
+           afi = ip_afi_from_char(token);
+           res=inet_pton(afi,token,&netipdstbin); 
+           ip_addr_init(&(rules[i].mux_tuple.dst_net),&netipdstbin,afi);
+           token=strtok(NULL,"/");
+           rules[i].mux_tuple.dst_mask=atoi(token);
+           } 
+        rules[i].user_mtu=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"mtu-user");
+        rules[i].interface_mtu=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"mtu-int");
+        rules[i].limit_numpackets_tun=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"num-pkt");
+        rules[i].size_threshold=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"threshold");
+        rules[i].timeout=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"timeout");
+        rules[i].period=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"period");
+        rules[i].ROHC_mode=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"ROHC-mode");
+        rules[i].latency_budget=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"latency-budget");
+        rules[i].bulk_period=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"bulk-period");
+        rules[i].bulk_threshold=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"bulk-threshold");
+
+        // FIXME: New parameters included, not used in MUX yet
+        rules[i].port_dst=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"port-dst");
+        rules[i].port_src=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"port-src");
+		// Verify ROHC mode
+		if ( rules[i].ROHC_mode < 0 ) {  // check ROHC option
+			rules[i].ROHC_mode = 0;
+		} else if ( rules[i].ROHC_mode > 2 ) { 
+			rules[i].ROHC_mode = 2;
+		}
+
+    }
+    muxed_rules_apply();
+}
+/*SIMPLEMUX: simplemux rules*/
+
 /*SIMPLEMUX: parameter configuration for simplemux*/
 int
 configure_xtrsm(cfg_t *cfg)
@@ -777,79 +861,7 @@ configure_xtrsm(cfg_t *cfg)
 
 
 /*SIMPLEMUX: simplemux data*/
-
-    n = cfg_size(cfg, "simplemux");
-    numdsm=n;
-    if (n>10){n=10;LMLOG(LINF,"The simplemux data is more than 10, so will take only 10\n");} // FIXME: use realloc
-    numdsm=n;
-    for (i = 0; i < n; i++) 
-    {
-        int afi;
-        char *token;
-        
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc")!=NULL)
-           {
-           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc"));
-           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipsrc"),&ipsrcbin); 
-           ip_addr_init(&(conf_sm[i].mux_tuple.src_addr),&ipsrcbin,afi);
-           } 
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst")!=NULL)
-           {
-           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst"));
-           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"ipdst"),&ipdstbin); 
-           ip_addr_init(&(conf_sm[i].mux_tuple.dst_addr),&ipdstbin,afi);
-           } 
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc")!=NULL)
-           {
-           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc"));
-           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispsrc"),&lispsrcbin);
-           lisp_addr_set_lafi(&(conf_sm[i].mux_tuple.srloc),afi);
-           ip_addr_init(&(conf_sm[i].mux_tuple.srloc.ip),&lispsrcbin,afi);
-           } 
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst")!=NULL)
-           {
-           afi = ip_afi_from_char(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst"));
-           res=inet_pton(afi,cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"lispdst"),&lispdstbin);
-           lisp_addr_set_lafi(&(conf_sm[i].mux_tuple.drloc),afi);
-           ip_addr_init(&(conf_sm[i].mux_tuple.drloc.ip),&lispdstbin,afi);
-           } 
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netsrc")!=NULL)
-           {
-           token=strtok(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netsrc"),"/");
-           afi = ip_afi_from_char(token);
-           res=inet_pton(afi,token,&netipsrcbin); 
-           ip_addr_init(&(conf_sm[i].mux_tuple.src_net),&netipsrcbin,afi);
-           token=strtok(NULL,"/");
-           conf_sm[i].mux_tuple.src_mask=atoi(token);
-           } 
-        if (cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netdst")!=NULL)
-           {
-           token=strtok(cfg_getstr(cfg_getnsec(cfg, "simplemux",i),"netdst"),"/");
-           afi = ip_afi_from_char(token);
-           res=inet_pton(afi,token,&netipdstbin); 
-           ip_addr_init(&(conf_sm[i].mux_tuple.dst_net),&netipdstbin,afi);
-           token=strtok(NULL,"/");
-           conf_sm[i].mux_tuple.dst_mask=atoi(token);
-           } 
-        conf_sm[i].user_mtu=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"mtu-user");
-        conf_sm[i].interface_mtu=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"mtu-int");
-        conf_sm[i].limit_numpackets_tun=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"num-pkt");
-        conf_sm[i].size_threshold=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"threshold");
-        conf_sm[i].timeout=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"timeout");
-        conf_sm[i].period=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"period");
-        conf_sm[i].ROHC_mode=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"ROHC-mode");
-
-        // FIXME: New parameters included, not used in MUX yet
-        conf_sm[i].port_dst=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"port-dst");
-        conf_sm[i].port_src=cfg_getint(cfg_getnsec(cfg, "simplemux",i),"port-src");
-		// Verify ROHC mode
-		if ( conf_sm[i].ROHC_mode < 0 ) {  // check ROHC option
-			conf_sm[i].ROHC_mode = 0;
-		} else if ( conf_sm[i].ROHC_mode > 2 ) { 
-			conf_sm[i].ROHC_mode = 2;
-		}
-
-    }
+    configure_simplemux(cfg);
 /*SIMPLEMUX: simplemux data*/
 
     n = cfg_size(cfg, "database-mapping");
@@ -1216,13 +1228,16 @@ configure_ms(cfg_t *cfg)
     return(GOOD);
 }
 
-int
-handle_config_file(char **lispdconf_conf_file)
+/* Parse the config file. With simplemux_only, only the simplemux rules are
+ * configured again, and a file with errors leaves them as they are */
+static int
+read_config_file(char **lispdconf_conf_file, int simplemux_only)
 {
     int ret;
     cfg_t *cfg;
     char *mode;
     char *log_file;
+    char *encap;
 
     /* xTR specific */
     static cfg_opt_t map_server_opts[] = {
@@ -1264,6 +1279,9 @@ handle_config_file(char **lispdconf_conf_file)
             CFG_INT("timeout",                  0, CFGF_NONE),
             CFG_INT("period",                  0, CFGF_NONE),
             CFG_INT("ROHC-mode",                  0, CFGF_NONE),
+            CFG_INT("latency-budget",             0, CFGF_NONE),
+            CFG_INT("bulk-period",                0, CFGF_NONE),
+            CFG_INT("bulk-threshold",             0, CFGF_NONE),
             CFG_INT("port-dst",                  99999, CFGF_NONE), //out of range
             CFG_INT("port-src",                  99999, CFGF_NONE), //out of range
             CFG_END()
@@ -1382,6 +1400,14 @@ handle_config_file(char **lispdconf_conf_file)
             CFG_INT("map-request-retries",  0, CFGF_NONE),
             CFG_INT("control-port",         0, CFGF_NONE),
             CFG_INT("debug",                0, CFGF_NONE),
+            CFG_INT("data-batch-size",      0, CFGF_NONE),
+            CFG_INT("data-queues",          0, CFGF_NONE),
+            CFG_INT("flow-table-size",      0, CFGF_NONE),
+            CFG_STR("data-encap",           0, CFGF_NONE),
+            CFG_INT("map-cache-max-entries",0, CFGF_NONE),
+            CFG_INT("map-cache-max-size",   0, CFGF_NONE),
+            CFG_INT("map-request-rate",     0, CFGF_NONE),
+            CFG_INT("map-request-burst",    0, CFGF_NONE),
             CFG_STR("log-file",             0, CFGF_NONE),
             CFG_INT("rloc-probing-interval",0, CFGF_NONE),
             CFG_STR_LIST("map-resolver",    0, CFGF_NONE),
@@ -1415,6 +1441,20 @@ handle_config_file(char **lispdconf_conf_file)
     cfg = cfg_init(opts, CFGF_NOCASE);
     ret = cfg_parse(cfg, *lispdconf_conf_file);
 
+    if (simplemux_only) {
+        if (ret != CFG_SUCCESS) {
+            LMLOG(LERR, "Couldn't parse config file %s. The simplemux rules "
+                    "are not changed", *lispdconf_conf_file);
+            cfg_free(cfg);
+            return(BAD);
+        }
+        mode = cfg_getstr(cfg, "operating-mode");
+        if (mode && strcmp(mode, "xTRSM") == 0) {
+            configure_simplemux(cfg);
+        }
+        cfg_free(cfg);
+        return(GOOD);
+    }
 
     if (ret == CFG_FILE_ERROR) {
         LMLOG(LCRIT, "Couldn't find config file %s, exiting...", config_file);
@@ -1447,6 +1487,58 @@ handle_config_file(char **lispdconf_conf_file)
         LMLOG (LINF, "Log level: High Debug");
     }
 
+    /* Number of data packets processed per wakeup of the data plane */
+    ret = cfg_getint(cfg, "data-batch-size");
+    if (ret > 0){
+        data_batch_size = (ret > MAX_DATA_BATCH_SIZE) ? MAX_DATA_BATCH_SIZE : ret;
+    }
+
+    /* Number of flows cached by the data plane */
+    ret = cfg_getint(cfg, "flow-table-size");
+    if (ret > 0){
+        if (ret < MIN_FLOW_TABLE_SIZE){
+            ret = MIN_FLOW_TABLE_SIZE;
+        }
+        flow_table_size = (ret > MAX_FLOW_TABLE_SIZE) ? MAX_FLOW_TABLE_SIZE : ret;
+    }
+
+    /* Limits of the dynamic entries of the map-cache */
+    ret = cfg_getint(cfg, "map-cache-max-entries");
+    if (ret > 0){
+        map_cache_max_entries = ret;
+    }
+    ret = cfg_getint(cfg, "map-cache-max-size");
+    if (ret > 0){
+        map_cache_max_size = (ret > MAX_MAP_CACHE_SIZE) ? MAX_MAP_CACHE_SIZE : ret;
+    }
+
+    /* Token bucket of the Map-Requests sent to each Map-Resolver */
+    ret = cfg_getint(cfg, "map-request-rate");
+    if (ret > 0){
+        map_request_rate = (ret > MAX_MAP_REQUEST_RATE) ? MAX_MAP_REQUEST_RATE : ret;
+    }
+    ret = cfg_getint(cfg, "map-request-burst");
+    if (ret > 0){
+        map_request_burst = (ret > MAX_MAP_REQUEST_RATE) ? MAX_MAP_REQUEST_RATE : ret;
+    }
+
+    /* Number of queues of the tun, each one served by its own thread */
+    ret = cfg_getint(cfg, "data-queues");
+    if (ret > 0){
+        data_queues = (ret > MAX_DATA_QUEUES) ? MAX_DATA_QUEUES : ret;
+    }
+
+    /* How the outer headers of the encapsulated packets are built */
+    encap = cfg_getstr(cfg, "data-encap");
+    if (encap != NULL){
+        if (strcmp(encap, "udp") == 0){
+            data_encap = DATA_ENCAP_UDP;
+        }else if (strcmp(encap, "raw") != 0){
+            LMLOG(LWRN, "Configuration file: Unknown data-encap %s. Using raw",
+                    encap);
+        }
+    }
+
     /*
      * Log file
      */
@@ -1477,6 +1569,20 @@ handle_config_file(char **lispdconf_conf_file)
     return(GOOD);
 }
 
+int
+handle_config_file(char **lispdconf_conf_file)
+{
+    return(read_config_file(lispdconf_conf_file, FALSE));
+}
+
+/*SIMPLEMUX: reload of the simplemux rules*/
+int
+handle_simplemux_config_file(char *lispdconf_conf_file)
+{
+    return(read_config_file(&lispdconf_conf_file, TRUE));
+}
+/*SIMPLEMUX: reload of the simplemux rules*/
+
 /*
  * Editor modelines
  *
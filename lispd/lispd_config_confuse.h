@@ -25,6 +25,12 @@
  */
 int handle_config_file(char ** lispdconf_conf_file);
 
+/*
+ *  Parse the config file again and apply only the changes of the simplemux
+ *  rules
+ */
+int handle_simplemux_config_file(char *lispdconf_conf_file);
+
 
 
 #endif /*LISPD_CONFIG_CONFUSE_H_*/
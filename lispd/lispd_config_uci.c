@@ -98,6 +98,7 @@ handle_config_file(char **uci_conf_file_path)
     struct uci_section *sect;
     struct uci_element *element;
     int uci_debug;
+    int uci_batch;
     char *uci_log_file;
     char *uci_op_mode;
     int res = BAD;
@@ -153,6 +154,70 @@ handle_config_file(char **uci_conf_file_path)
                     debug_level = 3;
             }
 
+            if (uci_lookup_option_string(ctx, sect, "data_batch_size") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "data_batch_size"),NULL,10);
+                if (uci_batch > 0){
+                    data_batch_size = (uci_batch > MAX_DATA_BATCH_SIZE) ?
+                            MAX_DATA_BATCH_SIZE : uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "data_queues") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "data_queues"),NULL,10);
+                if (uci_batch > 0){
+                    data_queues = (uci_batch > MAX_DATA_QUEUES) ?
+                            MAX_DATA_QUEUES : uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "data_encap") != NULL
+                    && strcmp(uci_lookup_option_string(ctx, sect, "data_encap"),
+                            "udp") == 0){
+                data_encap = DATA_ENCAP_UDP;
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "flow_table_size") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "flow_table_size"),NULL,10);
+                if (uci_batch > 0){
+                    if (uci_batch < MIN_FLOW_TABLE_SIZE){
+                        uci_batch = MIN_FLOW_TABLE_SIZE;
+                    }
+                    flow_table_size = (uci_batch > MAX_FLOW_TABLE_SIZE) ?
+                            MAX_FLOW_TABLE_SIZE : uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "map_cache_max_entries") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "map_cache_max_entries"),NULL,10);
+                if (uci_batch > 0){
+                    map_cache_max_entries = uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "map_cache_max_size") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "map_cache_max_size"),NULL,10);
+                if (uci_batch > 0){
+                    map_cache_max_size = (uci_batch > MAX_MAP_CACHE_SIZE) ?
+                            MAX_MAP_CACHE_SIZE : uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "map_request_rate") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "map_request_rate"),NULL,10);
+                if (uci_batch > 0){
+                    map_request_rate = (uci_batch > MAX_MAP_REQUEST_RATE) ?
+                            MAX_MAP_REQUEST_RATE : uci_batch;
+                }
+            }
+
+            if (uci_lookup_option_string(ctx, sect, "map_request_burst") != NULL){
+                uci_batch = strtol(uci_lookup_option_string(ctx, sect, "map_request_burst"),NULL,10);
+                if (uci_batch > 0){
+                    map_request_burst = (uci_batch > MAX_MAP_REQUEST_RATE) ?
+                            MAX_MAP_REQUEST_RATE : uci_batch;
+                }
+            }
+
             uci_log_file = (char *)uci_lookup_option_string(ctx, sect, "log_file");
             if (daemonize == TRUE){
                 open_log_file(uci_log_file);
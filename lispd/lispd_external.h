@@ -25,6 +25,14 @@
 extern char *config_file;
 extern int daemonize;
 extern int default_rloc_afi;
+extern int data_batch_size;
+extern int flow_table_size;
+extern int data_queues;
+extern int data_encap;
+extern int map_cache_max_entries;
+extern int map_cache_max_size;
+extern int map_request_rate;
+extern int map_request_burst;
 extern int netlink_fd;
 extern int nat_aware;
 extern int nat_status;
@@ -0,0 +1,407 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+/*
+ * Randomized equivalence test and microbenchmark of the checksum code. Every
+ * implementation of cksum_partial() supported by the CPU is compared with
+ * the scalar 16 bit loops used before (kept below as reference) on random
+ * buffers of random length and alignment. The incremental updates of
+ * ip_hdr_set_ttl_and_tos() and cksum_update32() are compared with a full
+ * computation of the header checksum. Then the time per checksum is measured
+ * for some packet sizes:
+ *
+ *   cksum_bench [-c <cases>] [-i <iterations>]
+ *
+ * The exit status is not zero if any result differs from the reference.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+
+#include "defs.h"
+#include "lib/cksum.h"
+#include "lib/packets.h"
+#include "lib/sockets.h"
+
+#define BENCH_BUF_SIZE      (9000 + 64)
+#define BENCH_ALIGN         32
+
+/* Globals of lispd used by the library code */
+int debug_level = 0;
+int daemonize = FALSE;
+sockmstr_t *smaster = NULL;
+
+uint16_t udp_ipv4_checksum(const void *b, unsigned int len, in_addr_t src,
+        in_addr_t dst);
+uint16_t udp_ipv6_checksum(const struct ip6_hdr *ip6, const struct udphdr *up,
+        unsigned int len);
+
+static const int bench_sizes[] = { 20, 40, 64, 128, 576, 1500, 9000 };
+
+
+/* Reference implementations */
+
+static uint16_t
+ref_ip_checksum(uint16_t *buffer, int size)
+{
+    uint32_t cksum = 0;
+
+    while (size > 1) {
+        cksum += *buffer++;
+        size -= sizeof(uint16_t);
+    }
+
+    if (size) {
+        cksum += *(uint8_t *) buffer;
+    }
+
+    cksum = (cksum >> 16) + (cksum & 0xffff);
+    cksum += (cksum >> 16);
+
+    return ((uint16_t) (~cksum));
+}
+
+static uint16_t
+ref_udp_ipv4_checksum(const void *b, unsigned int len, in_addr_t src,
+        in_addr_t dst)
+{
+    const uint16_t *buf = b;
+    uint16_t *ip_src = (void *) &src;
+    uint16_t *ip_dst = (void *) &dst;
+    uint32_t length = len;
+    uint32_t sum = 0;
+
+    while (len > 1) {
+        sum += *buf++;
+        if (sum & 0x80000000)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        len -= 2;
+    }
+
+    if (len & 1)
+        sum += *((uint8_t *) buf);
+
+    sum += *(ip_src++);
+    sum += *ip_src;
+    sum += *(ip_dst++);
+    sum += *ip_dst;
+    sum += htons(IPPROTO_UDP);
+    sum += htons(length);
+
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+
+    return ((uint16_t) (~sum));
+}
+
+static uint16_t
+ref_udp_ipv6_checksum(const struct ip6_hdr *ip6, const struct udphdr *up,
+        unsigned int len)
+{
+    size_t i;
+    const uint16_t *sp;
+    uint32_t sum;
+    union {
+        struct {
+            struct in6_addr ph_src;
+            struct in6_addr ph_dst;
+            uint32_t ph_len;
+            uint8_t ph_zero[3];
+            uint8_t ph_nxt;
+        } ph;
+        uint16_t pa[20];
+    } phu;
+
+    memset(&phu, 0, sizeof(phu));
+    phu.ph.ph_src = ip6->ip6_src;
+    phu.ph.ph_dst = ip6->ip6_dst;
+    phu.ph.ph_len = htonl(len);
+    phu.ph.ph_nxt = IPPROTO_UDP;
+
+    sum = 0;
+    for (i = 0; i < sizeof(phu.pa) / sizeof(phu.pa[0]); i++)
+        sum += phu.pa[i];
+
+    sp = (const uint16_t *) up;
+    for (i = 0; i < (len & ~1); i += 2)
+        sum += *sp++;
+
+    if (len & 1)
+        sum += htons((*(const uint8_t *) sp) << 8);
+
+    while (sum > 0xffff)
+        sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum & 0xffff;
+
+    return (sum);
+}
+
+
+static uint64_t
+bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Random contents, with runs of 0x00 and 0xff now and then to exercise the
+ * carries */
+static void
+fill_random(uint8_t *p, int len)
+{
+    int i, mode = rand() % 8;
+
+    for (i = 0; i < len; i++) {
+        switch (mode) {
+        case 0:
+            p[i] = 0xff;
+            break;
+        case 1:
+            p[i] = 0;
+            break;
+        default:
+            p[i] = rand();
+        }
+    }
+}
+
+static int
+random_len()
+{
+    /* Mostly packet sizes, but also the lengths around the vector widths */
+    switch (rand() % 3) {
+    case 0:
+        return (rand() % 80);
+    case 1:
+        return (rand() % 1600);
+    default:
+        return (rand() % (BENCH_BUF_SIZE - BENCH_ALIGN));
+    }
+}
+
+static int
+test_buffers(int cases)
+{
+    static uint8_t buf[BENCH_BUF_SIZE + BENCH_ALIGN];
+    struct ip6_hdr *ip6h;
+    uint8_t *p;
+    in_addr_t src, dst;
+    int c, len, errors = 0;
+
+    for (c = 0; c < cases; c++) {
+        len = random_len();
+        p = buf + rand() % BENCH_ALIGN;
+        fill_random(p, len);
+
+        if (ip_checksum((uint16_t *)p, len) != ref_ip_checksum((uint16_t *)p,
+                len)) {
+            fprintf(stderr, "ip_checksum differs: len %d offset %d\n", len,
+                    (int)(p - buf));
+            errors++;
+        }
+
+        src = rand();
+        dst = rand();
+        if (udp_ipv4_checksum(p, len, src, dst)
+                != ref_udp_ipv4_checksum(p, len, src, dst)) {
+            fprintf(stderr, "udp_ipv4_checksum differs: len %d offset %d\n",
+                    len, (int)(p - buf));
+            errors++;
+        }
+
+        if (len >= sizeof(struct ip6_hdr)) {
+            ip6h = (struct ip6_hdr *)p;
+            if (udp_ipv6_checksum(ip6h, (struct udphdr *)(ip6h + 1),
+                    len - sizeof(struct ip6_hdr))
+                    != ref_udp_ipv6_checksum(ip6h, (struct udphdr *)(ip6h + 1),
+                            len - sizeof(struct ip6_hdr))) {
+                fprintf(stderr, "udp_ipv6_checksum differs: len %d offset "
+                        "%d\n", len, (int)(p - buf));
+                errors++;
+            }
+        }
+    }
+
+    return (errors);
+}
+
+/* Random IPv4 header with a valid checksum */
+static void
+random_ipv4_hdr(struct ip *iph)
+{
+    fill_random((uint8_t *)iph, sizeof(struct ip));
+    iph->ip_v = IPVERSION;
+    iph->ip_hl = 5;
+    iph->ip_sum = 0;
+    iph->ip_sum = ref_ip_checksum((uint16_t *)iph, sizeof(struct ip));
+}
+
+static int
+test_updates(int cases)
+{
+    struct ip iph, ref;
+    uint32_t addr;
+    int c, ttl, tos, errors = 0;
+
+    for (c = 0; c < cases; c++) {
+        random_ipv4_hdr(&iph);
+        ttl = rand() % 256;
+        tos = rand() % 256;
+
+        ref = iph;
+        if (ttl != 0) {
+            ref.ip_ttl = ttl;
+        }
+        ref.ip_tos = tos;
+        ref.ip_sum = 0;
+        ref.ip_sum = ref_ip_checksum((uint16_t *)&ref, sizeof(struct ip));
+
+        ip_hdr_set_ttl_and_tos((struct iphdr *)&iph, ttl, tos);
+        if (memcmp(&iph, &ref, sizeof(struct ip)) != 0) {
+            fprintf(stderr, "ip_hdr_set_ttl_and_tos differs: ttl %d tos %d "
+                    "checksum %04x instead of %04x\n", ttl, tos, iph.ip_sum,
+                    ref.ip_sum);
+            errors++;
+        }
+
+        /* NAT rewrite of the source address */
+        addr = rand();
+        ref.ip_src.s_addr = addr;
+        ref.ip_sum = 0;
+        ref.ip_sum = ref_ip_checksum((uint16_t *)&ref, sizeof(struct ip));
+        iph.ip_sum = cksum_update32(iph.ip_sum, iph.ip_src.s_addr, addr);
+        iph.ip_src.s_addr = addr;
+        if (iph.ip_sum != ref.ip_sum) {
+            fprintf(stderr, "cksum_update32 differs: %04x instead of %04x\n",
+                    iph.ip_sum, ref.ip_sum);
+            errors++;
+        }
+    }
+
+    return (errors);
+}
+
+static double
+bench_size(int len, int iterations, int ref)
+{
+    static uint8_t buf[BENCH_BUF_SIZE];
+    volatile uint16_t sink = 0;
+    uint64_t start;
+    int i;
+
+    fill_random(buf, len);
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+        buf[0] = i;
+        if (ref) {
+            sink += ref_ip_checksum((uint16_t *)buf, len);
+        } else {
+            sink += ip_checksum((uint16_t *)buf, len);
+        }
+    }
+    return ((double)(bench_now_ns() - start) / iterations);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c <cases>] [-i <iterations>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    cksum_impl_e best, impl;
+    int cases = 200000, iterations = 2000000;
+    int nsizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+    int s, opt, errors, failed = 0;
+    double ns;
+
+    while ((opt = getopt(argc, argv, "c:i:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            cases = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (cases < 0 || iterations <= 0) {
+        usage(argv[0]);
+    }
+
+    best = cksum_selected();
+    printf("Selected implementation: %s\n", cksum_impl_to_char(best));
+
+    srand(1);
+    for (impl = CKSUM_GENERIC; impl < CKSUM_NIMPL; impl++) {
+        if (cksum_select(impl) != GOOD) {
+            printf("%s\tnot supported\n", cksum_impl_to_char(impl));
+            continue;
+        }
+        errors = test_buffers(cases) + test_updates(cases);
+        printf("%s\t%d cases\t%s\n", cksum_impl_to_char(impl), cases,
+                errors ? "FAIL" : "ok");
+        if (errors) {
+            failed = 1;
+        }
+    }
+
+    printf("\nbytes\treference_ns");
+    for (impl = CKSUM_GENERIC; impl < CKSUM_NIMPL; impl++) {
+        printf("\t%s_ns", cksum_impl_to_char(impl));
+    }
+    printf("\n");
+    for (s = 0; s < nsizes; s++) {
+        printf("%d\t%.1f", bench_sizes[s], bench_size(bench_sizes[s],
+                iterations, TRUE));
+        for (impl = CKSUM_GENERIC; impl < CKSUM_NIMPL; impl++) {
+            if (cksum_select(impl) != GOOD) {
+                printf("\t-");
+                continue;
+            }
+            ns = bench_size(bench_sizes[s], iterations, FALSE);
+            printf("\t%.1f", ns);
+        }
+        printf("\n");
+    }
+    cksum_select(best);
+
+    return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
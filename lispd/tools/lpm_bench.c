@@ -0,0 +1,308 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Check and benchmark of the compiled index of the IP prefixes of the mapping
+ * databases. Random IPv4 and IPv6 prefixes, many of them nested, are added to
+ * a database and then half of them are removed and added again. After each
+ * step the index answers the lookups of random addresses, inside and outside
+ * the prefixes, and the answers are compared with a search of the Patricia
+ * tree. Then the time per lookup of both is measured:
+ *
+ *   lpm_bench [-n <prefixes>] [-c <lookups>]
+ *
+ * The exit status is not zero if any answer differs from the Patricia tree.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "lib/mapping_db.h"
+#include "lib/sockets.h"
+#include "lib/util.h"
+
+/* Globals of lispd used by the library code */
+int debug_level = 0;
+int daemonize = FALSE;
+sockmstr_t *smaster = NULL;
+
+patricia_node_t *pt_find_ip_node(patricia_tree_t *pt, ip_addr_t *ipaddr);
+
+typedef struct bench_pref {
+    lisp_addr_t addr;
+    uint8_t in_db;
+} bench_pref_t;
+
+
+static uint64_t
+bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+fill_random(uint8_t *p, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        p[i] = rand();
+    }
+}
+
+static int
+random_plen(int afi)
+{
+    int r = rand() % 10;
+
+    /* Mostly the usual lengths of EID prefixes */
+    if (afi == AF_INET) {
+        return (r < 3 ? 24 : 8 + rand() % 25);
+    }
+    if (r < 3) {
+        return (48);
+    }
+    return (r < 5 ? 64 : 16 + rand() % 113);
+}
+
+/* Random prefixes. A quarter of them share the address of the previous one
+ * with another length, so many prefixes contain others */
+static void
+random_prefixes(bench_pref_t *prefs, int n, int afi)
+{
+    uint8_t a[16];
+    ip_addr_t ip;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (i == 0 || rand() % 4 != 0) {
+            fill_random(a, sizeof(a));
+        }
+        ip_addr_init(&ip, a, afi);
+        lisp_addr_init_from_ippref(&prefs[i].addr, &ip, random_plen(afi));
+        prefs[i].in_db = FALSE;
+    }
+}
+
+/* Addresses to look up: half of them inside a prefix, the rest random */
+static void
+random_addrs(lisp_addr_t *addrs, int n, bench_pref_t *prefs, int nprefs,
+        int afi)
+{
+    uint8_t a[16], *p;
+    ip_addr_t ip;
+    int i, j, plen;
+
+    for (i = 0; i < n; i++) {
+        fill_random(a, sizeof(a));
+        if (i % 2 == 0) {
+            j = rand() % nprefs;
+            p = ip_addr_get_addr(lisp_addr_ip_get_addr(&prefs[j].addr));
+            plen = lisp_addr_ip_get_plen(&prefs[j].addr);
+            memcpy(a, p, plen / 8);
+            if (plen % 8) {
+                a[plen / 8] = (p[plen / 8] & (0xFF << (8 - plen % 8)))
+                        | (a[plen / 8] & (0xFF >> plen % 8));
+            }
+        }
+        ip_addr_init(&ip, a, afi);
+        lisp_addr_init_from_ip(&addrs[i], &ip);
+    }
+}
+
+static void *
+pt_lookup(mdb_t *db, lisp_addr_t *addr)
+{
+    patricia_tree_t *pt;
+    patricia_node_t *node;
+
+    pt = (lisp_addr_ip_afi(addr) == AF_INET) ? db->AF4_ip_db->head->data
+            : db->AF6_ip_db->head->data;
+    node = pt_find_ip_node(pt, lisp_addr_ip_get_addr(addr));
+    return (node ? node->data : NULL);
+}
+
+static int
+check_lookups(mdb_t *db, lisp_addr_t *addrs, int n, const char *step)
+{
+    void *ref, *res;
+    int i, errors = 0;
+
+    for (i = 0; i < n; i++) {
+        ref = pt_lookup(db, &addrs[i]);
+        res = mdb_lookup_entry(db, &addrs[i]);
+        if (res != ref) {
+            if (errors < 10) {
+                fprintf(stderr, "%s: lookup of %s differs\n", step,
+                        lisp_addr_to_char(&addrs[i]));
+            }
+            errors++;
+        }
+    }
+    return (errors);
+}
+
+static double
+bench_lookups(mdb_t *db, lisp_addr_t *addrs, int n, int ref)
+{
+    volatile uintptr_t sink = 0;
+    uint64_t start;
+    int i;
+
+    start = bench_now_ns();
+    for (i = 0; i < n; i++) {
+        if (ref) {
+            sink += (uintptr_t)pt_lookup(db, &addrs[i]);
+        } else {
+            sink += (uintptr_t)mdb_lookup_entry(db, &addrs[i]);
+        }
+    }
+    return ((double)(bench_now_ns() - start) / n);
+}
+
+static int
+bench_afi(int afi, int nprefs, int nlookups)
+{
+    bench_pref_t *prefs;
+    lisp_addr_t *addrs;
+    uint8_t *vals;
+    mdb_t *db;
+    lpm_t *lpm;
+    int i, errors = 0, added = 0;
+
+    prefs = xcalloc(nprefs, sizeof(bench_pref_t));
+    addrs = xcalloc(nlookups, sizeof(lisp_addr_t));
+    vals = xcalloc(nprefs, 1);
+    db = mdb_new();
+    lpm = (afi == AF_INET) ? db->AF4_ip_lpm : db->AF6_ip_lpm;
+
+    random_prefixes(prefs, nprefs, afi);
+    random_addrs(addrs, nlookups, prefs, nprefs, afi);
+
+    /* Duplicated prefixes are only added once */
+    for (i = 0; i < nprefs; i++) {
+        if (!mdb_lookup_entry_exact(db, &prefs[i].addr)
+                && mdb_add_entry(db, &prefs[i].addr, &vals[i]) == GOOD) {
+            prefs[i].in_db = TRUE;
+            added++;
+        }
+    }
+    errors += check_lookups(db, addrs, nlookups, "add");
+
+    for (i = 0; i < nprefs; i++) {
+        if (prefs[i].in_db && rand() % 2) {
+            if (mdb_remove_entry(db, &prefs[i].addr) != &vals[i]) {
+                fprintf(stderr, "remove of %s failed\n",
+                        lisp_addr_to_char(&prefs[i].addr));
+                errors++;
+            }
+            prefs[i].in_db = FALSE;
+        }
+    }
+    errors += check_lookups(db, addrs, nlookups, "remove");
+
+    for (i = 0; i < nprefs; i++) {
+        if (!prefs[i].in_db && !mdb_lookup_entry_exact(db, &prefs[i].addr)
+                && mdb_add_entry(db, &prefs[i].addr, &vals[i]) == GOOD) {
+            prefs[i].in_db = TRUE;
+        }
+    }
+    errors += check_lookups(db, addrs, nlookups, "add again");
+
+    printf("%s\t%d\t%s\t%.1f\t\t%.1f\t%zu\n", afi == AF_INET ? "IPv4" : "IPv6",
+            added, errors ? "FAIL" : "ok",
+            bench_lookups(db, addrs, nlookups, TRUE),
+            bench_lookups(db, addrs, nlookups, FALSE),
+            lpm_mem_size(lpm) / 1024);
+
+    /* Without prefixes every node is given back */
+    for (i = 0; i < nprefs; i++) {
+        if (prefs[i].in_db) {
+            mdb_remove_entry(db, &prefs[i].addr);
+        }
+    }
+    for (i = 0; lpm->root && i < 1 << LPM_ROOT_BITS; i++) {
+        if (lpm->root[i].data || lpm->root[i].child || lpm->root_plen[i]) {
+            break;
+        }
+    }
+    if (lpm->n_nodes != 0 || lpm->n_prefixes != 0
+            || (lpm->root && i < 1 << LPM_ROOT_BITS)) {
+        fprintf(stderr, "index not empty after removing all the prefixes\n");
+        errors++;
+    }
+
+    mdb_del(db, NULL);
+    free(vals);
+    free(addrs);
+    free(prefs);
+    return (errors);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n <prefixes>] [-c <lookups>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    int nprefs = 200000, nlookups = 1000000;
+    int opt, errors;
+
+    while ((opt = getopt(argc, argv, "n:c:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            nprefs = atoi(optarg);
+            break;
+        case 'c':
+            nlookups = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nprefs <= 0 || nlookups <= 0) {
+        usage(argv[0]);
+    }
+
+    srand(1);
+    printf("afi\tprefixes\tcheck\tpatricia_ns\tindex_ns\tindex_kb\n");
+    errors = bench_afi(AF_INET, nprefs, nlookups);
+    errors += bench_afi(AF_INET6, nprefs, nlookups);
+
+    return (errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
@@ -0,0 +1,622 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Offline benchmark of the simplemux multiplexer. Synthetic streams (voip,
+ * gaming, mixed) or the IP packets of a pcap file are multiplexed with
+ * mux_packets() for every combination of num-pkt, threshold, period and ROHC
+ * mode. The bundles are then demultiplexed with demux_packets() into a
+ * socketpair and compared with the packets multiplexed. No TUN device, peer
+ * or privileges are needed:
+ *
+ *   mux_bench [-t voip|gaming|mixed|all] [-r <pcap>] [-c <packets>]
+ *             [-n <num-pkt,...>] [-s <threshold,...>] [-p <period,...>]
+ *             [-R 0|1|both] [-m <mtu>]
+ *
+ * The packets are fed back to back, so the figures are the CPU cost of the
+ * multiplexer. The period is applied to the timestamps of the packets: a
+ * bundle is flushed when the period expires in the time of the stream. The
+ * exit status is not zero if a round trip does not give back the packets
+ * multiplexed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "defs.h"
+#include "lib/cksum.h"
+#include "lib/lmlog.h"
+#include "lib/mux_trace.h"
+#include "lib/simplemux.h"
+#include "lib/sockets.h"
+#include "liblisp/lisp_address.h"
+
+#define BENCH_TUNNEL_HDR    (IPv4_HEADER_SIZE + UDP_HEADER_SIZE + LISP_HEADER_SIZE)
+#define BENCH_MAX_VALUES    16
+#define BENCH_VOIP_FLOWS    20
+#define BENCH_GAME_FLOWS    16
+
+/* Globals of lispd used by the simplemux code */
+int debug_level = 0;
+int daemonize = FALSE;
+sockmstr_t *smaster = NULL;
+
+typedef struct bench_pkt {
+    uint32_t off;           /* in the store of the stream */
+    uint16_t len;
+    uint64_t ts;            /* (microseconds) arrival in the time of the stream */
+} bench_pkt_t;
+
+typedef struct bench_stream {
+    const char *name;
+    bench_pkt_t *pkts;
+    int n;
+    uint8_t *store;
+    uint32_t store_len;
+} bench_stream_t;
+
+typedef struct bench_result {
+    uint64_t mux_ns;
+    uint64_t demux_ns;
+    uint64_t bundles;
+    uint64_t native_bytes;  /* packets sent one by one, with the tunnel headers */
+    uint64_t muxed_bytes;   /* bundles, with the tunnel headers */
+    int mismatches;
+} bench_result_t;
+
+
+static uint64_t
+bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+stream_init(bench_stream_t *st, const char *name, int n)
+{
+    memset(st, 0, sizeof(bench_stream_t));
+    st->name = name;
+    st->pkts = xzalloc(n * sizeof(bench_pkt_t));
+    st->store = xmalloc((size_t)n * BUFSIZE);
+}
+
+static void
+stream_free(bench_stream_t *st)
+{
+    free(st->pkts);
+    free(st->store);
+}
+
+static uint8_t *
+stream_add(bench_stream_t *st, uint16_t len, uint64_t ts)
+{
+    bench_pkt_t *p = &st->pkts[st->n++];
+
+    p->off = st->store_len;
+    p->len = len;
+    p->ts = ts;
+    st->store_len += len;
+    return (st->store + p->off);
+}
+
+/* IPv4 header of 'len' bytes with a valid checksum */
+static void
+bench_ipv4(uint8_t *pkt, uint16_t len, uint8_t proto, uint32_t src,
+        uint32_t dst, uint16_t id)
+{
+    struct ip *iph = (struct ip *)pkt;
+
+    memset(iph, 0, sizeof(struct ip));
+    iph->ip_v = IPVERSION;
+    iph->ip_hl = 5;
+    iph->ip_len = htons(len);
+    iph->ip_id = htons(id);
+    iph->ip_ttl = 64;
+    iph->ip_p = proto;
+    iph->ip_src.s_addr = htonl(src);
+    iph->ip_dst.s_addr = htonl(dst);
+    iph->ip_sum = ip_checksum((uint16_t *)iph, sizeof(struct ip));
+}
+
+/* IPv4/UDP packet with 'plen' bytes of payload. The UDP checksum is not
+ * used */
+static uint8_t *
+bench_udp(bench_stream_t *st, uint64_t ts, uint16_t plen, uint32_t src,
+        uint32_t dst, uint16_t sport, uint16_t dport, uint16_t id)
+{
+    uint16_t len = sizeof(struct ip) + sizeof(struct udphdr) + plen;
+    uint8_t *pkt = stream_add(st, len, ts);
+    struct udphdr *udph = (struct udphdr *)(pkt + sizeof(struct ip));
+
+    bench_ipv4(pkt, len, IPPROTO_UDP, src, dst, id);
+    udph->source = htons(sport);
+    udph->dest = htons(dport);
+    udph->len = htons(sizeof(struct udphdr) + plen);
+    udph->check = 0;
+    return (pkt + sizeof(struct ip) + sizeof(struct udphdr));
+}
+
+/* G.729 call: 20 bytes of voice every 20 ms, in RTP to a port detected as
+ * RTP by the compressor */
+static void
+bench_voip_pkt(bench_stream_t *st, uint64_t ts, int flow, uint32_t seq)
+{
+    uint8_t *rtp;
+    uint32_t v;
+
+    rtp = bench_udp(st, ts, 12 + 20, 0x0a000001 + flow, 0x0a010001 + flow,
+            16384 + 2 * flow, 5002, seq);
+    rtp[0] = 0x80;
+    rtp[1] = 18;                                /* G.729 */
+    rtp[2] = (seq >> 8) & 0xff;
+    rtp[3] = seq & 0xff;
+    v = htonl(seq * 160);
+    memcpy(rtp + 4, &v, sizeof(v));
+    v = htonl(0x1000 + flow);                   /* SSRC */
+    memcpy(rtp + 8, &v, sizeof(v));
+    memset(rtp + 12, seq & 0xff, 20);
+}
+
+/* Online game: updates of 30 to 120 bytes, each client every 40 ms */
+static void
+bench_game_pkt(bench_stream_t *st, uint64_t ts, int flow, uint32_t seq)
+{
+    uint16_t plen = 30 + rand() % 91;
+    uint8_t *payload;
+
+    payload = bench_udp(st, ts, plen, 0x0a000101 + flow, 0x0a010101,
+            27005 + flow, 27015, seq);
+    memset(payload, flow, plen);
+    memcpy(payload, &seq, sizeof(seq));
+}
+
+/* TCP ACK without payload */
+static void
+bench_ack_pkt(bench_stream_t *st, uint64_t ts, uint32_t seq)
+{
+    uint16_t len = sizeof(struct ip) + sizeof(struct tcphdr);
+    uint8_t *pkt = stream_add(st, len, ts);
+    struct tcphdr *tcph = (struct tcphdr *)(pkt + sizeof(struct ip));
+
+    bench_ipv4(pkt, len, IPPROTO_TCP, 0x0a000201, 0x0a010201, seq);
+    memset(tcph, 0, sizeof(struct tcphdr));
+    tcph->source = htons(40000);
+    tcph->dest = htons(80);
+    tcph->seq = htonl(1);
+    tcph->ack_seq = htonl(1 + seq * 1448);
+    tcph->doff = 5;
+    tcph->ack = 1;
+    tcph->window = htons(1024);
+}
+
+static void
+stream_voip(bench_stream_t *st, int n)
+{
+    int i;
+
+    stream_init(st, "voip", n);
+    for (i = 0; i < n; i++) {
+        bench_voip_pkt(st, (uint64_t)i * 20000 / BENCH_VOIP_FLOWS,
+                i % BENCH_VOIP_FLOWS, i / BENCH_VOIP_FLOWS);
+    }
+}
+
+static void
+stream_gaming(bench_stream_t *st, int n)
+{
+    int i;
+
+    stream_init(st, "gaming", n);
+    for (i = 0; i < n; i++) {
+        bench_game_pkt(st, (uint64_t)i * 40000 / BENCH_GAME_FLOWS,
+                i % BENCH_GAME_FLOWS, i / BENCH_GAME_FLOWS);
+    }
+}
+
+/* 40% voip, 30% gaming, 20% TCP ACKs and 10% bulk UDP, a packet every
+ * 500 usec */
+static void
+stream_mixed(bench_stream_t *st, int n, int mtu)
+{
+    uint16_t plen;
+    int i, r;
+
+    stream_init(st, "mixed", n);
+    for (i = 0; i < n; i++) {
+        r = rand() % 10;
+        if (r < 4) {
+            bench_voip_pkt(st, (uint64_t)i * 500, i % BENCH_VOIP_FLOWS, i);
+        } else if (r < 7) {
+            bench_game_pkt(st, (uint64_t)i * 500, i % BENCH_GAME_FLOWS, i);
+        } else if (r < 9) {
+            bench_ack_pkt(st, (uint64_t)i * 500, i);
+        } else {
+            plen = 1000 + rand() % 400;
+            if (plen > mtu - BENCH_TUNNEL_HDR - 3 - 28) {
+                plen = mtu - BENCH_TUNNEL_HDR - 3 - 28;
+            }
+            memset(bench_udp(st, (uint64_t)i * 500, plen, 0x0a000301,
+                    0x0a010301, 5000, 6000, i), 0xa5, plen);
+        }
+    }
+}
+
+static uint32_t
+pcap_u32(uint8_t *b, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, b, sizeof(v));
+    return (swap ? __builtin_bswap32(v) : v);
+}
+
+/* IP packets of a pcap file (Ethernet, raw IP or Linux cooked captures).
+ * The packets truncated by the capture or too big for the MTU are skipped */
+static int
+stream_pcap(bench_stream_t *st, const char *path, int n, int mtu)
+{
+    uint8_t ghdr[24], phdr[16], frame[65536];
+    uint32_t magic, linktype, caplen, origlen;
+    uint64_t ts, ts0 = 0;
+    uint16_t ethertype;
+    int swap, nsec, l2;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL || fread(ghdr, sizeof(ghdr), 1, f) != 1) {
+        fprintf(stderr, "%s: cannot read: %s\n", path, strerror(errno));
+        return (BAD);
+    }
+    memcpy(&magic, ghdr, sizeof(magic));
+    swap = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+    nsec = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+    if (!swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        fclose(f);
+        return (BAD);
+    }
+    linktype = pcap_u32(ghdr + 20, swap);
+
+    stream_init(st, "pcap", n);
+    while (st->n < n && fread(phdr, sizeof(phdr), 1, f) == 1) {
+        caplen = pcap_u32(phdr + 8, swap);
+        origlen = pcap_u32(phdr + 12, swap);
+        if (caplen > sizeof(frame) || fread(frame, caplen, 1, f) != 1) {
+            break;
+        }
+        ts = (uint64_t)pcap_u32(phdr, swap) * 1000000
+                + pcap_u32(phdr + 4, swap) / (nsec ? 1000 : 1);
+        if (ts0 == 0) {
+            ts0 = ts;
+        }
+
+        switch (linktype) {
+        case 1:                                 /* Ethernet */
+            l2 = 14;
+            if (caplen >= 18 && frame[12] == 0x81 && frame[13] == 0x00) {
+                l2 = 18;                        /* 802.1Q */
+            }
+            ethertype = caplen >= l2 ? (frame[l2 - 2] << 8) | frame[l2 - 1] : 0;
+            break;
+        case 113:                               /* Linux cooked */
+            l2 = 16;
+            ethertype = caplen >= l2 ? (frame[14] << 8) | frame[15] : 0;
+            break;
+        case 12:
+        case 101:                               /* Raw IP */
+            l2 = 0;
+            ethertype = caplen > 0 && (frame[0] >> 4) == 6 ? 0x86dd : 0x0800;
+            break;
+        default:
+            fprintf(stderr, "%s: link type %u not supported\n", path, linktype);
+            fclose(f);
+            return (BAD);
+        }
+
+        if ((ethertype != 0x0800 && ethertype != 0x86dd) || caplen < origlen
+                || caplen <= l2
+                || caplen - l2 + BENCH_TUNNEL_HDR + 3 > mtu) {
+            continue;
+        }
+        memcpy(stream_add(st, caplen - l2, ts - ts0), frame + l2, caplen - l2);
+    }
+    fclose(f);
+
+    if (st->n == 0) {
+        fprintf(stderr, "%s: no IP packets\n", path);
+        return (BAD);
+    }
+    return (GOOD);
+}
+
+/* Keep a bundle until it is demultiplexed */
+static void
+bench_keep(lbuf_t *b, uint8_t *bundles, uint32_t *bundles_len,
+        uint32_t *bundle_off, bench_result_t *res)
+{
+    bundle_off[res->bundles++] = *bundles_len;
+    memcpy(bundles + *bundles_len, lbuf_data(b), lbuf_size(b));
+    *bundles_len += lbuf_size(b);
+    res->muxed_bytes += lbuf_size(b) + BENCH_TUNNEL_HDR;
+}
+
+/* Packets written to the "tun" by demux_packets(), compared with the
+ * stream */
+static void
+bench_check(bench_stream_t *st, int fd, int *next, bench_result_t *res)
+{
+    uint8_t buf[BUFSIZE];
+    bench_pkt_t *p;
+    ssize_t len;
+
+    while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (*next >= st->n) {
+            res->mismatches++;
+            continue;
+        }
+        p = &st->pkts[(*next)++];
+        if (len != p->len || memcmp(buf, st->store + p->off, len) != 0) {
+            res->mismatches++;
+        }
+    }
+}
+
+static int
+bench_run(bench_stream_t *st, int rohc, int numpkt, int threshold,
+        uint64_t period, int mtu, bench_result_t *res)
+{
+    data_simplemux_t *ds;
+    lbuf_t b;
+    uint8_t *bundles;
+    uint32_t *bundle_off;
+    uint32_t bundles_len = 0;
+    uint64_t t0, last_period = 0;
+    ip_addr_t local, remote;
+    bench_pkt_t *p;
+    int sv[2], sndbuf = 1 << 20;
+    int i, next = 0, result;
+
+    memset(res, 0, sizeof(bench_result_t));
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return (BAD);
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    /* One rule, as configured in lispd.conf */
+    muxed_rules_alloc(1);
+    ds = &conf_sm[0];
+    ds->ROHC_mode = rohc;
+    ds->limit_numpackets_tun = numpkt;
+    ds->size_threshold = threshold;
+    ds->period = period;
+    ds->interface_mtu = mtu;
+    ds->user_mtu = mtu;
+    lisp_addr_ip_from_char("192.0.2.1", &ds->mux_tuple.srloc);
+    lisp_addr_ip_from_char("192.0.2.2", &ds->mux_tuple.drloc);
+    muxed_rules_compile();
+
+    /* The bundles of the stream fit in twice its size */
+    bundles = xmalloc(2 * st->store_len + BUFSIZE);
+    bundle_off = xmalloc((st->n + 1) * sizeof(uint32_t));
+
+    t0 = bench_now_ns();
+    for (i = 0; i < st->n; i++) {
+        p = &st->pkts[i];
+        res->native_bytes += p->len + BENCH_TUNNEL_HDR;
+
+        /* The period expires in the time of the stream. As in lispd, the
+         * next period starts at the last boundary */
+        if (period > 0 && p->ts - last_period >= period) {
+            if (ds->num_pkts_stored_from_tun > 0
+                    && mux_packets(NULL, 0, ds, &b) == 1) {
+                bench_keep(&b, bundles, &bundles_len, bundle_off, res);
+            }
+            last_period += (p->ts - last_period) / period * period;
+        }
+
+        result = mux_packets(st->store + p->off, p->len, ds, &b);
+        if (result == 0) {
+            continue;
+        }
+        bench_keep(&b, bundles, &bundles_len, bundle_off, res);
+        if (result == 2
+                && mux_packets(st->store + p->off, p->len, ds, &b) == 1) {
+            bench_keep(&b, bundles, &bundles_len, bundle_off, res);
+        }
+    }
+    if (ds->num_pkts_stored_from_tun > 0 && mux_packets(NULL, 0, ds, &b) == 1) {
+        bench_keep(&b, bundles, &bundles_len, bundle_off, res);
+    }
+    res->mux_ns = bench_now_ns() - t0;
+    bundle_off[res->bundles] = bundles_len;
+
+    /* The receiver sees the RLOCs the other way round */
+    ip_addr_copy(&local, lisp_addr_ip(&ds->mux_tuple.drloc));
+    ip_addr_copy(&remote, lisp_addr_ip(&ds->mux_tuple.srloc));
+    for (i = 0; i < res->bundles; i++) {
+        t0 = bench_now_ns();
+        demux_packets(bundles + bundle_off[i], bundle_off[i + 1] - bundle_off[i],
+                sv[0], &local, &remote);
+        res->demux_ns += bench_now_ns() - t0;
+        bench_check(st, sv[1], &next, res);
+    }
+    res->mismatches += st->n - next;
+
+    free(bundles);
+    free(bundle_off);
+    close(sv[0]);
+    close(sv[1]);
+    return (GOOD);
+}
+
+static int
+parse_list(char *arg, uint64_t *values)
+{
+    char *tok;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok != NULL && n < BENCH_MAX_VALUES;
+            tok = strtok(NULL, ",")) {
+        values[n++] = strtoull(tok, NULL, 10);
+    }
+    return (n);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t voip|gaming|mixed|all] [-r <pcap>] "
+            "[-c <packets>] [-n <num-pkt,...>] [-s <threshold,...>] "
+            "[-p <period,...>] [-R 0|1|both] [-m <mtu>]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t numpkts[BENCH_MAX_VALUES] = { 5, 10, 20 };
+    uint64_t thresholds[BENCH_MAX_VALUES] = { 600, 1300 };
+    uint64_t periods[BENCH_MAX_VALUES] = { 10000, 50000 };
+    int nnumpkts = 3, nthresholds = 2, nperiods = 2;
+    bench_stream_t streams[3];
+    bench_result_t res;
+    const char *type = "all", *pcap = NULL;
+    int count = 100000, mtu = 1500, rohc_min = 0, rohc_max = 1;
+    int nstreams = 0, failed = 0;
+    int s, r, in, is, ip, opt;
+    double mux_ns, demux_ns;
+
+    while ((opt = getopt(argc, argv, "t:r:c:n:s:p:R:m:h")) != -1) {
+        switch (opt) {
+        case 't':
+            type = optarg;
+            break;
+        case 'r':
+            pcap = optarg;
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'n':
+            nnumpkts = parse_list(optarg, numpkts);
+            break;
+        case 's':
+            nthresholds = parse_list(optarg, thresholds);
+            break;
+        case 'p':
+            nperiods = parse_list(optarg, periods);
+            break;
+        case 'R':
+            rohc_min = strcmp(optarg, "1") == 0 ? 1 : 0;
+            rohc_max = strcmp(optarg, "0") == 0 ? 0 : 1;
+            break;
+        case 'm':
+            mtu = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (count <= 0 || mtu <= BENCH_TUNNEL_HDR + 64 || mtu > BUFSIZE
+            || nnumpkts == 0 || nthresholds == 0 || nperiods == 0) {
+        usage(argv[0]);
+    }
+
+    srand(1);
+    if (pcap != NULL) {
+        if (stream_pcap(&streams[nstreams++], pcap, count, mtu) != GOOD) {
+            return (EXIT_FAILURE);
+        }
+    } else {
+        if (strcmp(type, "all") == 0 || strcmp(type, "voip") == 0) {
+            stream_voip(&streams[nstreams++], count);
+        }
+        if (strcmp(type, "all") == 0 || strcmp(type, "gaming") == 0) {
+            stream_gaming(&streams[nstreams++], count);
+        }
+        if (strcmp(type, "all") == 0 || strcmp(type, "mixed") == 0) {
+            stream_mixed(&streams[nstreams++], count, mtu);
+        }
+        if (nstreams == 0) {
+            usage(argv[0]);
+        }
+    }
+
+    smaster = sockmstr_create();
+    muxed_init();
+
+    printf("stream\tROHC\tnum-pkt\tthreshold\tperiod\tpackets\tbundles\t"
+            "mux_pps\tmux_ns/pkt\tdemux_ns/pkt\tsaving\tround_trip\n");
+    for (s = 0; s < nstreams; s++) {
+        for (r = rohc_min; r <= rohc_max; r++) {
+            for (in = 0; in < nnumpkts; in++) {
+                for (is = 0; is < nthresholds; is++) {
+                    for (ip = 0; ip < nperiods; ip++) {
+                        if (bench_run(&streams[s], r, numpkts[in],
+                                thresholds[is], periods[ip], mtu, &res) != GOOD) {
+                            return (EXIT_FAILURE);
+                        }
+                        mux_ns = (double)res.mux_ns / streams[s].n;
+                        demux_ns = (double)res.demux_ns / streams[s].n;
+                        printf("%s\t%d\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%d\t"
+                                "%"PRIu64"\t%.0f\t%.1f\t%.1f\t%.2f%%\t%s\n",
+                                streams[s].name, r, numpkts[in], thresholds[is],
+                                periods[ip], streams[s].n, res.bundles,
+                                mux_ns > 0 ? 1e9 / mux_ns : 0, mux_ns, demux_ns,
+                                100.0 * (1.0 - (double)res.muxed_bytes
+                                        / res.native_bytes),
+                                res.mismatches ? "FAIL" : "ok");
+                        if (res.mismatches) {
+                            fprintf(stderr, "%s: %d packets differ after the "
+                                    "round trip\n", streams[s].name,
+                                    res.mismatches);
+                            failed = 1;
+                        }
+                    }
+                }
+            }
+        }
+        stream_free(&streams[s]);
+    }
+
+    muxed_reset();
+    mux_trace_close();
+    return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */
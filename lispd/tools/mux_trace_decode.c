@@ -0,0 +1,199 @@
+/*
+ *
+ * Copyright (C) 2011, 2015 Cisco Systems, Inc.
+ * Copyright (C) 2015 CBA research group, Technical University of Catalonia.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Convert a simplemux event trace into the tab separated log written by the
+ * previous versions of simplemux, one line per event:
+ *
+ *   mux_trace_decode <trace file> [<output file>]
+ *
+ * The trace can be decoded while lispd is writing it.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../lib/mux_trace.h"
+
+static const char *decomp_errors[] = {
+    "decomp_failed",
+    "decomp_failed. Output buffer is too small",
+    "decomp_failed. No context",
+    "decomp_failed. Bad CRC",
+    "decomp_failed. Other error"
+};
+
+
+static const char *
+rloc_to_char(mux_trace_rec_t *rec, char *buf)
+{
+    if ((rec->afi != AF_INET && rec->afi != AF_INET6)
+            || inet_ntop(rec->afi, rec->rloc, buf, INET6_ADDRSTRLEN) == NULL) {
+        return ("");
+    }
+    return (buf);
+}
+
+static void
+print_rec(FILE *out, mux_trace_rec_t *rec)
+{
+    char buf[INET6_ADDRSTRLEN];
+
+    fprintf(out, "%"PRIu64"\t", rec->ts);
+    switch (rec->event) {
+    case MUX_EV_REC_NATIVE:
+        fprintf(out, "rec\tnative");
+        break;
+    case MUX_EV_COMPR_FAILED:
+        fprintf(out, "error\tcompr_failed. Native packet sent");
+        break;
+    case MUX_EV_SENT_MUXED:
+        fprintf(out, "sent\tmuxed\t%u\t%"PRIu64"\tto\t%s\t", rec->size,
+                rec->counter, rloc_to_char(rec, buf));
+        if (rec->reason & MUX_TRIG_PERIOD) {
+            fprintf(out, "\t%u\tperiod\n", rec->npkts);
+            return;
+        }
+        fprintf(out, "%u", rec->npkts);
+        if (rec->reason & MUX_TRIG_MTU) {
+            fprintf(out, "\tMTU");
+        }
+        if (rec->reason & MUX_TRIG_NUMPACKET) {
+            fprintf(out, "\tnumpacket_limit");
+        }
+        if (rec->reason & MUX_TRIG_SIZE) {
+            fprintf(out, "\tsize_limit");
+        }
+        if (rec->reason & MUX_TRIG_TIMEOUT) {
+            fprintf(out, "\ttimeout");
+        }
+        if (rec->reason & MUX_TRIG_BULK) {
+            fprintf(out, "\tbulk");
+        }
+        fprintf(out, "\n");
+        return;
+    case MUX_EV_DEMUX_BAD_LENGTH:
+        fprintf(out, "error\tdemux_bad_length");
+        break;
+    case MUX_EV_DROP_NO_ROHC:
+        fprintf(out, "drop\tno_ROHC_mode");
+        break;
+    case MUX_EV_REC_ROHC_FEEDBACK:
+        fprintf(out, "rec\tROHC_feedback\t%u\t%"PRIu64"\tfrom\n", rec->size,
+                rec->counter);
+        return;
+    case MUX_EV_DECOMP_FAILED:
+        fprintf(out, "error\t%s", rec->reason <= MUX_DECOMP_OTHER
+                ? decomp_errors[rec->reason] : decomp_errors[MUX_DECOMP_OTHER]);
+        break;
+    case MUX_EV_SENT_DEMUXED:
+        fprintf(out, "sent\tdemuxed");
+        break;
+    case MUX_EV_DROP_BULK_FULL:
+        fprintf(out, "drop\tbulk_queue_full");
+        break;
+    default:
+        fprintf(out, "unknown_event_%u", rec->event);
+        break;
+    }
+    fprintf(out, "\t%u\t%"PRIu64"\n", rec->size, rec->counter);
+}
+
+int
+main(int argc, char **argv)
+{
+    mux_trace_hdr_t *hdr;
+    mux_trace_rec_t *recs;
+    struct stat st;
+    FILE *out = stdout;
+    uint64_t head, first, i;
+    void *map;
+    int fd;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <trace file> [<output file>]\n", argv[0]);
+        return (EXIT_FAILURE);
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return (EXIT_FAILURE);
+    }
+    if (st.st_size < MUX_TRACE_HDR_SIZE) {
+        fprintf(stderr, "%s: not a simplemux trace\n", argv[1]);
+        return (EXIT_FAILURE);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(argv[1]);
+        return (EXIT_FAILURE);
+    }
+
+    hdr = map;
+    if (memcmp(hdr->magic, MUX_TRACE_MAGIC, sizeof(hdr->magic)) != 0
+            || hdr->version != MUX_TRACE_VERSION
+            || hdr->rec_size != sizeof(mux_trace_rec_t) || hdr->nrecs == 0
+            || MUX_TRACE_HDR_SIZE + (uint64_t)hdr->nrecs * hdr->rec_size
+                    > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a simplemux trace of version %d\n", argv[1],
+                MUX_TRACE_VERSION);
+        return (EXIT_FAILURE);
+    }
+    recs = (mux_trace_rec_t *)((uint8_t *)map + MUX_TRACE_HDR_SIZE);
+
+    if (argc == 3) {
+        out = fopen(argv[2], "w");
+        if (out == NULL) {
+            perror(argv[2]);
+            return (EXIT_FAILURE);
+        }
+    }
+
+    /* When the ring has wrapped, only the last nrecs events are left */
+    head = hdr->head;
+    first = head > hdr->nrecs ? head - hdr->nrecs : 0;
+    if (first > 0) {
+        fprintf(stderr, "%s: %"PRIu64" older events were overwritten\n",
+                argv[1], first);
+    }
+    for (i = first; i < head; i++) {
+        print_rec(out, &recs[i % hdr->nrecs]);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    munmap(map, st.st_size);
+    return (EXIT_SUCCESS);
+}
+
+/*
+ * Editor modelines
+ *
+ * vi: set shiftwidth=4 tabstop=4 expandtab:
+ * :indentSize=4:tabSize=4:noTabs=true:
+ */